@@ -0,0 +1,237 @@
+#!/bin/bash
+#
+# Copyright (C) 2021-2025 Colin Ian King
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+#
+# Throughput and rate accuracy benchmarks for sluice, see make bench
+#
+# Usage: sluice-bench.sh sluice report.json [baseline.json]
+#
+# Environment:
+#   BENCH_SIZE   data per throughput run in MB (default 512)
+#   BENCH_TIME   seconds per rate accuracy run (default 5), the -c
+#                constant delay run is not checked for regressions
+#                if this is less than CONST_SECS_MIN
+#   BENCH_TOL    allowed regression in percent (default 10)
+#   BENCH_DIR    directory for the file runs (default a mktemp dir)
+#
+# Results are in MB/s (1MB = 1048576 bytes) and CPU seconds per GB.
+# With a baseline report, throughput that has dropped or CPU use that
+# has grown by more than BENCH_TOL percent, rate errors that have got
+# more than BENCH_TOL / 10 points worse and time within 1% of the
+# target that has dropped by more than BENCH_TOL points are flagged as
+# regressions and the exit status is 1.
+#
+
+SLUICE=${1:-./sluice}
+REPORT=${2:-bench.json}
+BASELINE=${3:-}
+SIZE_MB=${BENCH_SIZE:-512}
+SECS=${BENCH_TIME:-5}
+TOL=${BENCH_TOL:-10}
+
+# -c 0.1 only adjusts the buffer size 10 times a second, shorter runs
+# are too few adjustments to give a reliable average rate
+CONST_SECS_MIN=10
+
+if [ ! -x "$SLUICE" ]; then
+	echo "Cannot find sluice binary $SLUICE" >&2
+	exit 2
+fi
+if [ -n "$BASELINE" ] && [ ! -f "$BASELINE" ]; then
+	echo "Cannot find baseline $BASELINE" >&2
+	exit 2
+fi
+
+if [ -n "$BENCH_DIR" ]; then
+	TMP=$(mktemp -d "$BENCH_DIR/sluice-bench.XXXXXX")
+else
+	TMP=$(mktemp -d /tmp/sluice-bench.XXXXXX)
+fi
+trap 'rm -rf "$TMP"' EXIT
+
+SIZE=$((SIZE_MB * 1048576))
+RESULTS="$TMP/results"
+DRIFT="$TMP/drift"
+: > "$RESULTS"
+: > "$DRIFT"
+
+#
+# to_bytes "20.00 MB", convert sluice's -S sizes back to bytes
+#
+to_bytes()
+{
+	echo "$1" | awk '{
+		n = $1; u = $2
+		if (u == "KB") n *= 1024
+		else if (u == "MB") n *= 1048576
+		else if (u == "GB") n *= 1073741824
+		else if (u == "TB") n *= 1099511627776
+		printf "%.0f\n", n
+	}'
+}
+
+#
+# result name value, add a result to the report
+#
+result()
+{
+	printf '    "%s": %s' "$1" "$2" >> "$RESULTS"
+	printf '\n' >> "$RESULTS"
+	printf '  %-28s %s\n' "$1" "$2"
+}
+
+#
+# throughput name bytes command..., time a -n run of bytes of data,
+# the command is run by the shell so it can be a pipeline
+#
+throughput()
+{
+	local name=$1 bytes=$2 times real cpu
+	shift 2
+
+	sync
+	TIMEFORMAT='%R %U %S'
+	times=$( { time sh -c "$*" > /dev/null 2>&1 ; } 2>&1 )
+	real=$(echo "$times" | awk '{ print $1 }')
+	cpu=$(echo "$times" | awk '{ print $2 + $3 }')
+	result "${name}_mbps" "$(awk -v b="$bytes" -v t="$real" \
+		'BEGIN { printf "%.1f", (t > 0) ? b / t / 1048576 : 0 }')"
+	result "${name}_cpu_per_gb" "$(awk -v b="$bytes" -v c="$cpu" \
+		'BEGIN { printf "%.3f", (b > 0) ? c * 1073741824 / b : 0 }')"
+}
+
+#
+# accuracy name rate command..., run a paced command with -S and
+# record how far the average rate was from the target and how much
+# of the time the rate was within 1% of the target
+#
+accuracy()
+{
+	local name=$1 rate=$2 stats avg
+	shift 2
+
+	stats="$TMP/$name.stats"
+	sh -c "{ $* ; } 2> $stats > /dev/null"
+	avg=$(to_bytes "$(awk -F: '/^Average rate/ { print $2 }' "$stats" | sed 's:/s::')")
+	result "${name}_error_pct" "$(awk -v a="$avg" -v r="$rate" \
+		'BEGIN { e = 100 * (a - r) / r; if (e < 0) e = -e; printf "%.3f", e }')"
+	result "${name}_within_1pct" "$(awk '
+		/^Drift from target/ { d = 1; next }
+		d && /%.*:/ {
+			split($0, f, ":")
+			lo = f[1]; sub(/^ */, "", lo); sub(/%.*/, "", lo)
+			if ((lo !~ /^>/) && (lo + 0 < 1.0)) { p = f[2]; sub(/%/, "", p); t += p }
+		}
+		END { printf "%.2f", t }' "$stats")"
+
+	# Keep the full drift distribution for reference
+	awk -v n="$name" '
+		/^Drift from target/ { d = 1; next }
+		d && /%.*:/ {
+			split($0, f, ":")
+			b = f[1]; gsub(/^ *| *$/, "", b); gsub(/ +/, " ", b)
+			p = f[2]; gsub(/[ %]/, "", p)
+			s = s (s ? ", " : "") "\"" b "\": " p
+		}
+		END { printf "    \"%s\": { %s }", n, s }' "$stats" >> "$DRIFT"
+	printf '\n' >> "$DRIFT"
+}
+
+echo "sluice benchmark, $SIZE_MB MB throughput runs, $SECS second rate runs"
+S=$SLUICE
+
+echo "Throughput (-n):"
+throughput zero_4k $SIZE "$S -z -n -m $SIZE -d"
+throughput zero_64k $SIZE "$S -z -n -m $SIZE -i 64K -d"
+throughput zero_1m $SIZE "$S -z -n -m $SIZE -i 1M -d"
+throughput pipe_64k $SIZE "$S -z -n -m $SIZE -i 64K | $S -n -i 64K -d"
+throughput pipe_1m $SIZE "$S -z -n -m $SIZE -i 1M | $S -n -i 1M -d"
+throughput urandom_64k $((SIZE / 8)) "$S -R -n -m $((SIZE / 8)) -i 64K -d"
+throughput gen_j2_64k $SIZE "$S -R -j 2 -n -m $SIZE -i 64K -d"
+throughput file_write_1m $SIZE "$S -z -n -m $SIZE -i 1M -O $TMP/data"
+throughput file_read_1m $SIZE "$S -n -I $TMP/data -i 1M -d"
+throughput tee_64k $SIZE "$S -z -n -m $SIZE -i 64K -t $TMP/tee -d"
+rm -f "$TMP/data" "$TMP/tee"
+
+echo "Rate accuracy (-r):"
+accuracy rate_1m 1048576 "$S -z -r 1M -T $SECS -d -S"
+accuracy rate_100m 104857600 "$S -z -r 100M -T $SECS -d -S"
+accuracy rate_10m_4k 10485760 "$S -z -r 10M -i 4K -T $SECS -d -S"
+accuracy rate_10m_const 10485760 "$S -z -r 10M -c 0.1 -T $SECS -d -S"
+accuracy rate_10m_uo 10485760 "$S -z -r 10M -u -o -T $SECS -d -S"
+accuracy rate_50m_pipe 52428800 "$S -z -r 50M -T $SECS -S | $S -n -d"
+
+{
+	echo "{"
+	echo "  \"version\": \"$($S -V | awk '{ print $NF }')\","
+	echo "  \"host\": \"$(uname -n)\","
+	echo "  \"kernel\": \"$(uname -r)\","
+	echo "  \"cpus\": $(nproc),"
+	echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+	echo "  \"size_mb\": $SIZE_MB,"
+	echo "  \"rate_secs\": $SECS,"
+	echo "  \"results\": {"
+	sed '$!s/$/,/' "$RESULTS"
+	echo "  },"
+	echo "  \"drift\": {"
+	sed '$!s/$/,/' "$DRIFT"
+	echo "  }"
+	echo "}"
+} > "$REPORT"
+echo "Report written to $REPORT"
+
+[ -z "$BASELINE" ] && exit 0
+
+#
+# Compare the results with the baseline, one "name": value per line
+#
+echo "Comparing with $BASELINE:"
+awk -v tol="$TOL" -v short_const=$((SECS < CONST_SECS_MIN)) '
+	function value(line) { sub(/.*: */, "", line); sub(/,$/, "", line); return line + 0 }
+	function key(line) { sub(/^ *"/, "", line); sub(/".*/, "", line); return line }
+	/"results": \{/ { r = 1; next }
+	r && /^ *\}/ { r = 0; nextfile }
+	r && (FILENAME == ARGV[1]) { base[key($0)] = value($0) }
+	r && (FILENAME != ARGV[1]) { k = key($0); cur[k] = value($0); order[++n] = k }
+	END {
+		bad = 0
+		for (i = 1; i <= n; i++) {
+			k = order[i]
+			if (!(k in base))
+				continue
+			b = base[k]; c = cur[k]; worse = 0
+			if (short_const && (k ~ /_const_/)) {
+				printf "  %-28s %12s %12s  (run too short, not checked)\n", k, b, c
+				continue
+			}
+			if (k ~ /_mbps$/)
+				worse = (c < b * (1 - tol / 100))
+			else if (k ~ /_cpu_per_gb$/)
+				worse = (c > b * (1 + tol / 100)) && (c - b > 0.01)
+			else if (k ~ /_error_pct$/)
+				worse = (c > b + tol / 10)
+			else if (k ~ /_within_1pct$/)
+				worse = (c < b - tol)
+			printf "  %-28s %12s %12s%s\n", k, b, c, worse ? "  REGRESSION" : ""
+			bad += worse
+		}
+		if (bad)
+			printf "%d regression(s) found\n", bad
+		else
+			printf "No regressions found\n"
+		exit bad ? 1 : 0
+	}' "$BASELINE" "$REPORT"
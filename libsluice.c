@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "libsluice.h"
+#include "sluice-ctl.h"
+
+#define PACER_IO_SIZE_MAX	(1024.0 * 1024.0 * 1024.0) /* Max io_size */
+#define PACER_RATE_MIN		(0.1)		/* Min data rate */
+#define PACER_SHIFT_MAX		(16)		/* Max adjustment shift */
+#define PACER_ADJUST		(1)		/* Under/overruns before adjusting */
+
+struct sluice_pacer {
+	sluice_ctl_t	ctl;		/* Rate controller */
+	sluice_ops_t	ops;		/* Controller environment */
+	const delay_info_t *di;		/* sluice_pacer_copy() delay mode */
+	sluice_pacer_opts_t opts;	/* Creation options */
+	sluice_pacer_stats_t stats;	/* Stats not kept by the controller */
+	double		epoch_secs;	/* Start of current rate target */
+	uint64_t	epoch_bytes;	/* total_bytes at epoch_secs */
+	double		next;		/* Earliest time of the next send */
+	char		*buffer;	/* sluice_pacer_copy() buffer */
+	int		fdin;		/* sluice_pacer_copy() source */
+	int		fdout;		/* sluice_pacer_copy() destination */
+	uint64_t	max;		/* sluice_pacer_copy() limit */
+	bool		rate_set;	/* Min/max set or not? */
+};
+
+/*
+ *  pacer_now()
+ *	monotonic time in seconds
+ */
+static double pacer_now(void *ctx)
+{
+	struct timespec ts;
+
+	(void)ctx;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ *  pacer_sleep()
+ *	sleep for usecs microseconds, a signal cuts the sleep short
+ *	and the controller catches up on the next update
+ */
+static int pacer_sleep(void *ctx, const double usecs)
+{
+	sluice_pacer_t *const p = (sluice_pacer_t *)ctx;
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(usecs / 1000000.0);
+	ts.tv_nsec = (long)((usecs - ((double)ts.tv_sec * 1000000.0)) * 1000.0);
+	p->stats.delays++;
+	if ((nanosleep(&ts, NULL) < 0) && (errno != EINTR))
+		return -1;
+	return 0;
+}
+
+/*
+ *  pacer_read()
+ *	fill the copy buffer, short only at end of file or -max
+ */
+static ssize_t pacer_read(void *ctx, const size_t size)
+{
+	sluice_pacer_t *const p = (sluice_pacer_t *)ctx;
+	size_t sz = size, got = 0;
+
+	if (p->max) {
+		if (p->stats.total_bytes >= p->max)
+			return 0;
+		if (sz > p->max - p->stats.total_bytes)
+			sz = (size_t)(p->max - p->stats.total_bytes);
+	}
+	while (got < sz) {
+		const ssize_t n = read(p->fdin, p->buffer + got, sz - got);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p->stats.reads++;
+		if (n == 0)
+			break;
+		got += (size_t)n;
+	}
+	return (ssize_t)got;
+}
+
+/*
+ *  pacer_write()
+ *	write out all of the copy buffer
+ */
+static ssize_t pacer_write(void *ctx, const size_t size)
+{
+	sluice_pacer_t *const p = (sluice_pacer_t *)ctx;
+	size_t done = 0;
+
+	while (done < size) {
+		const ssize_t n = write(p->fdout, p->buffer + done, size - done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p->stats.writes++;
+		done += (size_t)n;
+	}
+	p->stats.total_bytes += size;
+	return (ssize_t)size;
+}
+
+/*
+ *  pacer_resize()
+ *	grow the copy buffer and let the caller grow theirs
+ */
+static int pacer_resize(void *ctx, const double old_size, const double new_size)
+{
+	sluice_pacer_t *const p = (sluice_pacer_t *)ctx;
+
+	if (p->buffer) {
+		char *tmp = realloc(p->buffer, (size_t)new_size);
+
+		if (!tmp)
+			return -1;
+		if (p->opts.flags & SLUICE_PACER_ZERO)
+			(void)memset(tmp, 0, (size_t)new_size);
+		p->buffer = tmp;
+	}
+	if (p->opts.resize)
+		return p->opts.resize(p->opts.ctx, old_size, new_size);
+	return 0;
+}
+
+/*
+ *  pacer_rate_stats()
+ *	update min/max rate and buffer sizes and the drift histogram
+ */
+static void pacer_rate_stats(sluice_pacer_t *p, const double current_rate)
+{
+	sluice_pacer_stats_t *const stats = &p->stats;
+	const double io_size = p->ctl.io_size;
+
+	if (p->rate_set) {
+		if (current_rate > stats->rate_max)
+			stats->rate_max = current_rate;
+		if (current_rate < stats->rate_min)
+			stats->rate_min = current_rate;
+		if (io_size > stats->io_size_max)
+			stats->io_size_max = io_size;
+		if (io_size < stats->io_size_min)
+			stats->io_size_min = io_size;
+	} else {
+		stats->rate_min = current_rate;
+		stats->rate_max = current_rate;
+		stats->io_size_min = io_size;
+		stats->io_size_max = io_size;
+		p->rate_set = true;
+	}
+
+	/* Update drift stats only if we have rate controls enabled */
+	if (!(p->ctl.flags & CTL_NO_RATE_CONTROL)) {
+		const double drift_rate = 100.0 *
+			fabs(current_rate - p->ctl.data_rate) / p->ctl.data_rate;
+		double percent = SLUICE_DRIFT_START;
+		int i;
+
+		stats->drift_total++;
+		for (i = 0; i < SLUICE_DRIFT_MAX; i++, percent *= 2.0) {
+			if (drift_rate < percent) {
+				stats->drift[i]++;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ *  pacer_copy_sample()
+ *	stats for each sluice_pacer_copy() controller update
+ */
+static bool pacer_copy_sample(void *ctx, const double secs_now,
+	const double current_rate, const int run)
+{
+	sluice_pacer_t *const p = (sluice_pacer_t *)ctx;
+
+	(void)run;
+	p->stats.time_now = secs_now;
+	p->stats.current_rate = current_rate;
+	pacer_rate_stats(p, current_rate);
+	return true;
+}
+
+sluice_pacer_t *sluice_pacer_create(const sluice_pacer_opts_t *opts)
+{
+	sluice_pacer_t *p;
+	const bool no_rate = !!(opts->flags & SLUICE_PACER_NO_RATE);
+	double io_size = opts->io_size;
+
+	if ((!no_rate && (opts->rate < PACER_RATE_MIN)) ||
+	    (opts->shift > PACER_SHIFT_MAX) ||
+	    (opts->delay_mode > DELAY_MODE_MAX) ||
+	    (io_size < 0.0) || (io_size > PACER_IO_SIZE_MAX)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	/* Same io_size defaults as sluice */
+	if (io_size < 1.0) {
+		if (opts->const_delay > 0.0)
+			io_size = opts->rate * opts->const_delay;
+		else if (!no_rate)
+			io_size = opts->rate / 32;
+		if (io_size < 1.0)
+			io_size = 1.0;
+	}
+
+	p->opts = *opts;
+	p->di = &delay_info[opts->delay_mode];
+	p->fdin = -1;
+	p->fdout = -1;
+
+	p->ctl.data_rate = opts->rate;
+	p->ctl.const_delay = opts->const_delay;
+	p->ctl.io_size_max = PACER_IO_SIZE_MAX;
+	p->ctl.adjust_shift = opts->shift;
+	p->ctl.flags = (no_rate ? CTL_NO_RATE_CONTROL : 0) |
+		((opts->flags & SLUICE_PACER_UNDERRUN) ? CTL_UNDERRUN : 0) |
+		((opts->flags & SLUICE_PACER_OVERRUN) ? CTL_OVERRUN : 0);
+	if (opts->const_delay > 0.0)
+		p->ctl.flags |= (CTL_CONST_DELAY | CTL_UNDERRUN | CTL_OVERRUN);
+	p->ctl.underrun_adjust = PACER_ADJUST;
+	p->ctl.overrun_adjust = PACER_ADJUST;
+	sluice_ctl_init(&p->ctl, io_size);
+
+	p->ops.now = pacer_now;
+	p->ops.sleep = pacer_sleep;
+	p->ops.read = pacer_read;
+	p->ops.write = pacer_write;
+	p->ops.resize = pacer_resize;
+	p->ops.sample = pacer_copy_sample;
+	p->ops.ctx = p;
+
+	p->stats.target_rate = opts->rate;
+	sluice_pacer_start(p, pacer_now(NULL), 0);
+	p->stats.time_begin = p->epoch_secs;
+
+	return p;
+}
+
+void sluice_pacer_destroy(sluice_pacer_t *p)
+{
+	if (!p)
+		return;
+	free(p->buffer);
+	free(p);
+}
+
+void sluice_pacer_start(sluice_pacer_t *p, const double secs_now,
+	const uint64_t total_bytes)
+{
+	p->epoch_secs = secs_now;
+	p->epoch_bytes = total_bytes;
+	p->next = secs_now;
+	p->stats.total_bytes = total_bytes;
+	p->stats.time_now = secs_now;
+}
+
+int sluice_pacer_update(sluice_pacer_t *p, const uint64_t total_bytes,
+	const uint64_t pending, const double secs_now)
+{
+	const double secs = secs_now - p->epoch_secs;
+	const double current_rate = (secs > 0.0) ?
+		((double)(total_bytes - p->epoch_bytes)) / secs : 0.0;
+	int run;
+
+	p->stats.total_bytes = total_bytes;
+	p->stats.time_now = secs_now;
+	p->stats.current_rate = current_rate;
+	pacer_rate_stats(p, current_rate);
+
+	run = sluice_ctl_update(&p->ctl, &p->ops, current_rate, secs_now,
+		p->epoch_secs, (double)(total_bytes - p->epoch_bytes + pending));
+	p->ctl.last_delay = (uint64_t)p->ctl.delay;
+	p->next = secs_now + (p->ctl.delay / 1000000.0);
+	return run;
+}
+
+void sluice_pacer_set_rate(sluice_pacer_t *p, const double rate,
+	const uint64_t total_bytes, const double secs_now)
+{
+	if (rate < PACER_RATE_MIN)
+		return;
+	p->ctl.data_rate = rate;
+	p->stats.target_rate = rate;
+	sluice_pacer_start(p, secs_now, total_bytes);
+	p->ctl.delay = p->ctl.io_size * 1000000.0 / rate;
+	p->ctl.last_delay = (uint64_t)p->ctl.delay;
+}
+
+void sluice_pacer_pause(sluice_pacer_t *p, const double secs)
+{
+	p->epoch_secs += secs;
+}
+
+void sluice_pacer_set_io_size(sluice_pacer_t *p, const double io_size)
+{
+	char *tmp;
+
+	if ((io_size < 1.0) || (io_size > p->ctl.io_size_max))
+		return;
+	if (p->buffer && (io_size > p->ctl.io_size)) {
+		tmp = realloc(p->buffer, (size_t)io_size);
+		if (!tmp)
+			return;
+		p->buffer = tmp;
+	}
+	/* Keep the delay per byte the same */
+	p->ctl.delay *= io_size / p->ctl.io_size;
+	p->ctl.io_size = io_size;
+}
+
+double sluice_pacer_reserve(sluice_pacer_t *p, const size_t n)
+{
+	double due;
+
+	if (p->ctl.flags & CTL_NO_RATE_CONTROL)
+		return 0.0;
+
+	/*
+	 *  Without -s or -c the controller schedules each send so the
+	 *  bytes are paid for by the time they go, the same sum gives
+	 *  the exact due time for n bytes. Otherwise the controller's
+	 *  own delay decides.
+	 */
+	if (!p->ctl.adjust_shift && !(p->ctl.flags & CTL_CONST_DELAY))
+		due = p->epoch_secs +
+			((double)(p->stats.total_bytes - p->epoch_bytes + n) /
+			 p->ctl.data_rate);
+	else
+		due = p->next;
+
+	due -= pacer_now(NULL);
+	return (due > 0.0) ? due : 0.0;
+}
+
+int sluice_pacer_acquire(sluice_pacer_t *p, const size_t n)
+{
+	const double wait = sluice_pacer_reserve(p, n);
+
+	if (wait > 0.0)
+		return pacer_sleep(p, wait * 1000000.0);
+	return 0;
+}
+
+int sluice_pacer_submit(sluice_pacer_t *p, const size_t n)
+{
+	p->stats.writes++;
+	return sluice_pacer_update(p, p->stats.total_bytes + n, n,
+		pacer_now(NULL));
+}
+
+int64_t sluice_pacer_copy(sluice_pacer_t *p, const int fdin,
+	const int fdout, const uint64_t max)
+{
+	int64_t ret;
+
+	if (!p->buffer) {
+		p->buffer = calloc(1, (size_t)p->ctl.io_size);
+		if (!p->buffer)
+			return -1;
+	}
+	p->fdin = fdin;
+	p->fdout = fdout;
+	p->max = max ? p->stats.total_bytes + max : 0;
+	ret = sluice_ctl_run(&p->ctl, &p->ops, p->di);
+	p->fdin = -1;
+	p->fdout = -1;
+	return ret;
+}
+
+double sluice_pacer_delay(const sluice_pacer_t *p)
+{
+	return p->ctl.delay;
+}
+
+double sluice_pacer_io_size(const sluice_pacer_t *p)
+{
+	return p->ctl.io_size;
+}
+
+double sluice_pacer_current_rate(const sluice_pacer_t *p)
+{
+	return p->stats.current_rate;
+}
+
+void sluice_pacer_stats(const sluice_pacer_t *p, sluice_pacer_stats_t *stats)
+{
+	*stats = p->stats;
+	stats->underruns = p->ctl.total_underruns;
+	stats->overruns = p->ctl.total_overruns;
+	stats->perfect = p->ctl.perfect;
+	stats->reallocs = p->ctl.reallocs;
+	stats->io_size = p->ctl.io_size;
+	stats->delay = p->ctl.delay;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+#ifndef LIBSLUICE_H
+#define LIBSLUICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  libsluice, the sluice rate controller as a library. A pacer
+ *  can be used in three ways:
+ *
+ *  1. sluice_pacer_acquire() before and sluice_pacer_submit() after
+ *     each send, the pacer sleeps so the sends hold the rate.
+ *  2. sluice_pacer_reserve() to ask how long to wait before a send,
+ *     for callers with their own event loop, then submit.
+ *  3. sluice_pacer_copy() to copy between two file descriptors.
+ *
+ *  Callers with their own clock and loop, such as sluice itself,
+ *  drive the controller directly with sluice_pacer_update().
+ *
+ *  A pacer is not thread safe, use one per stream or lock around it.
+ */
+#define LIBSLUICE_VERSION	(1)
+
+#define SLUICE_PACER_NO_RATE	(0x01)	/* No rate control, just count */
+#define SLUICE_PACER_UNDERRUN	(0x02)	/* Grow io_size on underruns */
+#define SLUICE_PACER_OVERRUN	(0x04)	/* Shrink io_size on overruns */
+#define SLUICE_PACER_ZERO	(0x08)	/* Zero the copy buffer when it grows */
+
+#define SLUICE_DRIFT_MAX	(11)	/* Drift histogram buckets */
+#define SLUICE_DRIFT_START	(0.0625) /* First bucket, doubles each bucket */
+
+typedef struct sluice_pacer sluice_pacer_t;
+
+typedef struct {
+	double		rate;		/* Target rate, bytes per second */
+	double		io_size;	/* Send size, 0 picks a default */
+	double		const_delay;	/* Constant delay in seconds, <= 0 none */
+	uint32_t	shift;		/* Controller adjustment shift, 0..16 */
+	uint32_t	delay_mode;	/* Where copy delays go, 0..5, see sluice -D */
+	uint32_t	flags;		/* SLUICE_PACER_* flags */
+	/*
+	 *  Optional, called when the controller grows io_size so the
+	 *  caller can grow its buffer, return 0 on success. Without it
+	 *  the pacer grows its own copy buffer.
+	 */
+	int		(*resize)(void *ctx, const double old_size,
+				  const double new_size);
+	void		*ctx;		/* Passed to resize */
+} sluice_pacer_opts_t;
+
+typedef struct {
+	uint64_t	total_bytes;	/* Bytes sent */
+	uint64_t	reads;		/* Reads by sluice_pacer_copy() */
+	uint64_t	writes;		/* Writes or submits */
+	uint64_t	delays;		/* Sleeps */
+	uint64_t	underruns;	/* Count of underruns */
+	uint64_t	overruns;	/* Count of overruns */
+	uint64_t	perfect;	/* Count of no under/overruns */
+	uint64_t	reallocs;	/* Count of io_size increases */
+	uint64_t	drift[SLUICE_DRIFT_MAX]; /* Drift from target rate */
+	uint64_t	drift_total;	/* Number of drift samples */
+	double		time_begin;	/* Time began */
+	double		time_now;	/* Time of last update */
+	double		target_rate;	/* Target rate */
+	double		current_rate;	/* Rate at last update */
+	double		rate_min;	/* Minimum rate */
+	double		rate_max;	/* Maximum rate */
+	double		io_size;	/* Current send size */
+	double		io_size_min;	/* Minimum send size */
+	double		io_size_max;	/* Maximum send size */
+	double		delay;		/* Current delay, microseconds */
+} sluice_pacer_stats_t;
+
+/* Create a pacer, returns NULL and sets errno on failure */
+extern sluice_pacer_t *sluice_pacer_create(const sluice_pacer_opts_t *opts);
+extern void sluice_pacer_destroy(sluice_pacer_t *p);
+
+/* Seconds to wait before n bytes may be sent, 0.0 if they can go now */
+extern double sluice_pacer_reserve(sluice_pacer_t *p, const size_t n);
+/* Sleep until n bytes may be sent, returns 0 or -1 and errno */
+extern int sluice_pacer_acquire(sluice_pacer_t *p, const size_t n);
+/* Account for n bytes sent, returns '+' overrun, '-' underrun or '0' */
+extern int sluice_pacer_submit(sluice_pacer_t *p, const size_t n);
+
+/* Paced copy of up to max bytes, 0 for all, returns bytes or -1 and errno */
+extern int64_t sluice_pacer_copy(sluice_pacer_t *p, const int fdin,
+	const int fdout, const uint64_t max);
+
+/* Own clock and loop: (re)start the rate epoch at total_bytes */
+extern void sluice_pacer_start(sluice_pacer_t *p, const double secs_now,
+	const uint64_t total_bytes);
+/* Own clock and loop: feed back progress, returns as submit */
+extern int sluice_pacer_update(sluice_pacer_t *p, const uint64_t total_bytes,
+	const uint64_t pending, const double secs_now);
+/* Change the target rate from now on */
+extern void sluice_pacer_set_rate(sluice_pacer_t *p, const double rate,
+	const uint64_t total_bytes, const double secs_now);
+/* Leave secs of time out of the rate, e.g. time spent paused */
+extern void sluice_pacer_pause(sluice_pacer_t *p, const double secs);
+/* Change the send size, the caller's buffer must already fit it */
+extern void sluice_pacer_set_io_size(sluice_pacer_t *p, const double io_size);
+
+extern double sluice_pacer_delay(const sluice_pacer_t *p);
+extern double sluice_pacer_io_size(const sluice_pacer_t *p);
+extern double sluice_pacer_current_rate(const sluice_pacer_t *p);
+extern void sluice_pacer_stats(const sluice_pacer_t *p,
+	sluice_pacer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
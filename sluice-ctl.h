@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+#ifndef SLUICE_CTL_H
+#define SLUICE_CTL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ *  The rate controller, shared by sluice and sluice-sim. It makes
+ *  no system calls itself, the clock, sleeps, I/O and buffer resizing
+ *  are all done through a sluice_ops_t so the same decisions can be
+ *  driven by the real main loop or by a virtual clock.
+ */
+
+/* R = read, W = write, D = delay */
+#define DELAY_R_W_D		(0x00000000)	/* full delay */
+#define DELAY_D_R_W		(0x00000001)	/* full delay */
+#define DELAY_R_D_W		(0x00000002)	/* full delay */
+#define DELAY_D_R_D_W		(0x00000003)	/* 2 * 1/2 delay */
+#define DELAY_R_D_W_D		(0x00000004)	/* 2 * 1/2 delay */
+#define DELAY_D_R_D_W_D		(0x00000005)	/* 3 * 1/3 delay */
+
+#define DELAY_MODE_MIN		0
+#define DELAY_MODE_MAX		DELAY_D_R_D_W_D
+
+#define DELAY_D			(0x01)		/* delay */
+#define DELAY_S			(0x00)		/* skip */
+
+#define DELAY_SET_ACTION(a1, a2, a3)	((a1 << 0) | (a2 << 1) | (a3 << 2))
+#define DELAY_GET_ACTION(n, action)	((1 << n) & action)
+
+/* sluice_ctl_t flags */
+#define CTL_NO_RATE_CONTROL	(0x01)		/* -n, just copy */
+#define CTL_CONST_DELAY		(0x02)		/* -c, fixed delay */
+#define CTL_UNDERRUN		(0x04)		/* -u, grow io_size */
+#define CTL_OVERRUN		(0x08)		/* -o, shrink io_size */
+
+typedef struct {
+	double	divisor;			/* delay divisor */
+	uint8_t	mode;				/* User specified mode */
+	uint8_t	action;				/* action bit map */
+} delay_info_t;
+
+/*
+ *  action bit#
+ *	0		sleep on/off
+ *			read
+ *	1		sleep on/off
+ *			write
+ *	2		sleep on/off
+ */
+static const delay_info_t delay_info[] = {
+	{ 1.0, DELAY_R_W_D,	DELAY_SET_ACTION(DELAY_S, DELAY_S, DELAY_D) },
+	{ 1.0, DELAY_D_R_W,	DELAY_SET_ACTION(DELAY_D, DELAY_S, DELAY_S) },
+	{ 1.0, DELAY_R_D_W,     DELAY_SET_ACTION(DELAY_S, DELAY_D, DELAY_S) },
+	{ 2.0, DELAY_D_R_D_W,   DELAY_SET_ACTION(DELAY_D, DELAY_D, DELAY_S) },
+	{ 2.0, DELAY_R_D_W_D,   DELAY_SET_ACTION(DELAY_S, DELAY_D, DELAY_D) },
+	{ 3.0, DELAY_D_R_D_W_D, DELAY_SET_ACTION(DELAY_D, DELAY_D, DELAY_D) },
+};
+
+/*
+ *  Environment the controller runs in. sluice_ctl_update() only
+ *  needs resize, sluice_ctl_run() needs them all. Times are in
+ *  seconds, sleeps in microseconds.
+ */
+typedef struct {
+	double	(*now)(void *ctx);		/* Current time */
+	int	(*sleep)(void *ctx, const double usecs);
+	ssize_t	(*read)(void *ctx, const size_t size);
+	ssize_t	(*write)(void *ctx, const size_t size);
+	int	(*resize)(void *ctx, const double old_size, const double new_size);
+	bool	(*sample)(void *ctx, const double secs_now,
+			  const double current_rate, const int run);
+	void	*ctx;				/* Passed to all the above */
+} sluice_ops_t;
+
+typedef struct {
+	/* Settings */
+	double		data_rate;		/* Target rate, -r */
+	double		const_delay;		/* -c delay time between I/O */
+	double		io_size_max;		/* Largest io_size allowed */
+	uint64_t	adjust_shift;		/* -s adjustment scaling shift */
+	uint32_t	flags;			/* CTL_* flags */
+	int		underrun_adjust;	/* Underruns before adjusting */
+	int		overrun_adjust;		/* Overruns before adjusting */
+
+	/* State */
+	double		delay;			/* Current delay, microseconds */
+	double		io_size;		/* Current read/write size */
+	uint64_t	last_delay;		/* Delay of previous iteration */
+	int		underruns;		/* Continuous underruns */
+	int		overruns;		/* Continuous overruns */
+	int		warnings;		/* Underruns since last overrun */
+
+	/* Counters */
+	uint64_t	total_underruns;	/* Count of underruns */
+	uint64_t	total_overruns;		/* Count of overruns */
+	uint64_t	perfect;		/* Count of exact rate hits */
+	uint64_t	reallocs;		/* Count of io_size changes */
+} sluice_ctl_t;
+
+/*
+ *  sluice_ctl_init()
+ *	set up the controller state for a run, the settings must
+ *	already be filled in
+ */
+static inline void sluice_ctl_init(sluice_ctl_t *ctl, const double io_size)
+{
+	ctl->io_size = io_size;
+	ctl->last_delay = 0;
+	ctl->underruns = 0;
+	ctl->overruns = 0;
+	ctl->warnings = 0;
+	ctl->total_underruns = 0;
+	ctl->total_overruns = 0;
+	ctl->perfect = 0;
+	ctl->reallocs = 0;
+
+	if (ctl->flags & CTL_NO_RATE_CONTROL)
+		ctl->delay = 0.0;
+	else if (ctl->flags & CTL_CONST_DELAY)
+		ctl->delay = 1000000.0 * ctl->const_delay;
+	else
+		ctl->delay = io_size * 1000000.0 / ctl->data_rate;
+}
+
+/*
+ *  sluice_ctl_resize()
+ *	ask the owner of the buffer to grow it to new_size
+ */
+static inline void sluice_ctl_resize(
+	sluice_ctl_t *ctl,
+	const sluice_ops_t *ops,
+	const double new_size)
+{
+	/* Need to grow buffer? */
+	if ((new_size > ctl->io_size) &&
+	    (new_size < ctl->io_size_max)) {
+		ctl->reallocs++;
+		if (!ops->resize ||
+		    ops->resize(ops->ctx, ctl->io_size, new_size) == 0)
+			ctl->io_size = new_size;
+	}
+}
+
+/*
+ *  sluice_ctl_update()
+ *	work out the next delay and io_size from the rate achieved
+ *	so far. epoch_secs is the time the current rate started and
+ *	pending is the bytes transferred since then plus any still
+ *	buffered. Returns the run character, '+' on an overrun, '-'
+ *	on an underrun and '0' when the rate is spot on.
+ */
+static inline int sluice_ctl_update(
+	sluice_ctl_t *ctl,
+	const sluice_ops_t *ops,
+	const double current_rate,
+	const double secs_now,
+	const double epoch_secs,
+	const double pending)
+{
+	int run;
+
+	if (ctl->flags & CTL_NO_RATE_CONTROL) {
+		/* No rate to compare to */
+		return '-';
+	}
+
+	if (current_rate > ctl->data_rate) {
+		/* Overrun */
+		run = '+';
+		if (!(ctl->flags & CTL_CONST_DELAY)) {
+			if (ctl->adjust_shift)
+				ctl->delay += ((ctl->last_delay >> ctl->adjust_shift) + 100);
+			else {
+				const double secs_desired = epoch_secs + (pending / ctl->data_rate);
+
+				ctl->delay = 1000000.0 * (secs_desired - secs_now);
+				if (ctl->delay < 0)
+					ctl->delay = 0;
+			}
+		}
+		ctl->warnings = 0;
+		ctl->underruns = 0;
+		ctl->overruns++;
+		ctl->total_overruns++;
+	} else if (current_rate < ctl->data_rate) {
+		/* Underrun */
+		run = '-';
+		if (!(ctl->flags & CTL_CONST_DELAY)) {
+			if (ctl->adjust_shift)
+				ctl->delay -= ((ctl->last_delay >> ctl->adjust_shift) + 100);
+			else {
+				const double secs_desired = epoch_secs + (pending / ctl->data_rate);
+
+				ctl->delay = 1000000.0 * (secs_desired - secs_now);
+				if (ctl->delay < 0)
+					ctl->delay = 0;
+			}
+		}
+		ctl->warnings++;
+		ctl->underruns++;
+		ctl->total_underruns++;
+		ctl->overruns = 0;
+	} else {
+		/* Perfect, rather unlikely.. */
+		ctl->warnings = 0;
+		ctl->underruns = 0;
+		ctl->overruns = 0;
+		ctl->perfect++;
+		run = '0';
+	}
+
+	/* Avoid the impossible */
+	if (ctl->delay < 0)
+		ctl->delay = 0;
+
+	if ((ctl->flags & CTL_UNDERRUN) &&
+	    (ctl->underruns >= ctl->underrun_adjust)) {
+		/* Adjust rate due to underruns */
+		double tmp_io_size;
+
+		if (ctl->adjust_shift) {
+			/* Adjust by scaling io_size */
+			tmp_io_size = ctl->io_size +
+				(ctl->io_size / (1 << ctl->adjust_shift));
+			/*
+			 * If size is too small, we get
+			 * stuck at 1
+			 */
+			if (tmp_io_size < 1)
+				tmp_io_size = 1;
+		} else {
+			/*
+			 * Adjust by comparing differences
+			 * in rates
+			 */
+			tmp_io_size = ctl->io_size +
+				(ctl->data_rate - current_rate) *
+				ctl->const_delay;
+		}
+		sluice_ctl_resize(ctl, ops, tmp_io_size);
+		ctl->underruns = 0;
+	}
+
+	if ((ctl->flags & CTL_OVERRUN) &&
+	    (ctl->overruns >= ctl->overrun_adjust)) {
+		/* Adjust rate due to overruns */
+		double tmp_io_size;
+
+		if (ctl->adjust_shift) {
+			/* Adjust by scaling io_size */
+			tmp_io_size = ctl->io_size -
+				(ctl->io_size / (1 << ctl->adjust_shift));
+			/*
+			 * If size is too small, we get
+			 * stuck at 1
+			 */
+			if (tmp_io_size < 1)
+				tmp_io_size = 1;
+		} else {
+			/*
+			 * Adjust by comparing differences
+			 * in rates
+			 */
+			tmp_io_size = ctl->io_size +
+				(ctl->data_rate - current_rate) *
+				ctl->const_delay;
+		}
+		sluice_ctl_resize(ctl, ops, tmp_io_size);
+		ctl->overruns = 0;
+	}
+	return run;
+}
+
+/*
+ *  sluice_ctl_delay()
+ *	sleep for delay slot n of the delay mode
+ */
+static inline int sluice_ctl_delay(
+	const sluice_ctl_t *ctl,
+	const sluice_ops_t *ops,
+	const delay_info_t *di,
+	const int n)
+{
+	const double delay = ctl->delay / di->divisor;
+
+	if (DELAY_GET_ACTION(n, di->action) && (delay > 0))
+		return ops->sleep(ops->ctx, delay);
+	return 0;
+}
+
+/*
+ *  sluice_ctl_run()
+ *	the bare bones of the sluice main loop: read io_size bytes,
+ *	write them, sleep in the delay mode's slots and feed the rate
+ *	back into the controller. Runs until a read returns 0, an op
+ *	fails or sample returns false. Returns the bytes transferred
+ *	or -1 on an error.
+ */
+static inline int64_t sluice_ctl_run(
+	sluice_ctl_t *ctl,
+	const sluice_ops_t *ops,
+	const delay_info_t *di)
+{
+	const double secs_start = ops->now(ops->ctx);
+	uint64_t total_bytes = 0;
+
+	for (;;) {
+		ssize_t n;
+		double secs_now, current_rate;
+		int run;
+
+		if (sluice_ctl_delay(ctl, ops, di, 0) < 0)
+			return -1;
+		n = ops->read(ops->ctx, (size_t)ctl->io_size);
+		if (n <= 0)
+			return (n < 0) ? -1 : (int64_t)total_bytes;
+		if (sluice_ctl_delay(ctl, ops, di, 1) < 0)
+			return -1;
+		if (ops->write(ops->ctx, (size_t)n) < 0)
+			return -1;
+		total_bytes += (uint64_t)n;
+		if (sluice_ctl_delay(ctl, ops, di, 2) < 0)
+			return -1;
+
+		secs_now = ops->now(ops->ctx);
+		current_rate = (secs_now > secs_start) ?
+			(double)total_bytes / (secs_now - secs_start) : 0.0;
+		run = sluice_ctl_update(ctl, ops, current_rate, secs_now,
+			secs_start, (double)(total_bytes + (uint64_t)n));
+		ctl->last_delay = (uint64_t)ctl->delay;
+
+		if (ops->sample &&
+		    !ops->sample(ops->ctx, secs_now, current_rate, run))
+			break;
+	}
+	return (int64_t)total_bytes;
+}
+
+#endif
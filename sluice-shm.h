@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+#ifndef SLUICE_SHM_H
+#define SLUICE_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ *  Live statistics segment, published by sluice -M and read by
+ *  sluice-top. The writer bumps seq to an odd value, updates the
+ *  snapshot and bumps seq to an even value; readers retry if seq
+ *  was odd or changed while they copied the snapshot.
+ */
+#define SLUICE_SHM_MAGIC	(0x534c4349)	/* "SLCI" */
+#define SLUICE_SHM_VERSION	(1)
+#define SLUICE_SHM_DIR		"/dev/shm"
+#define SLUICE_SHM_PREFIX	"sluice-stats-"
+
+typedef struct {
+	uint64_t	total_bytes;	/* Total bytes copied */
+	uint64_t	reads;		/* Total read calls */
+	uint64_t	writes;		/* Total write calls */
+	uint64_t	underruns;	/* Count of underruns */
+	uint64_t	overruns;	/* Count of overruns */
+	uint64_t	delays;		/* Count of delays */
+	uint64_t	reallocs;	/* Count of buffer reallocations */
+	double		time_begin;	/* Time began */
+	double		time_now;	/* Time of this snapshot */
+	double		target_rate;	/* Target transfer rate */
+	double		current_rate;	/* Average rate so far */
+	double		io_size;	/* Current read/write size */
+	double		delay;		/* Current delay in microseconds */
+	int32_t		run;		/* Last adjustment, '+', '-', '0' */
+	int32_t		finished;	/* Non-zero when sluice has stopped */
+} sluice_shm_snapshot_t;
+
+typedef struct {
+	uint32_t	magic;		/* SLUICE_SHM_MAGIC */
+	uint32_t	version;	/* SLUICE_SHM_VERSION */
+	uint32_t	seq;		/* seqlock sequence number */
+	int32_t		pid;		/* Process ID of the writer */
+	sluice_shm_snapshot_t snap;	/* Seqlock protected snapshot */
+} sluice_shm_t;
+
+/*
+ *  sluice_shm_write_begin()
+ *	start a seqlock write, seq becomes odd
+ */
+static inline void sluice_shm_write_begin(sluice_shm_t *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ *  sluice_shm_write_end()
+ *	end a seqlock write, seq becomes even
+ */
+static inline void sluice_shm_write_end(sluice_shm_t *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  sluice_shm_read()
+ *	take a consistent copy of the snapshot, returns 0 on success
+ *	or -1 if the writer kept updating it during all the retries
+ */
+static inline int sluice_shm_read(
+	const sluice_shm_t *shm,
+	sluice_shm_snapshot_t *snap)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		const uint32_t seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		uint32_t seq2;
+
+		if (seq1 & 1)
+			continue;
+		(void)memcpy(snap, &shm->snap, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+		if (seq1 == seq2)
+			return 0;
+	}
+	return -1;
+}
+
+#endif
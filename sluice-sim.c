@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+#include "sluice-ctl.h"
+
+#define KB			(1024ULL)
+#define MB			(KB * KB)
+#define GB			(KB * MB)
+
+#define IO_SIZE_MAX		(1ULL * GB)	/* Max io buffer size, see -i */
+#define DELAY_SHIFT_MAX		(16)		/* Max shift, see -s */
+#define DRIFT_MAX		(11)		/* Number of drift stats */
+#define DRIFT_PERCENT_START	(0.0625)	/* Drift stats first point */
+
+#define DEFAULT_DURATION	(3600.0)	/* Simulated seconds, see -T */
+#define DEFAULT_SYSCALL		(2.0)		/* Syscall cost in usecs, see -k */
+#define DEFAULT_BANDWIDTH	(4.0 * GB)	/* Copy bandwidth, see -b */
+#define DEFAULT_SLACK		(60.0)		/* Max sleep overshoot usecs, see -j */
+#define DEFAULT_STALL_TIME	(0.05)		/* Mean consumer stall, see -y */
+#define DEFAULT_SEED		(0x5eed5eedULL)	/* PRNG seed, see -e */
+
+/* simulated environment, the ops context */
+typedef struct {
+	double		now;		/* Virtual clock, seconds */
+	double		duration;	/* -T simulated run time */
+	double		syscall;	/* -k cost of each syscall, seconds */
+	double		bandwidth;	/* -b copy bandwidth, bytes/sec */
+	double		slack;		/* -j max sleep overshoot, seconds */
+	double		stall_rate;	/* -x consumer stalls per second */
+	double		stall_time;	/* -y mean stall time, seconds */
+	double		stall_next;	/* Start of the next stall */
+	double		stall_until;	/* End of the current stall */
+	double		stalled;	/* Total time writes were stalled */
+	double		freq;		/* -v timeline interval */
+	double		sample_last;	/* Time of last timeline line */
+	double		target;		/* Target rate */
+	double		rate_min;	/* Minimum rate sampled */
+	double		rate_max;	/* Maximum rate sampled */
+	double		slept;		/* Total time asleep */
+	uint64_t	max_bytes;	/* -m stop after this much data */
+	uint64_t	total_bytes;	/* Bytes read so far */
+	uint64_t	rnd;		/* xorshift PRNG state */
+	uint64_t	reads;		/* Count of reads */
+	uint64_t	writes;		/* Count of writes */
+	uint64_t	sleeps;		/* Count of sleeps */
+	uint64_t	stalls;		/* Count of consumer stalls */
+	uint64_t	samples;	/* Count of controller updates */
+	uint64_t	drift[DRIFT_MAX]; /* Drift from the target rate */
+	uint64_t	drift_total;	/* Samples in drift histogram */
+	bool		verbose;	/* -v timeline */
+} sim_t;
+
+static const char *app_name = "sluice-sim";
+
+/*
+ *  sim_rand()
+ *	xorshift64 PRNG, the same seed always gives the same run
+ */
+static uint64_t sim_rand(sim_t *sim)
+{
+	sim->rnd ^= sim->rnd << 13;
+	sim->rnd ^= sim->rnd >> 7;
+	sim->rnd ^= sim->rnd << 17;
+	return sim->rnd;
+}
+
+/*
+ *  sim_uniform()
+ *	uniform random number in the range [0, 1)
+ */
+static double sim_uniform(sim_t *sim)
+{
+	return (double)(sim_rand(sim) >> 11) / 9007199254740992.0;
+}
+
+/*
+ *  sim_exp()
+ *	exponentially distributed random number with the given mean
+ */
+static double sim_exp(sim_t *sim, const double mean)
+{
+	return -mean * log(1.0 - sim_uniform(sim));
+}
+
+static double sim_now(void *ctx)
+{
+	return ((sim_t *)ctx)->now;
+}
+
+/*
+ *  sim_sleep()
+ *	sleeps cost a syscall and overshoot by up to the timer slack
+ */
+static int sim_sleep(void *ctx, const double usecs)
+{
+	sim_t *const sim = (sim_t *)ctx;
+	const double t = (usecs / 1000000.0) + sim->syscall +
+		(sim->slack * sim_uniform(sim));
+
+	sim->now += t;
+	sim->slept += t;
+	sim->sleeps++;
+	return 0;
+}
+
+/*
+ *  sim_read()
+ *	input is always ready, like /dev/zero, and costs a syscall
+ *	plus the copy time
+ */
+static ssize_t sim_read(void *ctx, const size_t size)
+{
+	sim_t *const sim = (sim_t *)ctx;
+	size_t n = size ? size : 1;
+
+	if (sim->max_bytes) {
+		if (sim->total_bytes >= sim->max_bytes)
+			return 0;
+		if (n > sim->max_bytes - sim->total_bytes)
+			n = (size_t)(sim->max_bytes - sim->total_bytes);
+	}
+	sim->now += sim->syscall + ((double)n / sim->bandwidth);
+	sim->total_bytes += n;
+	sim->reads++;
+	return (ssize_t)n;
+}
+
+/*
+ *  sim_write()
+ *	the consumer stalls at random times, a write during a stall
+ *	blocks until the consumer drains again
+ */
+static ssize_t sim_write(void *ctx, const size_t size)
+{
+	sim_t *const sim = (sim_t *)ctx;
+
+	if (sim->stall_rate > 0.0) {
+		while (sim->now >= sim->stall_next) {
+			sim->stall_until = sim->stall_next +
+				sim_exp(sim, sim->stall_time);
+			sim->stall_next = sim->stall_until +
+				sim_exp(sim, 1.0 / sim->stall_rate);
+			sim->stalls++;
+		}
+		if (sim->now < sim->stall_until) {
+			sim->stalled += sim->stall_until - sim->now;
+			sim->now = sim->stall_until;
+		}
+	}
+	sim->now += sim->syscall + ((double)size / sim->bandwidth);
+	sim->writes++;
+	return (ssize_t)size;
+}
+
+/*
+ *  sim_sample()
+ *	gather drift and rate statistics after each controller
+ *	update and print the -v timeline
+ */
+static bool sim_sample(void *ctx, const double secs_now,
+	const double current_rate, const int run)
+{
+	sim_t *const sim = (sim_t *)ctx;
+	const double drift_rate = 100.0 *
+		fabs(current_rate - sim->target) / sim->target;
+	double percent = DRIFT_PERCENT_START;
+	int i;
+
+	if (sim->samples++ == 0) {
+		sim->rate_min = current_rate;
+		sim->rate_max = current_rate;
+	}
+	if (current_rate < sim->rate_min)
+		sim->rate_min = current_rate;
+	if (current_rate > sim->rate_max)
+		sim->rate_max = current_rate;
+
+	sim->drift_total++;
+	for (i = 0; i < DRIFT_MAX; i++, percent *= 2.0) {
+		if (drift_rate < percent) {
+			sim->drift[i]++;
+			break;
+		}
+	}
+
+	if (sim->verbose && (secs_now > sim->sample_last + sim->freq)) {
+		(void)printf("%12.3f S  Rate: %14.1f B/S  Drift: %8.4f%%  %c\n",
+			secs_now, current_rate, drift_rate, run);
+		sim->sample_last = secs_now;
+	}
+	return secs_now < sim->duration;
+}
+
+/*
+ *  get_double_byte()
+ *	size in bytes, K, M or G
+ */
+static double get_double_byte(const char *const str)
+{
+	char *end;
+	double val = strtod(str, &end);
+
+	switch (toupper((unsigned char)*end)) {
+	case 'K':
+		return val * KB;
+	case 'M':
+		return val * MB;
+	case 'G':
+		return val * GB;
+	case 'B':
+	case '\0':
+		return val;
+	default:
+		(void)fprintf(stderr, "Illegal size '%s'\n", str);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ *  show_usage()
+ *	show options
+ */
+static void show_usage(void)
+{
+	(void)printf("%s, version %s\n\n", app_name, VERSION);
+	(void)printf("Usage: %s [options]\n", app_name);
+	(void)printf("  -b size    copy bandwidth per second of reads and writes.\n");
+	(void)printf("  -c delay   constant delay time in seconds.\n");
+	(void)printf("  -D mode    delay mode, 0..5 as for sluice -D.\n");
+	(void)printf("  -e seed    random number seed.\n");
+	(void)printf("  -h         print this help.\n");
+	(void)printf("  -i size    initial I/O size.\n");
+	(void)printf("  -j usecs   maximum sleep overshoot in microseconds.\n");
+	(void)printf("  -k usecs   cost of each system call in microseconds.\n");
+	(void)printf("  -m size    stop after size bytes.\n");
+	(void)printf("  -o         shrink I/O size on overrun.\n");
+	(void)printf("  -r rate    target data rate.\n");
+	(void)printf("  -s shift   controller adjustment shift.\n");
+	(void)printf("  -t percent fail if the average rate is off by more than percent.\n");
+	(void)printf("  -T secs    simulated run time in seconds.\n");
+	(void)printf("  -u         grow I/O size on underrun.\n");
+	(void)printf("  -v secs    print a timeline every secs simulated seconds.\n");
+	(void)printf("  -x rate    consumer stalls per second.\n");
+	(void)printf("  -y secs    mean consumer stall time in seconds.\n");
+}
+
+int main(int argc, char **argv)
+{
+	sim_t sim;
+	sluice_ctl_t ctl;
+	sluice_ops_t ops;
+	uint64_t delay_mode = DELAY_R_W_D;
+	double io_size = 0.0, tolerance = -1.0, error;
+	double percent = DRIFT_PERCENT_START, last_percent = 0.0;
+	struct timespec t1, t2;
+	int64_t total;
+	int i;
+
+	(void)memset(&sim, 0, sizeof(sim));
+	(void)memset(&ctl, 0, sizeof(ctl));
+	sim.duration = DEFAULT_DURATION;
+	sim.syscall = DEFAULT_SYSCALL / 1000000.0;
+	sim.bandwidth = DEFAULT_BANDWIDTH;
+	sim.slack = DEFAULT_SLACK / 1000000.0;
+	sim.stall_time = DEFAULT_STALL_TIME;
+	sim.rnd = DEFAULT_SEED;
+	ctl.const_delay = -1.0;
+	ctl.io_size_max = (double)IO_SIZE_MAX;
+	ctl.underrun_adjust = 1;
+	ctl.overrun_adjust = 1;
+
+	for (;;) {
+		const int c = getopt(argc, argv, "b:c:D:e:hi:j:k:m:or:s:t:T:uv:x:y:");
+
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'b':
+			sim.bandwidth = get_double_byte(optarg);
+			break;
+		case 'c':
+			ctl.flags |= (CTL_CONST_DELAY | CTL_UNDERRUN | CTL_OVERRUN);
+			ctl.const_delay = atof(optarg);
+			break;
+		case 'D':
+			delay_mode = strtoull(optarg, NULL, 10);
+			break;
+		case 'e':
+			sim.rnd = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			show_usage();
+			exit(EXIT_SUCCESS);
+		case 'i':
+			io_size = get_double_byte(optarg);
+			break;
+		case 'j':
+			sim.slack = atof(optarg) / 1000000.0;
+			break;
+		case 'k':
+			sim.syscall = atof(optarg) / 1000000.0;
+			break;
+		case 'm':
+			sim.max_bytes = (uint64_t)get_double_byte(optarg);
+			break;
+		case 'o':
+			ctl.flags |= CTL_OVERRUN;
+			break;
+		case 'r':
+			ctl.data_rate = get_double_byte(optarg);
+			break;
+		case 's':
+			ctl.adjust_shift = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		case 'T':
+			sim.duration = atof(optarg);
+			break;
+		case 'u':
+			ctl.flags |= CTL_UNDERRUN;
+			break;
+		case 'v':
+			sim.verbose = true;
+			sim.freq = atof(optarg);
+			break;
+		case 'x':
+			sim.stall_rate = atof(optarg);
+			break;
+		case 'y':
+			sim.stall_time = atof(optarg);
+			break;
+		default:
+			show_usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ctl.data_rate < 0.1) {
+		(void)fprintf(stderr, "A data rate must be given with -r.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (delay_mode > DELAY_MODE_MAX) {
+		(void)fprintf(stderr, "Delay mode -D %" PRIu64 " is too large, "
+			"range 0..%d.\n", delay_mode, DELAY_MODE_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if (ctl.adjust_shift > DELAY_SHIFT_MAX) {
+		(void)fprintf(stderr, "Delay shift must be less or equal to %d.\n",
+			DELAY_SHIFT_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if ((sim.duration <= 0.0) || (sim.bandwidth <= 0.0) ||
+	    (sim.syscall < 0.0) || (sim.slack < 0.0) ||
+	    (sim.stall_rate < 0.0) || (sim.stall_time <= 0.0)) {
+		(void)fprintf(stderr, "Invalid simulation parameter.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!sim.rnd)
+		sim.rnd = DEFAULT_SEED;
+
+	/* Same io_size defaults as sluice */
+	if (io_size < 1.0) {
+		if (ctl.flags & CTL_CONST_DELAY)
+			io_size = ctl.data_rate * ctl.const_delay;
+		else
+			io_size = ctl.data_rate / 32;
+		if (io_size < 1.0)
+			io_size = 1.0;
+	}
+	if (io_size > ctl.io_size_max) {
+		(void)fprintf(stderr, "I/O size too large.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sim.target = ctl.data_rate;
+	if (sim.stall_rate > 0.0)
+		sim.stall_next = sim_exp(&sim, 1.0 / sim.stall_rate);
+	sluice_ctl_init(&ctl, io_size);
+
+	(void)memset(&ops, 0, sizeof(ops));
+	ops.now = sim_now;
+	ops.sleep = sim_sleep;
+	ops.read = sim_read;
+	ops.write = sim_write;
+	ops.sample = sim_sample;
+	ops.ctx = &sim;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+	total = sluice_ctl_run(&ctl, &ops, &delay_info[delay_mode]);
+	(void)clock_gettime(CLOCK_MONOTONIC, &t2);
+	if (total < 0) {
+		(void)fprintf(stderr, "Simulation failed.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	error = (sim.now > 0.0) ?
+		100.0 * (((double)total / sim.now) - sim.target) / sim.target : 0.0;
+
+	(void)printf("Simulated time:   %.3f s\n", sim.now);
+	(void)printf("Wall clock time:  %.3f s\n",
+		(double)(t2.tv_sec - t1.tv_sec) +
+		(double)(t2.tv_nsec - t1.tv_nsec) / 1000000000.0);
+	(void)printf("Data:             %" PRId64 " B\n", total);
+	(void)printf("Reads:            %" PRIu64 "\n", sim.reads);
+	(void)printf("Writes:           %" PRIu64 "\n", sim.writes);
+	(void)printf("Delays:           %" PRIu64 "\n", sim.sleeps);
+	(void)printf("Total delay time: %.3f s\n", sim.slept);
+	(void)printf("Buffer reallocs:  %" PRIu64 "\n", ctl.reallocs);
+	(void)printf("Final buffer:     %.0f B\n", ctl.io_size);
+	(void)printf("Stalls:           %" PRIu64 " (%.3f s)\n",
+		sim.stalls, sim.stalled);
+	(void)printf("Target rate:      %.1f B/s\n", sim.target);
+	(void)printf("Average rate:     %.1f B/s\n",
+		sim.now > 0.0 ? (double)total / sim.now : 0.0);
+	(void)printf("Minimum rate:     %.1f B/s\n", sim.rate_min);
+	(void)printf("Maximum rate:     %.1f B/s\n", sim.rate_max);
+	(void)printf("Rate error:       %.4f%%\n", error);
+	(void)printf("Overruns:         %" PRIu64 "\n", ctl.total_overruns);
+	(void)printf("Underruns:        %" PRIu64 "\n", ctl.total_underruns);
+
+	(void)printf("\nDrift from target rate: (%%)\n");
+	for (i = 0; i < DRIFT_MAX; i++, percent *= 2.0) {
+		(void)printf("  %7.3f%% - %7.3f%%: %6.2f%%\n",
+			last_percent, percent - 0.001,
+			sim.drift_total ? 100.0 * (double)sim.drift[i] /
+				(double)sim.drift_total : 0.0);
+		last_percent = percent;
+	}
+
+	if ((tolerance >= 0.0) && (fabs(error) > tolerance)) {
+		(void)fprintf(stderr, "Rate error %.4f%% exceeds tolerance %.4f%%.\n",
+			error, tolerance);
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
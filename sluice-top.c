@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2021-2025 Colin Ian King
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Author Colin Ian King,  colin.i.king@gmail.com
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "sluice-shm.h"
+
+#define MAX_SEGMENTS		(1024)		/* Max instances watched */
+#define DEFAULT_DELAY		(1.0)		/* Default refresh, see -d */
+
+/* a watched sluice live statistics segment */
+typedef struct {
+	char		path[PATH_MAX];	/* Segment path */
+	sluice_shm_t	*shm;		/* Mapped segment */
+	uint64_t	prev_bytes;	/* Total bytes at last refresh */
+	double		prev_time;	/* Snapshot time at last refresh */
+	bool		seen;		/* Found in latest scan */
+} segment_t;
+
+static const char *app_name = "sluice-top";
+static volatile bool top_finish = false;
+static segment_t segments[MAX_SEGMENTS];
+static size_t n_segments;
+
+/*
+ *  handle_sigint()
+ *	catch SIGINT, stop watching
+ */
+static void handle_sigint(int dummy)
+{
+	(void)dummy;
+
+	top_finish = true;
+}
+
+/*
+ *  size_to_str()
+ *	report size in different units
+ */
+static const char *size_to_str(const double val, char *const buf, const size_t buflen)
+{
+	double v = val;
+	int i;
+
+	static const char *const sizes[] = {
+		"B ", "KB", "MB", "GB", "TB", "PB", "EB",
+	};
+
+	for (i = 0; i < 6; i++, v /= 1024.0) {
+		if (v <= 512.0)
+			break;
+	}
+	(void)snprintf(buf, buflen, "%7.1f %s", v, sizes[i]);
+	return buf;
+}
+
+/*
+ *  segment_add()
+ *	map a segment if it is not already being watched
+ */
+static void segment_add(const char *const path)
+{
+	size_t i;
+	int fd;
+	struct stat statbuf;
+	sluice_shm_t *shm;
+
+	for (i = 0; i < n_segments; i++) {
+		if (!strcmp(segments[i].path, path)) {
+			segments[i].seen = true;
+			return;
+		}
+	}
+	if (n_segments >= MAX_SEGMENTS)
+		return;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if ((fstat(fd, &statbuf) < 0) ||
+	    ((size_t)statbuf.st_size < sizeof(sluice_shm_t))) {
+		(void)close(fd);
+		return;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (shm == MAP_FAILED)
+		return;
+	if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SLUICE_SHM_MAGIC) ||
+	    (shm->version != SLUICE_SHM_VERSION)) {
+		(void)munmap((void *)shm, sizeof(*shm));
+		return;
+	}
+	(void)snprintf(segments[n_segments].path,
+		sizeof(segments[n_segments].path), "%s", path);
+	segments[n_segments].shm = shm;
+	segments[n_segments].prev_bytes = 0;
+	segments[n_segments].prev_time = 0.0;
+	segments[n_segments].seen = true;
+	n_segments++;
+}
+
+/*
+ *  segments_scan()
+ *	find all the segments to watch, either the named ones or
+ *	all the sluice- segments in /dev/shm
+ */
+static void segments_scan(const int argc, char **argv)
+{
+	size_t i, j;
+
+	for (i = 0; i < n_segments; i++)
+		segments[i].seen = false;
+
+	if (argc > 0) {
+		int k;
+
+		for (k = 0; k < argc; k++) {
+			char path[PATH_MAX];
+
+			if (strchr(argv[k], '/'))
+				(void)snprintf(path, sizeof(path), "%s", argv[k]);
+			else
+				(void)snprintf(path, sizeof(path), "%s/%s%s",
+					SLUICE_SHM_DIR, SLUICE_SHM_PREFIX, argv[k]);
+			segment_add(path);
+		}
+	} else {
+		DIR *dir = opendir(SLUICE_SHM_DIR);
+		const struct dirent *d;
+
+		if (dir) {
+			while ((d = readdir(dir)) != NULL) {
+				char path[PATH_MAX];
+
+				if (strncmp(d->d_name, SLUICE_SHM_PREFIX,
+					    sizeof(SLUICE_SHM_PREFIX) - 1))
+					continue;
+				(void)snprintf(path, sizeof(path), "%s/%s",
+					SLUICE_SHM_DIR, d->d_name);
+				segment_add(path);
+			}
+			(void)closedir(dir);
+		}
+	}
+
+	/* Drop segments that have been removed */
+	for (i = 0, j = 0; i < n_segments; i++) {
+		if (segments[i].seen && (access(segments[i].path, F_OK) == 0)) {
+			segments[j++] = segments[i];
+		} else {
+			(void)munmap((void *)segments[i].shm, sizeof(sluice_shm_t));
+		}
+	}
+	n_segments = j;
+}
+
+/*
+ *  segments_show()
+ *	show one line of statistics per segment
+ */
+static void segments_show(void)
+{
+	size_t i;
+
+	if (isatty(fileno(stdout)))
+		(void)printf("\033[H\033[2J");
+	(void)printf("%-7s %-20s %10s %10s %10s %10s %10s %3s %9s %9s\n",
+		"PID", "Name", "Rate/S", "Avg/S", "Target/S", "Total", "Buffer",
+		"Adj", "Underruns", "Overruns");
+
+	for (i = 0; i < n_segments; i++) {
+		segment_t *const seg = &segments[i];
+		sluice_shm_snapshot_t snap;
+		const char *name = strrchr(seg->path, '/');
+		char rate_str[32], avg_str[32], target_str[32];
+		char total_str[32], buf_str[32];
+		double rate = 0.0;
+
+		if (sluice_shm_read(seg->shm, &snap) < 0)
+			continue;
+		name = name ? name + 1 : seg->path;
+		if (!strncmp(name, SLUICE_SHM_PREFIX, sizeof(SLUICE_SHM_PREFIX) - 1))
+			name += sizeof(SLUICE_SHM_PREFIX) - 1;
+
+		if ((seg->prev_time > 0.0) && (snap.time_now > seg->prev_time))
+			rate = (double)(snap.total_bytes - seg->prev_bytes) /
+				(snap.time_now - seg->prev_time);
+		seg->prev_bytes = snap.total_bytes;
+		seg->prev_time = snap.time_now;
+
+		(void)printf("%-7" PRId32 " %-20.20s %s %s %s %s %s  %c  %9" PRIu64 " %9" PRIu64 "%s\n",
+			seg->shm->pid, name,
+			size_to_str(rate, rate_str, sizeof(rate_str)),
+			size_to_str(snap.current_rate, avg_str, sizeof(avg_str)),
+			size_to_str(snap.target_rate, target_str, sizeof(target_str)),
+			size_to_str((double)snap.total_bytes, total_str, sizeof(total_str)),
+			size_to_str(snap.io_size, buf_str, sizeof(buf_str)),
+			snap.run ? (char)snap.run : ' ',
+			snap.underruns, snap.overruns,
+			snap.finished ? " (finished)" : "");
+	}
+	(void)fflush(stdout);
+}
+
+/*
+ *  show_usage()
+ *	show options
+ */
+static void show_usage(void)
+{
+	(void)printf("%s, version %s\n\n", app_name, VERSION);
+	(void)printf("Usage: %s [options] [name ...]\n", app_name);
+	(void)printf("  -d delay   refresh delay in seconds.\n");
+	(void)printf("  -h         print this help.\n");
+	(void)printf("  -n count   stop after count refreshes.\n");
+}
+
+int main(int argc, char **argv)
+{
+	double delay = DEFAULT_DELAY;
+	uint64_t count = 0, i;
+	struct sigaction new_action;
+
+	for (;;) {
+		const int c = getopt(argc, argv, "d:hn:");
+
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'd':
+			delay = atof(optarg);
+			if (delay < 0.01) {
+				(void)fprintf(stderr, "Delay must be at least 0.01 seconds.\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			show_usage();
+			exit(EXIT_SUCCESS);
+		case 'n':
+			count = (uint64_t)strtoull(optarg, NULL, 10);
+			break;
+		default:
+			show_usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	(void)memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = handle_sigint;
+	(void)sigemptyset(&new_action.sa_mask);
+	if (sigaction(SIGINT, &new_action, NULL) < 0) {
+		(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
+			errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; !top_finish && (!count || (i < count)); i++) {
+		segments_scan(argc - optind, argv + optind);
+		segments_show();
+		if (count && (i + 1 >= count))
+			break;
+		(void)usleep((useconds_t)(delay * 1000000.0));
+	}
+
+	for (i = 0; i < n_segments; i++)
+		(void)munmap((void *)segments[i].shm, sizeof(sluice_shm_t));
+
+	exit(EXIT_SUCCESS);
+}
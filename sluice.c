@@ -31,14 +31,66 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <math.h>
 #include <float.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/times.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(HAVE_LZ4)
+#include <lz4frame.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "sluice-shm.h"
+#include "sluice-ctl.h"
+#include "libsluice.h"
+
+/*
+ *  USDT static probes, build with make USDT=1 to enable these,
+ *  otherwise they compile to nothing
+ */
+#if defined(HAVE_SDT)
+#include <sys/sdt.h>
+#define SLUICE_PROBE1(name, a1)	DTRACE_PROBE1(sluice, name, a1)
+#define SLUICE_PROBE2(name, a1, a2)	DTRACE_PROBE2(sluice, name, a1, a2)
+#define SLUICE_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(sluice, name, a1, a2, a3, a4)
+#else
+#define SLUICE_PROBE1(name, a1)	do { (void)(a1); } while (0)
+#define SLUICE_PROBE2(name, a1, a2)	do { (void)(a1); (void)(a2); } while (0)
+#define SLUICE_PROBE4(name, a1, a2, a3, a4) \
+	do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
 
 #define KB			(1024ULL)
 #define MB			(KB * KB)
@@ -53,8 +105,6 @@
 #define PAGE_4K			(4 * KB)
 
 #define UNDERRUN_MAX		(100)		/* Max underruns before warning, see -w */
-#define UNDERRUN_ADJUST_MAX	(1)		/* Underruns before adjusting rate */
-#define OVERRUN_ADJUST_MAX	(1)		/* Overruns before adjusting rate */
 
 #define DELAY_SHIFT_MIN		(0)		/* Min shift, see -s */
 #define DELAY_SHIFT_MAX		(16)		/* Max shift, see -s */
@@ -69,35 +119,174 @@
 
 #define FREQ_MIN		(0.01)		/* Min frequency, see -f */
 
-#define DRIFT_MAX		(11)		/* Number of drift stats, see -S */
-#define DRIFT_PERCENT_START	(0.0625)	/* Drift stats first point */
+#define DRIFT_MAX		SLUICE_DRIFT_MAX /* Number of drift stats, see -S */
+#define DRIFT_PERCENT_START	SLUICE_DRIFT_START /* Drift stats first point */
 #define DEFAULT_FREQ		(0.250)		/* Default verbose feedback freq, see -f */
 
+#define STREAM_SLACK		(0.001)		/* -L wakeup coalescing, seconds */
+
+#define GEN_WORKERS_MIN		(1)		/* Min generator workers, see -j */
+#define GEN_WORKERS_MAX		(256)		/* Max generator workers, see -j */
+#define CODEC_WORKERS_DEFAULT	(2)		/* Default -Z compression workers */
+
+#define SOCK_LISTEN_BACKLOG	(64)		/* Pending connections, see -I -O -t */
+#define SOCK_BACKLOG_MAX	(4 * MB)	/* Max queued data per client */
+#define SOCK_ZEROCOPY_MIN	(16 * KB)	/* Min send size for MSG_ZEROCOPY */
+
+#define DGRAM_MAGIC		(0x534c4344)	/* "SLCD", see -U */
+#define DGRAM_FLAG_END		(0x0001)	/* End of stream datagram */
+#define DGRAM_SIZE_DEFAULT	(1400)		/* Default datagram size, see -U */
+#define DGRAM_SIZE_MAX		(65507)		/* Max UDP payload */
+#define DGRAM_BATCH_TIME	(0.001)		/* Datagrams per sendmmsg, seconds */
+#define DGRAM_BATCH_MAX		(1024)		/* Max datagrams per sendmmsg */
+#define DGRAM_GSO_SEGS_MAX	(64)		/* Max UDP GSO segments per send */
+#define DGRAM_GSO_BYTES_MAX	(60 * KB)	/* Max UDP GSO bytes per send */
+#define DGRAM_RECV_BATCH	(64)		/* Datagrams per recvmmsg */
+#define DGRAM_RCVBUF		(4 * MB)	/* Sink socket receive buffer */
+#define DGRAM_END_REPEAT	(3)		/* End datagrams sent, may be lost */
+
+#define GROUP_MAGIC		(0x534c4347)	/* "SLCG", see -g */
+#define GROUP_VERSION		(1)
+#define GROUP_SHM_PREFIX	"sluice-group-"	/* -g segment, apart from -M ones */
+#define GROUP_MEMBERS_MAX	(64)		/* Max processes in a group */
+#define GROUP_BURST		(0.25)		/* Token bucket depth, seconds */
+#define GROUP_UPDATE		(0.1)		/* Share re-evaluation period, seconds */
+#define GROUP_HEARTBEAT_MAX	(2.0)		/* Silent members are inactive, seconds */
+#define GROUP_RATE_CHANGE	(0.01)		/* Share change that re-targets rate */
+
+#define CHECKPOINT_VERSION	(1)		/* -K checkpoint file format */
+#define CHECKPOINT_INTERVAL	(10.0)		/* Default -K interval, seconds */
+
+#define PREFETCH_CHUNK		(1 * MB)	/* -H prefetch advice size */
+
+#define SPARSE_ZERO_SIZE	(1 * MB)	/* -b hole write size */
+
+#define AUTOTUNE_IO_MIN		(4 * KB)	/* -A smallest io_size tried */
+#define AUTOTUNE_IO_MAX		(8 * MB)	/* -A largest io_size tried */
+#define AUTOTUNE_WRITES_MIN	(8)		/* -A at least 8 writes per second */
+#define AUTOTUNE_CANDIDATES	(12)		/* -A io_sizes tried, doubling */
+#define AUTOTUNE_WINDOW		(0.25)		/* -A measurement window, seconds */
+#define AUTOTUNE_WINDOW_WRITES	(4)		/* -A min writes per window */
+#define AUTOTUNE_BLOCKED	(0.25)		/* -A max share of time in write */
+#define AUTOTUNE_CPU_SLACK	(1.10)		/* -A smallest size within 10% of best CPU */
+#define AUTOTUNE_RATE_SLACK	(0.90)		/* -A window rate below 90% is bad */
+#define AUTOTUNE_RETUNE		(8)		/* -A bad windows in a row to re-tune */
+
+#define TRAFFIC_ON_DEFAULT	(1.0)		/* -l mean on period, seconds */
+#define TRAFFIC_OFF_DEFAULT	(1.0)		/* -l mean off period, seconds */
+#define TRAFFIC_ALPHA_DEFAULT	(1.5)		/* -l Pareto shape */
+#define TRAFFIC_PERIOD_MIN	(0.001)		/* -l shortest mean period, seconds */
+#define TRAFFIC_PERIOD_CAP	(1000.0)	/* -l longest Pareto period, x mean */
+#define TRAFFIC_SIGMA_MAX	(4.0)		/* -l largest lognormal sigma */
+#define TRAFFIC_SIZE_CAP	(16.0)		/* -l largest chunk, x mean */
+#define TRAFFIC_LATE		(0.001)		/* -l chunk sent late, seconds */
+
+#define OCC_BUCKETS		(10)		/* -q fill level histogram buckets */
+#define OCC_LOW			(0.25)		/* -q pipe running dry below this */
+#define OCC_BACKOFF_MIN		(0.0001)	/* -q shortest back-off, seconds */
+#define OCC_BACKOFF_MAX		(0.01)		/* -q longest back-off, seconds */
+#define OCC_DRAIN_WINDOW	(0.05)		/* -q drain rate sample window, seconds */
+#define OCC_DRAIN_SMOOTH	(0.25)		/* -q drain rate moving average */
+#define OCC_PIPE_SIZE_DEFAULT	(64 * KB)	/* -q pipe size if it cannot be read */
+
+#define REPLAY_IF_MAX		(64)		/* -Q pcapng interfaces per section */
+#define REPLAY_IOV_MAX		(64)		/* -Q max packets per writev */
+#define REPLAY_LATE		(0.001)		/* -Q packet sent late, seconds */
+#define REPLAY_SPEED_MIN	(0.001)		/* -Q slowest speed multiplier */
+#define REPLAY_SPEED_MAX	(1000000.0)	/* -Q fastest speed multiplier */
+#define REPLAY_PCAP_MAGIC_US	(0xa1b2c3d4)	/* pcap, microsecond timestamps */
+#define REPLAY_PCAP_MAGIC_NS	(0xa1b23c4d)	/* pcap, nanosecond timestamps */
+#define REPLAY_PCAPNG_SHB	(0x0a0d0d0a)	/* pcapng section header block */
+#define REPLAY_PCAPNG_BOM	(0x1a2b3c4d)	/* pcapng byte order magic */
+#define REPLAY_PCAPNG_IDB	(1)		/* pcapng interface description */
+#define REPLAY_PCAPNG_PB	(2)		/* pcapng obsolete packet block */
+#define REPLAY_PCAPNG_SPB	(3)		/* pcapng simple packet block */
+#define REPLAY_PCAPNG_EPB	(6)		/* pcapng enhanced packet block */
+#define REPLAY_LINK_NULL	(0)		/* BSD loopback */
+#define REPLAY_LINK_ETHERNET	(1)		/* Ethernet */
+#define REPLAY_LINK_RAW_BSD	(12)		/* Raw IP on some BSDs */
+#define REPLAY_LINK_RAW		(101)		/* Raw IP */
+#define REPLAY_LINK_LOOP	(108)		/* OpenBSD loopback */
+#define REPLAY_LINK_SLL		(113)		/* Linux cooked capture */
+#define REPLAY_LINK_IPV4	(228)		/* Raw IPv4 */
+#define REPLAY_LINK_IPV6	(229)		/* Raw IPv6 */
+#define REPLAY_LINK_SLL2	(276)		/* Linux cooked capture v2 */
+
+#define TEE_QUEUE_DEFAULT	(16 * MB)	/* -E tee queue size */
+#define TEE_QUEUE_MIN		(64 * KB)	/* -E smallest tee queue */
+#define TEE_SLOTS		(4096)		/* -E max chunks queued */
+#define TEE_SPILL_CHUNK		(1 * MB)	/* -E spill file read size */
+#define TEE_SPILL_DIR		"/var/tmp"	/* -E spill file if no TMPDIR */
+
+#define COMMIT_INTERVAL_DEFAULT	(1.0)		/* -G commit interval, seconds */
+#define COMMIT_INTERVAL_MIN	(0.001)		/* -G shortest commit interval */
+#define COMMIT_KICK		(1 * MB)	/* -G start writeback every so many bytes */
+#define COMMIT_FDS		(2)		/* -G stdout and the -t/-O file */
+
+#define CACHE_FDS		(3)		/* -N input, stdout and the -t/-O file */
+#define CACHE_WINDOW_MIN	(1 * MB)	/* -N smallest cache window */
+#define CACHE_STEPS		(8)		/* -N checks per window of progress */
+#define CACHE_FOLIO_MAX		(2 * MB)	/* -N largest page cache folio */
+
+#define LAT_SUB			(16)		/* Latency buckets per power of 2 */
+#define LAT_BUCKETS		(61 * LAT_SUB)	/* Latency histogram buckets */
+
+#define BLOCK_SIZE_DEFAULT	(4 * KB)	/* Default -W block size */
+#define BLOCK_QD_MAX		(256)		/* Max -W queue depth */
+#define BLOCK_ALIGN		(4 * KB)	/* -W buffer alignment for O_DIRECT */
+#define BLOCK_LATE		(0.001)		/* -W I/O issued late, seconds */
+
+#define TREE_WORKERS_DEFAULT	(4)		/* Default directory copy workers, see -j */
+#define TREE_QUEUE_MAX		(1024)		/* Max files queued for the copy workers */
+#define TREE_IO_SIZE		(128 * KB)	/* Max default directory copy io size */
+#define TREE_BURST		(0.1)		/* Shared token bucket depth, seconds */
+
 #define DEBUG_RATE		(0)		/* Set to non-zero to get datarate debug */
 #define DEBUG_SETUP		(0)		/* Set to non-zero to dump setup state */
 
-#define OPT_VERBOSE		(0x00000001)	/* -v */
-#define OPT_GOT_RATE		(0x00000002)	/* -r */
-#define OPT_GOT_IOSIZE		(0x00000004)	/* -i */
-#define OPT_GOT_CONST_DELAY	(0x00000008)	/* -c */
-#define OPT_WARNING		(0x00000010)	/* -w */
-#define OPT_UNDERRUN		(0x00000020)	/* -u */
-#define OPT_DISCARD_STDOUT	(0x00000040)	/* -d */
-#define OPT_OVERRUN		(0x00000080)	/* -o */
-#define OPT_ZERO		(0x00000100)	/* -z */
-#define OPT_URANDOM		(0x00000200)	/* -R */
-#define OPT_APPEND		(0x00000400)	/* -a */
-#define OPT_STATS		(0x00000800)	/* -S */
-#define OPT_NO_RATE_CONTROL	(0x00001000)	/* -n */
-#define OPT_TIMED_RUN		(0x00002000)	/* -T */
-#define OPT_INPUT_FILE		(0x00004000)	/* -I */
-#define OPT_VERSION		(0x00008000)	/* -V */
-#define OPT_PROGRESS		(0x00010000)	/* -p */
-#define OPT_MAX_TRANS_SIZE	(0x00020000)	/* -m */
-#define OPT_SKIP_READ_ERRORS	(0x00040000)	/* -e */
-#define OPT_GOT_SHIFT		(0x00080000)	/* -s */
-#define OPT_PIPE_XFER_SIZE	(0x00100000)	/* -x */
-#define OPT_FSYNC		(0x00200000)	/* -F */
+#define OPT_VERBOSE		(0x0000000000000001ULL)	/* -v */
+#define OPT_GOT_RATE		(0x0000000000000002ULL)	/* -r */
+#define OPT_GOT_IOSIZE		(0x0000000000000004ULL)	/* -i */
+#define OPT_GOT_CONST_DELAY	(0x0000000000000008ULL)	/* -c */
+#define OPT_WARNING		(0x0000000000000010ULL)	/* -w */
+#define OPT_UNDERRUN		(0x0000000000000020ULL)	/* -u */
+#define OPT_DISCARD_STDOUT	(0x0000000000000040ULL)	/* -d */
+#define OPT_OVERRUN		(0x0000000000000080ULL)	/* -o */
+#define OPT_ZERO		(0x0000000000000100ULL)	/* -z */
+#define OPT_URANDOM		(0x0000000000000200ULL)	/* -R */
+#define OPT_APPEND		(0x0000000000000400ULL)	/* -a */
+#define OPT_STATS		(0x0000000000000800ULL)	/* -S */
+#define OPT_NO_RATE_CONTROL	(0x0000000000001000ULL)	/* -n */
+#define OPT_TIMED_RUN		(0x0000000000002000ULL)	/* -T */
+#define OPT_INPUT_FILE		(0x0000000000004000ULL)	/* -I */
+#define OPT_VERSION		(0x0000000000008000ULL)	/* -V */
+#define OPT_PROGRESS		(0x0000000000010000ULL)	/* -p */
+#define OPT_MAX_TRANS_SIZE	(0x0000000000020000ULL)	/* -m */
+#define OPT_SKIP_READ_ERRORS	(0x0000000000040000ULL)	/* -e */
+#define OPT_GOT_SHIFT		(0x0000000000080000ULL)	/* -s */
+#define OPT_PIPE_XFER_SIZE	(0x0000000000100000ULL)	/* -x */
+#define OPT_FSYNC		(0x0000000000200000ULL)	/* -F */
+#define OPT_SHM_STATS		(0x0000000000400000ULL)	/* -M */
+#define OPT_STREAM_LIST		(0x0000000000800000ULL)	/* -L */
+#define OPT_GEN_WORKERS		(0x0000000001000000ULL)	/* -j */
+#define OPT_GROUP		(0x0000000002000000ULL)	/* -g */
+#define OPT_CPU_AFFINITY	(0x0000000004000000ULL)	/* -C */
+#define OPT_SCHED		(0x0000000008000000ULL)	/* -Y */
+#define OPT_MLOCK		(0x0000000010000000ULL)	/* -k */
+#define OPT_DGRAM		(0x0000000020000000ULL)	/* -U */
+#define OPT_CODEC		(0x0000000040000000ULL)	/* -Z */
+#define OPT_CHECKPOINT		(0x0000000080000000ULL)	/* -K */
+#define OPT_RESUME		(0x0000000100000000ULL)	/* -J */
+#define OPT_PREFETCH		(0x0000000200000000ULL)	/* -H */
+#define OPT_SPARSE		(0x0000000400000000ULL)	/* -b */
+#define OPT_BLOCK		(0x0000000800000000ULL)	/* -W */
+#define OPT_AUTOTUNE		(0x0000001000000000ULL)	/* -A */
+#define OPT_TRAFFIC		(0x0000002000000000ULL)	/* -l */
+#define OPT_OCCUPANCY		(0x0000004000000000ULL)	/* -q */
+#define OPT_REPLAY		(0x0000008000000000ULL)	/* -Q */
+#define OPT_ASYNC_TEE		(0x0000010000000000ULL)	/* -E */
+#define OPT_GROUP_COMMIT	(0x0000020000000000ULL)	/* -G */
+#define OPT_CACHE_NEUTRAL	(0x0000040000000000ULL)	/* -N */
 
 #define EXIT_BAD_OPTION		(1)
 #define EXIT_FILE_ERROR		(2)
@@ -107,50 +296,33 @@
 #define EXIT_READ_ERROR		(6)
 #define EXIT_WRITE_ERROR	(7)
 #define EXIT_ALLOC_ERROR	(8)
+#define EXIT_SCHED_ERROR	(9)
 
-#define BUF_SIZE(sz)		((((size_t)sz) < 1) ? 1 : ((size_t)sz))
-
-/* R = read, W = write, D = delay */
-#define DELAY_R_W_D		(0x00000000)	/* full delay */
-#define DELAY_D_R_W		(0x00000001)	/* full delay */
-#define DELAY_R_D_W		(0x00000002)	/* full delay */
-#define DELAY_D_R_D_W		(0x00000003)	/* 2 * 1/2 delay */
-#define DELAY_R_D_W_D		(0x00000004)	/* 2 * 1/2 delay */
-#define DELAY_D_R_D_W_D		(0x00000005)	/* 3 * 1/3 delay */
-
-#define DELAY_MODE_MIN		0
-#define DELAY_MODE_MAX		DELAY_D_R_D_W_D
-
-#define DELAY_D			(0x01)		/* delay */
-#define DELAY_S			(0x00)		/* skip */
+#define SIZEOF_ARRAY(a)		(sizeof(a) / sizeof(a[0]))
 
-#define DELAY_SET_ACTION(a1, a2, a3)	((a1 << 0) | (a2 << 1) | (a3 << 2))
-#define DELAY_GET_ACTION(n, action)	((1 << n) & action)
+#define BUF_SIZE(sz)		((((size_t)sz) < 1) ? 1 : ((size_t)sz))
 
 #define DOUBLE_TINY		(0.0000001)
 #define DOUBLE_CMP(a, b)		(fabs((a) - (b)) < DOUBLE_TINY)
 
-typedef struct {
-	double	divisor;			/* delay divisor */
-	uint8_t	mode;				/* User specified mode */
-	uint8_t	action;				/* action bit map */
-} delay_info_t;
-
-/*
- *  action bit#
- *	0		sleep on/off
- *			read
- *	1		sleep on/off
- *			write
- *	2		sleep on/off
- */
-static const delay_info_t delay_info[] = {
-	{ 1.0, DELAY_R_W_D,	DELAY_SET_ACTION(DELAY_S, DELAY_S, DELAY_D) },
-	{ 1.0, DELAY_D_R_W,	DELAY_SET_ACTION(DELAY_D, DELAY_S, DELAY_S) },
-	{ 1.0, DELAY_R_D_W,     DELAY_SET_ACTION(DELAY_S, DELAY_D, DELAY_S) },
-	{ 2.0, DELAY_D_R_D_W,   DELAY_SET_ACTION(DELAY_D, DELAY_D, DELAY_S) },
-	{ 2.0, DELAY_R_D_W_D,   DELAY_SET_ACTION(DELAY_S, DELAY_D, DELAY_D) },
-	{ 3.0, DELAY_D_R_D_W_D, DELAY_SET_ACTION(DELAY_D, DELAY_D, DELAY_D) },
+/* main loop phases, for time accounting */
+typedef enum {
+	PHASE_READ = 0,			/* read fill loop */
+	PHASE_WRITE,			/* stdout write */
+	PHASE_TEE,			/* -t tee file write */
+	PHASE_FSYNC,			/* -F fsync */
+	PHASE_DELAY,			/* rate control delays */
+	PHASE_CONTROL,			/* rate controller and feedback */
+	PHASE_MAX,
+} phase_t;
+
+static const char *const phase_names[] = {
+	"Read",
+	"Write",
+	"Tee",
+	"Fsync",
+	"Delay",
+	"Control",
 };
 
 /* scaling factor */
@@ -179,10 +351,719 @@ typedef struct {
 	double		buf_size_total;	/* For average buffer size */
 	double		rate_min;	/* Minimum rate */
 	double		rate_max;	/* Maximum rate */
-	bool		rate_set;	/* Min/max set or not? */
+	double		phase_time[PHASE_MAX];/* Time spent in each phase */
+	uint64_t	nvcsw;		/* Voluntary context switches */
+	uint64_t	nivcsw;		/* Involuntary context switches */
+	bool		csw_valid;	/* Context switch counts available */
+	int64_t		migrations;	/* CPU migrations, -1 if unknown */
+	uint64_t	resumed;	/* Bytes copied before -J resume */
+	uint64_t	checkpoints;	/* -K checkpoints written */
+	double		resumed_time;	/* Run time before -J resume */
 } stats_t;
 
-static unsigned int opt_flags;
+/* -H read-ahead prefetcher for the -I files */
+typedef struct {
+	pthread_mutex_t	lock;		/* Protects the cursor state */
+	pthread_cond_t	cond;		/* Cursor has moved on */
+	pthread_t	thread;		/* Prefetcher thread */
+	char		**names;	/* -I files */
+	uint64_t	*sizes;		/* File sizes, 0 = not prefetched */
+	size_t		n_files;	/* Number of -I files */
+	uint64_t	distance;	/* How far ahead to prefetch */
+	uint64_t	cursor;		/* Read offset across all the files */
+	uint64_t	issued;		/* Prefetched up to here */
+	uint64_t	bytes;		/* Bytes prefetched */
+	uint64_t	calls;		/* posix_fadvise calls */
+	uint64_t	files;		/* Files prefetched */
+	uint64_t	overtaken;	/* Reader got ahead of the prefetcher */
+	uint64_t	errors;		/* Files that could not be prefetched */
+	double		time;		/* Time spent issuing advice */
+	bool		started;	/* Thread was created */
+	bool		stop;		/* Tell the thread to stop */
+} prefetch_t;
+
+/* -b sparse -I file, only the data extents are read */
+typedef struct {
+	off_t		offset;		/* Input offset */
+	off_t		data_end;	/* End of the current data extent */
+	char		*zeros;		/* Holes written to unseekable outputs */
+	double		hole_rate;	/* -B rate for written holes, 0 = none */
+	double		hole_time;	/* Time spent on holes */
+	uint64_t	data_bytes;	/* Data read */
+	uint64_t	hole_bytes;	/* Hole bytes skipped or written */
+	uint64_t	extents;	/* Data extents */
+	uint64_t	holes;		/* Holes */
+	bool		seek_out;	/* stdout can skip holes by seeking */
+	bool		seek_tee;	/* -t/-O file can skip holes by seeking */
+	bool		written;	/* Some holes had to be written */
+} sparse_t;
+
+/* -A auto-tune measurements of one io_size */
+typedef struct {
+	double		io_size;	/* io_size tried */
+	size_t		pipe_size;	/* Pipe size used with it, 0 = none */
+	double		cpu;		/* Thread CPU time */
+	double		wall;		/* Wall clock time */
+	double		blocked;	/* Time in write */
+	uint64_t	bytes;		/* Data written */
+} autotune_cand_t;
+
+/* -A auto-tune of io_size and pipe size */
+typedef struct {
+	autotune_cand_t	cand[AUTOTUNE_CANDIDATES]; /* io_sizes tried */
+	size_t		n_cand;		/* Number of io_sizes to try */
+	size_t		cur;		/* io_size being measured */
+	size_t		pipe_max;	/* Max pipe size, 0 if not a pipe */
+	int		fdin;		/* Input pipe */
+	int		fdout;		/* Output pipe */
+	double		target;		/* Target data rate */
+	double		io_size;	/* io_size chosen */
+	size_t		pipe_size;	/* Pipe size chosen, 0 = none */
+	double		win_start;	/* Window start time */
+	double		win_cpu;	/* Thread CPU time at window start */
+	double		win_blocked;	/* Write time at window start */
+	uint64_t	win_bytes;	/* Bytes at window start */
+	uint64_t	win_writes;	/* Writes in window */
+	double		tune_start;	/* Start of current warm-up */
+	double		warmup;		/* Total time spent tuning */
+	uint64_t	retunes;	/* Re-tunes after the first */
+	uint32_t	bad;		/* Bad windows in a row */
+	bool		tuning;		/* Warm-up in progress */
+} autotune_t;
+
+/* -K checkpointed progress of a -I to -O copy */
+typedef struct {
+	const char	*path;		/* Checkpoint file */
+	double		interval;	/* Seconds between checkpoints */
+	double		last;		/* Time of last checkpoint */
+	double		elapsed;	/* Run time before resuming */
+	uint64_t	offset;		/* Committed offset */
+	uint64_t	saves;		/* Checkpoints written */
+} checkpoint_t;
+
+/* a regular file queued for a directory copy worker */
+typedef struct {
+	char		*src;		/* Source path */
+	char		*dst;		/* Destination path */
+	struct stat	st;		/* Source metadata */
+} tree_file_t;
+
+/* a copied directory, metadata is set once everything under it is done */
+typedef struct {
+	char		*dst;		/* Destination path */
+	struct stat	st;		/* Source metadata */
+} tree_dir_t;
+
+typedef struct tree tree_t;
+
+/* a directory copy worker */
+typedef struct {
+	tree_t		*tree;		/* Copy the worker belongs to */
+	pthread_t	thread;		/* Worker thread */
+	char		*buffer;	/* Copy buffer */
+	uint64_t	files;		/* Files copied */
+	uint64_t	bytes;		/* Bytes copied */
+	uint64_t	delays;		/* Times the worker waited for tokens */
+	double		delay_time;	/* Time spent waiting for tokens */
+	bool		started;	/* Thread was created */
+} tree_worker_t;
+
+/* -I dir -O dir copy, the walker queues files for a pool of workers */
+struct tree {
+	pthread_mutex_t	lock;		/* Protects the queue */
+	pthread_cond_t	cond_queued;	/* A file has been queued */
+	pthread_cond_t	cond_space;	/* A file has been taken */
+	pthread_mutex_t	bucket_lock;	/* Protects the token bucket */
+	tree_file_t	*queue;		/* Ring of files to copy */
+	size_t		head;		/* Next file to copy */
+	size_t		count;		/* Files in the ring */
+	tree_worker_t	*workers;	/* Worker threads */
+	size_t		n_workers;	/* Number of worker threads */
+	size_t		running;	/* Workers still running */
+	size_t		io_size;	/* Read/write size */
+	tree_dir_t	*dirs;		/* Directories created */
+	size_t		n_dirs;		/* Number of directories */
+	size_t		max_dirs;	/* Allocated directories */
+	dev_t		dst_dev;	/* Destination, not to be walked */
+	ino_t		dst_ino;
+	double		rate;		/* Shared rate, 0 = no rate control */
+	double		tokens;		/* Token bucket, may go into debt */
+	double		time_last;	/* Last token bucket refill */
+	double		time_start;	/* Start of the copy */
+	double		verbose_last;	/* Last -v progress report */
+	double		freq;		/* -v progress report frequency */
+	uint64_t	timed_run;	/* -T run duration */
+	uint64_t	bytes;		/* Bytes copied */
+	uint64_t	files;		/* Files copied */
+	uint64_t	links;		/* Symbolic links created */
+	uint64_t	skipped;	/* Special files not copied */
+	uint64_t	errors;		/* Files that failed */
+	bool		done;		/* Walk has finished */
+	bool		stop;		/* Tell workers to stop */
+};
+
+/* a -L multi-stream mode input/output pair */
+typedef struct {
+	char		*input;		/* Input filename, - for stdin */
+	char		*output;	/* Output filename, - for stdout */
+	char		*buffer;	/* I/O buffer */
+	size_t		io_size;	/* Read size */
+	size_t		buf_len;	/* Bytes in buffer */
+	size_t		buf_off;	/* Bytes of buffer written so far */
+	double		rate;		/* Requested rate, 0.0 = unlimited */
+	double		weight;		/* Share of the -r aggregate rate */
+	double		eff_rate;	/* Rate after aggregate sharing */
+	double		tokens;		/* Bytes allowed to be read now */
+	double		time_last;	/* Time of last token refill */
+	uint64_t	total_bytes;	/* Total bytes copied */
+	uint64_t	reads;		/* Total read calls */
+	uint64_t	writes;		/* Total write calls */
+	int		fdin;		/* Input file descriptor */
+	int		fdout;		/* Output file descriptor */
+	bool		done;		/* Reached end of input */
+	bool		shared;		/* Rate is a share of the aggregate */
+} stream_t;
+
+/* a -j generator pool chunk */
+typedef struct {
+	char		*data;		/* Generated data */
+	uint64_t	seq;		/* Chunk sequence number */
+	bool		full;		/* Filled, waiting to be written */
+} gen_chunk_t;
+
+typedef struct gen gen_t;
+
+/* a -j generator worker */
+typedef struct {
+	gen_t		*gen;		/* Generator the worker belongs to */
+	pthread_t	thread;		/* Worker thread */
+	uint64_t	rnd[2];		/* xorshift128+ state */
+	uint64_t	bytes;		/* Bytes filled */
+	double		fill_time;	/* Time spent filling */
+	int		id;		/* Worker number */
+	bool		started;	/* Thread was created */
+} gen_worker_t;
+
+/* -j generator, workers fill a pool of chunks that are written in order */
+struct gen {
+	pthread_mutex_t	lock;		/* Protects the pool state */
+	pthread_cond_t	cond_full;	/* A chunk has been filled */
+	pthread_cond_t	cond_empty;	/* A chunk has been written */
+	gen_chunk_t	*chunks;	/* Pool of chunks */
+	gen_worker_t	*workers;	/* Worker threads */
+	size_t		n_chunks;	/* Number of chunks in pool */
+	size_t		n_workers;	/* Number of worker threads */
+	size_t		chunk_size;	/* Size of each chunk, the io_size */
+	size_t		fill_size;	/* chunk_size rounded up to 64 bits */
+	size_t		read_off;	/* Offset into chunk being written */
+	uint64_t	next_fill;	/* Next chunk sequence to fill */
+	uint64_t	next_read;	/* Next chunk sequence to write */
+	bool		stop;		/* Tell workers to stop */
+};
+
+/* -W block workload spec */
+typedef struct {
+	uint64_t	bs;		/* Block size */
+	uint64_t	qd;		/* Queue depth, one thread per I/O */
+	double		iops;		/* Target IOPS, 0 = use the -r rate */
+	bool		write;		/* Write rather than read */
+	bool		random;		/* Random rather than sequential offsets */
+	bool		direct;		/* Use O_DIRECT */
+} block_spec_t;
+
+typedef struct block block_t;
+
+/* a -W block workload worker, keeps one I/O in flight */
+typedef struct {
+	block_t		*blk;		/* Workload the worker belongs to */
+	pthread_t	thread;		/* Worker thread */
+	gen_worker_t	rnd;		/* Random offsets and write data */
+	char		*buffer;	/* Aligned I/O buffer */
+	uint64_t	ios;		/* I/Os completed */
+	uint64_t	late;		/* I/Os issued late */
+	uint64_t	lat_min;	/* Min latency, ns */
+	uint64_t	lat_max;	/* Max latency, ns */
+	double		lat_total;	/* Total latency, ns */
+	uint64_t	lat[LAT_BUCKETS];	/* Latency histogram */
+	bool		started;	/* Thread was created */
+} block_worker_t;
+
+/* -W block workload, the workers issue I/Os in scheduled slots */
+struct block {
+	block_spec_t	spec;		/* What to do */
+	block_worker_t	*workers;	/* One per queue slot */
+	int		fd;		/* Target file or device */
+	uint64_t	blocks;		/* Blocks in the target span */
+	uint64_t	limit;		/* -m limit in I/Os, 0 = none */
+	uint64_t	next;		/* Next I/O slot */
+	uint64_t	ios;		/* I/Os completed */
+	uint64_t	errors;		/* I/Os that failed */
+	double		iops;		/* Target IOPS, 0 = no rate control */
+	double		time_start;	/* Start of the run */
+	size_t		running;	/* Workers still running */
+	bool		stop;		/* Tell the workers to stop */
+};
+
+/* -l traffic models */
+typedef enum {
+	TRAFFIC_POISSON,		/* Poisson arrivals */
+	TRAFFIC_ONOFF,			/* Exponential on/off periods */
+	TRAFFIC_PARETO,			/* Pareto on/off periods */
+} traffic_model_t;
+
+/* -l traffic model spec */
+typedef struct {
+	traffic_model_t	model;		/* Arrival model */
+	double		on;		/* Mean on period, seconds */
+	double		off;		/* Mean off period, seconds */
+	double		alpha;		/* Pareto shape */
+	double		sigma;		/* Lognormal chunk size sigma, 0 = fixed */
+	uint64_t	seed;		/* PRNG seed */
+	bool		got_seed;	/* Seed was given */
+} traffic_spec_t;
+
+/* -l traffic model state and achieved burst statistics */
+typedef struct {
+	traffic_spec_t	spec;		/* What to generate */
+	gen_worker_t	rnd;		/* xorshift128+ state */
+	double		rate;		/* Mean data rate */
+	double		peak;		/* Rate during an on period */
+	double		size;		/* Mean chunk size */
+	double		size_max;	/* Largest chunk size */
+	double		chunk;		/* Size of the next chunk */
+	double		next;		/* Next chunk is due, monotonic time */
+	double		on_end;		/* End of the current on period */
+	double		threshold;	/* Gaps longer than this end a burst */
+	uint64_t	chunks;		/* Chunks sent */
+	uint64_t	bytes;		/* Bytes sent */
+	double		chunk_min;	/* Smallest chunk sent */
+	double		chunk_max;	/* Largest chunk sent */
+	double		last;		/* Last chunk sent at */
+	double		gap_total;	/* Sum of gaps between chunks */
+	double		gap_sq_total;	/* Sum of squared gaps */
+	uint64_t	bursts;		/* Bursts seen */
+	uint64_t	burst_chunks;	/* Chunks in the current burst */
+	uint64_t	burst_bytes;	/* Bytes in the current burst */
+	double		burst_start;	/* Current burst began */
+	double		burst_last;	/* Last chunk of the current burst */
+	uint64_t	burst_last_bytes; /* Size of that chunk */
+	uint64_t	burst_bytes_max; /* Largest burst */
+	double		burst_time_total; /* Total burst time */
+	double		burst_time_max;	/* Longest burst */
+	double		burst_rate_max;	/* Highest rate within a burst */
+	double		idle_total;	/* Total time between bursts */
+	double		idle_max;	/* Longest time between bursts */
+	uint64_t	late;		/* Chunks sent late */
+	double		late_max;	/* Most late */
+} traffic_t;
+
+/* -q output pipe occupancy */
+typedef struct {
+	int		fd;		/* Output pipe */
+	size_t		capacity;	/* Pipe size at the last sample */
+	size_t		capacity_min;	/* Smallest pipe size seen */
+	size_t		capacity_max;	/* Largest pipe size seen */
+	size_t		queued;		/* Bytes queued at the last sample */
+	size_t		after;		/* Bytes queued at the last sample or write */
+	uint64_t	drained;	/* Bytes taken by the consumer this window */
+	double		after_time;	/* Start of the drain rate window */
+	double		drain;		/* Smoothed consumer drain rate */
+	double		fill_total;	/* Sum of sampled fill levels */
+	uint64_t	samples;	/* Samples taken before writes */
+	uint64_t	hist[OCC_BUCKETS]; /* Fill level histogram */
+	uint64_t	full;		/* Writes that would have blocked */
+	uint64_t	backoffs;	/* Sleeps instead of blocking */
+	double		backoff_time;	/* Time spent backing off */
+	uint64_t	hurries;	/* Delays skipped, pipe draining */
+	bool		hurry;		/* Skip delays until the next write */
+} occupancy_t;
+
+/* a -Q pcapng interface */
+typedef struct {
+	uint32_t	linktype;	/* Link layer header type */
+	uint64_t	tps;		/* Timestamp ticks per second */
+} replay_if_t;
+
+/* a -Q captured packet */
+typedef struct {
+	uint8_t		*data;		/* Captured bytes */
+	size_t		len;		/* Captured length */
+	uint32_t	linktype;	/* Link layer header type */
+	uint64_t	ts;		/* Timestamp, ns */
+} replay_pkt_t;
+
+/* -Q pcap or pcapng capture replay */
+typedef struct {
+	uint8_t		*base;		/* mmap'd capture */
+	size_t		size;		/* Capture size */
+	size_t		start;		/* First record */
+	size_t		off;		/* Next record */
+	bool		pcapng;		/* pcapng rather than pcap */
+	bool		swap;		/* Opposite endian capture */
+	bool		frames;		/* Send whole frames, not payloads */
+	bool		truncated;	/* Capture ends part way through a record */
+	replay_if_t	ifs[REPLAY_IF_MAX]; /* Interfaces, pcap has just one */
+	uint32_t	n_ifs;		/* Interfaces in this section */
+	uint64_t	ts_last;	/* Last timestamp, for simple packets */
+	uint64_t	packets;	/* Packets read */
+	uint64_t	sent;		/* Packets sent */
+	uint64_t	empty;		/* Packets with no payload */
+	uint64_t	skipped;	/* Packets that are not IP */
+	uint64_t	bytes;		/* Bytes sent */
+	uint64_t	writes;		/* writev calls */
+	uint64_t	late;		/* Packets sent late */
+	uint64_t	err_max;	/* Largest timing error, ns */
+	double		err_total;	/* Sum of timing errors, ns */
+	uint64_t	lat[LAT_BUCKETS];	/* Timing error histogram */
+} replay_t;
+
+/* -E tee queue full policies */
+typedef enum {
+	TEE_BLOCK,			/* Wait for the writer */
+	TEE_DROP,			/* Drop the chunk and count it */
+	TEE_SPILL,			/* Queue the chunk in a spill file */
+} tee_policy_t;
+
+/* a -E queued tee chunk */
+typedef struct {
+	size_t		size;		/* Bytes in the ring */
+	double		time;		/* Time queued */
+} tee_slot_t;
+
+/* -E asynchronous tee writer */
+typedef struct {
+	pthread_mutex_t	lock;		/* Protects the queue */
+	pthread_cond_t	cond;		/* Chunk queued or stop */
+	pthread_cond_t	room;		/* Chunk written */
+	pthread_t	thread;		/* Writer thread */
+	tee_policy_t	policy;		/* Queue full policy */
+	int		fd;		/* Tee output */
+	int		fd_spill;	/* Unlinked spill file, -1 if none */
+	bool		sync;		/* fsync after each write */
+	char		*ring;		/* Queued data */
+	size_t		capacity;	/* Ring size */
+	size_t		head;		/* Next byte to queue */
+	size_t		tail;		/* Next byte to write */
+	size_t		queued;		/* Bytes in the ring */
+	tee_slot_t	slots[TEE_SLOTS]; /* Queued chunks, oldest at slot_tail */
+	size_t		slot_head;	/* Next slot to fill */
+	size_t		slot_tail;	/* Next slot to write */
+	size_t		n_slots;	/* Slots in use */
+	bool		spilling;	/* New chunks go to the spill file */
+	bool		spill_busy;	/* Producer is writing to the spill file */
+	uint64_t	spill_rd;	/* Spill file written up to here */
+	uint64_t	spill_wr;	/* Spill file filled up to here */
+	int		err;		/* Writer errno, 0 if ok */
+	bool		started;	/* Thread was created */
+	bool		stop;		/* Tell the thread to stop when drained */
+	uint64_t	chunks;		/* Chunks given to the tee */
+	uint64_t	written;	/* Bytes written */
+	uint64_t	writes;		/* write calls */
+	uint64_t	full;		/* Chunks that found the queue full */
+	uint64_t	dropped;	/* Bytes dropped */
+	uint64_t	drops;		/* Chunks dropped */
+	uint64_t	spilled;	/* Bytes spilled */
+	uint64_t	spill_max;	/* Largest spill file backlog */
+	double		block_time;	/* Time blocked on a full queue */
+	double		write_time;	/* Time in write */
+	double		fsync_time;	/* Time in fsync */
+	double		drain_time;	/* Time draining the queue at the end */
+	uint64_t	behind_max;	/* Largest backlog in bytes */
+	double		behind_total;	/* Sum of backlogs at each chunk */
+	uint64_t	lag_max;	/* Largest queue to disk time, ns */
+	double		lag_total;	/* Sum of queue to disk times, ns */
+	uint64_t	lags;		/* Chunks timed */
+	uint64_t	lat[LAT_BUCKETS];	/* Queue to disk time histogram */
+} tee_t;
+
+/* -G group commit spec */
+typedef struct {
+	double		interval;	/* Commit every interval seconds, 0 none */
+	uint64_t	bytes;		/* Commit every so many bytes, 0 none */
+	bool		thread;		/* Commit on a helper thread */
+} commit_spec_t;
+
+/* a -G committed output */
+typedef struct {
+	int		fd;		/* Output */
+	bool		ok;		/* Can be synced, cleared on failure */
+	uint64_t	written;	/* Bytes written */
+	uint64_t	synced;		/* Bytes committed */
+} commit_fd_t;
+
+/* -G group commit durability */
+typedef struct {
+	pthread_mutex_t	lock;		/* Protects the state, -G thread only */
+	pthread_cond_t	cond;		/* Work for the helper */
+	pthread_t	thread;		/* Helper thread */
+	commit_spec_t	spec;		/* When to commit */
+	commit_fd_t	fds[COMMIT_FDS]; /* Outputs */
+	size_t		n_fds;		/* Number of outputs */
+	double		last;		/* Last commit time */
+	uint64_t	pending;	/* Bytes written since the last commit */
+	uint64_t	unkicked;	/* Bytes written since writeback started */
+	bool		want_kick;	/* Helper should start writeback */
+	bool		want_commit;	/* Helper should commit */
+	bool		started;	/* Helper was created */
+	bool		stop;		/* Tell the helper to stop */
+	uint64_t	kicks;		/* sync_file_range calls */
+	uint64_t	commits;	/* Commits */
+	uint64_t	coalesced;	/* Commits folded into a busy one */
+	uint64_t	unsynced_max;	/* Most bytes written but not committed */
+	double		kick_time;	/* Time in sync_file_range */
+	double		commit_time;	/* Time in fdatasync */
+	uint64_t	lat_max;	/* Longest commit, ns */
+	uint64_t	lat[LAT_BUCKETS];	/* Commit time histogram */
+} commit_t;
+
+/* a -N cache neutral file */
+typedef struct {
+	int		fd;		/* File, -1 if none */
+	bool		output;		/* Written rather than read */
+	off_t		done;		/* Dropped from the cache up to here */
+	off_t		kicked;		/* Writeback started up to here */
+	off_t		cursor;		/* Offset at the last check */
+	int		fd_map;		/* Read only reopen for mincore, -1 if none */
+} cache_fd_t;
+
+/* -N cache neutral streaming */
+typedef struct {
+	cache_fd_t	fds[CACHE_FDS];	/* Input, stdout and -t/-O file */
+	uint64_t	window;		/* Cached bytes allowed behind the cursor */
+	uint64_t	next;		/* Check again at this many bytes */
+	size_t		page_size;	/* Page size, drops are page aligned */
+	unsigned char	*vec;		/* mincore residency vector */
+	size_t		vec_size;	/* Pages in vec */
+	uint64_t	dropped;	/* Bytes dropped */
+	uint64_t	drops;		/* posix_fadvise calls */
+	uint64_t	kicks;		/* Writeback started */
+	uint64_t	waits;		/* Waits for writeback before a drop */
+	double		wait_time;	/* Time waiting for writeback */
+	double		time;		/* Time in the drop and sample calls */
+	uint64_t	resident;	/* Resident bytes at the last sample */
+	uint64_t	resident_max;	/* Most resident bytes */
+	double		resident_total;	/* Sum of sampled resident bytes */
+	uint64_t	samples;	/* Residency samples */
+	uint64_t	errors;		/* Files that could not be dropped */
+} cache_t;
+
+/* -Z compression algorithms */
+typedef enum {
+	CODEC_LZ4,
+	CODEC_ZSTD,
+} codec_algo_t;
+
+/* a -Z compression stage type */
+typedef struct {
+	const char	*name;		/* -Z name */
+	codec_algo_t	algo;		/* Compression algorithm */
+	bool		decompress;	/* Decompress rather than compress */
+	bool		available;	/* Built with the library */
+	int		level_default;	/* Default compression level */
+	int		level_max;	/* Max compression level */
+} codec_type_t;
+
+/* -Z chunk states, a chunk moves through these in order */
+typedef enum {
+	CODEC_EMPTY,			/* Free for the reader */
+	CODEC_READ,			/* Read, waiting for a worker */
+	CODEC_BUSY,			/* Being (de)compressed */
+	CODEC_DONE,			/* Waiting to be written */
+} codec_state_t;
+
+/* a -Z pool chunk */
+typedef struct {
+	char		*in;		/* Input data */
+	char		*out;		/* (De)compressed data */
+	size_t		in_len;		/* Input bytes */
+	size_t		out_len;	/* Output bytes */
+	size_t		out_size;	/* Size of out buffer */
+	uint64_t	seq;		/* Chunk sequence number */
+	codec_state_t	state;		/* Chunk state */
+} codec_chunk_t;
+
+typedef struct codec codec_t;
+
+/* a -Z (de)compression worker */
+typedef struct {
+	codec_t		*codec;		/* Stage the worker belongs to */
+	pthread_t	thread;		/* Worker thread */
+	uint64_t	bytes;		/* Input bytes processed */
+	double		busy_time;	/* Time spent (de)compressing */
+	bool		started;	/* Thread was created */
+#if defined(HAVE_LZ4)
+	LZ4F_dctx	*dctx_lz4;	/* lz4 decompression stream */
+#endif
+#if defined(HAVE_ZSTD)
+	ZSTD_CCtx	*cctx;		/* zstd compression context */
+	ZSTD_DStream	*dctx_zstd;	/* zstd decompression stream */
+#endif
+} codec_worker_t;
+
+/*
+ *  -Z compression stage, a reader thread fills chunks in order,
+ *  workers (de)compress them and the pacing loop writes them in order
+ */
+struct codec {
+	pthread_mutex_t	lock;		/* Protects the pool state */
+	pthread_cond_t	cond_empty;	/* A chunk has been written */
+	pthread_cond_t	cond_read;	/* A chunk has been read */
+	pthread_cond_t	cond_done;	/* A chunk has been (de)compressed */
+	const codec_type_t *type;	/* Compression type */
+	codec_chunk_t	*chunks;	/* Pool of chunks */
+	codec_worker_t	*workers;	/* Worker threads */
+	pthread_t	reader;		/* Input reader thread */
+	size_t		n_chunks;	/* Number of chunks in pool */
+	size_t		n_workers;	/* Number of worker threads */
+	size_t		chunk_size;	/* Input size of each chunk */
+	size_t		read_off;	/* Offset into chunk output being written */
+	size_t		in_off;		/* Input accounted for the chunk so far */
+	uint64_t	next_fill;	/* Next chunk sequence to read */
+	uint64_t	next_work;	/* Next chunk sequence to (de)compress */
+	uint64_t	next_read;	/* Next chunk sequence to write */
+	uint64_t	max_trans;	/* -m input limit, 0 = none */
+	uint64_t	in_bytes;	/* Input bytes read */
+	uint64_t	out_bytes;	/* Output bytes written */
+	uint64_t	reads;		/* Input read calls */
+	uint64_t	waits;		/* Times the writer waited for output */
+	double		read_time;	/* Time spent reading */
+	double		wait_time;	/* Time the writer waited for output */
+	int		level;		/* Compression level */
+	int		fdin;		/* Input, -1 = zeros */
+	bool		rate_in;	/* -r applies to the input side */
+	bool		skip_errors;	/* -e skip read errors */
+	bool		reader_started;	/* Reader thread was created */
+	bool		eof;		/* Reader reached end of input */
+	bool		failed;		/* Read or (de)compression error */
+	bool		stop;		/* Tell threads to stop */
+	char		error[128];	/* Error message when failed */
+};
+
+/* a -g rate group member, only written by the owning process */
+typedef struct {
+	int32_t		pid;		/* Member process, 0 = free slot */
+	uint32_t	weight;		/* Weight * 1000 */
+	uint64_t	min_rate;	/* Guaranteed rate */
+	uint64_t	max_rate;	/* Member -r rate cap, 0 = none */
+	uint64_t	share;		/* Current share of the group rate */
+	uint64_t	heartbeat;	/* Last update, monotonic ns */
+	uint64_t	bytes;		/* Bytes sent by the member */
+} group_member_t;
+
+/* -g rate group shared memory segment */
+typedef struct {
+	uint32_t	magic;		/* GROUP_MAGIC */
+	uint32_t	version;	/* GROUP_VERSION */
+	uint64_t	rate;		/* Aggregate rate, bytes per second */
+	int64_t		tokens;		/* Token bucket, negative = debt */
+	uint64_t	last_ns;	/* Last token bucket refill */
+	group_member_t	members[GROUP_MEMBERS_MAX];
+} group_shm_t;
+
+/* -g rate group membership */
+typedef struct {
+	group_shm_t	*shm;		/* Mapped group segment */
+	group_member_t	*self;		/* Our member slot */
+	pid_t		pid;		/* Our pid, the slot owner */
+	dev_t		dev;		/* Segment device and inode */
+	ino_t		ino;
+	double		weight;		/* Member weight */
+	double		min_rate;	/* Guaranteed rate */
+	double		max_rate;	/* Member -r rate cap, 0 = none */
+	const char	*name;		/* Group name */
+	char		path[PATH_MAX];	/* Group segment path */
+} group_t;
+
+/* socket endpoint types for -I, -O and -t */
+typedef struct {
+	const char	*prefix;	/* Endpoint prefix */
+	int		domain;		/* AF_UNIX or AF_INET (any IP) */
+	bool		listen;		/* Listen rather than connect */
+	int		type;		/* SOCK_STREAM or SOCK_DGRAM */
+} sock_type_t;
+
+/* a client of a -O/-t listening socket */
+typedef struct {
+	char		name[64];	/* Peer address */
+	char		*backlog;	/* Data queued for the client */
+	size_t		backlog_len;	/* Bytes queued */
+	size_t		backlog_peak;	/* Maximum bytes queued */
+	uint64_t	id;		/* Client number */
+	uint64_t	bytes;		/* Bytes sent */
+	uint64_t	dropped;	/* Bytes dropped, backlog full */
+	uint64_t	zc_pending;	/* MSG_ZEROCOPY sends not completed */
+	uint64_t	zc_sends;	/* MSG_ZEROCOPY sends */
+	int		fd;		/* Client socket, -1 = closed */
+	bool		zerocopy;	/* SO_ZEROCOPY enabled */
+} sock_client_t;
+
+/* a -O/-t listening socket fanning out data to its clients */
+typedef struct {
+	const char	*spec;		/* Endpoint */
+	sock_client_t	*clients;	/* Current and past clients */
+	size_t		n_clients;	/* Number of clients */
+	size_t		max_clients;	/* Size of clients array */
+	uint64_t	clients_total;	/* Clients accepted */
+	int		listen_fd;	/* Listening socket */
+	bool		zerocopy;	/* Data is unchanging, MSG_ZEROCOPY is safe */
+} sock_server_t;
+
+/* header at the start of each -U datagram, network byte order */
+typedef struct {
+	uint32_t	magic;		/* DGRAM_MAGIC */
+	uint16_t	flags;		/* DGRAM_FLAG_END */
+	uint16_t	len;		/* Payload length */
+	uint64_t	seq;		/* Datagram sequence number */
+} dgram_hdr_t;
+
+/* -O udp: datagram sender state */
+typedef struct {
+	char		*buffer;	/* Datagrams of a batch, back to back */
+	char		*staging;	/* Payload read from the input */
+	struct iovec	*iov;		/* One per message */
+	struct mmsghdr	*msgs;		/* sendmmsg messages */
+	size_t		size;		/* Datagram size including header */
+	size_t		gso_segs;	/* Datagrams per message, 0 = no GSO */
+	uint64_t	max_trans;	/* -m payload limit, 0 = none */
+	uint64_t	payload_bytes;	/* Payload bytes read */
+	uint64_t	seq;		/* Next sequence number */
+	uint64_t	packets;	/* Datagrams sent */
+	uint64_t	batches;	/* Batches sent */
+	uint64_t	syscalls;	/* sendmmsg calls */
+	uint64_t	send_errors;	/* Batches refused by the receiver */
+	double		late_total;	/* Total batch lateness, seconds */
+	double		late_max;	/* Max batch lateness, seconds */
+	double		time_begin;	/* Time began */
+	int		fd;		/* Connected datagram socket */
+} dgram_t;
+
+static const sock_type_t sock_types[] = {
+	{ "unix:",		AF_UNIX,	false,	SOCK_STREAM },
+	{ "unix-listen:",	AF_UNIX,	true,	SOCK_STREAM },
+	{ "tcp:",		AF_INET,	false,	SOCK_STREAM },
+	{ "tcp-listen:",	AF_INET,	true,	SOCK_STREAM },
+	{ "udp:",		AF_INET,	false,	SOCK_DGRAM },
+	{ "udp-listen:",	AF_INET,	true,	SOCK_DGRAM },
+};
+
+static const codec_type_t codec_types[] = {
+#if defined(HAVE_LZ4)
+	{ "lz4",	CODEC_LZ4,	false,	true,	0,	12 },
+	{ "unlz4",	CODEC_LZ4,	true,	true,	0,	0 },
+#else
+	{ "lz4",	CODEC_LZ4,	false,	false,	0,	12 },
+	{ "unlz4",	CODEC_LZ4,	true,	false,	0,	0 },
+#endif
+#if defined(HAVE_ZSTD)
+	{ "zstd",	CODEC_ZSTD,	false,	true,	3,	19 },
+	{ "unzstd",	CODEC_ZSTD,	true,	true,	0,	0 },
+#else
+	{ "zstd",	CODEC_ZSTD,	false,	false,	3,	19 },
+	{ "unzstd",	CODEC_ZSTD,	true,	false,	0,	0 },
+#endif
+};
+
+static uint64_t opt_flags;
 static const char *app_name = "sluice";
 static const char *dev_urandom = "/dev/urandom";
 static volatile bool sluice_finish = false;
@@ -219,12 +1100,13 @@ static const scale_t second_scales[] = {
  *  count_bits()
  *      count bits set, from C Programming Language 2nd Ed
  */
-static inline unsigned int count_bits(const unsigned int val)
+static inline unsigned int count_bits(const uint64_t val)
 {
 #if defined(__GNUC__)
-	return __builtin_popcount(val);
+	return (unsigned int)__builtin_popcountll(val);
 #else
-	register unsigned int c, n = val;
+	register unsigned int c;
+	register uint64_t n = val;
 
 	for (c = 0; n; c++)
 		n &= n - 1;
@@ -265,6 +1147,45 @@ static void handle_sigusr2(int dummy)
 	opt_flags ^= (OPT_OVERRUN | OPT_UNDERRUN);
 }
 
+/*
+ *  sigaction_setup()
+ *	install the SIGINT, SIGUSR1/SIGINFO and SIGUSR2 handlers
+ */
+static int sigaction_setup(void)
+{
+	struct sigaction new_action;
+
+	(void)memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = handle_sigint;
+	(void)sigemptyset(&new_action.sa_mask);
+	new_action.sa_flags = 0;
+	if (sigaction(SIGINT, &new_action, NULL) < 0)
+		goto err;
+
+	(void)memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = handle_siginfo;
+	(void)sigemptyset(&new_action.sa_mask);
+	new_action.sa_flags = 0;
+	if (sigaction(SIGUSR1, &new_action, NULL) < 0)
+		goto err;
+#ifdef SIGINFO
+	if (sigaction(SIGINFO, &new_action, NULL) < 0)
+		goto err;
+#endif
+	(void)memset(&new_action, 0, sizeof(new_action));
+	new_action.sa_handler = handle_sigusr2;
+	(void)sigemptyset(&new_action.sa_mask);
+	new_action.sa_flags = 0;
+	if (sigaction(SIGUSR2, &new_action, NULL) < 0)
+		goto err;
+
+	return 0;
+err:
+	(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
+		errno, strerror(errno));
+	return -1;
+}
+
 /*
  *  stats_init()
  *	Initialize statistics
@@ -289,7 +1210,14 @@ static inline void stats_init(stats_t *const stats)
 	stats->buf_size_total = 0.0;
 	stats->rate_min = 0.0;
 	stats->rate_max = 0.0;
-	stats->rate_set = false;
+	(void)memset(&stats->phase_time, 0, sizeof(stats->phase_time));
+	stats->nvcsw = 0;
+	stats->nivcsw = 0;
+	stats->csw_valid = false;
+	stats->migrations = -1;
+	stats->resumed = 0;
+	stats->checkpoints = 0;
+	stats->resumed_time = 0.0;
 }
 
 #if defined(SET_XFER_SIZE)
@@ -529,6 +1457,55 @@ static void stats_info(const stats_t *stats)
 					t.tms_stime) / (double)ticks_per_sec));
 		}
 	}
+	if (stats->csw_valid) {
+		(void)fprintf(stderr, "Vol. ctxt switch: %" PRIu64 "\n",
+			stats->nvcsw);
+		(void)fprintf(stderr, "Inv. ctxt switch: %" PRIu64 "\n",
+			stats->nivcsw);
+	}
+	/* perf_event_paranoid can refuse the counter */
+	if (stats->migrations >= 0)
+		(void)fprintf(stderr, "CPU migrations:   %" PRId64 "\n",
+			stats->migrations);
+	else
+		(void)fprintf(stderr, "CPU migrations:   unknown\n");
+
+	if (stats->checkpoints)
+		(void)fprintf(stderr, "Checkpoints:      %" PRIu64 "\n",
+			stats->checkpoints);
+	if (stats->resumed || (stats->resumed_time > 0.0)) {
+		/* Continuity across -J resumes */
+		(void)fprintf(stderr, "Resumed from:     %s\n",
+			double_to_str((double)stats->resumed));
+		(void)fprintf(stderr, "Overall data:     %s\n",
+			double_to_str((double)(stats->resumed + stats->total_bytes)));
+		(void)fprintf(stderr, "Overall duration: %s\n",
+			secs_to_str(stats->resumed_time + secs));
+		(void)fprintf(stderr, "Overall rate:     %s/s\n",
+			double_to_str((double)(stats->resumed + stats->total_bytes) /
+				(stats->resumed_time + secs)));
+	}
+
+	if (stats->writes) {
+		/* Where the wall clock time went, phase by phase */
+		int i;
+		double phase_total = 0.0;
+
+		(void)fprintf(stderr, "\nTime breakdown:\n");
+		for (i = 0; i < PHASE_MAX; i++) {
+			(void)fprintf(stderr, "  %-16s%10s %6.2f%%\n",
+				phase_names[i],
+				secs_to_str(stats->phase_time[i]),
+				100.0 * stats->phase_time[i] / secs);
+			phase_total += stats->phase_time[i];
+		}
+		if (phase_total > secs)
+			phase_total = secs;
+		(void)fprintf(stderr, "  %-16s%10s %6.2f%%\n", "Other",
+			secs_to_str(secs - phase_total),
+			100.0 * (secs - phase_total) / secs);
+		(void)fprintf(stderr, "\n");
+	}
 
 	if (!(opt_flags & OPT_NO_RATE_CONTROL)) {
 		/* The following only make sense if we have rate stats */
@@ -584,6 +1561,88 @@ redo:
 	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
 }
 
+/*
+ *  mono_time()
+ *	monotonic time in seconds as a double, cheap enough
+ *	to call several times per iteration for phase timing
+ */
+static inline double mono_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ *  cond_wait_timed()
+ *	wait on a condition for at most 0.1 seconds, so that threads
+ *	blocked on it wake up now and then to notice SIGINT and -T
+ */
+static void cond_wait_timed(pthread_cond_t *const cond, pthread_mutex_t *const lock)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	(void)pthread_cond_timedwait(cond, lock, &ts);
+}
+
+/*
+ *  lat_bucket()
+ *	map a latency in ns to a log-linear histogram bucket, the
+ *	buckets are within 1/LAT_SUB of the value
+ */
+static inline size_t lat_bucket(const uint64_t ns)
+{
+	int p;
+
+	if (ns < LAT_SUB)
+		return (size_t)ns;
+	p = 63 - __builtin_clzll(ns);
+	return (size_t)((p - 3) * LAT_SUB) +
+		(size_t)((ns >> (p - 4)) & (LAT_SUB - 1));
+}
+
+/*
+ *  lat_value()
+ *	the largest latency in ns that maps to a histogram bucket
+ */
+static uint64_t lat_value(const size_t bucket)
+{
+	const uint64_t sub = bucket % LAT_SUB;
+	int p;
+
+	if (bucket < LAT_SUB)
+		return (uint64_t)bucket;
+	p = (int)(bucket / LAT_SUB) + 3;
+	return ((LAT_SUB + sub + 1) << (p - 4)) - 1;
+}
+
+/*
+ *  lat_percentile()
+ *	latency in ns below which percent of the n samples in a
+ *	histogram fall
+ */
+static uint64_t lat_percentile(const uint64_t *const lat, const uint64_t n, const double percent)
+{
+	const uint64_t target = (uint64_t)ceil((double)n * percent / 100.0);
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		count += lat[i];
+		if (count && (count >= target))
+			return lat_value(i);
+	}
+	return 0;
+}
+
 /*
  *  get_uint64()
  *	get a uint64 value
@@ -729,125 +1788,7145 @@ static inline void fsync_data(const int fd, bool *do_sync)
 }
 
 /*
- *  show_usage()
- *	show options
+ *  shm_stats_open()
+ *	create the live statistics segment; a name without a '/'
+ *	is created in /dev/shm with a sluice- prefix
  */
-static void show_usage(void)
+static sluice_shm_t *shm_stats_open(
+	const char *const name,
+	char *const path,
+	const size_t pathlen)
 {
-	(void)printf("%s, version %s\n\n", app_name, VERSION);
-	(void)printf("Usage: %s [options]\n", app_name);
-	(void)printf("  -a         append to file (-t, -O options only).\n");
-	(void)printf("  -c delay   specify constant delay time (seconds).\n");
-	(void)printf("  -d         discard output (no output).\n");
-	(void)printf("  -D         delay mode.\n");
-	(void)printf("  -e         skip read errors.\n");
-	(void)printf("  -f freq    frequency of -v statistics.\n");
-	(void)printf("  -F         fsync file output on each write.\n");
-	(void)printf("  -h         print this help.\n");
-	(void)printf("  -i size    set io read/write size in bytes.\n");
-	(void)printf("  -I file    read input from file.\n");
-	(void)printf("  -m size    set maximum amount to process.\n");
-	(void)printf("  -n         no rate controls, just copy data untouched.\n");
-	(void)printf("  -o         shrink read/write buffer to avoid overrun.\n");
-	(void)printf("  -O file    short cut for -dt file; output to a file.\n");
-	(void)printf("  -p         enable verbose mode with progress stats.\n");
-	(void)printf("  -P pidfile save process ID into file pidfile.\n");
-	(void)printf("  -r rate    set rate (in bytes per second).\n");
-	(void)printf("  -R	     ignore stdin, read from %s.\n", dev_urandom);
-	(void)printf("  -s shift   controls delay or buffer size adjustment.\n");
-	(void)printf("  -S         display statistics at end of stream to stderr.\n");
-	(void)printf("  -t file    tee output to file.\n");
-	(void)printf("  -T time    stop after a specified amount of time.\n");
-	(void)printf("  -u         expand read/write buffer to avoid underrun.\n");
-	(void)printf("  -v         set verbose mode (to stderr).\n");
-	(void)printf("  -V         print version information.\n");
-	(void)printf("  -w         warn on data rate underrun.\n");
-#if defined(SET_XFER_SIZE)
-	(void)printf("  -x size    set pipe transfer size.\n");
-#endif
-	(void)printf("  -z         ignore stdin, generate zeros.\n");
-}
-
-#define DELAY(delay, stats)						\
-	if (delay > 0) {						\
-		stats.delays++;						\
-		if (usleep((useconds_t)delay) < 0) {			\
-			if (errno == EINTR) {				\
-				if (sluice_finish)			\
-					goto finish;			\
-				/*					\
-				 * usleep got interrupted, let		\
-				 * subsequent I/O cater with the	\
-				 * delay deltas rather than		\
-				 * trying to figure out how much	\
-				 * time was lost on early exit		\
-				 * from usleep				\
-				 */					\
-			} else {					\
-				(void)fprintf(stderr, "usleep error: "	\
-					"errno=%d (%s).\n",		\
-					errno, strerror(errno));	\
-				ret = EXIT_DELAY_ERROR;			\
-				goto tidy;				\
-			}						\
-		}							\
+	sluice_shm_t *shm;
+	sluice_shm_t old;
+	int fd;
+
+	if (strchr(name, '/'))
+		(void)snprintf(path, pathlen, "%s", name);
+	else
+		(void)snprintf(path, pathlen, "%s/%s%s",
+			SLUICE_SHM_DIR, SLUICE_SHM_PREFIX, name);
+
+	fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+			path, errno, strerror(errno));
+		return NULL;
 	}
-
-#define DO_DELAY(delay, di, n, stats)					\
-	if (DELAY_GET_ACTION(n, di->action))				\
-		DELAY(delay / di->divisor, stats);
-
-static const delay_info_t *get_delay_info(uint64_t delay_mode)
-{
-	int i;
-
-	if (delay_mode > DELAY_MODE_MAX) {
-		(void)fprintf(stderr, "Delay mode -D %" PRIu64
-			" is too large, range 0..%u.\n",
-			delay_mode, DELAY_MODE_MAX);
+	/*
+	 *  Never truncate a segment another running sluice is still
+	 *  publishing to; a segment left behind by an instance that
+	 *  has finished or died is reused. The lock stops two
+	 *  instances starting together from both claiming it.
+	 */
+	(void)flock(fd, LOCK_EX);
+	(void)memset(&old, 0, sizeof(old));
+	if ((pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old)) &&
+	    (old.magic == SLUICE_SHM_MAGIC) &&
+	    (!old.snap.finished) &&
+	    (old.pid > 0) &&
+	    (old.pid != (int32_t)getpid()) &&
+	    ((kill((pid_t)old.pid, 0) == 0) || (errno != ESRCH))) {
+		(void)fprintf(stderr, "Statistics segment %s is in use by pid %" PRId32 ".\n",
+			path, old.pid);
+		(void)flock(fd, LOCK_UN);
+		(void)close(fd);
 		return NULL;
 	}
-
-	for (i = 0; i <= DELAY_MODE_MAX; i++) {
-		if (delay_info[i].mode == delay_mode)
-			return &delay_info[i];
+	if ((ftruncate(fd, 0) < 0) ||
+	    (ftruncate(fd, (off_t)sizeof(*shm)) < 0)) {
+		(void)fprintf(stderr, "ftruncate on %s failed: errno = %d (%s).\n",
+			path, errno, strerror(errno));
+		(void)flock(fd, LOCK_UN);
+		(void)close(fd);
+		(void)unlink(path);
+		return NULL;
 	}
-	(void)fprintf(stderr, "Cannot find delay mode %" PRIu64 ".\n",
-			delay_mode);
-	return NULL;
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm != MAP_FAILED) {
+		(void)memset(shm, 0, sizeof(*shm));
+		shm->version = SLUICE_SHM_VERSION;
+		shm->pid = (int32_t)getpid();
+		/* Magic last, readers ignore the segment until it is set */
+		__atomic_store_n(&shm->magic, SLUICE_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	(void)flock(fd, LOCK_UN);
+	(void)close(fd);
+	if (shm == MAP_FAILED) {
+		(void)fprintf(stderr, "mmap on %s failed: errno = %d (%s).\n",
+			path, errno, strerror(errno));
+		(void)unlink(path);
+		return NULL;
+	}
+
+	return shm;
 }
 
-int main(int argc, char **argv)
+/*
+ *  shm_stats_update()
+ *	publish statistics and controller state to the live segment
+ */
+static void shm_stats_update(
+	sluice_shm_t *const shm,
+	const stats_t *const stats,
+	const double secs_now,
+	const double current_rate,
+	const double io_size,
+	const double delay,
+	const char run)
 {
-	char run = ' ';			/* Overrun/underrun flag */
-	char *buffer = NULL;		/* Temp I/O buffer */
-	char *out_filename = NULL;	/* -t or -O option filename */
-	char *in_filename = NULL;	/* -I option filename */
-	char *pid_filename = NULL;	/* -P option filename */
+	sluice_shm_snapshot_t *const snap = &shm->snap;
+
+	sluice_shm_write_begin(shm);
+	snap->total_bytes = stats->total_bytes;
+	snap->reads = stats->reads;
+	snap->writes = stats->writes;
+	snap->underruns = stats->underruns;
+	snap->overruns = stats->overruns;
+	snap->delays = stats->delays;
+	snap->reallocs = stats->reallocs;
+	snap->time_begin = stats->time_begin;
+	snap->time_now = secs_now;
+	snap->target_rate = stats->target_rate;
+	snap->current_rate = current_rate;
+	snap->io_size = io_size;
+	snap->delay = delay;
+	snap->run = run;
+	sluice_shm_write_end(shm);
+}
 
-	double delay;
-	double io_size = 0.9;		/* -i IO buffer size */
-	double data_rate = 0.0;		/* -r data rate */
-	double secs_start, secs_last, freq = DEFAULT_FREQ;
-	double const_delay = -1.0;	/* -c delay time between I/O */
+/*
+ *  shm_stats_close()
+ *	flag the live segment as finished, unmap and remove it
+ */
+static void shm_stats_close(sluice_shm_t *const shm, const char *const path)
+{
+	sluice_shm_write_begin(shm);
+	shm->snap.finished = 1;
+	sluice_shm_write_end(shm);
+	(void)munmap((void *)shm, sizeof(*shm));
+	(void)unlink(path);
+}
+
+/*
+ *  checkpoint_load()
+ *	read a -K checkpoint, returns 1 if it was loaded, 0 if there
+ *	is no checkpoint yet and -1 if it is invalid or for a different
+ *	copy
+ */
+static int checkpoint_load(
+	checkpoint_t *const ckpt,
+	const char *const in_filename,
+	const char *const out_filename)
+{
+	FILE *fp;
+	char line[PATH_MAX + 32], input[sizeof(line)] = "", output[sizeof(line)] = "";
+	int version = 0;
+	bool got_offset = false;
+
+	fp = fopen(ckpt->path, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 0;
+		(void)fprintf(stderr, "Cannot open checkpoint %s: errno=%d (%s).\n",
+			ckpt->path, errno, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strncmp(line, "version ", 8))
+			version = atoi(line + 8);
+		else if (!strncmp(line, "input ", 6))
+			(void)snprintf(input, sizeof(input), "%s", line + 6);
+		else if (!strncmp(line, "output ", 7))
+			(void)snprintf(output, sizeof(output), "%s", line + 7);
+		else if (sscanf(line, "offset %" SCNu64, &ckpt->offset) == 1)
+			got_offset = true;
+		else
+			(void)sscanf(line, "elapsed %lf", &ckpt->elapsed);
+	}
+	(void)fclose(fp);
+
+	if ((version != CHECKPOINT_VERSION) || !got_offset) {
+		(void)fprintf(stderr, "Checkpoint %s is not a valid sluice checkpoint.\n",
+			ckpt->path);
+		return -1;
+	}
+	if (strcmp(input, in_filename) || strcmp(output, out_filename)) {
+		(void)fprintf(stderr, "Checkpoint %s is for copying %s to %s.\n",
+			ckpt->path, input, output);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ *  checkpoint_save()
+ *	commit the output to stable storage and then record how much
+ *	of it is committed; the checkpoint is replaced atomically so
+ *	an interruption leaves the previous one intact
+ */
+static int checkpoint_save(
+	checkpoint_t *const ckpt,
+	const int fdout,
+	const char *const in_filename,
+	const char *const out_filename,
+	const double elapsed)
+{
+	char tmp[PATH_MAX + 8];
+	int fd, len;
+	char buf[(2 * PATH_MAX) + 128];
+	off_t offset;
+
+	/* Only what actually reached the output counts, not what was read */
+	offset = lseek(fdout, 0, SEEK_CUR);
+	if (offset < 0) {
+		(void)fprintf(stderr, "lseek on %s failed: errno=%d (%s).\n",
+			out_filename, errno, strerror(errno));
+		return -1;
+	}
+	if (fdatasync(fdout) < 0) {
+		(void)fprintf(stderr, "fdatasync on %s failed: errno=%d (%s).\n",
+			out_filename, errno, strerror(errno));
+		return -1;
+	}
+	len = snprintf(buf, sizeof(buf),
+		"# sluice checkpoint\n"
+		"version %d\n"
+		"input %s\n"
+		"output %s\n"
+		"offset %" PRIu64 "\n"
+		"elapsed %.6f\n",
+		CHECKPOINT_VERSION, in_filename, out_filename, (uint64_t)offset, elapsed);
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", ckpt->path);
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto err;
+	if ((write(fd, buf, (size_t)len) != len) || (fsync(fd) < 0)) {
+		const int err = errno;
+
+		(void)close(fd);
+		(void)unlink(tmp);
+		errno = err;
+		goto err;
+	}
+	(void)close(fd);
+	if (rename(tmp, ckpt->path) < 0) {
+		const int err = errno;
+
+		(void)unlink(tmp);
+		errno = err;
+		goto err;
+	}
+	ckpt->offset = (uint64_t)offset;
+	ckpt->saves++;
+	return 0;
+err:
+	(void)fprintf(stderr, "Cannot write checkpoint %s: errno=%d (%s).\n",
+		ckpt->path, errno, strerror(errno));
+	return -1;
+}
+
+/*
+ *  prefetch_thread()
+ *	-H prefetcher, keep the page cache populated up to distance
+ *	bytes ahead of the read cursor, carrying on into the next -I
+ *	files in the list
+ */
+static void *prefetch_thread(void *arg)
+{
+	prefetch_t *const pf = (prefetch_t *)arg;
+	int fd = -1;
+	size_t file = 0;
+	uint64_t file_start = 0;
+
+	(void)pthread_mutex_lock(&pf->lock);
+	while (!pf->stop) {
+		const uint64_t target = pf->cursor + pf->distance;
+		uint64_t len;
+		double t;
+		int ret;
+
+		if ((pf->issued >= target) || (file >= pf->n_files)) {
+			(void)pthread_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+		/* Skip past files that are done or cannot be prefetched */
+		if (pf->issued >= file_start + pf->sizes[file]) {
+			if (fd >= 0) {
+				(void)close(fd);
+				fd = -1;
+			}
+			file_start += pf->sizes[file];
+			file++;
+			continue;
+		}
+		len = target - pf->issued;
+		if (len > PREFETCH_CHUNK)
+			len = PREFETCH_CHUNK;
+		if (len > file_start + pf->sizes[file] - pf->issued)
+			len = file_start + pf->sizes[file] - pf->issued;
+		(void)pthread_mutex_unlock(&pf->lock);
+
+		t = mono_time();
+		if (fd < 0)
+			fd = open(pf->names[file], O_RDONLY);
+		ret = (fd < 0) ? -1 : posix_fadvise(fd, (off_t)(pf->issued - file_start),
+			(off_t)len, POSIX_FADV_WILLNEED);
+
+		(void)pthread_mutex_lock(&pf->lock);
+		pf->time += mono_time() - t;
+		if (ret) {
+			/* Give up on this file, the reader will still get to it */
+			pf->errors++;
+			pf->issued = file_start + pf->sizes[file];
+			continue;
+		}
+		if (pf->issued - file_start == 0)
+			pf->files++;
+		pf->issued += len;
+		pf->bytes += len;
+		pf->calls++;
+	}
+	(void)pthread_mutex_unlock(&pf->lock);
+	if (fd >= 0)
+		(void)close(fd);
+
+	return NULL;
+}
+
+/*
+ *  prefetch_update()
+ *	move the read cursor on, waking the prefetcher if it has
+ *	fallen behind the distance it should be ahead by
+ */
+static void prefetch_update(prefetch_t *const pf, const uint64_t cursor)
+{
+	(void)pthread_mutex_lock(&pf->lock);
+	pf->cursor = cursor;
+	if (pf->issued < cursor) {
+		/* The reader got there first */
+		pf->overtaken++;
+		pf->issued = cursor;
+	}
+	if (pf->issued < cursor + (pf->distance / 2))
+		(void)pthread_cond_signal(&pf->cond);
+	(void)pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ *  prefetch_free()
+ *	stop the -H prefetcher
+ */
+static void prefetch_free(prefetch_t *const pf)
+{
+	if (!pf)
+		return;
+
+	if (pf->started) {
+		(void)pthread_mutex_lock(&pf->lock);
+		pf->stop = true;
+		(void)pthread_cond_signal(&pf->cond);
+		(void)pthread_mutex_unlock(&pf->lock);
+		(void)pthread_join(pf->thread, NULL);
+	}
+	(void)pthread_cond_destroy(&pf->cond);
+	(void)pthread_mutex_destroy(&pf->lock);
+	free(pf->sizes);
+	free(pf);
+}
+
+/*
+ *  prefetch_init()
+ *	start a -H prefetcher for the -I files, starting at offset
+ *	into the list; only regular files are prefetched
+ */
+static prefetch_t *prefetch_init(
+	char **const names,
+	const size_t n_files,
+	const uint64_t distance,
+	const uint64_t offset)
+{
+	prefetch_t *pf;
+	sigset_t set, old_set;
+	size_t i;
+	int ret;
+
+	pf = calloc(1, sizeof(*pf));
+	if (!pf)
+		return NULL;
+	(void)pthread_mutex_init(&pf->lock, NULL);
+	(void)pthread_cond_init(&pf->cond, NULL);
+	pf->sizes = calloc(n_files, sizeof(*pf->sizes));
+	if (!pf->sizes) {
+		prefetch_free(pf);
+		return NULL;
+	}
+	for (i = 0; i < n_files; i++) {
+		struct stat buf;
+
+		if ((stat(names[i], &buf) == 0) && S_ISREG(buf.st_mode))
+			pf->sizes[i] = (uint64_t)buf.st_size;
+	}
+	pf->names = names;
+	pf->n_files = n_files;
+	pf->distance = distance;
+	pf->cursor = offset;
+	pf->issued = offset;
+
+	/* Signals are for the pacing thread */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	ret = pthread_create(&pf->thread, NULL, prefetch_thread, pf);
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (ret) {
+		prefetch_free(pf);
+		return NULL;
+	}
+	pf->started = true;
+
+	return pf;
+}
+
+/*
+ *  prefetch_stats_info()
+ *	display the -H prefetcher statistics
+ */
+static void prefetch_stats_info(const prefetch_t *const pf)
+{
+	(void)fprintf(stderr, "\nPrefetcher:\n");
+	(void)fprintf(stderr, "  Distance:       %s\n",
+		double_to_str((double)pf->distance));
+	(void)fprintf(stderr, "  Prefetched:     %s in %" PRIu64 " calls, %s\n",
+		double_to_str((double)pf->bytes), pf->calls, secs_to_str(pf->time));
+	(void)fprintf(stderr, "  Files:          %" PRIu64 " of %zu\n",
+		pf->files, pf->n_files);
+	(void)fprintf(stderr, "  Overtaken:      %" PRIu64 "\n", pf->overtaken);
+	if (pf->errors)
+		(void)fprintf(stderr, "  Errors:         %" PRIu64 "\n", pf->errors);
+}
+
+/*
+ *  tree_stop()
+ *	tell the walker and the directory copy workers to stop
+ */
+static void tree_stop(tree_t *const tree)
+{
+	(void)pthread_mutex_lock(&tree->lock);
+	__atomic_store_n(&tree->stop, true, __ATOMIC_RELAXED);
+	(void)pthread_cond_broadcast(&tree->cond_queued);
+	(void)pthread_cond_broadcast(&tree->cond_space);
+	(void)pthread_mutex_unlock(&tree->lock);
+}
+
+/*
+ *  tree_tick()
+ *	called by the walker, stop on SIGINT or at the end of a -T
+ *	timed run and show -v progress
+ */
+static void tree_tick(tree_t *const tree)
+{
+	const double now = mono_time();
+	const double secs = now - tree->time_start;
+
+	if (sluice_finish ||
+	    ((opt_flags & OPT_TIMED_RUN) && (secs > (double)tree->timed_run)))
+		tree_stop(tree);
+
+	if ((opt_flags & OPT_VERBOSE) && (now > tree->verbose_last + tree->freq) &&
+	    (secs > 0.0)) {
+		const uint64_t bytes = __atomic_load_n(&tree->bytes, __ATOMIC_RELAXED);
+		const uint64_t files = __atomic_load_n(&tree->files, __ATOMIC_RELAXED);
+		char rate_str[32], total_str[32];
+
+		size_to_str((double)bytes / secs, "%7.1f %s", rate_str, sizeof(rate_str));
+		size_to_str((double)bytes, "%7.1f %s", total_str, sizeof(total_str));
+		(void)fprintf(stderr, "Rate: %s/S, Total: %s, Files: %" PRIu64
+			", %.1f/S, Dur: %.1f S  \r",
+			rate_str, total_str, files, (double)files / secs, secs);
+		(void)fflush(stderr);
+		tree->verbose_last = now;
+	}
+}
+
+/*
+ *  tree_take()
+ *	take n bytes worth of tokens from the bucket shared by all
+ *	the directory copy workers, returns the seconds needed to
+ *	pay off any debt
+ */
+static double tree_take(tree_t *const tree, const size_t n)
+{
+	double now, debt;
+
+	if (tree->rate <= 0.0)
+		return 0.0;
+
+	(void)pthread_mutex_lock(&tree->bucket_lock);
+	now = mono_time();
+	tree->tokens += (now - tree->time_last) * tree->rate;
+	if (tree->tokens > tree->rate * TREE_BURST)
+		tree->tokens = tree->rate * TREE_BURST;
+	tree->time_last = now;
+	tree->tokens -= (double)n;
+	debt = (tree->tokens < 0.0) ? -tree->tokens / tree->rate : 0.0;
+	(void)pthread_mutex_unlock(&tree->bucket_lock);
+
+	return debt;
+}
+
+/*
+ *  tree_delay()
+ *	sleep off a token debt in short naps so a worker stops promptly
+ */
+static void tree_delay(tree_worker_t *const w, const double secs)
+{
+	const double t = mono_time();
+	const double end = t + secs;
+	double now = t;
+
+	w->delays++;
+	while ((now < end) && !__atomic_load_n(&w->tree->stop, __ATOMIC_RELAXED)) {
+		const double nap = (end - now > 0.1) ? 0.1 : end - now;
+
+		(void)usleep((useconds_t)(nap * 1000000.0));
+		now = mono_time();
+	}
+	w->delay_time += now - t;
+}
+
+/*
+ *  tree_set_meta()
+ *	copy the ownership, mode and timestamps of a source file,
+ *	ownership can only be given away by root so a failure to
+ *	change it is not an error
+ */
+static int tree_set_meta(const char *const path, const struct stat *const st)
+{
+	const struct timespec ts[2] = { st->st_atim, st->st_mtim };
+
+	(void)lchown(path, st->st_uid, st->st_gid);
+	if (!S_ISLNK(st->st_mode) && (chmod(path, st->st_mode & 07777) < 0)) {
+		(void)fprintf(stderr, "Cannot set mode of %s: errno=%d (%s).\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+	if (utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW) < 0) {
+		(void)fprintf(stderr, "Cannot set times of %s: errno=%d (%s).\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  tree_copy_file()
+ *	copy a regular file, paced by the shared token bucket
+ */
+static int tree_copy_file(tree_worker_t *const w, const tree_file_t *const f)
+{
+	tree_t *const tree = w->tree;
+	int fdin, fdout, ret = -1;
+
+	fdin = open(f->src, O_RDONLY | O_NOFOLLOW);
+	if (fdin < 0) {
+		(void)fprintf(stderr, "Cannot open %s: errno=%d (%s).\n",
+			f->src, errno, strerror(errno));
+		return -1;
+	}
+	fdout = open(f->dst, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+		S_IRUSR | S_IWUSR);
+	if (fdout < 0) {
+		(void)fprintf(stderr, "Cannot create %s: errno=%d (%s).\n",
+			f->dst, errno, strerror(errno));
+		(void)close(fdin);
+		return -1;
+	}
+
+	for (;;) {
+		const ssize_t n = read(fdin, w->buffer, tree->io_size);
+		ssize_t off = 0;
+		double secs;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			(void)fprintf(stderr, "read error on %s: errno=%d (%s).\n",
+				f->src, errno, strerror(errno));
+			goto tidy;
+		}
+		if (n == 0)
+			break;
+		secs = tree_take(tree, (size_t)n);
+		if (secs > 0.0)
+			tree_delay(w, secs);
+		while (off < n) {
+			const ssize_t wr = write(fdout, w->buffer + off, (size_t)(n - off));
+
+			if (wr < 0) {
+				if (errno == EINTR)
+					continue;
+				(void)fprintf(stderr, "write error on %s: errno=%d (%s).\n",
+					f->dst, errno, strerror(errno));
+				goto tidy;
+			}
+			off += wr;
+		}
+		w->bytes += (uint64_t)n;
+		__atomic_add_fetch(&tree->bytes, (uint64_t)n, __ATOMIC_RELAXED);
+		/* A partially copied file is neither a copy nor an error */
+		if (__atomic_load_n(&tree->stop, __ATOMIC_RELAXED)) {
+			ret = 0;
+			goto tidy;
+		}
+	}
+	(void)close(fdout);
+	fdout = -1;
+	if (tree_set_meta(f->dst, &f->st) < 0)
+		goto tidy;
+	w->files++;
+	__atomic_add_fetch(&tree->files, 1, __ATOMIC_RELAXED);
+	ret = 0;
+tidy:
+	if (fdout >= 0)
+		(void)close(fdout);
+	(void)close(fdin);
+
+	return ret;
+}
+
+/*
+ *  tree_worker()
+ *	directory copy worker, copy queued files until the walk
+ *	has finished and the queue is empty
+ */
+static void *tree_worker(void *arg)
+{
+	tree_worker_t *const w = (tree_worker_t *)arg;
+	tree_t *const tree = w->tree;
+
+	(void)pthread_mutex_lock(&tree->lock);
+	for (;;) {
+		tree_file_t f;
+
+		while (!tree->stop && !tree->count && !tree->done)
+			(void)pthread_cond_wait(&tree->cond_queued, &tree->lock);
+		if (tree->stop || !tree->count)
+			break;
+		f = tree->queue[tree->head];
+		tree->head = (tree->head + 1) % TREE_QUEUE_MAX;
+		tree->count--;
+		(void)pthread_cond_signal(&tree->cond_space);
+		(void)pthread_mutex_unlock(&tree->lock);
+
+		if (tree_copy_file(w, &f) < 0)
+			__atomic_add_fetch(&tree->errors, 1, __ATOMIC_RELAXED);
+		free(f.src);
+		free(f.dst);
+
+		(void)pthread_mutex_lock(&tree->lock);
+	}
+	tree->running--;
+	(void)pthread_cond_broadcast(&tree->cond_space);
+	(void)pthread_mutex_unlock(&tree->lock);
+
+	return NULL;
+}
+
+/*
+ *  tree_path()
+ *	allocate dir/name
+ */
+static char *tree_path(const char *const dir, const char *const name)
+{
+	const size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+
+	if (path)
+		(void)snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+/*
+ *  tree_queue()
+ *	queue a regular file for the workers, the queue owns the
+ *	paths from now on; waits while the queue is full
+ */
+static void tree_queue(
+	tree_t *const tree,
+	char *const src,
+	char *const dst,
+	const struct stat *const st)
+{
+	(void)pthread_mutex_lock(&tree->lock);
+	while (!tree->stop && (tree->count == TREE_QUEUE_MAX)) {
+		cond_wait_timed(&tree->cond_space, &tree->lock);
+		(void)pthread_mutex_unlock(&tree->lock);
+		tree_tick(tree);
+		(void)pthread_mutex_lock(&tree->lock);
+	}
+	if (tree->stop) {
+		(void)pthread_mutex_unlock(&tree->lock);
+		free(src);
+		free(dst);
+		return;
+	}
+	tree->queue[(tree->head + tree->count) % TREE_QUEUE_MAX] =
+		(tree_file_t){ src, dst, *st };
+	tree->count++;
+	(void)pthread_cond_signal(&tree->cond_queued);
+	(void)pthread_mutex_unlock(&tree->lock);
+}
+
+/*
+ *  tree_mkdir()
+ *	create a destination directory, its metadata is set after
+ *	the walk as copying into it changes its times
+ */
+static int tree_mkdir(tree_t *const tree, char *const dst, const struct stat *const st)
+{
+	struct stat buf;
+
+	if ((mkdir(dst, S_IRWXU) < 0) &&
+	    ((errno != EEXIST) || (stat(dst, &buf) < 0) || !S_ISDIR(buf.st_mode))) {
+		(void)fprintf(stderr, "Cannot create directory %s: errno=%d (%s).\n",
+			dst, errno, strerror(errno));
+		return -1;
+	}
+	if (tree->n_dirs == tree->max_dirs) {
+		const size_t max_dirs = tree->max_dirs ? tree->max_dirs * 2 : 64;
+		tree_dir_t *dirs = realloc(tree->dirs, max_dirs * sizeof(*dirs));
+
+		if (!dirs) {
+			(void)fprintf(stderr, "Cannot allocate directory list.\n");
+			return -1;
+		}
+		tree->dirs = dirs;
+		tree->max_dirs = max_dirs;
+	}
+	tree->dirs[tree->n_dirs].dst = dst;
+	tree->dirs[tree->n_dirs].st = *st;
+	tree->n_dirs++;
+
+	return 0;
+}
+
+/*
+ *  tree_symlink()
+ *	recreate a symbolic link, replacing any existing file
+ */
+static int tree_symlink(const char *const src, const char *const dst, const struct stat *const st)
+{
+	char target[PATH_MAX];
+	const ssize_t n = readlink(src, target, sizeof(target) - 1);
+
+	if (n < 0) {
+		(void)fprintf(stderr, "Cannot read link %s: errno=%d (%s).\n",
+			src, errno, strerror(errno));
+		return -1;
+	}
+	target[n] = '\0';
+	if ((symlink(target, dst) < 0) &&
+	    ((errno != EEXIST) || (unlink(dst) < 0) || (symlink(target, dst) < 0))) {
+		(void)fprintf(stderr, "Cannot create link %s: errno=%d (%s).\n",
+			dst, errno, strerror(errno));
+		return -1;
+	}
+	return tree_set_meta(dst, st);
+}
+
+/*
+ *  tree_walk()
+ *	walk a source directory, creating directories and links as
+ *	they are found and queueing regular files for the workers.
+ *	Devices, fifos and sockets are skipped. Returns -1 if out of
+ *	memory, other errors are counted and the walk carries on
+ */
+static int tree_walk(tree_t *const tree, const char *const src, const char *const dst)
+{
+	DIR *dir;
+	const struct dirent *d;
+	int ret = 0;
+
+	dir = opendir(src);
+	if (!dir) {
+		(void)fprintf(stderr, "Cannot open directory %s: errno=%d (%s).\n",
+			src, errno, strerror(errno));
+		__atomic_add_fetch(&tree->errors, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	while (!__atomic_load_n(&tree->stop, __ATOMIC_RELAXED) &&
+	       ((d = readdir(dir)) != NULL)) {
+		struct stat st;
+		char *s, *t;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		s = tree_path(src, d->d_name);
+		t = tree_path(dst, d->d_name);
+		if (!s || !t) {
+			(void)fprintf(stderr, "Cannot allocate path name.\n");
+			free(s);
+			free(t);
+			ret = -1;
+			break;
+		}
+		if (lstat(s, &st) < 0) {
+			(void)fprintf(stderr, "Cannot stat %s: errno=%d (%s).\n",
+				s, errno, strerror(errno));
+			__atomic_add_fetch(&tree->errors, 1, __ATOMIC_RELAXED);
+			free(s);
+			free(t);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			/* Don't copy the destination into itself */
+			if ((st.st_dev == tree->dst_dev) && (st.st_ino == tree->dst_ino)) {
+				free(t);
+			} else if (tree_mkdir(tree, t, &st) < 0) {
+				__atomic_add_fetch(&tree->errors, 1, __ATOMIC_RELAXED);
+				free(t);
+			} else if (tree_walk(tree, s, t) < 0) {
+				ret = -1;
+			}
+			free(s);
+		} else if (S_ISREG(st.st_mode)) {
+			tree_queue(tree, s, t, &st);
+		} else {
+			if (!S_ISLNK(st.st_mode))
+				tree->skipped++;
+			else if (tree_symlink(s, t, &st) < 0)
+				__atomic_add_fetch(&tree->errors, 1, __ATOMIC_RELAXED);
+			else
+				tree->links++;
+			free(s);
+			free(t);
+		}
+		if (ret < 0)
+			break;
+		tree_tick(tree);
+	}
+	(void)closedir(dir);
+
+	return ret;
+}
+
+/*
+ *  tree_free()
+ *	stop the directory copy workers and free everything
+ */
+static void tree_free(tree_t *const tree)
+{
+	size_t i;
+
+	if (!tree)
+		return;
+
+	tree_stop(tree);
+	if (tree->workers) {
+		for (i = 0; i < tree->n_workers; i++) {
+			tree_worker_t *const w = &tree->workers[i];
+
+			if (w->started)
+				(void)pthread_join(w->thread, NULL);
+			free(w->buffer);
+		}
+		free(tree->workers);
+	}
+	if (tree->queue) {
+		for (i = 0; i < tree->count; i++) {
+			tree_file_t *const f = &tree->queue[(tree->head + i) % TREE_QUEUE_MAX];
+
+			free(f->src);
+			free(f->dst);
+		}
+		free(tree->queue);
+	}
+	for (i = 0; i < tree->n_dirs; i++)
+		free(tree->dirs[i].dst);
+	free(tree->dirs);
+	(void)pthread_mutex_destroy(&tree->bucket_lock);
+	(void)pthread_cond_destroy(&tree->cond_space);
+	(void)pthread_cond_destroy(&tree->cond_queued);
+	(void)pthread_mutex_destroy(&tree->lock);
+	free(tree);
+}
+
+/*
+ *  tree_stats_info()
+ *	display the directory copy statistics
+ */
+static void tree_stats_info(const tree_t *const tree, const double secs)
+{
+	uint64_t delays = 0;
+	double delay_time = 0.0;
+	size_t i;
+
+	if (secs <= 0.0) {
+		(void)fprintf(stderr, "Cannot compute statistics\n");
+		return;
+	}
+	for (i = 0; i < tree->n_workers; i++) {
+		delays += tree->workers[i].delays;
+		delay_time += tree->workers[i].delay_time;
+	}
+	(void)fprintf(stderr, "Data:             %s\n",
+		double_to_str((double)tree->bytes));
+	(void)fprintf(stderr, "Files:            %" PRIu64 "\n", tree->files);
+	(void)fprintf(stderr, "Directories:      %zu\n", tree->n_dirs);
+	(void)fprintf(stderr, "Symbolic links:   %" PRIu64 "\n", tree->links);
+	if (tree->skipped)
+		(void)fprintf(stderr, "Skipped:          %" PRIu64 "\n", tree->skipped);
+	if (tree->errors)
+		(void)fprintf(stderr, "Errors:           %" PRIu64 "\n", tree->errors);
+	(void)fprintf(stderr, "Duration:         %s\n", secs_to_str(secs));
+	if (tree->rate > 0.0)
+		(void)fprintf(stderr, "Target rate:      %s/s\n",
+			double_to_str(tree->rate));
+	(void)fprintf(stderr, "Average rate:     %s/s\n",
+		double_to_str((double)tree->bytes / secs));
+	(void)fprintf(stderr, "Files rate:       %.2f files/s\n",
+		(double)tree->files / secs);
+	(void)fprintf(stderr, "Delays:           %" PRIu64 ", %s\n",
+		delays, secs_to_str(delay_time));
+
+	(void)fprintf(stderr, "\nCopy workers:\n");
+	for (i = 0; i < tree->n_workers; i++) {
+		const tree_worker_t *const w = &tree->workers[i];
+
+		(void)fprintf(stderr, "  Worker %-3zu      %s in %" PRIu64 " files\n",
+			i, double_to_str((double)w->bytes), w->files);
+	}
+}
+
+/*
+ *  tree_run()
+ *	-I dir -O dir copy mode, the calling thread walks the source
+ *	tree and a pool of workers copies the regular files, all
+ *	drawing on one token bucket so together they keep to the
+ *	rate. Directory metadata is set last, deepest first.
+ */
+static int tree_run(
+	const char *const src,
+	const char *const dst,
+	const double rate,
+	const size_t io_size,
+	const size_t n_workers,
+	const uint64_t timed_run,
+	const double freq)
+{
+	tree_t *tree;
+	struct stat st;
+	sigset_t set, old_set;
+	char *root;
+	size_t i;
+	int ret = EXIT_SUCCESS;
+
+	if (stat(src, &st) < 0) {
+		(void)fprintf(stderr, "Cannot stat %s: errno=%d (%s).\n",
+			src, errno, strerror(errno));
+		return EXIT_FILE_ERROR;
+	}
+
+	tree = calloc(1, sizeof(*tree));
+	if (!tree) {
+		(void)fprintf(stderr, "Cannot allocate directory copy state.\n");
+		return EXIT_ALLOC_ERROR;
+	}
+	(void)pthread_mutex_init(&tree->lock, NULL);
+	(void)pthread_cond_init(&tree->cond_queued, NULL);
+	(void)pthread_cond_init(&tree->cond_space, NULL);
+	(void)pthread_mutex_init(&tree->bucket_lock, NULL);
+	tree->queue = calloc(TREE_QUEUE_MAX, sizeof(*tree->queue));
+	tree->workers = calloc(n_workers, sizeof(*tree->workers));
+	if (!tree->queue || !tree->workers) {
+		(void)fprintf(stderr, "Cannot allocate directory copy state.\n");
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+	tree->n_workers = n_workers;
+	for (i = 0; i < n_workers; i++) {
+		tree->workers[i].tree = tree;
+		tree->workers[i].buffer = malloc(io_size);
+		if (!tree->workers[i].buffer) {
+			(void)fprintf(stderr,"Cannot allocate buffer of %zu bytes.\n",
+				io_size);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+	}
+	tree->io_size = io_size;
+	tree->rate = rate;
+	tree->freq = freq;
+	tree->timed_run = timed_run;
+
+	root = strdup(dst);
+	if (!root) {
+		(void)fprintf(stderr, "Cannot allocate path name.\n");
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+	if (tree_mkdir(tree, root, &st) < 0) {
+		free(root);
+		ret = EXIT_FILE_ERROR;
+		goto tidy;
+	}
+	if (stat(dst, &st) < 0) {
+		(void)fprintf(stderr, "Cannot stat %s: errno=%d (%s).\n",
+			dst, errno, strerror(errno));
+		ret = EXIT_FILE_ERROR;
+		goto tidy;
+	}
+	tree->dst_dev = st.st_dev;
+	tree->dst_ino = st.st_ino;
+
+	tree->time_start = mono_time();
+	tree->time_last = tree->time_start;
+	tree->verbose_last = tree->time_start;
+
+	/* Signals are for the walker, it has to see SIGINT */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	for (i = 0; i < n_workers; i++) {
+		tree_worker_t *const w = &tree->workers[i];
+
+		(void)pthread_mutex_lock(&tree->lock);
+		tree->running++;
+		(void)pthread_mutex_unlock(&tree->lock);
+		if (pthread_create(&w->thread, NULL, tree_worker, w) != 0) {
+			(void)pthread_mutex_lock(&tree->lock);
+			tree->running--;
+			(void)pthread_mutex_unlock(&tree->lock);
+			break;
+		}
+		w->started = true;
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (i < n_workers) {
+		(void)fprintf(stderr, "Cannot start %zu directory copy workers.\n",
+			n_workers);
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+
+	if (tree_walk(tree, src, dst) < 0)
+		ret = EXIT_ALLOC_ERROR;
+
+	/* Walk done, wait for the workers to drain the queue */
+	(void)pthread_mutex_lock(&tree->lock);
+	tree->done = true;
+	(void)pthread_cond_broadcast(&tree->cond_queued);
+	while (tree->running) {
+		cond_wait_timed(&tree->cond_space, &tree->lock);
+		(void)pthread_mutex_unlock(&tree->lock);
+		tree_tick(tree);
+		(void)pthread_mutex_lock(&tree->lock);
+	}
+	(void)pthread_mutex_unlock(&tree->lock);
+
+	for (i = tree->n_dirs; i > 0; i--) {
+		const tree_dir_t *const d = &tree->dirs[i - 1];
+
+		if (tree_set_meta(d->dst, &d->st) < 0)
+			tree->errors++;
+	}
+
+	if (opt_flags & OPT_VERBOSE)
+		(void)fprintf(stderr, "%78s\r", "");
+	if (opt_flags & OPT_STATS) {
+		for (i = 0; i < n_workers; i++) {
+			(void)pthread_join(tree->workers[i].thread, NULL);
+			tree->workers[i].started = false;
+		}
+		tree_stats_info(tree, mono_time() - tree->time_start);
+	}
+	if (tree->errors && (ret == EXIT_SUCCESS))
+		ret = EXIT_FILE_ERROR;
+tidy:
+	tree_free(tree);
+
+	return ret;
+}
+
+/*
+ *  stream_free()
+ *	free a list of -L streams, closing any open files
+ */
+static void stream_free(stream_t *const streams, const size_t n_streams)
+{
+	size_t i;
+
+	for (i = 0; i < n_streams; i++) {
+		stream_t *const s = &streams[i];
+
+		if ((s->fdin >= 0) && (s->fdin != fileno(stdin)))
+			(void)close(s->fdin);
+		if ((s->fdout >= 0) && (s->fdout != fileno(stdout)))
+			(void)close(s->fdout);
+		free(s->buffer);
+		free(s->input);
+		free(s->output);
+	}
+	free(streams);
+}
+
+/*
+ *  stream_list_load()
+ *	load the -L stream list, one stream per line:
+ *	input output rate [weight], where input and output can
+ *	be - for stdin and stdout and a rate of 0 is unlimited
+ */
+static stream_t *stream_list_load(const char *const filename, size_t *n_streams)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t line_len = 0, n = 0, n_max = 0;
+	stream_t *streams = NULL;
+	int lineno = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+			filename, errno, strerror(errno));
+		return NULL;
+	}
+
+	while (getline(&line, &line_len, fp) != -1) {
+		char *saveptr = NULL, *input, *output, *rate, *weight;
+		stream_t *s;
+
+		lineno++;
+		input = strtok_r(line, " \t\n", &saveptr);
+		if (!input || (*input == '#'))
+			continue;
+		output = strtok_r(NULL, " \t\n", &saveptr);
+		rate = strtok_r(NULL, " \t\n", &saveptr);
+		weight = strtok_r(NULL, " \t\n", &saveptr);
+		if (!output || !rate) {
+			(void)fprintf(stderr, "%s: line %d: expecting input output rate [weight].\n",
+				filename, lineno);
+			goto err;
+		}
+		if (n >= n_max) {
+			stream_t *tmp;
+
+			n_max = n_max ? n_max * 2 : 16;
+			tmp = realloc(streams, n_max * sizeof(*streams));
+			if (!tmp) {
+				(void)fprintf(stderr, "Cannot allocate stream list.\n");
+				goto err;
+			}
+			streams = tmp;
+		}
+		s = &streams[n];
+		(void)memset(s, 0, sizeof(*s));
+		s->fdin = -1;
+		s->fdout = -1;
+		n++;
+		s->input = strdup(input);
+		s->output = strdup(output);
+		if (!s->input || !s->output) {
+			(void)fprintf(stderr, "Cannot allocate stream list.\n");
+			goto err;
+		}
+		s->rate = get_double_byte(rate);
+		s->weight = weight ? atof(weight) : 1.0;
+		if ((s->rate < 0.0) || (s->weight <= 0.0)) {
+			(void)fprintf(stderr, "%s: line %d: invalid rate or weight.\n",
+				filename, lineno);
+			goto err;
+		}
+		if ((s->rate > 0.0) && (s->rate < DATA_RATE_MIN)) {
+			(void)fprintf(stderr, "%s: line %d: rate too low, minimum allowed is %.2f bytes/sec.\n",
+				filename, lineno, DATA_RATE_MIN);
+			goto err;
+		}
+	}
+	free(line);
+	(void)fclose(fp);
+
+	if (!n) {
+		(void)fprintf(stderr, "No streams found in %s.\n", filename);
+		free(streams);
+		return NULL;
+	}
+	*n_streams = n;
+	return streams;
+err:
+	free(line);
+	(void)fclose(fp);
+	stream_free(streams, n);
+	return NULL;
+}
+
+/*
+ *  stream_share_rates()
+ *	share the -r aggregate rate between the active streams by
+ *	weight. Streams with a rate lower than their share keep
+ *	their own rate and the remainder is shared between the
+ *	others (water filling). A rate of 0.0 is unlimited.
+ */
+static void stream_share_rates(
+	stream_t *const streams,
+	const size_t n_streams,
+	const double aggregate_rate)
+{
+	size_t i;
+	double remaining = aggregate_rate;
+	bool changed;
+
+	for (i = 0; i < n_streams; i++) {
+		streams[i].eff_rate = streams[i].rate;
+		streams[i].shared = !streams[i].done && (aggregate_rate > 0.0);
+	}
+	if (aggregate_rate <= 0.0)
+		return;
+
+	do {
+		double weights = 0.0;
+
+		changed = false;
+		for (i = 0; i < n_streams; i++)
+			if (streams[i].shared)
+				weights += streams[i].weight;
+		for (i = 0; i < n_streams; i++) {
+			stream_t *const s = &streams[i];
+
+			if (s->shared && (s->rate > 0.0) &&
+			    (s->rate <= remaining * s->weight / weights)) {
+				s->shared = false;
+				remaining -= s->rate;
+				changed = true;
+			}
+		}
+		if (!changed) {
+			for (i = 0; i < n_streams; i++) {
+				stream_t *const s = &streams[i];
+
+				if (s->shared)
+					s->eff_rate = remaining * s->weight / weights;
+			}
+		}
+	} while (changed);
+}
+
+/*
+ *  stream_open()
+ *	open the input and output of a stream, non-blocking
+ */
+static int stream_open(stream_t *const s)
+{
+	const int open_flags = (opt_flags & OPT_APPEND) ? O_APPEND : O_TRUNC;
+
+	if (!strcmp(s->input, "-")) {
+		s->fdin = fileno(stdin);
+	} else {
+		s->fdin = open(s->input, O_RDONLY | O_NONBLOCK);
+		if (s->fdin < 0) {
+			(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+				s->input, errno, strerror(errno));
+			return -1;
+		}
+	}
+	if (!strcmp(s->output, "-")) {
+		s->fdout = fileno(stdout);
+	} else {
+		s->fdout = open(s->output, O_CREAT | open_flags | O_WRONLY | O_NONBLOCK,
+			S_IRUSR | S_IWUSR);
+		if (s->fdout < 0) {
+			(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+				s->output, errno, strerror(errno));
+			return -1;
+		}
+	}
+	(void)fcntl(s->fdin, F_SETFL, fcntl(s->fdin, F_GETFL) | O_NONBLOCK);
+	(void)fcntl(s->fdout, F_SETFL, fcntl(s->fdout, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+ *  streams_info()
+ *	display per stream and aggregate statistics
+ */
+static void streams_info(
+	const stream_t *const streams,
+	const size_t n_streams,
+	const stats_t *const stats,
+	const uint64_t wakeups)
+{
+	const double secs = stats->time_end - stats->time_begin;
+	size_t i;
+
+	if (secs <= 0.0)  {
+		(void)fprintf(stderr, "Cannot compute statistics\n");
+		return;
+	}
+	(void)fprintf(stderr, "%-24s %-24s %12s %12s %12s\n",
+		"Input", "Output", "Data", "Rate/S", "Target/S");
+	for (i = 0; i < n_streams; i++) {
+		const stream_t *const s = &streams[i];
+		char data_str[32], rate_str[32], target_str[32];
+
+		size_to_str((double)s->total_bytes, "%7.1f %s",
+			data_str, sizeof(data_str));
+		size_to_str((double)s->total_bytes / secs, "%7.1f %s",
+			rate_str, sizeof(rate_str));
+		if (s->rate > 0.0)
+			size_to_str(s->rate, "%7.1f %s",
+				target_str, sizeof(target_str));
+		else
+			(void)snprintf(target_str, sizeof(target_str), "%10s", "-");
+		(void)fprintf(stderr, "%-24.24s %-24.24s %12s %12s %12s\n",
+			s->input, s->output, data_str, rate_str, target_str);
+	}
+	(void)fprintf(stderr, "\n");
+	(void)fprintf(stderr, "Streams:          %zu\n", n_streams);
+	(void)fprintf(stderr, "Data:             %s\n",
+		double_to_str((double)stats->total_bytes));
+	(void)fprintf(stderr, "Reads:            %" PRIu64 "\n",
+		stats->reads);
+	(void)fprintf(stderr, "Writes:           %" PRIu64 "\n",
+		stats->writes);
+	(void)fprintf(stderr, "Wakeups:          %" PRIu64 "\n",
+		wakeups);
+	(void)fprintf(stderr, "Duration:         %s\n",
+		secs_to_str(secs));
+	if (stats->target_rate > 0.0)
+		(void)fprintf(stderr, "Aggregate target: %s/s\n",
+			double_to_str(stats->target_rate));
+	(void)fprintf(stderr, "Aggregate rate:   %s/s\n",
+		double_to_str((double)stats->total_bytes / secs));
+}
+
+/*
+ *  streams_run()
+ *	-L multi-stream mode, pace all the streams in the list from
+ *	a single poll() event loop. Each stream has a token bucket
+ *	that is refilled at its rate; a chunk is read once a stream
+ *	has enough tokens and is written out as the output allows.
+ *	Streams that become due within STREAM_SLACK of each other
+ *	are serviced in the same wakeup.
+ */
+static int streams_run(
+	const char *const filename,
+	const double aggregate_rate,
+	const double io_size,
+	const uint64_t timed_run,
+	const double freq)
+{
+	stream_t *streams;
+	struct pollfd *pfds = NULL;
+	size_t *pfd_stream = NULL;
+	size_t n_streams, i, active;
+	stats_t stats;
+	double secs_start, secs_last;
+	uint64_t wakeups = 0;
+	int ret = EXIT_SUCCESS;
+	int stdin_flags, stdout_flags;
+
+	streams = stream_list_load(filename, &n_streams);
+	if (!streams)
+		return EXIT_FILE_ERROR;
+
+	pfds = calloc(n_streams, sizeof(*pfds));
+	pfd_stream = calloc(n_streams, sizeof(*pfd_stream));
+	if (!pfds || !pfd_stream) {
+		(void)fprintf(stderr, "Cannot allocate stream poll list.\n");
+		free(pfds);
+		free(pfd_stream);
+		stream_free(streams, n_streams);
+		return EXIT_ALLOC_ERROR;
+	}
+
+	stdin_flags = fcntl(fileno(stdin), F_GETFL);
+	stdout_flags = fcntl(fileno(stdout), F_GETFL);
+
+	stream_share_rates(streams, n_streams, aggregate_rate);
+	secs_start = mono_time();
+	for (i = 0; i < n_streams; i++) {
+		stream_t *const s = &streams[i];
+
+		if (stream_open(s) < 0) {
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		/* Default to ~32 chunks per second */
+		if (opt_flags & OPT_GOT_IOSIZE)
+			s->io_size = (size_t)io_size;
+		else if (s->eff_rate > 0.0)
+			s->io_size = (size_t)(s->eff_rate / 32.0);
+		else
+			s->io_size = 64 * KB;
+		if (s->io_size < IO_SIZE_MIN)
+			s->io_size = IO_SIZE_MIN;
+		if (s->io_size > IO_SIZE_MAX)
+			s->io_size = IO_SIZE_MAX;
+		s->buffer = malloc(s->io_size);
+		if (!s->buffer) {
+			(void)fprintf(stderr,"Cannot allocate buffer of %zu bytes.\n",
+				s->io_size);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+		s->tokens = (double)s->io_size;
+		s->time_last = secs_start;
+	}
+
+	stats_init(&stats);
+	stats.target_rate = aggregate_rate;
+	stats.time_begin = timeval_to_double();
+	secs_last = secs_start;
+	active = n_streams;
+
+	while (active && !sluice_finish) {
+		double secs_now = mono_time();
+		double next = secs_now + 1.0;
+		size_t n_pfds = 0;
+		int n;
+		bool rates_changed = false;
+
+		for (i = 0; i < n_streams; i++) {
+			stream_t *const s = &streams[i];
+
+			if (s->done)
+				continue;
+			if (s->buf_off < s->buf_len) {
+				/* Data pending, wait for the output */
+				pfds[n_pfds].fd = s->fdout;
+				pfds[n_pfds].events = POLLOUT;
+				pfd_stream[n_pfds++] = i;
+				continue;
+			}
+			if (s->eff_rate > 0.0) {
+				const double burst = 2.0 * (double)s->io_size;
+
+				s->tokens += s->eff_rate * (secs_now - s->time_last);
+				if (s->tokens > burst)
+					s->tokens = burst;
+				s->time_last = secs_now;
+				if (s->tokens + (s->eff_rate * STREAM_SLACK) <
+				    (double)s->io_size) {
+					/* Not due yet, when will it be? */
+					const double due = secs_now +
+						((double)s->io_size - s->tokens) /
+						s->eff_rate;
+
+					if (due < next)
+						next = due;
+					continue;
+				}
+			}
+			pfds[n_pfds].fd = s->fdin;
+			pfds[n_pfds].events = POLLIN;
+			pfd_stream[n_pfds++] = i;
+		}
+
+		if ((opt_flags & OPT_TIMED_RUN) &&
+		    ((secs_now - secs_start) > timed_run))
+			break;
+
+		if ((opt_flags & OPT_VERBOSE) &&
+		    (secs_now > secs_last + freq)) {
+			char rate_str[32], total_str[32];
+
+			size_to_str((double)stats.total_bytes / (secs_now - secs_start),
+				"%7.1f %s", rate_str, sizeof(rate_str));
+			size_to_str((double)stats.total_bytes, "%7.1f %s",
+				total_str, sizeof(total_str));
+			(void)fprintf(stderr, "Rate: %s/S, Total: %s, "
+				"Dur: %.1f S, Active: %zu  \r",
+				rate_str, total_str, secs_now - secs_start, active);
+			(void)fflush(stderr);
+			secs_last = secs_now;
+		}
+
+		wakeups++;
+		n = poll(pfds, n_pfds, (next > secs_now) ?
+			(int)((next - secs_now) * 1000.0) + 1 : 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			(void)fprintf(stderr, "poll error: errno=%d (%s).\n",
+				errno, strerror(errno));
+			ret = EXIT_READ_ERROR;
+			break;
+		}
+		if (n == 0)
+			continue;
+
+		for (i = 0; i < n_pfds; i++) {
+			stream_t *const s = &streams[pfd_stream[i]];
+			ssize_t ret_io;
+
+			if (!pfds[i].revents)
+				continue;
+			if (pfds[i].events & POLLIN) {
+				ret_io = read(s->fdin, s->buffer, s->io_size);
+				if (ret_io < 0) {
+					if ((errno == EAGAIN) || (errno == EINTR))
+						continue;
+					if (!(opt_flags & OPT_SKIP_READ_ERRORS)) {
+						(void)fprintf(stderr, "read error on %s: errno=%d (%s).\n",
+							s->input, errno, strerror(errno));
+						ret = EXIT_READ_ERROR;
+						goto tidy;
+					}
+					(void)memset(s->buffer, 0, s->io_size);
+					ret_io = (ssize_t)s->io_size;
+				}
+				stats.reads++;
+				if (ret_io == 0) {
+					s->done = true;
+					active--;
+					rates_changed = true;
+					continue;
+				}
+				s->tokens -= (double)ret_io;
+				s->buf_len = (size_t)ret_io;
+				s->buf_off = 0;
+				s->reads++;
+			}
+			/* Try the write straight away, it will normally succeed */
+			ret_io = write(s->fdout, s->buffer + s->buf_off,
+				s->buf_len - s->buf_off);
+			if (ret_io < 0) {
+				if ((errno == EAGAIN) || (errno == EINTR))
+					continue;
+				(void)fprintf(stderr, "write error on %s: errno=%d (%s).\n",
+					s->output, errno, strerror(errno));
+				ret = EXIT_WRITE_ERROR;
+				goto tidy;
+			}
+			s->buf_off += (size_t)ret_io;
+			s->total_bytes += (uint64_t)ret_io;
+			s->writes++;
+			stats.writes++;
+			stats.total_bytes += (uint64_t)ret_io;
+			stats.buf_size_total += (double)ret_io;
+		}
+		if (rates_changed)
+			stream_share_rates(streams, n_streams, aggregate_rate);
+	}
+
+	if (opt_flags & OPT_VERBOSE)
+		(void)fprintf(stderr, "%78s\r", "");
+	if (opt_flags & OPT_STATS) {
+		stats.time_end = timeval_to_double();
+		streams_info(streams, n_streams, &stats, wakeups);
+	}
+tidy:
+	if (stdin_flags >= 0)
+		(void)fcntl(fileno(stdin), F_SETFL, stdin_flags);
+	if (stdout_flags >= 0)
+		(void)fcntl(fileno(stdout), F_SETFL, stdout_flags);
+	free(pfds);
+	free(pfd_stream);
+	stream_free(streams, n_streams);
+
+	return ret;
+}
+
+/*
+ *  gen_seed()
+ *	seed a worker's random number generator from /dev/urandom,
+ *	falling back to time and pid if it cannot be read
+ */
+static void gen_seed(gen_worker_t *const w)
+{
+	int fd;
+
+	w->rnd[0] = (uint64_t)getpid() ^ ((uint64_t)w->id << 32);
+	w->rnd[1] = (uint64_t)(mono_time() * 1000000000.0);
+	fd = open(dev_urandom, O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, w->rnd, sizeof(w->rnd)) != sizeof(w->rnd))
+			w->rnd[1] ^= 0x9e3779b97f4a7c15ULL;
+		(void)close(fd);
+	}
+	/* xorshift128+ state must not be all zero */
+	if (!(w->rnd[0] | w->rnd[1]))
+		w->rnd[0] = 0x9e3779b97f4a7c15ULL;
+}
+
+/*
+ *  gen_fill()
+ *	fill a chunk with xorshift128+ pseudo random data
+ */
+static void gen_fill(gen_worker_t *const w, char *const data, const size_t len)
+{
+	uint64_t *ptr = (uint64_t *)data;
+	const uint64_t *end = ptr + (len / sizeof(*ptr));
+	uint64_t s0 = w->rnd[0], s1 = w->rnd[1];
+
+	while (ptr < end) {
+		uint64_t x = s0;
+		const uint64_t y = s1;
+
+		s0 = y;
+		x ^= x << 23;
+		s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+		*ptr++ = s1 + y;
+	}
+	w->rnd[0] = s0;
+	w->rnd[1] = s1;
+}
+
+/*
+ *  gen_worker()
+ *	-j generator worker, claim the next chunk in sequence, wait
+ *	for its slot in the pool to be free and fill it
+ */
+static void *gen_worker(void *arg)
+{
+	gen_worker_t *const w = (gen_worker_t *)arg;
+	gen_t *const gen = w->gen;
+
+	(void)pthread_mutex_lock(&gen->lock);
+	while (!gen->stop) {
+		const uint64_t seq = gen->next_fill++;
+		gen_chunk_t *const chunk = &gen->chunks[seq % gen->n_chunks];
+		double t;
+
+		while (!gen->stop && (seq >= gen->next_read + gen->n_chunks))
+			(void)pthread_cond_wait(&gen->cond_empty, &gen->lock);
+		if (gen->stop)
+			break;
+		(void)pthread_mutex_unlock(&gen->lock);
+
+		t = mono_time();
+		gen_fill(w, chunk->data, gen->fill_size);
+		w->fill_time += mono_time() - t;
+		w->bytes += gen->chunk_size;
+
+		(void)pthread_mutex_lock(&gen->lock);
+		chunk->seq = seq;
+		chunk->full = true;
+		(void)pthread_cond_broadcast(&gen->cond_full);
+	}
+	(void)pthread_mutex_unlock(&gen->lock);
+
+	return NULL;
+}
+
+/*
+ *  gen_free()
+ *	stop the -j generator workers and free the pool
+ */
+static void gen_free(gen_t *const gen)
+{
+	size_t i;
+
+	if (!gen)
+		return;
+
+	(void)pthread_mutex_lock(&gen->lock);
+	gen->stop = true;
+	(void)pthread_cond_broadcast(&gen->cond_empty);
+	(void)pthread_mutex_unlock(&gen->lock);
+
+	for (i = 0; i < gen->n_workers; i++) {
+		if (gen->workers[i].started)
+			(void)pthread_join(gen->workers[i].thread, NULL);
+	}
+	for (i = 0; i < gen->n_chunks; i++)
+		free(gen->chunks[i].data);
+	(void)pthread_cond_destroy(&gen->cond_full);
+	(void)pthread_cond_destroy(&gen->cond_empty);
+	(void)pthread_mutex_destroy(&gen->lock);
+	free(gen->chunks);
+	free(gen->workers);
+	free(gen);
+}
+
+/*
+ *  gen_init()
+ *	create a pool of chunks and start n_workers threads to fill them
+ */
+static gen_t *gen_init(const size_t n_workers, const size_t io_size)
+{
+	gen_t *gen;
+	size_t i;
+
+	gen = calloc(1, sizeof(*gen));
+	if (!gen)
+		return NULL;
+	(void)pthread_mutex_init(&gen->lock, NULL);
+	(void)pthread_cond_init(&gen->cond_full, NULL);
+	(void)pthread_cond_init(&gen->cond_empty, NULL);
+
+	/*
+	 *  Chunks are filled 64 bits at a time, but only io_size of each
+	 *  is handed out so every write is a full io_size
+	 */
+	gen->chunk_size = io_size;
+	gen->fill_size = (io_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	gen->n_chunks = (2 * n_workers) + 2;
+	gen->chunks = calloc(gen->n_chunks, sizeof(*gen->chunks));
+	gen->workers = calloc(n_workers, sizeof(*gen->workers));
+	if (!gen->chunks || !gen->workers)
+		goto err;
+	for (i = 0; i < gen->n_chunks; i++) {
+		gen->chunks[i].data = malloc(gen->fill_size);
+		if (!gen->chunks[i].data)
+			goto err;
+	}
+	for (i = 0; i < n_workers; i++) {
+		gen_worker_t *const w = &gen->workers[i];
+
+		w->gen = gen;
+		w->id = (int)i;
+		gen_seed(w);
+		if (pthread_create(&w->thread, NULL, gen_worker, w) != 0)
+			goto err;
+		w->started = true;
+		gen->n_workers++;
+	}
+	return gen;
+err:
+	gen_free(gen);
+	return NULL;
+}
+
+/*
+ *  gen_get()
+ *	get up to len bytes of generated data in sequence order,
+ *	the data remains valid until the next call
+ */
+static size_t gen_get(gen_t *const gen, char **const ptr, const size_t len)
+{
+	gen_chunk_t *chunk;
+	size_t n;
+
+	(void)pthread_mutex_lock(&gen->lock);
+	if (gen->read_off >= gen->chunk_size) {
+		/* Previous chunk has been written, hand it back */
+		gen->chunks[gen->next_read % gen->n_chunks].full = false;
+		gen->next_read++;
+		gen->read_off = 0;
+		(void)pthread_cond_broadcast(&gen->cond_empty);
+	}
+	chunk = &gen->chunks[gen->next_read % gen->n_chunks];
+	while (!(chunk->full && (chunk->seq == gen->next_read)))
+		(void)pthread_cond_wait(&gen->cond_full, &gen->lock);
+	(void)pthread_mutex_unlock(&gen->lock);
+
+	n = gen->chunk_size - gen->read_off;
+	if (n > len)
+		n = len;
+	*ptr = chunk->data + gen->read_off;
+	gen->read_off += n;
+
+	return n;
+}
+
+/*
+ *  gen_stats_info()
+ *	display the -j generator per worker fill throughput
+ */
+static void gen_stats_info(const gen_t *const gen)
+{
+	size_t i;
+
+	(void)fprintf(stderr, "\nGenerator workers:\n");
+	for (i = 0; i < gen->n_workers; i++) {
+		const gen_worker_t *const w = &gen->workers[i];
+		char rate_str[32];
+
+		size_to_str(w->fill_time > 0.0 ? (double)w->bytes / w->fill_time : 0.0,
+			"%.2f %s", rate_str, sizeof(rate_str));
+		(void)fprintf(stderr, "  Worker %-3zu      %s filled, %s/s fill rate\n",
+			i, double_to_str((double)w->bytes), rate_str);
+	}
+}
+
+/*
+ *  codec_compress()
+ *	compress a chunk into a self contained lz4 or zstd frame,
+ *	concatenated frames are a valid stream for both formats
+ */
+static int codec_compress(
+	codec_t *const codec,
+	codec_worker_t *const w,
+	codec_chunk_t *const chunk)
+{
+	(void)w;
+
+	switch (codec->type->algo) {
+#if defined(HAVE_LZ4)
+	case CODEC_LZ4: {
+		LZ4F_preferences_t prefs;
+		size_t n;
+
+		(void)memset(&prefs, 0, sizeof(prefs));
+		prefs.compressionLevel = codec->level;
+		n = LZ4F_compressFrame(chunk->out, chunk->out_size,
+			chunk->in, chunk->in_len, &prefs);
+		if (LZ4F_isError(n)) {
+			(void)snprintf(codec->error, sizeof(codec->error),
+				"lz4 compression failed: %s", LZ4F_getErrorName(n));
+			return -1;
+		}
+		chunk->out_len = n;
+		return 0;
+	}
+#endif
+#if defined(HAVE_ZSTD)
+	case CODEC_ZSTD: {
+		const size_t n = ZSTD_compressCCtx(w->cctx, chunk->out, chunk->out_size,
+			chunk->in, chunk->in_len, codec->level);
+
+		if (ZSTD_isError(n)) {
+			(void)snprintf(codec->error, sizeof(codec->error),
+				"zstd compression failed: %s", ZSTD_getErrorName(n));
+			return -1;
+		}
+		chunk->out_len = n;
+		return 0;
+	}
+#endif
+	default:
+		break;
+	}
+	(void)chunk;
+	return -1;
+}
+
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+/*
+ *  codec_out_grow()
+ *	make room for more decompressed output in a chunk
+ */
+static int codec_out_grow(codec_t *const codec, codec_chunk_t *const chunk)
+{
+	const size_t size = chunk->out_size * 2;
+	char *out;
+
+	out = realloc(chunk->out, size);
+	if (!out) {
+		(void)snprintf(codec->error, sizeof(codec->error),
+			"cannot grow decompression buffer to %zu bytes", size);
+		return -1;
+	}
+	chunk->out = out;
+	chunk->out_size = size;
+	return 0;
+}
+#endif
+
+/*
+ *  codec_decompress()
+ *	decompress a chunk of the input stream, frames can span chunks
+ *	so the single decompression worker keeps the stream state
+ */
+static int codec_decompress(
+	codec_t *const codec,
+	codec_worker_t *const w,
+	codec_chunk_t *const chunk)
+{
+	chunk->out_len = 0;
+
+	switch (codec->type->algo) {
+#if defined(HAVE_LZ4)
+	case CODEC_LZ4: {
+		size_t in_off = 0;
+
+		while (in_off < chunk->in_len) {
+			size_t src_len = chunk->in_len - in_off;
+			size_t dst_len;
+			size_t n;
+
+			if ((chunk->out_size - chunk->out_len < chunk->in_len) &&
+			    (codec_out_grow(codec, chunk) < 0))
+				return -1;
+			dst_len = chunk->out_size - chunk->out_len;
+			n = LZ4F_decompress(w->dctx_lz4, chunk->out + chunk->out_len,
+				&dst_len, chunk->in + in_off, &src_len, NULL);
+			if (LZ4F_isError(n)) {
+				(void)snprintf(codec->error, sizeof(codec->error),
+					"lz4 decompression failed: %s", LZ4F_getErrorName(n));
+				return -1;
+			}
+			in_off += src_len;
+			chunk->out_len += dst_len;
+		}
+		return 0;
+	}
+#endif
+#if defined(HAVE_ZSTD)
+	case CODEC_ZSTD: {
+		ZSTD_inBuffer in = { chunk->in, chunk->in_len, 0 };
+
+		for (;;) {
+			ZSTD_outBuffer out;
+			size_t n;
+
+			if ((chunk->out_size - chunk->out_len < chunk->in_len) &&
+			    (codec_out_grow(codec, chunk) < 0))
+				return -1;
+			out.dst = chunk->out;
+			out.size = chunk->out_size;
+			out.pos = chunk->out_len;
+			n = ZSTD_decompressStream(w->dctx_zstd, &out, &in);
+			if (ZSTD_isError(n)) {
+				(void)snprintf(codec->error, sizeof(codec->error),
+					"zstd decompression failed: %s", ZSTD_getErrorName(n));
+				return -1;
+			}
+			chunk->out_len = out.pos;
+			/* All input used and the output was not full, nothing is pending */
+			if ((in.pos == in.size) && (out.pos < out.size))
+				break;
+		}
+		return 0;
+	}
+#endif
+	default:
+		break;
+	}
+	(void)w;
+	return -1;
+}
+
+/*
+ *  codec_reader()
+ *	-Z input thread, read the input in order into free chunks,
+ *	it can only be cancelled while it is blocked in read
+ */
+static void *codec_reader(void *arg)
+{
+	codec_t *const codec = (codec_t *)arg;
+	uint64_t total = 0;
+	bool eof = false;
+
+	(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (!eof) {
+		const uint64_t seq = codec->next_fill;
+		codec_chunk_t *const chunk = &codec->chunks[seq % codec->n_chunks];
+		size_t len = 0, sz = codec->chunk_size;
+		int err = 0;
+		double t;
+
+		(void)pthread_mutex_lock(&codec->lock);
+		while (!codec->stop && (chunk->state != CODEC_EMPTY))
+			(void)pthread_cond_wait(&codec->cond_empty, &codec->lock);
+		(void)pthread_mutex_unlock(&codec->lock);
+		if (codec->stop)
+			break;
+
+		if (codec->max_trans && (total + sz >= codec->max_trans)) {
+			sz = (size_t)(codec->max_trans - total);
+			eof = true;
+		}
+		t = mono_time();
+		if (codec->fdin < 0) {
+			/* -z, the chunks are zeroed when allocated */
+			len = sz;
+		} else {
+			while (len < sz) {
+				ssize_t n;
+
+				(void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+				n = read(codec->fdin, chunk->in + len, sz - len);
+				(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					if (codec->skip_errors) {
+						(void)memset(chunk->in + len, 0, sz - len);
+						len = sz;
+						break;
+					}
+					err = errno;
+					eof = true;
+					break;
+				}
+				if (n == 0) {
+					eof = true;
+					break;
+				}
+				len += (size_t)n;
+				codec->reads++;
+			}
+		}
+		codec->read_time += mono_time() - t;
+		total += len;
+
+		(void)pthread_mutex_lock(&codec->lock);
+		if (err) {
+			(void)snprintf(codec->error, sizeof(codec->error),
+				"read error: errno=%d (%s)", err, strerror(err));
+			codec->failed = true;
+		}
+		if (len) {
+			chunk->in_len = len;
+			chunk->seq = seq;
+			chunk->state = CODEC_READ;
+			codec->next_fill++;
+			codec->in_bytes += len;
+		}
+		if (eof)
+			codec->eof = true;
+		(void)pthread_cond_broadcast(&codec->cond_read);
+		(void)pthread_cond_broadcast(&codec->cond_done);
+		(void)pthread_mutex_unlock(&codec->lock);
+	}
+	return NULL;
+}
+
+/*
+ *  codec_worker()
+ *	-Z worker, (de)compress the chunks read in sequence order,
+ *	chunks can complete out of order when there are several workers
+ */
+static void *codec_worker(void *arg)
+{
+	codec_worker_t *const w = (codec_worker_t *)arg;
+	codec_t *const codec = w->codec;
+
+	(void)pthread_mutex_lock(&codec->lock);
+	while (!codec->stop) {
+		const uint64_t seq = codec->next_work;
+		codec_chunk_t *const chunk = &codec->chunks[seq % codec->n_chunks];
+		double t;
+		int ret;
+
+		if ((chunk->state != CODEC_READ) || (chunk->seq != seq)) {
+			(void)pthread_cond_wait(&codec->cond_read, &codec->lock);
+			continue;
+		}
+		codec->next_work++;
+		chunk->state = CODEC_BUSY;
+		(void)pthread_mutex_unlock(&codec->lock);
+
+		t = mono_time();
+		ret = codec->type->decompress ?
+			codec_decompress(codec, w, chunk) :
+			codec_compress(codec, w, chunk);
+		w->busy_time += mono_time() - t;
+		w->bytes += chunk->in_len;
+
+		(void)pthread_mutex_lock(&codec->lock);
+		if (ret < 0)
+			codec->failed = true;
+		chunk->state = CODEC_DONE;
+		(void)pthread_cond_broadcast(&codec->cond_done);
+	}
+	(void)pthread_mutex_unlock(&codec->lock);
+
+	return NULL;
+}
+
+/*
+ *  codec_free()
+ *	stop the -Z reader and workers and free the pool
+ */
+static void codec_free(codec_t *const codec)
+{
+	size_t i;
+
+	if (!codec)
+		return;
+
+	(void)pthread_mutex_lock(&codec->lock);
+	codec->stop = true;
+	(void)pthread_cond_broadcast(&codec->cond_empty);
+	(void)pthread_cond_broadcast(&codec->cond_read);
+	(void)pthread_mutex_unlock(&codec->lock);
+
+	for (i = 0; i < codec->n_workers; i++) {
+		codec_worker_t *const w = &codec->workers[i];
+
+		if (w->started)
+			(void)pthread_join(w->thread, NULL);
+#if defined(HAVE_LZ4)
+		if (w->dctx_lz4)
+			(void)LZ4F_freeDecompressionContext(w->dctx_lz4);
+#endif
+#if defined(HAVE_ZSTD)
+		ZSTD_freeCCtx(w->cctx);
+		ZSTD_freeDStream(w->dctx_zstd);
+#endif
+	}
+	/* The reader may be blocked reading input that never comes */
+	if (codec->reader_started) {
+		(void)pthread_cancel(codec->reader);
+		(void)pthread_join(codec->reader, NULL);
+	}
+	if (codec->chunks) {
+		for (i = 0; i < codec->n_chunks; i++) {
+			free(codec->chunks[i].in);
+			free(codec->chunks[i].out);
+		}
+	}
+	(void)pthread_cond_destroy(&codec->cond_empty);
+	(void)pthread_cond_destroy(&codec->cond_read);
+	(void)pthread_cond_destroy(&codec->cond_done);
+	(void)pthread_mutex_destroy(&codec->lock);
+	free(codec->chunks);
+	free(codec->workers);
+	free(codec);
+}
+
+/*
+ *  codec_bound()
+ *	worst case compressed size of a chunk
+ */
+static size_t codec_bound(const codec_t *const codec, const size_t len)
+{
+	switch (codec->type->algo) {
+#if defined(HAVE_LZ4)
+	case CODEC_LZ4: {
+		LZ4F_preferences_t prefs;
+
+		(void)memset(&prefs, 0, sizeof(prefs));
+		prefs.compressionLevel = codec->level;
+		return LZ4F_compressFrameBound(len, &prefs);
+	}
+#endif
+#if defined(HAVE_ZSTD)
+	case CODEC_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	default:
+		break;
+	}
+	return len;
+}
+
+/*
+ *  codec_worker_init()
+ *	create a worker's compression or decompression context
+ */
+static int codec_worker_init(const codec_t *const codec, codec_worker_t *const w)
+{
+	switch (codec->type->algo) {
+#if defined(HAVE_LZ4)
+	case CODEC_LZ4:
+		if (codec->type->decompress &&
+		    LZ4F_isError(LZ4F_createDecompressionContext(&w->dctx_lz4, LZ4F_VERSION)))
+			return -1;
+		return 0;
+#endif
+#if defined(HAVE_ZSTD)
+	case CODEC_ZSTD:
+		if (codec->type->decompress) {
+			w->dctx_zstd = ZSTD_createDStream();
+			return w->dctx_zstd ? 0 : -1;
+		}
+		w->cctx = ZSTD_createCCtx();
+		return w->cctx ? 0 : -1;
+#endif
+	default:
+		break;
+	}
+	(void)w;
+	return -1;
+}
+
+/*
+ *  codec_init()
+ *	create the -Z chunk pool, start the input reader and the
+ *	(de)compression workers; fdin < 0 compresses zeros (-z)
+ */
+static codec_t *codec_init(
+	const codec_type_t *const type,
+	const int level,
+	const size_t n_workers,
+	const int fdin,
+	const size_t io_size,
+	const uint64_t max_trans)
+{
+	codec_t *codec;
+	sigset_t set, old_set;
+	size_t i, out_size;
+
+	codec = calloc(1, sizeof(*codec));
+	if (!codec)
+		return NULL;
+	(void)pthread_mutex_init(&codec->lock, NULL);
+	(void)pthread_cond_init(&codec->cond_empty, NULL);
+	(void)pthread_cond_init(&codec->cond_read, NULL);
+	(void)pthread_cond_init(&codec->cond_done, NULL);
+	codec->type = type;
+	codec->level = level;
+	codec->fdin = fdin;
+	codec->max_trans = max_trans;
+	codec->skip_errors = (opt_flags & OPT_SKIP_READ_ERRORS) != 0;
+
+	/* Decompression is a single stream, so it cannot be split */
+	if (type->decompress)
+		codec->n_workers = 1;
+	else
+		codec->n_workers = n_workers;
+	codec->chunk_size = io_size;
+	codec->n_chunks = (2 * codec->n_workers) + 2;
+	out_size = type->decompress ? io_size * 4 : codec_bound(codec, io_size);
+
+	codec->chunks = calloc(codec->n_chunks, sizeof(*codec->chunks));
+	codec->workers = calloc(codec->n_workers, sizeof(*codec->workers));
+	if (!codec->chunks || !codec->workers)
+		goto err;
+	for (i = 0; i < codec->n_chunks; i++) {
+		codec->chunks[i].in = calloc(1, codec->chunk_size);
+		codec->chunks[i].out = malloc(out_size);
+		codec->chunks[i].out_size = out_size;
+		if (!codec->chunks[i].in || !codec->chunks[i].out)
+			goto err;
+	}
+	for (i = 0; i < codec->n_workers; i++) {
+		codec->workers[i].codec = codec;
+		if (codec_worker_init(codec, &codec->workers[i]) < 0)
+			goto err;
+	}
+
+	/* Signals are for the pacing thread, it has to see SIGINT */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	for (i = 0; i < codec->n_workers; i++) {
+		codec_worker_t *const w = &codec->workers[i];
+
+		if (pthread_create(&w->thread, NULL, codec_worker, w) != 0)
+			break;
+		w->started = true;
+	}
+	if ((i == codec->n_workers) &&
+	    (pthread_create(&codec->reader, NULL, codec_reader, codec) == 0))
+		codec->reader_started = true;
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (!codec->reader_started)
+		goto err;
+
+	return codec;
+err:
+	codec_free(codec);
+	return NULL;
+}
+
+/*
+ *  codec_get()
+ *	get up to len bytes of (de)compressed output in order, the
+ *	data remains valid until the next call. *in_bytes is the
+ *	input consumed to produce it. Returns 0 at the end of the
+ *	input and -1 on an error.
+ */
+static ssize_t codec_get(
+	codec_t *const codec,
+	char **const ptr,
+	const size_t len,
+	uint64_t *const in_bytes)
+{
+	codec_chunk_t *chunk;
+	size_t n, in_off;
+	struct timespec ts;
+	double t = mono_time();
+
+	*in_bytes = 0;
+	(void)pthread_mutex_lock(&codec->lock);
+	for (;;) {
+		chunk = &codec->chunks[codec->next_read % codec->n_chunks];
+		if (codec->failed) {
+			(void)pthread_mutex_unlock(&codec->lock);
+			(void)fprintf(stderr, "%s.\n", codec->error);
+			return -1;
+		}
+		if ((chunk->state == CODEC_DONE) && (chunk->seq == codec->next_read)) {
+			if (codec->read_off < chunk->out_len)
+				break;
+			/* Chunk fully written (or had no output), hand it back */
+			*in_bytes += chunk->in_len - codec->in_off;
+			chunk->state = CODEC_EMPTY;
+			codec->next_read++;
+			codec->read_off = 0;
+			codec->in_off = 0;
+			(void)pthread_cond_broadcast(&codec->cond_empty);
+			continue;
+		}
+		if ((codec->eof && (codec->next_read == codec->next_fill)) ||
+		    sluice_finish) {
+			(void)pthread_mutex_unlock(&codec->lock);
+			codec->wait_time += mono_time() - t;
+			return 0;
+		}
+		codec->waits++;
+		/* Wake up now and then to notice SIGINT */
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		(void)pthread_cond_timedwait(&codec->cond_done, &codec->lock, &ts);
+	}
+	(void)pthread_mutex_unlock(&codec->lock);
+	codec->wait_time += mono_time() - t;
+
+	n = chunk->out_len - codec->read_off;
+	if (n > len)
+		n = len;
+	*ptr = chunk->out + codec->read_off;
+	codec->read_off += n;
+	codec->out_bytes += n;
+
+	/* Account for the input in proportion to the output handed out */
+	in_off = (size_t)(((double)chunk->in_len * (double)codec->read_off) /
+			  (double)chunk->out_len);
+	*in_bytes += in_off - codec->in_off;
+	codec->in_off = in_off;
+
+	return (ssize_t)n;
+}
+
+/*
+ *  codec_stats_info()
+ *	display the -Z compression ratio and per stage throughput
+ */
+static void codec_stats_info(const codec_t *const codec)
+{
+	const double in = (double)codec->in_bytes, out = (double)codec->out_bytes;
+	const double uncompressed = codec->type->decompress ? out : in;
+	const double compressed = codec->type->decompress ? in : out;
+	char rate_str[32];
+	size_t i;
+
+	(void)fprintf(stderr, "\n%s stage (rate applied to %s):\n",
+		codec->type->name, codec->rate_in ? "input" : "output");
+	(void)fprintf(stderr, "  Input data:     %s\n", double_to_str(in));
+	(void)fprintf(stderr, "  Output data:    %s\n", double_to_str(out));
+	(void)fprintf(stderr, "  Ratio:          %.3f : 1\n",
+		compressed > 0.0 ? uncompressed / compressed : 0.0);
+	size_to_str(codec->read_time > 0.0 ? in / codec->read_time : 0.0,
+		"%.2f %s", rate_str, sizeof(rate_str));
+	(void)fprintf(stderr, "  Reader:         %s/s read rate\n", rate_str);
+	for (i = 0; i < codec->n_workers; i++) {
+		const codec_worker_t *const w = &codec->workers[i];
+
+		size_to_str(w->busy_time > 0.0 ? (double)w->bytes / w->busy_time : 0.0,
+			"%.2f %s", rate_str, sizeof(rate_str));
+		(void)fprintf(stderr, "  Worker %-3zu      %s in, %s/s\n",
+			i, double_to_str((double)w->bytes), rate_str);
+	}
+	(void)fprintf(stderr, "  Writer waits:   %" PRIu64 " (%s)\n",
+		codec->waits, secs_to_str(codec->wait_time));
+}
+
+/*
+ *  mono_time_ns()
+ *	monotonic time in nanoseconds, shared by all
+ *	processes so it can be used in the -g group segment
+ */
+static inline uint64_t mono_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ *  group_refill()
+ *	lock-free refill of the group token bucket, only the member
+ *	that wins the race to move last_ns on adds the new tokens
+ */
+static void group_refill(group_shm_t *const shm, const uint64_t now_ns)
+{
+	uint64_t last_ns = __atomic_load_n(&shm->last_ns, __ATOMIC_ACQUIRE);
+	const double rate = (double)__atomic_load_n(&shm->rate, __ATOMIC_RELAXED);
+	const int64_t burst = (int64_t)(rate * GROUP_BURST);
+	int64_t add, tokens;
+
+	if (now_ns <= last_ns)
+		return;
+	if (!__atomic_compare_exchange_n(&shm->last_ns, &last_ns, now_ns,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+
+	add = (int64_t)(rate * (double)(now_ns - last_ns) / 1000000000.0);
+	tokens = __atomic_add_fetch(&shm->tokens, add, __ATOMIC_ACQ_REL);
+	while (tokens > burst) {
+		if (__atomic_compare_exchange_n(&shm->tokens, &tokens, burst,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+/*
+ *  group_take()
+ *	take n bytes worth of tokens from the group bucket, returns
+ *	the delay in microseconds needed to pay off any debt
+ */
+static double group_take(group_t *const group, const uint64_t n)
+{
+	group_shm_t *const shm = group->shm;
+	const double rate = (double)__atomic_load_n(&shm->rate, __ATOMIC_RELAXED);
+	int64_t tokens;
+
+	group_refill(shm, mono_time_ns());
+	tokens = __atomic_sub_fetch(&shm->tokens, (int64_t)n, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&group->self->bytes, n, __ATOMIC_RELAXED);
+	if ((tokens >= 0) || (rate <= 0.0))
+		return 0.0;
+
+	return 1000000.0 * (double)-tokens / rate;
+}
+
+/*
+ *  group_member_alive()
+ *	is a group member slot owned by a live process? It may be
+ *	blocked and not heartbeating.
+ */
+static bool group_member_alive(const group_member_t *const m)
+{
+	const int32_t pid = __atomic_load_n(&m->pid, __ATOMIC_ACQUIRE);
+
+	if (!pid)
+		return false;
+	return !((kill((pid_t)pid, 0) < 0) && (errno == ESRCH));
+}
+
+/*
+ *  group_member_active()
+ *	is a group member slot in use by a live process?
+ */
+static bool group_member_active(
+	const group_member_t *const m,
+	const uint64_t now_ns)
+{
+	const uint64_t heartbeat = __atomic_load_n(&m->heartbeat, __ATOMIC_RELAXED);
+
+	if ((now_ns > heartbeat) &&
+	    ((double)(now_ns - heartbeat) > GROUP_HEARTBEAT_MAX * 1000000000.0))
+		return false;
+	return group_member_alive(m);
+}
+
+/*
+ *  group_shares()
+ *	compute the share of the group rate for all the active members.
+ *	Each member first gets its minimum rate (scaled down if the
+ *	minimums exceed the group rate), the remainder is shared by
+ *	weight, and members capped by their own -r rate hand their
+ *	unused share to the others (water filling).
+ */
+static void group_shares(
+	group_shm_t *const shm,
+	const uint64_t now_ns,
+	double *const shares)
+{
+	const double rate = (double)__atomic_load_n(&shm->rate, __ATOMIC_RELAXED);
+	bool active[GROUP_MEMBERS_MAX], open[GROUP_MEMBERS_MAX];
+	double min_rate[GROUP_MEMBERS_MAX], max_rate[GROUP_MEMBERS_MAX];
+	double sum_min = 0.0, remaining;
+	bool changed;
+	int i;
+
+	for (i = 0; i < GROUP_MEMBERS_MAX; i++) {
+		const group_member_t *const m = &shm->members[i];
+
+		shares[i] = 0.0;
+		active[i] = group_member_active(m, now_ns);
+		if (!active[i])
+			continue;
+		min_rate[i] = (double)__atomic_load_n(&m->min_rate, __ATOMIC_RELAXED);
+		max_rate[i] = (double)__atomic_load_n(&m->max_rate, __ATOMIC_RELAXED);
+		if ((max_rate[i] > 0.0) && (min_rate[i] > max_rate[i]))
+			min_rate[i] = max_rate[i];
+		sum_min += min_rate[i];
+	}
+
+	if (sum_min >= rate) {
+		for (i = 0; i < GROUP_MEMBERS_MAX; i++)
+			if (active[i] && (sum_min > 0.0))
+				shares[i] = rate * min_rate[i] / sum_min;
+		return;
+	}
+
+	remaining = rate - sum_min;
+	for (i = 0; i < GROUP_MEMBERS_MAX; i++) {
+		if (!active[i]) {
+			open[i] = false;
+			continue;
+		}
+		shares[i] = min_rate[i];
+		open[i] = (max_rate[i] <= 0.0) || (max_rate[i] > min_rate[i]);
+	}
+	do {
+		double weights = 0.0;
+
+		changed = false;
+		for (i = 0; i < GROUP_MEMBERS_MAX; i++)
+			if (open[i])
+				weights += (double)shm->members[i].weight;
+		if (weights <= 0.0)
+			break;
+		for (i = 0; i < GROUP_MEMBERS_MAX; i++) {
+			const double extra = remaining *
+				(double)shm->members[i].weight / weights;
+
+			if (open[i] && (max_rate[i] > 0.0) &&
+			    (shares[i] + extra >= max_rate[i])) {
+				remaining -= max_rate[i] - shares[i];
+				shares[i] = max_rate[i];
+				open[i] = false;
+				changed = true;
+			}
+		}
+		if (!changed) {
+			for (i = 0; i < GROUP_MEMBERS_MAX; i++)
+				if (open[i])
+					shares[i] += remaining *
+						(double)shm->members[i].weight / weights;
+		}
+	} while (changed);
+}
+
+/*
+ *  group_claim()
+ *	claim a free or stale member slot for pid, NULL if the
+ *	group is full
+ */
+static group_member_t *group_claim(
+	group_shm_t *const shm,
+	const group_t *const group,
+	const uint64_t now_ns)
+{
+	int i;
+
+	for (i = 0; i < GROUP_MEMBERS_MAX; i++) {
+		group_member_t *const m = &shm->members[i];
+		int32_t old_pid = __atomic_load_n(&m->pid, __ATOMIC_ACQUIRE);
+
+		if (old_pid && group_member_active(m, now_ns))
+			continue;
+		if (__atomic_compare_exchange_n(&m->pid, &old_pid, (int32_t)group->pid,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			m->weight = (uint32_t)(group->weight * 1000.0);
+			m->min_rate = (uint64_t)group->min_rate;
+			m->max_rate = (uint64_t)group->max_rate;
+			m->bytes = 0;
+			__atomic_store_n(&m->heartbeat, now_ns, __ATOMIC_RELEASE);
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *  group_heartbeat()
+ *	show this member is alive, called around reads and writes
+ *	that may block. A member silent for longer than
+ *	GROUP_HEARTBEAT_MAX can have its slot taken, if so claim
+ *	another one.
+ */
+static void group_heartbeat(group_t *const group)
+{
+	const uint64_t now_ns = mono_time_ns();
+
+	if (__atomic_load_n(&group->self->pid, __ATOMIC_ACQUIRE) != (int32_t)group->pid) {
+		group_member_t *const m = group_claim(group->shm, group, now_ns);
+
+		/* Group full, carry on at the last share */
+		if (!m)
+			return;
+		group->self = m;
+	}
+	__atomic_store_n(&group->self->heartbeat, now_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ *  group_update()
+ *	heartbeat and re-evaluate this member's share of the group
+ *	rate, returns the share in bytes per second
+ */
+static double group_update(group_t *const group)
+{
+	uint64_t now_ns;
+	double shares[GROUP_MEMBERS_MAX];
+	int self;
+
+	group_heartbeat(group);
+	now_ns = mono_time_ns();
+	self = (int)(group->self - group->shm->members);
+	group_shares(group->shm, now_ns, shares);
+	__atomic_store_n(&group->self->share, (uint64_t)shares[self], __ATOMIC_RELAXED);
+
+	return shares[self] < DATA_RATE_MIN ? DATA_RATE_MIN : shares[self];
+}
+
+/*
+ *  group_open()
+ *	open and lock the -g rate group segment, retrying if the last
+ *	member unlinked it while we waited for the lock
+ */
+static int group_open(const char *const path, const int flags)
+{
+	for (;;) {
+		struct stat fd_stat, path_stat;
+		const int fd = open(path, flags, S_IRUSR | S_IWUSR);
+
+		if (fd < 0)
+			return -1;
+		(void)flock(fd, LOCK_EX);
+		if ((fstat(fd, &fd_stat) == 0) && (stat(path, &path_stat) == 0) &&
+		    (fd_stat.st_dev == path_stat.st_dev) &&
+		    (fd_stat.st_ino == path_stat.st_ino))
+			return fd;
+		(void)flock(fd, LOCK_UN);
+		(void)close(fd);
+		if (!(flags & O_CREAT)) {
+			errno = ENOENT;
+			return -1;
+		}
+	}
+}
+
+/*
+ *  group_join()
+ *	join the named -g rate group, creating it if necessary. The
+ *	file lock is only held while joining and leaving, the token
+ *	bucket and member state are updated lock-free. A group with
+ *	no active members takes on the new rate.
+ */
+static group_t *group_join(
+	const char *const name,
+	const double rate,
+	const double weight,
+	const double min_rate,
+	const double max_rate)
+{
+	group_t *group;
+	group_shm_t *shm;
+	struct stat statbuf;
+	int fd, i;
+	bool active = false;
+	const uint64_t now_ns = mono_time_ns();
+
+	group = calloc(1, sizeof(*group));
+	if (!group) {
+		(void)fprintf(stderr, "Cannot allocate rate group.\n");
+		return NULL;
+	}
+	group->name = name;
+	group->pid = getpid();
+	group->weight = weight;
+	group->min_rate = min_rate;
+	group->max_rate = max_rate;
+	(void)snprintf(group->path, sizeof(group->path), "%s/%s%s",
+		SLUICE_SHM_DIR, GROUP_SHM_PREFIX, name);
+
+	fd = group_open(group->path, O_CREAT | O_RDWR);
+	if (fd < 0) {
+		(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+			group->path, errno, strerror(errno));
+		free(group);
+		return NULL;
+	}
+	if ((fstat(fd, &statbuf) < 0) ||
+	    ((statbuf.st_size == 0) &&
+	     (ftruncate(fd, (off_t)sizeof(*shm)) < 0))) {
+		(void)fprintf(stderr, "Cannot size rate group %s: errno = %d (%s).\n",
+			group->path, errno, strerror(errno));
+		goto err_close;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		(void)fprintf(stderr, "mmap on %s failed: errno = %d (%s).\n",
+			group->path, errno, strerror(errno));
+		goto err_close;
+	}
+	if (shm->magic == GROUP_MAGIC) {
+		for (i = 0; i < GROUP_MEMBERS_MAX; i++)
+			active |= group_member_alive(&shm->members[i]);
+	}
+	/* A new group, or one left behind by members that died */
+	if ((shm->magic != GROUP_MAGIC) ||
+	    ((shm->version == GROUP_VERSION) && !active)) {
+		(void)memset(shm, 0, sizeof(*shm));
+		shm->version = GROUP_VERSION;
+		shm->rate = (uint64_t)rate;
+		shm->tokens = (int64_t)(rate * GROUP_BURST);
+		shm->last_ns = now_ns;
+		__atomic_store_n(&shm->magic, GROUP_MAGIC, __ATOMIC_RELEASE);
+	} else if (shm->version != GROUP_VERSION) {
+		(void)fprintf(stderr, "Rate group %s has an incompatible version.\n",
+			group->path);
+		goto err_unmap;
+	} else if (shm->rate != (uint64_t)rate) {
+		(void)fprintf(stderr, "Warning: rate group %s already has a rate of %s/s, "
+			"using that rate.\n", name, double_to_str((double)shm->rate));
+	}
+
+	group->self = group_claim(shm, group, now_ns);
+	if (!group->self) {
+		(void)fprintf(stderr, "Rate group %s is full, maximum of %d members.\n",
+			name, GROUP_MEMBERS_MAX);
+		goto err_unmap;
+	}
+	group->shm = shm;
+	group->dev = statbuf.st_dev;
+	group->ino = statbuf.st_ino;
+	(void)flock(fd, LOCK_UN);
+	(void)close(fd);
+
+	return group;
+
+err_unmap:
+	(void)munmap((void *)shm, sizeof(*shm));
+err_close:
+	(void)flock(fd, LOCK_UN);
+	(void)close(fd);
+	free(group);
+	return NULL;
+}
+
+/*
+ *  group_leave()
+ *	give up this member's slot in the rate group, unless it was
+ *	taken over while we were silent, and remove the group segment
+ *	if we were the last active member
+ */
+static void group_leave(group_t *const group)
+{
+	int32_t pid;
+	int fd, i;
+	bool active = false;
+
+	if (!group)
+		return;
+	pid = (int32_t)group->pid;
+	(void)__atomic_compare_exchange_n(&group->self->pid, &pid, 0,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+	fd = group_open(group->path, O_RDWR);
+	if (fd >= 0) {
+		struct stat statbuf;
+
+		for (i = 0; i < GROUP_MEMBERS_MAX; i++)
+			active |= group_member_alive(&group->shm->members[i]);
+		/* Only remove the segment we are attached to */
+		if (!active && (fstat(fd, &statbuf) == 0) &&
+		    (statbuf.st_dev == group->dev) && (statbuf.st_ino == group->ino))
+			(void)unlink(group->path);
+		(void)flock(fd, LOCK_UN);
+		(void)close(fd);
+	}
+	(void)munmap((void *)group->shm, sizeof(*group->shm));
+	free(group);
+}
+
+/*
+ *  group_stats_info()
+ *	display the -g rate group state
+ */
+static void group_stats_info(group_t *const group)
+{
+	group_shm_t *const shm = group->shm;
+	const uint64_t now_ns = mono_time_ns();
+	int i;
+
+	(void)fprintf(stderr, "\nRate group:       %s\n", group->name);
+	(void)fprintf(stderr, "Group rate:       %s/s\n",
+		double_to_str((double)__atomic_load_n(&shm->rate, __ATOMIC_RELAXED)));
+	(void)fprintf(stderr, "Group tokens:     %" PRId64 "\n",
+		__atomic_load_n(&shm->tokens, __ATOMIC_RELAXED));
+	(void)fprintf(stderr, "  %-8s %8s %12s %12s %12s\n",
+		"PID", "Weight", "Min/S", "Share/S", "Data");
+	for (i = 0; i < GROUP_MEMBERS_MAX; i++) {
+		const group_member_t *const m = &shm->members[i];
+		char min_str[32], share_str[32], data_str[32];
+
+		if (!group_member_active(m, now_ns))
+			continue;
+		size_to_str((double)m->min_rate, "%7.1f %s", min_str, sizeof(min_str));
+		size_to_str((double)__atomic_load_n(&m->share, __ATOMIC_RELAXED),
+			"%7.1f %s", share_str, sizeof(share_str));
+		size_to_str((double)__atomic_load_n(&m->bytes, __ATOMIC_RELAXED),
+			"%7.1f %s", data_str, sizeof(data_str));
+		(void)fprintf(stderr, "  %-8" PRId32 " %8.3f %12s %12s %12s%s\n",
+			m->pid, (double)m->weight / 1000.0,
+			min_str, share_str, data_str,
+			m == group->self ? " (self)" : "");
+	}
+}
+
+/*
+ *  parse_cpu_list()
+ *	parse a cpu list such as 0-3,6,8 into a cpu set
+ */
+static int parse_cpu_list(char *const str, cpu_set_t *const set)
+{
+	char *saveptr = NULL, *tok;
+
+	CPU_ZERO(set);
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		char *end;
+		long lo, hi;
+
+		errno = 0;
+		lo = strtol(tok, &end, 10);
+		hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if (errno || (end == tok) || *end || (lo < 0) ||
+		    (hi < lo) || (hi >= CPU_SETSIZE))
+			return -1;
+		for (; lo <= hi; lo++)
+			CPU_SET((int)lo, set);
+	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+/*
+ *  parse_sched()
+ *	parse a -Y scheduling policy[,priority]
+ */
+static int parse_sched(char *const str, int *const policy, int *const priority)
+{
+	char *saveptr = NULL;
+	const char *name = strtok_r(str, ",", &saveptr);
+	const char *prio = strtok_r(NULL, ",", &saveptr);
+
+	if (!name)
+		return -1;
+	if (!strcmp(name, "fifo"))
+		*policy = SCHED_FIFO;
+	else if (!strcmp(name, "rr"))
+		*policy = SCHED_RR;
+	else if (!strcmp(name, "other"))
+		*policy = SCHED_OTHER;
+	else
+		return -1;
+
+	if (*policy == SCHED_OTHER) {
+		*priority = 0;
+	} else if (prio) {
+		*priority = atoi(prio);
+		if ((*priority < sched_get_priority_min(*policy)) ||
+		    (*priority > sched_get_priority_max(*policy)))
+			return -1;
+	} else {
+		*priority = (sched_get_priority_min(*policy) +
+			     sched_get_priority_max(*policy)) / 2;
+	}
+	return 0;
+}
+
+/*
+ *  set_mempolicy_local()
+ *	prefer memory on the node of the CPU doing the allocation,
+ *	so that buffers first touched by the pinned pacing thread
+ *	are NUMA local
+ */
+static void set_mempolicy_local(void)
+{
+#if defined(__NR_set_mempolicy)
+	(void)syscall(__NR_set_mempolicy, MPOL_LOCAL, NULL, 0);
+#endif
+}
+
+/*
+ *  sched_counters()
+ *	get the pacing thread's context switch counts and the
+ *	CPU migrations counted since the counter was opened,
+ *	returns false if the context switch counts are unavailable
+ */
+static bool sched_counters(
+	const int fd_migrations,
+	uint64_t *const nvcsw,
+	uint64_t *const nivcsw,
+	int64_t *const migrations)
+{
+	struct rusage usage;
+	uint64_t count;
+	bool ok = false;
+
+#if defined(RUSAGE_THREAD)
+	if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+#else
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#endif
+		*nvcsw = (uint64_t)usage.ru_nvcsw;
+		*nivcsw = (uint64_t)usage.ru_nivcsw;
+		ok = true;
+	}
+	if ((fd_migrations >= 0) &&
+	    (read(fd_migrations, &count, sizeof(count)) == sizeof(count)))
+		*migrations = (int64_t)count;
+	else
+		*migrations = -1;
+	return ok;
+}
+
+/*
+ *  open_migrations_counter()
+ *	open a perf software counter of the pacing thread's CPU
+ *	migrations, returns -1 if perf events are not available
+ */
+static int open_migrations_counter(void)
+{
+#if defined(__NR_perf_event_open)
+	struct perf_event_attr attr;
+
+	(void)memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.size = sizeof(attr);
+	/* Migrations happen in the kernel, so do not exclude it */
+	attr.config = PERF_COUNT_SW_CPU_MIGRATIONS;
+
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+/*
+ *  sock_is_spec()
+ *	is a -I, -O or -t name a socket endpoint?
+ */
+static bool sock_is_spec(const char *const name)
+{
+	size_t i;
+
+	for (i = 0; i < SIZEOF_ARRAY(sock_types); i++) {
+		if (!strncmp(name, sock_types[i].prefix, strlen(sock_types[i].prefix)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ *  sock_is_dgram()
+ *	is a -I, -O or -t name a datagram socket endpoint?
+ */
+static bool sock_is_dgram(const char *const name)
+{
+	size_t i;
+
+	for (i = 0; i < SIZEOF_ARRAY(sock_types); i++) {
+		if (!strncmp(name, sock_types[i].prefix, strlen(sock_types[i].prefix)))
+			return sock_types[i].type == SOCK_DGRAM;
+	}
+	return false;
+}
+
+/*
+ *  sock_addr()
+ *	parse a socket endpoint into an address, returns the socket
+ *	type index or -1 on error
+ */
+static int sock_addr(
+	const char *const spec,
+	struct sockaddr_storage *const addr,
+	socklen_t *const addr_len)
+{
+	size_t i;
+
+	for (i = 0; i < SIZEOF_ARRAY(sock_types); i++) {
+		const char *const arg = spec + strlen(sock_types[i].prefix);
+		char host[256], *port;
+		struct addrinfo hints, *res;
+		int ret;
+
+		if (strncmp(spec, sock_types[i].prefix, strlen(sock_types[i].prefix)))
+			continue;
+
+		(void)memset(addr, 0, sizeof(*addr));
+		if (sock_types[i].domain == AF_UNIX) {
+			struct sockaddr_un *const un = (struct sockaddr_un *)addr;
+
+			if (!*arg || (strlen(arg) >= sizeof(un->sun_path)))
+				break;
+			un->sun_family = AF_UNIX;
+			(void)snprintf(un->sun_path, sizeof(un->sun_path), "%s", arg);
+			*addr_len = sizeof(*un);
+			return (int)i;
+		}
+
+		/* [host:]port, host can be a [bracketed] IPv6 address */
+		(void)snprintf(host, sizeof(host), "%s", arg);
+		port = strrchr(host, ':');
+		if (port) {
+			*port++ = '\0';
+		} else {
+			port = host;
+			(void)memmove(host + 1, host, strlen(host) + 1);
+			port++;
+			*host = '\0';
+		}
+		if ((*host == '[') && (host[strlen(host) - 1] == ']')) {
+			host[strlen(host) - 1] = '\0';
+			(void)memmove(host, host + 1, strlen(host));
+		}
+		if (!*port || (!*host && !sock_types[i].listen))
+			break;
+
+		(void)memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = sock_types[i].type;
+		hints.ai_flags = sock_types[i].listen ? AI_PASSIVE : 0;
+		ret = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+		if (ret) {
+			(void)fprintf(stderr, "Cannot resolve %s: %s.\n",
+				spec, gai_strerror(ret));
+			return -1;
+		}
+		(void)memcpy(addr, res->ai_addr, res->ai_addrlen);
+		*addr_len = res->ai_addrlen;
+		freeaddrinfo(res);
+		return (int)i;
+	}
+	(void)fprintf(stderr, "Invalid socket address %s.\n", spec);
+	return -1;
+}
+
+/*
+ *  sock_unlink()
+ *	remove a stale Unix domain socket, returns -1 and sets errno
+ *	to EEXIST if path is something other than a socket
+ */
+static int sock_unlink(const char *const path)
+{
+	struct stat buf;
+
+	if (lstat(path, &buf) < 0)
+		return 0;
+	if (!S_ISSOCK(buf.st_mode)) {
+		errno = EEXIST;
+		return -1;
+	}
+	(void)unlink(path);
+	return 0;
+}
+
+/*
+ *  sock_open()
+ *	open a socket endpoint. Connecting endpoints return the
+ *	connected socket, listening endpoints return the listening
+ *	socket and set *listening. Listening datagram endpoints are
+ *	just bound, there is nothing to accept.
+ */
+static int sock_open(const char *const spec, bool *const listening)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = 0;
+	int type, fd;
+	const int one = 1;
+
+	type = sock_addr(spec, &addr, &addr_len);
+	if (type < 0)
+		return -1;
+	*listening = sock_types[type].listen;
+
+	fd = socket(addr.ss_family, sock_types[type].type | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		(void)fprintf(stderr, "socket failed: errno=%d (%s).\n",
+			errno, strerror(errno));
+		return -1;
+	}
+	if (*listening) {
+		if ((addr.ss_family == AF_UNIX) &&
+		    (sock_unlink(((struct sockaddr_un *)&addr)->sun_path) < 0)) {
+			(void)fprintf(stderr, "Cannot listen on %s: it is not a socket.\n",
+				spec);
+			(void)close(fd);
+			errno = EEXIST;
+			return -1;
+		}
+		if (addr.ss_family != AF_UNIX)
+			(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ((bind(fd, (struct sockaddr *)&addr, addr_len) < 0) ||
+		    ((sock_types[type].type == SOCK_STREAM) &&
+		     (listen(fd, SOCK_LISTEN_BACKLOG) < 0))) {
+			(void)fprintf(stderr, "Cannot listen on %s: errno=%d (%s).\n",
+				spec, errno, strerror(errno));
+			(void)close(fd);
+			return -1;
+		}
+	} else {
+		if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+			(void)fprintf(stderr, "Cannot connect to %s: errno=%d (%s).\n",
+				spec, errno, strerror(errno));
+			(void)close(fd);
+			return -1;
+		}
+	}
+	if ((addr.ss_family != AF_UNIX) && (sock_types[type].type == SOCK_STREAM))
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+ *  sock_accept()
+ *	accept a client, blocking until one connects
+ */
+static int sock_accept(const int listen_fd, const char *const spec)
+{
+	int fd;
+
+	for (;;) {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+		if ((errno == EINTR) && !sluice_finish)
+			continue;
+		(void)fprintf(stderr, "accept on %s failed: errno=%d (%s).\n",
+			spec, errno, strerror(errno));
+		return -1;
+	}
+}
+
+/*
+ *  sock_input_open()
+ *	open a -I socket endpoint for reading, a listening endpoint
+ *	reads from the first client to connect
+ */
+static int sock_input_open(const char *const spec)
+{
+	bool listening;
+	int fd, client;
+
+	fd = sock_open(spec, &listening);
+	if ((fd < 0) || !listening)
+		return fd;
+	client = sock_accept(fd, spec);
+	(void)close(fd);
+	if (!strncmp(spec, "unix-listen:", 12))
+		(void)sock_unlink(spec + 12);
+	return client;
+}
+
+/*
+ *  sock_server_add()
+ *	add a newly connected client to a -O/-t fan-out server
+ */
+static int sock_server_add(sock_server_t *const server, const int fd)
+{
+	sock_client_t *client;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if (server->n_clients >= server->max_clients) {
+		const size_t max = server->max_clients ? server->max_clients * 2 : 8;
+		sock_client_t *tmp;
+
+		tmp = realloc(server->clients, max * sizeof(*tmp));
+		if (!tmp) {
+			(void)close(fd);
+			return -1;
+		}
+		server->clients = tmp;
+		server->max_clients = max;
+	}
+	client = &server->clients[server->n_clients++];
+	(void)memset(client, 0, sizeof(*client));
+	client->fd = fd;
+	client->id = ++server->clients_total;
+	(void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if ((getpeername(fd, (struct sockaddr *)&addr, &addr_len) == 0) &&
+	    (addr.ss_family != AF_UNIX)) {
+		char host[INET6_ADDRSTRLEN], port[16];
+
+		if (getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host),
+				port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+			(void)snprintf(client->name, sizeof(client->name), "%s:%s", host, port);
+	}
+	if (!*client->name)
+		(void)snprintf(client->name, sizeof(client->name), "client %" PRIu64, client->id);
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	if (server->zerocopy && (addr.ss_family != AF_UNIX)) {
+		const int one = 1;
+
+		client->zerocopy = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+	}
+#endif
+	return 0;
+}
+
+/*
+ *  sock_server_open()
+ *	open a -O/-t fan-out server and wait for the first client
+ */
+static sock_server_t *sock_server_open(
+	const char *const spec,
+	const int listen_fd,
+	const bool zerocopy)
+{
+	sock_server_t *server;
+	int fd;
+
+	server = calloc(1, sizeof(*server));
+	if (!server) {
+		(void)fprintf(stderr, "Cannot allocate socket server.\n");
+		(void)close(listen_fd);
+		return NULL;
+	}
+	server->listen_fd = listen_fd;
+	server->spec = spec;
+	server->zerocopy = zerocopy;
+
+	fd = sock_accept(listen_fd, spec);
+	if ((fd < 0) || (sock_server_add(server, fd) < 0)) {
+		(void)close(listen_fd);
+		free(server);
+		return NULL;
+	}
+	(void)fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	return server;
+}
+
+/*
+ *  sock_client_close()
+ *	close a client, its statistics are kept for -S
+ */
+static void sock_client_close(sock_client_t *const client)
+{
+	(void)close(client->fd);
+	client->fd = -1;
+	free(client->backlog);
+	client->backlog = NULL;
+	client->backlog_len = 0;
+}
+
+/*
+ *  sock_client_reap_zerocopy()
+ *	reap MSG_ZEROCOPY completion notifications
+ */
+static void sock_client_reap_zerocopy(sock_client_t *const client)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	while (client->zc_pending) {
+		char control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+		const struct sock_extended_err *err;
+
+		(void)memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(client->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			return;
+		err = (const struct sock_extended_err *)CMSG_DATA(cm);
+		if ((err->ee_errno != 0) || (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+			continue;
+		client->zc_pending -= (uint64_t)(err->ee_data - err->ee_info + 1);
+	}
+#else
+	(void)client;
+#endif
+}
+
+/*
+ *  sock_client_send()
+ *	non-blocking send to a client, returns bytes sent or
+ *	-1 if the client has gone away
+ */
+static ssize_t sock_client_send(
+	sock_client_t *const client,
+	const char *const data,
+	const size_t len,
+	const bool stable)
+{
+	ssize_t n;
+	int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	/* Zero copy only pays off for larger sends of unchanging data */
+	if (client->zerocopy && stable && (len >= SOCK_ZEROCOPY_MIN))
+		flags |= MSG_ZEROCOPY;
+#else
+	(void)stable;
+#endif
+	n = send(client->fd, data, len, flags);
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	if ((n < 0) && (errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+		/* Out of optmem for notifications, fall back to a copy */
+		sock_client_reap_zerocopy(client);
+		n = send(client->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} else if ((n > 0) && (flags & MSG_ZEROCOPY)) {
+		client->zc_pending++;
+		client->zc_sends++;
+	}
+#endif
+	if (n < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return 0;
+		return -1;
+	}
+	return n;
+}
+
+/*
+ *  sock_server_write()
+ *	send a chunk to all the clients of a fan-out server. Data a
+ *	client cannot take straight away is queued in its backlog and
+ *	is dropped (and counted) if the backlog is full. New clients
+ *	join the stream from the next chunk.
+ */
+static void sock_server_write(
+	sock_server_t *const server,
+	const char *const data,
+	const size_t len,
+	const bool stable)
+{
+	size_t i;
+	int fd;
+
+	while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+		(void)sock_server_add(server, fd);
+
+	for (i = 0; i < server->n_clients; i++) {
+		sock_client_t *const client = &server->clients[i];
+		size_t off = 0;
+		ssize_t n;
+
+		if (client->fd < 0)
+			continue;
+		sock_client_reap_zerocopy(client);
+
+		/* Older data first */
+		if (client->backlog_len) {
+			n = sock_client_send(client, client->backlog, client->backlog_len, false);
+			if (n < 0) {
+				sock_client_close(client);
+				continue;
+			}
+			client->bytes += (uint64_t)n;
+			client->backlog_len -= (size_t)n;
+			(void)memmove(client->backlog, client->backlog + n, client->backlog_len);
+		}
+		if (!client->backlog_len) {
+			n = sock_client_send(client, data, len, stable);
+			if (n < 0) {
+				sock_client_close(client);
+				continue;
+			}
+			client->bytes += (uint64_t)n;
+			off = (size_t)n;
+		}
+		if (off < len) {
+			const size_t left = len - off;
+
+			if (client->backlog_len + left > SOCK_BACKLOG_MAX) {
+				client->dropped += left;
+				continue;
+			}
+			if (!client->backlog) {
+				client->backlog = malloc(SOCK_BACKLOG_MAX);
+				if (!client->backlog) {
+					client->dropped += left;
+					continue;
+				}
+			}
+			(void)memcpy(client->backlog + client->backlog_len, data + off, left);
+			client->backlog_len += left;
+			if (client->backlog_len > client->backlog_peak)
+				client->backlog_peak = client->backlog_len;
+		}
+	}
+
+}
+
+/*
+ *  sock_server_close()
+ *	flush any backlogs, close the clients and the server
+ */
+static void sock_server_close(sock_server_t *const server)
+{
+	size_t i;
+
+	if (!server)
+		return;
+	for (i = 0; i < server->n_clients; i++) {
+		sock_client_t *const client = &server->clients[i];
+		size_t off = 0;
+
+		if (client->fd < 0)
+			continue;
+		(void)fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) & ~O_NONBLOCK);
+		while (off < client->backlog_len) {
+			const ssize_t n = send(client->fd, client->backlog + off,
+				client->backlog_len - off, MSG_NOSIGNAL);
+
+			if (n <= 0)
+				break;
+			off += (size_t)n;
+			client->bytes += (uint64_t)n;
+		}
+		sock_client_close(client);
+	}
+	(void)close(server->listen_fd);
+	if (!strncmp(server->spec, "unix-listen:", 12))
+		(void)sock_unlink(server->spec + 12);
+	free(server->clients);
+	free(server);
+}
+
+/*
+ *  sock_server_stats_info()
+ *	display the per client statistics of a fan-out server
+ */
+static void sock_server_stats_info(const sock_server_t *const server)
+{
+	size_t i;
+
+	(void)fprintf(stderr, "\nSocket clients:   %" PRIu64 " (%s)\n",
+		server->clients_total, server->spec);
+	(void)fprintf(stderr, "  %-24s %12s %12s %12s %10s\n",
+		"Client", "Sent", "Dropped", "Max backlog", "Zerocopy");
+	for (i = 0; i < server->n_clients; i++) {
+		const sock_client_t *const client = &server->clients[i];
+		char sent_str[32], dropped_str[32], backlog_str[32];
+
+		size_to_str((double)client->bytes, "%7.1f %s", sent_str, sizeof(sent_str));
+		size_to_str((double)client->dropped, "%7.1f %s", dropped_str, sizeof(dropped_str));
+		size_to_str((double)client->backlog_peak, "%7.1f %s", backlog_str, sizeof(backlog_str));
+		(void)fprintf(stderr, "  %-24.24s %12s %12s %12s %10" PRIu64 "\n",
+			client->name, sent_str, dropped_str, backlog_str,
+			client->zc_sends);
+	}
+}
+
+/*
+ *  dgram_fill()
+ *	fill the payloads of up to n_pkts datagrams from the input,
+ *	returns the number of datagrams filled, the last one may be
+ *	short at the end of the input
+ */
+static size_t dgram_fill(
+	dgram_t *const dg,
+	const int fdin,
+	const size_t n_pkts,
+	size_t *const last_len,
+	bool *const eof)
+{
+	const size_t payload = dg->size - sizeof(dgram_hdr_t);
+	size_t want = n_pkts * payload, got = 0, i;
+
+	if (dg->max_trans) {
+		const uint64_t left = dg->max_trans - dg->payload_bytes;
+
+		if (want >= left) {
+			want = (size_t)left;
+			*eof = true;
+		}
+	}
+
+	if (opt_flags & OPT_ZERO) {
+		/* Payloads are zeroed on allocation and never change */
+		got = want;
+	} else {
+		while (got < want) {
+			const ssize_t n = read(fdin, dg->staging + got, want - got);
+
+			if (n < 0) {
+				if ((errno == EINTR) && !sluice_finish)
+					continue;
+				if ((errno != EINTR) && (opt_flags & OPT_SKIP_READ_ERRORS)) {
+					(void)memset(dg->staging + got, 0, want - got);
+					got = want;
+					break;
+				}
+				if (errno != EINTR)
+					(void)fprintf(stderr, "read error: errno=%d (%s).\n",
+						errno, strerror(errno));
+				*eof = true;
+				break;
+			}
+			if (n == 0) {
+				*eof = true;
+				break;
+			}
+			got += (size_t)n;
+		}
+		for (i = 0; i * payload < got; i++) {
+			const size_t len = (got - i * payload) < payload ?
+				(got - i * payload) : payload;
+
+			(void)memcpy(dg->buffer + (i * dg->size) + sizeof(dgram_hdr_t),
+				dg->staging + (i * payload), len);
+		}
+	}
+	dg->payload_bytes += got;
+	*last_len = (got % payload) ? (got % payload) : payload;
+
+	return (got + payload - 1) / payload;
+}
+
+/*
+ *  dgram_send_batch()
+ *	send n_pkts datagrams from the buffer with one sendmmsg, each
+ *	message covers up to gso_segs datagrams when UDP GSO is on
+ */
+static int dgram_send_batch(
+	dgram_t *const dg,
+	const size_t n_pkts,
+	const size_t last_len)
+{
+	const size_t segs = dg->gso_segs ? dg->gso_segs : 1;
+	size_t n_msgs = 0, pkt, sent = 0;
+
+	for (pkt = 0; pkt < n_pkts; pkt += segs) {
+		const size_t n = (n_pkts - pkt) < segs ? (n_pkts - pkt) : segs;
+		struct iovec *const iov = &dg->iov[n_msgs];
+
+		iov->iov_base = dg->buffer + (pkt * dg->size);
+		iov->iov_len = n * dg->size;
+		if (pkt + n == n_pkts)
+			iov->iov_len -= (dg->size - sizeof(dgram_hdr_t)) - last_len;
+		(void)memset(&dg->msgs[n_msgs], 0, sizeof(dg->msgs[n_msgs]));
+		dg->msgs[n_msgs].msg_hdr.msg_iov = iov;
+		dg->msgs[n_msgs].msg_hdr.msg_iovlen = 1;
+		n_msgs++;
+	}
+
+	while (sent < n_msgs) {
+		const int n = sendmmsg(dg->fd, dg->msgs + sent, (unsigned int)(n_msgs - sent), 0);
+
+		dg->syscalls++;
+		if (n < 0) {
+			if (errno == EINTR) {
+				if (sluice_finish)
+					return 0;
+				continue;
+			}
+			/*
+			 *  No receiver on a connected socket, an earlier send
+			 *  got a port unreachable. Reporting it clears the error,
+			 *  so count it and send this batch again.
+			 */
+			if (errno == ECONNREFUSED) {
+				dg->send_errors++;
+				continue;
+			}
+#if defined(UDP_SEGMENT)
+			if (dg->gso_segs && ((errno == EIO) || (errno == EINVAL))) {
+				/* GSO not supported by the device, fall back */
+				const int zero = 0;
+
+				(void)setsockopt(dg->fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+				dg->gso_segs = 0;
+				return dgram_send_batch(dg, n_pkts, last_len);
+			}
+#endif
+			(void)fprintf(stderr, "sendmmsg error: errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1;
+		}
+		sent += (size_t)n;
+	}
+	dg->packets += n_pkts;
+	dg->batches++;
+
+	return 0;
+}
+
+/*
+ *  dgram_send_end()
+ *	tell the receiver the stream has ended and how many
+ *	datagrams were sent so it can count any trailing loss
+ */
+static void dgram_send_end(dgram_t *const dg)
+{
+	dgram_hdr_t hdr;
+	int i;
+
+	hdr.magic = htonl(DGRAM_MAGIC);
+	hdr.flags = htons(DGRAM_FLAG_END);
+	hdr.len = 0;
+	hdr.seq = htobe64(dg->seq);
+	for (i = 0; i < DGRAM_END_REPEAT; i++)
+		(void)send(dg->fd, &hdr, sizeof(hdr), 0);
+}
+
+/*
+ *  dgram_send_run()
+ *	-O udp: datagram output. Input is sliced into -U size
+ *	datagrams, each starting with a sequence number header, and
+ *	sent in batches with sendmmsg. Batches are paced in packets
+ *	per second, each batch is sent at its own absolute deadline.
+ */
+static int dgram_send_run(
+	const int fd,
+	const int fdin,
+	const size_t size,
+	const double data_rate,
+	const uint64_t max_trans,
+	const uint64_t timed_run)
+{
+	dgram_t dg;
+	const double pps = data_rate / (double)size;
+	size_t batch_pkts, i;
+	double secs_start, time_end;
+	bool eof = false;
+	int ret = EXIT_SUCCESS;
+
+	(void)memset(&dg, 0, sizeof(dg));
+	dg.fd = fd;
+	dg.size = size;
+	dg.max_trans = max_trans;
+
+	/* Batch up to DGRAM_BATCH_TIME worth of datagrams per syscall */
+	if (opt_flags & OPT_NO_RATE_CONTROL) {
+		batch_pkts = DGRAM_BATCH_MAX;
+	} else {
+		batch_pkts = (size_t)(pps * DGRAM_BATCH_TIME);
+		if (batch_pkts < 1)
+			batch_pkts = 1;
+		if (batch_pkts > DGRAM_BATCH_MAX)
+			batch_pkts = DGRAM_BATCH_MAX;
+	}
+
+#if defined(UDP_SEGMENT)
+	{
+		const int gso_size = (int)size;
+
+		if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0) {
+			dg.gso_segs = DGRAM_GSO_BYTES_MAX / size;
+			if (dg.gso_segs > DGRAM_GSO_SEGS_MAX)
+				dg.gso_segs = DGRAM_GSO_SEGS_MAX;
+			if (dg.gso_segs < 2) {
+				const int zero = 0;
+
+				(void)setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+				dg.gso_segs = 0;
+			}
+		}
+	}
+#endif
+
+	dg.buffer = calloc(batch_pkts, size);
+	dg.staging = malloc(batch_pkts * size);
+	dg.iov = calloc(batch_pkts, sizeof(*dg.iov));
+	dg.msgs = calloc(batch_pkts, sizeof(*dg.msgs));
+	if (!dg.buffer || !dg.staging || !dg.iov || !dg.msgs) {
+		(void)fprintf(stderr, "Cannot allocate datagram buffers.\n");
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+
+	secs_start = mono_time();
+	dg.time_begin = timeval_to_double();
+
+	while (!eof && !sluice_finish) {
+		size_t last_len, n_pkts;
+		double deadline, late;
+
+		n_pkts = dgram_fill(&dg, fdin, batch_pkts, &last_len, &eof);
+		if (!n_pkts)
+			break;
+		for (i = 0; i < n_pkts; i++) {
+			dgram_hdr_t hdr;
+
+			/* Datagrams are not 8 byte aligned, so copy the header in */
+			hdr.magic = htonl(DGRAM_MAGIC);
+			hdr.flags = 0;
+			hdr.len = htons((uint16_t)((i == n_pkts - 1) ?
+				last_len : size - sizeof(dgram_hdr_t)));
+			hdr.seq = htobe64(dg.seq + i);
+			(void)memcpy(dg.buffer + (i * size), &hdr, sizeof(hdr));
+		}
+
+		if (!(opt_flags & OPT_NO_RATE_CONTROL)) {
+			/* This batch is due when its first datagram is due */
+			struct timespec ts;
+
+			deadline = secs_start + ((double)dg.seq / pps);
+			ts.tv_sec = (time_t)deadline;
+			ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1000000000.0);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+				if (sluice_finish)
+					goto finish;
+			}
+			late = mono_time() - deadline;
+			if (late > dg.late_max)
+				dg.late_max = late;
+			dg.late_total += late;
+		}
+		if (dgram_send_batch(&dg, n_pkts, last_len) < 0) {
+			ret = EXIT_WRITE_ERROR;
+			goto tidy;
+		}
+		dg.seq += n_pkts;
+
+		if ((opt_flags & OPT_TIMED_RUN) &&
+		    ((mono_time() - secs_start) > timed_run))
+			break;
+	}
+finish:
+	dgram_send_end(&dg);
+	time_end = timeval_to_double();
+
+	if (opt_flags & OPT_STATS) {
+		const double secs = time_end - dg.time_begin;
+
+		if (secs <= 0.0) {
+			(void)fprintf(stderr, "Cannot compute statistics\n");
+			goto tidy;
+		}
+		(void)fprintf(stderr, "Datagrams:        %" PRIu64 "\n", dg.packets);
+		(void)fprintf(stderr, "Datagram size:    %zu\n", size);
+		(void)fprintf(stderr, "Payload data:     %s\n",
+			double_to_str((double)dg.payload_bytes));
+		(void)fprintf(stderr, "Batches:          %" PRIu64 "\n", dg.batches);
+		(void)fprintf(stderr, "Avg. batch size:  %.1f datagrams\n",
+			dg.batches ? (double)dg.packets / (double)dg.batches : 0.0);
+		(void)fprintf(stderr, "sendmmsg calls:   %" PRIu64 "\n", dg.syscalls);
+		(void)fprintf(stderr, "UDP GSO:          %s\n",
+			dg.gso_segs ? "enabled" : "disabled");
+		(void)fprintf(stderr, "Send errors:      %" PRIu64 "\n", dg.send_errors);
+		(void)fprintf(stderr, "Duration:         %s\n", secs_to_str(secs));
+		if (!(opt_flags & OPT_NO_RATE_CONTROL))
+			(void)fprintf(stderr, "Target rate:      %.1f datagrams/s\n", pps);
+		(void)fprintf(stderr, "Average rate:     %.1f datagrams/s\n",
+			(double)dg.packets / secs);
+		(void)fprintf(stderr, "Average rate:     %s/s\n",
+			double_to_str((double)dg.payload_bytes / secs));
+		if (!(opt_flags & OPT_NO_RATE_CONTROL) && dg.batches) {
+			(void)fprintf(stderr, "Avg. lateness:    %.1f us\n",
+				1000000.0 * dg.late_total / (double)dg.batches);
+			(void)fprintf(stderr, "Max. lateness:    %.1f us\n",
+				1000000.0 * dg.late_max);
+		}
+	}
+tidy:
+	free(dg.buffer);
+	free(dg.staging);
+	free(dg.iov);
+	free(dg.msgs);
+
+	return ret;
+}
+
+/*
+ *  dgram_sink_run()
+ *	-I udp-listen: datagram sink, receive datagrams with recvmmsg,
+ *	count lost and out of order datagrams using the sequence
+ *	number header and write the payloads to the output
+ */
+static int dgram_sink_run(
+	const int fd,
+	const int fdout,
+	const uint64_t timed_run)
+{
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	char *buffer;
+	uint64_t next_seq = 0, received = 0, bytes = 0, lost = 0;
+	uint64_t reordered = 0, invalid = 0, recv_calls = 0, total = 0;
+	double secs_start, time_begin, time_end;
+	bool end = false, started = false;
+	int ret = EXIT_SUCCESS;
+	const int rcvbuf = DGRAM_RCVBUF;
+	size_t i;
+
+	buffer = malloc(DGRAM_RECV_BATCH * DGRAM_SIZE_MAX);
+	msgs = calloc(DGRAM_RECV_BATCH, sizeof(*msgs));
+	iov = calloc(DGRAM_RECV_BATCH, sizeof(*iov));
+	if (!buffer || !msgs || !iov) {
+		(void)fprintf(stderr, "Cannot allocate datagram buffers.\n");
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+	for (i = 0; i < DGRAM_RECV_BATCH; i++) {
+		iov[i].iov_base = buffer + (i * DGRAM_SIZE_MAX);
+		iov[i].iov_len = DGRAM_SIZE_MAX;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* Absorb bursts of a whole sendmmsg batch and more */
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	secs_start = mono_time();
+	time_begin = timeval_to_double();
+
+	while (!end && !sluice_finish) {
+		struct pollfd pfd;
+		int n;
+
+		if ((opt_flags & OPT_TIMED_RUN) &&
+		    ((mono_time() - secs_start) > timed_run))
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		n = recvmmsg(fd, msgs, DGRAM_RECV_BATCH, MSG_DONTWAIT, NULL);
+		recv_calls++;
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue;
+			(void)fprintf(stderr, "recvmmsg error: errno=%d (%s).\n",
+				errno, strerror(errno));
+			ret = EXIT_READ_ERROR;
+			break;
+		}
+		if (!started) {
+			/* Rates are measured from the first datagram */
+			started = true;
+			time_begin = timeval_to_double();
+		}
+		for (i = 0; i < (size_t)n; i++) {
+			const char *const data = (const char *)iov[i].iov_base;
+			const size_t len = msgs[i].msg_len;
+			dgram_hdr_t hdr;
+			uint64_t seq;
+			size_t payload;
+
+			if (len < sizeof(hdr)) {
+				invalid++;
+				continue;
+			}
+			(void)memcpy(&hdr, data, sizeof(hdr));
+			if (ntohl(hdr.magic) != DGRAM_MAGIC) {
+				invalid++;
+				continue;
+			}
+			seq = be64toh(hdr.seq);
+			if (ntohs(hdr.flags) & DGRAM_FLAG_END) {
+				total = seq;
+				end = true;
+				continue;
+			}
+			payload = ntohs(hdr.len);
+			if (payload > len - sizeof(hdr))
+				payload = len - sizeof(hdr);
+
+			if (seq >= next_seq) {
+				lost += seq - next_seq;
+				next_seq = seq + 1;
+			} else {
+				/* Arrived late, it was counted as lost */
+				reordered++;
+				if (lost)
+					lost--;
+			}
+			received++;
+			bytes += payload;
+
+			if (!(opt_flags & OPT_DISCARD_STDOUT) &&
+			    (write(fdout, data + sizeof(hdr), payload) < 0)) {
+				(void)fprintf(stderr, "write error: errno=%d (%s).\n",
+					errno, strerror(errno));
+				ret = EXIT_WRITE_ERROR;
+				goto tidy;
+			}
+		}
+	}
+	time_end = timeval_to_double();
+	if (end && (total > next_seq))
+		lost += total - next_seq;
+
+	if (opt_flags & OPT_STATS) {
+		const double secs = time_end - time_begin;
+		const uint64_t expected = received + lost;
+
+		(void)fprintf(stderr, "Datagrams:        %" PRIu64 "\n", received);
+		(void)fprintf(stderr, "Payload data:     %s\n", double_to_str((double)bytes));
+		(void)fprintf(stderr, "recvmmsg calls:   %" PRIu64 "\n", recv_calls);
+		(void)fprintf(stderr, "Lost:             %" PRIu64 " (%.3f%%)\n", lost,
+			expected ? 100.0 * (double)lost / (double)expected : 0.0);
+		(void)fprintf(stderr, "Out of order:     %" PRIu64 "\n", reordered);
+		(void)fprintf(stderr, "Invalid:          %" PRIu64 "\n", invalid);
+		(void)fprintf(stderr, "End of stream:    %s\n", end ? "received" : "not received");
+		if (secs > 0.0) {
+			(void)fprintf(stderr, "Duration:         %s\n", secs_to_str(secs));
+			(void)fprintf(stderr, "Average rate:     %.1f datagrams/s\n",
+				(double)received / secs);
+			(void)fprintf(stderr, "Average rate:     %s/s\n",
+				double_to_str((double)bytes / secs));
+		}
+	}
+tidy:
+	free(buffer);
+	free(msgs);
+	free(iov);
+
+	return ret;
+}
+
+/*
+ *  sparse_seekable()
+ *	can holes be skipped on an output by seeking over them?
+ */
+static bool sparse_seekable(const int fd)
+{
+	struct stat buf;
+	int flags;
+
+	if ((fd < 0) || (fstat(fd, &buf) < 0) || !S_ISREG(buf.st_mode))
+		return false;
+	flags = fcntl(fd, F_GETFL);
+	return (flags >= 0) && !(flags & O_APPEND);
+}
+
+/*
+ *  sparse_init()
+ *	start walking the -b sparse input extents from the current
+ *	input offset, fdout is -1 if stdout is being discarded
+ */
+static sparse_t *sparse_init(
+	const int fdin,
+	const int fdout,
+	const int fdtee,
+	const double hole_rate)
+{
+	sparse_t *sp;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp) {
+		(void)fprintf(stderr, "Cannot allocate sparse input state.\n");
+		return NULL;
+	}
+	sp->offset = lseek(fdin, 0, SEEK_CUR);
+	if (sp->offset < 0) {
+		(void)fprintf(stderr, "lseek on input failed: errno=%d (%s).\n",
+			errno, strerror(errno));
+		free(sp);
+		return NULL;
+	}
+	/* The first read finds the first extent */
+	sp->data_end = sp->offset;
+	sp->hole_rate = hole_rate;
+	sp->seek_out = sparse_seekable(fdout);
+	sp->seek_tee = sparse_seekable(fdtee);
+
+	return sp;
+}
+
+/*
+ *  sparse_free()
+ *	free the -b sparse input state
+ */
+static void sparse_free(sparse_t *const sp)
+{
+	if (!sp)
+		return;
+	free(sp->zeros);
+	free(sp);
+}
+
+/*
+ *  write_all()
+ *	write all of buf, carrying on after short writes and
+ *	retrying interrupted ones
+ */
+static int write_all(const int fd, const char *buf, size_t n)
+{
+	while (n) {
+		const ssize_t ret = write(fd, buf, n);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		n -= (size_t)ret;
+	}
+	return 0;
+}
+
+/*
+ *  sparse_zeros()
+ *	write a hole as zeros to the outputs that cannot seek over
+ *	it, paced at the -B hole rate if one was given
+ */
+static int sparse_zeros(
+	sparse_t *const sp,
+	const int fdout,
+	const int fdtee,
+	sock_server_t *const sock_out,
+	const uint64_t len)
+{
+	const double t = mono_time();
+	uint64_t done = 0;
+
+	if (!sp->zeros) {
+		sp->zeros = calloc(1, SPARSE_ZERO_SIZE);
+		if (!sp->zeros) {
+			(void)fprintf(stderr, "Cannot allocate sparse hole buffer.\n");
+			return -1;
+		}
+	}
+	sp->written = true;
+
+	while ((done < len) && !sluice_finish) {
+		const size_t n = (len - done > SPARSE_ZERO_SIZE) ?
+			SPARSE_ZERO_SIZE : (size_t)(len - done);
+
+		if ((fdout >= 0) && !sp->seek_out &&
+		    (write_all(fdout, sp->zeros, n) < 0)) {
+			(void)fprintf(stderr, "Write error: errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1;
+		}
+		if ((fdtee >= 0) && !sp->seek_tee &&
+		    (write_all(fdtee, sp->zeros, n) < 0)) {
+			(void)fprintf(stderr, "write error: errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1;
+		}
+		if (sock_out)
+			sock_server_write(sock_out, sp->zeros, n, true);
+		done += n;
+
+		if (sp->hole_rate > 0.0) {
+			const double ahead = t + ((double)done / sp->hole_rate) - mono_time();
+
+			if (ahead > 0.0)
+				(void)usleep((useconds_t)(ahead * 1000000.0));
+		}
+	}
+	return 0;
+}
+
+/*
+ *  sparse_hole()
+ *	move the input on to the next data extent. The hole before it
+ *	is skipped by seeking the outputs that are files and written
+ *	as zeros to any others. Returns the time spent or -1.0 on an
+ *	error
+ */
+static double sparse_hole(
+	sparse_t *const sp,
+	const int fdin,
+	const int fdout,
+	const int fdtee,
+	sock_server_t *const sock_out)
+{
+	const double t = mono_time();
+	double secs;
+	struct stat buf;
+	off_t data;
+
+	if (fstat(fdin, &buf) < 0) {
+		(void)fprintf(stderr, "fstat on input failed: errno=%d (%s).\n",
+			errno, strerror(errno));
+		return -1.0;
+	}
+	data = lseek(fdin, sp->offset, SEEK_DATA);
+	if (data < 0) {
+		if (errno == ENXIO) {
+			/* No more data, just a hole up to the end */
+			data = buf.st_size;
+		} else if (errno == EINVAL) {
+			/* File system cannot tell, treat the rest as data */
+			sp->data_end = -1;
+			return 0.0;
+		} else {
+			(void)fprintf(stderr, "lseek SEEK_DATA on input failed: errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1.0;
+		}
+	}
+
+	if (data > sp->offset) {
+		const off_t len = data - sp->offset;
+
+		if ((sp->seek_out && (lseek(fdout, len, SEEK_CUR) < 0)) ||
+		    (sp->seek_tee && (lseek(fdtee, len, SEEK_CUR) < 0))) {
+			(void)fprintf(stderr, "lseek on output failed: errno=%d (%s).\n",
+				errno, strerror(errno));
+			return -1.0;
+		}
+		if ((((fdout >= 0) && !sp->seek_out) ||
+		     ((fdtee >= 0) && !sp->seek_tee) || sock_out) &&
+		    (sparse_zeros(sp, fdout, fdtee, sock_out, (uint64_t)len) < 0))
+			return -1.0;
+		sp->holes++;
+		sp->hole_bytes += (uint64_t)len;
+	}
+
+	if (data >= buf.st_size) {
+		/* Read on to EOF in case the file is still growing */
+		sp->data_end = -1;
+	} else {
+		const off_t end = lseek(fdin, data, SEEK_HOLE);
+
+		sp->data_end = ((end < 0) || (end >= buf.st_size)) ? -1 : end;
+		sp->extents++;
+	}
+	if (lseek(fdin, data, SEEK_SET) < 0) {
+		(void)fprintf(stderr, "lseek on input failed: errno=%d (%s).\n",
+			errno, strerror(errno));
+		return -1.0;
+	}
+	sp->offset = data;
+	secs = mono_time() - t;
+	sp->hole_time += secs;
+
+	return secs;
+}
+
+/*
+ *  sparse_extend()
+ *	a file that ends in a skipped hole has to be extended to
+ *	its full size
+ */
+static int sparse_extend(const int fd)
+{
+	struct stat buf;
+	const off_t offset = lseek(fd, 0, SEEK_CUR);
+
+	if ((offset < 0) || (fstat(fd, &buf) < 0))
+		return -1;
+	if ((buf.st_size < offset) && (ftruncate(fd, offset) < 0))
+		return -1;
+	return 0;
+}
+
+/*
+ *  sparse_finish()
+ *	extend the outputs that had holes skipped at the end
+ */
+static int sparse_finish(const sparse_t *const sp, const int fdout, const int fdtee)
+{
+	if ((sp->seek_out && (sparse_extend(fdout) < 0)) ||
+	    (sp->seek_tee && (sparse_extend(fdtee) < 0))) {
+		(void)fprintf(stderr, "Cannot extend output over the final hole: errno=%d (%s).\n",
+			errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  sparse_stats_info()
+ *	display the -b sparse input data and hole statistics
+ */
+static void sparse_stats_info(const sparse_t *const sp)
+{
+	(void)fprintf(stderr, "\nSparse input:\n");
+	(void)fprintf(stderr, "  Data:           %s in %" PRIu64 " extents\n",
+		double_to_str((double)sp->data_bytes), sp->extents);
+	(void)fprintf(stderr, "  Holes:          %s in %" PRIu64 " holes, %s\n",
+		double_to_str((double)sp->hole_bytes), sp->holes,
+		sp->written ? "written" : "skipped");
+	(void)fprintf(stderr, "  Hole time:      %s\n", secs_to_str(sp->hole_time));
+	if (sp->written && (sp->hole_rate > 0.0))
+		(void)fprintf(stderr, "  Hole rate:      %s/s\n",
+			double_to_str(sp->hole_rate));
+}
+
+/*
+ *  autotune_cpu()
+ *	CPU time used by the pacing thread
+ */
+static double autotune_cpu(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0.0;
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ *  autotune_pipe()
+ *	size the pipes to hold two writes of io_size so a write
+ *	does not have to wait for the reader to drain the pipe
+ */
+static size_t autotune_pipe(autotune_t *at, const double io_size)
+{
+#if defined(SET_XFER_SIZE)
+	size_t sz = get_pagesize();
+	bool ok = false;
+
+	if (!at->pipe_max)
+		return 0;
+	while ((sz < (size_t)(2.0 * io_size)) && (sz < at->pipe_max))
+		sz <<= 1;
+	if (sz > at->pipe_max)
+		sz = at->pipe_max;
+	if ((at->fdin >= 0) && (set_pipe_size(at->fdin, sz) == 0))
+		ok = true;
+	if ((at->fdout >= 0) && (set_pipe_size(at->fdout, sz) == 0))
+		ok = true;
+	return ok ? sz : 0;
+#else
+	(void)at;
+	(void)io_size;
+	return 0;
+#endif
+}
+
+/*
+ *  autotune_init()
+ *	work out the io_sizes to try, doubling from AUTOTUNE_IO_MIN
+ *	while there are still at least AUTOTUNE_WRITES_MIN writes a
+ *	second at the target rate. Returns the largest io_size so
+ *	the buffer can be allocated once.
+ */
+static double autotune_init(
+	autotune_t *at,
+	const double data_rate,
+	const uint64_t max_trans,
+	const int fdin,
+	const int fdout)
+{
+	double io_max = data_rate / AUTOTUNE_WRITES_MIN;
+	double sz;
+
+	(void)memset(at, 0, sizeof(*at));
+	at->target = data_rate;
+	at->fdin = -1;
+	at->fdout = -1;
+
+	if (io_max > AUTOTUNE_IO_MAX)
+		io_max = AUTOTUNE_IO_MAX;
+	if (max_trans && (io_max > (double)max_trans))
+		io_max = (double)max_trans;
+	if (io_max < AUTOTUNE_IO_MIN)
+		io_max = AUTOTUNE_IO_MIN;
+	for (sz = AUTOTUNE_IO_MIN; (sz <= io_max) &&
+	     (at->n_cand < AUTOTUNE_CANDIDATES); sz *= 2.0)
+		at->cand[at->n_cand++].io_size = sz;
+
+#if defined(SET_XFER_SIZE)
+	{
+		struct stat statbuf;
+
+		if ((fdin >= 0) && (fstat(fdin, &statbuf) == 0) &&
+		    S_ISFIFO(statbuf.st_mode))
+			at->fdin = fdin;
+		if ((fdout >= 0) && (fstat(fdout, &statbuf) == 0) &&
+		    S_ISFIFO(statbuf.st_mode))
+			at->fdout = fdout;
+		if ((at->fdin >= 0) || (at->fdout >= 0))
+			at->pipe_max = get_max_pipe_size();
+	}
+#else
+	(void)fdin;
+	(void)fdout;
+#endif
+	return at->cand[at->n_cand - 1].io_size;
+}
+
+/*
+ *  autotune_window()
+ *	start a new measurement window
+ */
+static void autotune_window(
+	autotune_t *at,
+	const double secs_now,
+	const uint64_t total_bytes,
+	const double blocked)
+{
+	at->win_start = secs_now;
+	at->win_cpu = autotune_cpu();
+	at->win_blocked = blocked;
+	at->win_bytes = total_bytes;
+	at->win_writes = 0;
+}
+
+/*
+ *  autotune_begin()
+ *	start a warm-up, trying each io_size in turn, returns
+ *	the first io_size to try
+ */
+static double autotune_begin(
+	autotune_t *at,
+	const double secs_now,
+	const uint64_t total_bytes,
+	const double blocked)
+{
+	at->tuning = true;
+	at->cur = 0;
+	at->bad = 0;
+	at->tune_start = secs_now;
+	at->cand[0].pipe_size = autotune_pipe(at, at->cand[0].io_size);
+	autotune_window(at, secs_now, total_bytes, blocked);
+	return at->cand[0].io_size;
+}
+
+/*
+ *  autotune_choose()
+ *	of the io_sizes that kept write blocking low, find the
+ *	lowest CPU per byte and then the smallest io_size within
+ *	AUTOTUNE_CPU_SLACK of it, smaller writes pace more smoothly
+ */
+static size_t autotune_choose(const autotune_t *at)
+{
+	size_t i, best = at->n_cand;
+	double best_cpu = 0.0, least_blocked = 2.0;
+
+	for (i = 0; i < at->n_cand; i++) {
+		const autotune_cand_t *c = &at->cand[i];
+		const double cpu = c->cpu / (double)(c->bytes ? c->bytes : 1);
+
+		if ((c->blocked / c->wall) > AUTOTUNE_BLOCKED)
+			continue;
+		if ((best == at->n_cand) || (cpu < best_cpu)) {
+			best = i;
+			best_cpu = cpu;
+		}
+	}
+	if (best == at->n_cand) {
+		/* All blocked, pick the one that blocked least */
+		for (i = 0; i < at->n_cand; i++) {
+			const double b = at->cand[i].blocked / at->cand[i].wall;
+
+			if (b < least_blocked) {
+				least_blocked = b;
+				best = i;
+			}
+		}
+		return best;
+	}
+	for (i = 0; i < best; i++) {
+		const autotune_cand_t *c = &at->cand[i];
+		const double cpu = c->cpu / (double)(c->bytes ? c->bytes : 1);
+
+		if (((c->blocked / c->wall) <= AUTOTUNE_BLOCKED) &&
+		    (cpu <= best_cpu * AUTOTUNE_CPU_SLACK))
+			return i;
+	}
+	return best;
+}
+
+/*
+ *  autotune_sample()
+ *	called after every write, blocked is the total time spent
+ *	in write so far. Returns the io_size to use from now on.
+ */
+static double autotune_sample(
+	autotune_t *at,
+	const double secs_now,
+	const uint64_t total_bytes,
+	const double blocked)
+{
+	const double wall = secs_now - at->win_start;
+	double bytes, rate;
+
+	at->win_writes++;
+	if ((wall < AUTOTUNE_WINDOW) || (at->win_writes < AUTOTUNE_WINDOW_WRITES))
+		return at->tuning ? at->cand[at->cur].io_size : at->io_size;
+
+	bytes = (double)(total_bytes - at->win_bytes);
+	if (at->tuning) {
+		autotune_cand_t *c = &at->cand[at->cur];
+
+		c->cpu = autotune_cpu() - at->win_cpu;
+		c->wall = wall;
+		c->blocked = blocked - at->win_blocked;
+		c->bytes = (uint64_t)bytes;
+
+		if (++at->cur < at->n_cand) {
+			c = &at->cand[at->cur];
+			c->pipe_size = autotune_pipe(at, c->io_size);
+			autotune_window(at, secs_now, total_bytes, blocked);
+			return c->io_size;
+		}
+		c = &at->cand[autotune_choose(at)];
+		at->io_size = c->io_size;
+		at->pipe_size = autotune_pipe(at, c->io_size);
+		at->tuning = false;
+		at->warmup += secs_now - at->tune_start;
+		autotune_window(at, secs_now, total_bytes, blocked);
+		return at->io_size;
+	}
+
+	/*
+	 *  Tuned, re-tune if writes keep blocking or the rate
+	 *  cannot be held, the reader or the system has changed
+	 */
+	rate = bytes / wall;
+	if ((((blocked - at->win_blocked) / wall) > AUTOTUNE_BLOCKED) ||
+	    (rate < at->target * AUTOTUNE_RATE_SLACK))
+		at->bad++;
+	else
+		at->bad = 0;
+	if (at->bad >= AUTOTUNE_RETUNE) {
+		at->retunes++;
+		return autotune_begin(at, secs_now, total_bytes, blocked);
+	}
+	autotune_window(at, secs_now, total_bytes, blocked);
+	return at->io_size;
+}
+
+/*
+ *  autotune_stats_info()
+ *	display the -A measurements and the chosen sizes
+ */
+static void autotune_stats_info(const autotune_t *at)
+{
+	size_t i;
+
+	(void)fprintf(stderr, "\nAuto-tune:\n");
+	if (at->io_size > 0.0)
+		(void)fprintf(stderr, "  I/O size:       %s\n",
+			double_to_str(at->io_size));
+	else
+		(void)fprintf(stderr, "  I/O size:       not tuned yet\n");
+	if (at->pipe_size)
+		(void)fprintf(stderr, "  Pipe size:      %s\n",
+			double_to_str((double)at->pipe_size));
+	else
+		(void)fprintf(stderr, "  Pipe size:      unchanged\n");
+	(void)fprintf(stderr, "  Warm-up time:   %s\n", secs_to_str(at->warmup));
+	(void)fprintf(stderr, "  Re-tunes:       %" PRIu64 "\n", at->retunes);
+	(void)fprintf(stderr, "  %-16s%12s%10s\n", "I/O size", "CPU us/MB", "Blocked");
+	for (i = 0; i < at->n_cand; i++) {
+		const autotune_cand_t *c = &at->cand[i];
+
+		if (c->wall <= 0.0)
+			continue;
+		(void)fprintf(stderr, "  %-16s%12.1f %8.2f%%%s\n",
+			double_to_str(c->io_size),
+			c->bytes ? 1000000.0 * c->cpu * (double)MB / (double)c->bytes : 0.0,
+			100.0 * c->blocked / c->wall,
+			DOUBLE_CMP(c->io_size, at->io_size) ? " *" : "");
+	}
+}
+
+/*
+ *  block_random()
+ *	next xorshift128+ random number of a worker
+ */
+static inline uint64_t block_random(gen_worker_t *const rnd)
+{
+	uint64_t x = rnd->rnd[0];
+	const uint64_t y = rnd->rnd[1];
+
+	rnd->rnd[0] = y;
+	x ^= x << 23;
+	rnd->rnd[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+	return rnd->rnd[1] + y;
+}
+
+/*
+ *  block_worker()
+ *	-W worker, take the next I/O slot, wait until it is due and
+ *	issue it, the queue depth is the number of workers
+ */
+static void *block_worker(void *arg)
+{
+	block_worker_t *const w = (block_worker_t *)arg;
+	block_t *const blk = w->blk;
+	const size_t bs = (size_t)blk->spec.bs;
+
+	while (!__atomic_load_n(&blk->stop, __ATOMIC_RELAXED)) {
+		const uint64_t n = __atomic_fetch_add(&blk->next, 1, __ATOMIC_RELAXED);
+		const uint64_t block = blk->spec.random ?
+			block_random(&w->rnd) % blk->blocks : n % blk->blocks;
+		const off_t offset = (off_t)(block * bs);
+		double t, secs, due = 0.0;
+		ssize_t ret;
+		uint64_t ns;
+		bool late = false;
+
+		if (blk->limit && (n >= blk->limit))
+			break;
+
+		/* Slot n is due n / iops seconds into the run */
+		if (blk->iops > 0.0) {
+			due = blk->time_start + ((double)n / blk->iops);
+
+			for (;;) {
+				const double now = mono_time();
+
+				if ((now >= due) || __atomic_load_n(&blk->stop, __ATOMIC_RELAXED))
+					break;
+				(void)usleep((useconds_t)(((due - now) > 0.1 ? 0.1 : due - now) * 1000000.0));
+			}
+			late = (mono_time() > due + BLOCK_LATE);
+		}
+
+		/* An interrupted I/O is retried at the same offset */
+		t = mono_time();
+		do {
+			if (blk->spec.write)
+				ret = pwrite(blk->fd, w->buffer, bs, offset);
+			else
+				ret = pread(blk->fd, w->buffer, bs, offset);
+		} while ((ret < 0) && (errno == EINTR) &&
+			 !__atomic_load_n(&blk->stop, __ATOMIC_RELAXED));
+		secs = mono_time() - t;
+
+		/*
+		 *  Slow I/Os make the run fall behind even when each one is
+		 *  issued on time, so an I/O that completes after its
+		 *  worker's next slot was due is late too
+		 */
+		if ((blk->iops > 0.0) &&
+		    (t + secs > due + ((double)blk->spec.qd / blk->iops) + BLOCK_LATE))
+			late = true;
+
+		if (ret != (ssize_t)bs) {
+			if ((ret < 0) && (errno == EINTR))
+				break;
+			if (__atomic_add_fetch(&blk->errors, 1, __ATOMIC_RELAXED) == 1) {
+				if (ret < 0)
+					(void)fprintf(stderr, "%s error at offset %jd: errno=%d (%s).\n",
+						blk->spec.write ? "write" : "read",
+						(intmax_t)offset, errno, strerror(errno));
+				else
+					(void)fprintf(stderr, "short %s at offset %jd.\n",
+						blk->spec.write ? "write" : "read",
+						(intmax_t)offset);
+			}
+			__atomic_store_n(&blk->stop, true, __ATOMIC_RELAXED);
+			break;
+		}
+
+		ns = (uint64_t)(secs * 1000000000.0);
+		w->lat[lat_bucket(ns)]++;
+		w->lat_total += (double)ns;
+		if (!w->ios || (ns < w->lat_min))
+			w->lat_min = ns;
+		if (ns > w->lat_max)
+			w->lat_max = ns;
+		if (late)
+			w->late++;
+		w->ios++;
+		__atomic_add_fetch(&blk->ios, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&blk->running, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/*
+ *  block_stats_info()
+ *	display the -W throughput and latency percentiles
+ */
+static void block_stats_info(const block_t *const blk, const double secs)
+{
+	static const double percents[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+	uint64_t lat[LAT_BUCKETS];
+	uint64_t ios = 0, late = 0, lat_min = 0, lat_max = 0;
+	double lat_total = 0.0, missed;
+	size_t i, j;
+
+	if (secs <= 0.0) {
+		(void)fprintf(stderr, "Cannot compute statistics\n");
+		return;
+	}
+	(void)memset(lat, 0, sizeof(lat));
+	for (i = 0; i < blk->spec.qd; i++) {
+		const block_worker_t *const w = &blk->workers[i];
+
+		for (j = 0; j < LAT_BUCKETS; j++)
+			lat[j] += w->lat[j];
+		if (w->ios && (!ios || (w->lat_min < lat_min)))
+			lat_min = w->lat_min;
+		if (w->lat_max > lat_max)
+			lat_max = w->lat_max;
+		lat_total += w->lat_total;
+		ios += w->ios;
+		late += w->late;
+	}
+
+	(void)fprintf(stderr, "Workload:         %s%s, %s blocks, queue depth %" PRIu64 "%s\n",
+		blk->spec.random ? "random " : "sequential ",
+		blk->spec.write ? "write" : "read",
+		double_to_str((double)blk->spec.bs), blk->spec.qd,
+		blk->spec.direct ? ", O_DIRECT" : "");
+	(void)fprintf(stderr, "I/Os:             %" PRIu64 "\n", ios);
+	(void)fprintf(stderr, "Data:             %s\n",
+		double_to_str((double)(ios * blk->spec.bs)));
+	if (blk->errors)
+		(void)fprintf(stderr, "Errors:           %" PRIu64 "\n", blk->errors);
+	(void)fprintf(stderr, "Duration:         %s\n", secs_to_str(secs));
+	if (blk->iops > 0.0) {
+		(void)fprintf(stderr, "Target IOPS:      %.1f\n", blk->iops);
+		missed = (blk->iops * secs) - (double)ios;
+		(void)fprintf(stderr, "Late I/Os:        %" PRIu64 " (%.2f%%)\n",
+			late, ios ? 100.0 * (double)late / (double)ios : 0.0);
+		/* I/Os the run fell short of the target by */
+		if (missed >= 1.0)
+			(void)fprintf(stderr, "Missed I/Os:      %.0f\n", missed);
+	}
+	(void)fprintf(stderr, "IOPS:             %.1f\n", (double)ios / secs);
+	(void)fprintf(stderr, "Average rate:     %s/s\n",
+		double_to_str((double)(ios * blk->spec.bs) / secs));
+	if (!ios)
+		return;
+	(void)fprintf(stderr, "\nLatency:\n");
+	(void)fprintf(stderr, "  Min:            %.1f us\n", (double)lat_min / 1000.0);
+	(void)fprintf(stderr, "  Average:        %.1f us\n", lat_total / (double)ios / 1000.0);
+	for (i = 0; i < SIZEOF_ARRAY(percents); i++) {
+		char label[16];
+		uint64_t ns = lat_percentile(lat, ios, percents[i]);
+
+		/* Bucket upper bounds can be above the actual max */
+		if (ns > lat_max)
+			ns = lat_max;
+		(void)snprintf(label, sizeof(label), "%g%%:", percents[i]);
+		(void)fprintf(stderr, "  %-16s%.1f us\n", label, (double)ns / 1000.0);
+	}
+	(void)fprintf(stderr, "  Max:            %.1f us\n", (double)lat_max / 1000.0);
+}
+
+/*
+ *  block_run()
+ *	-W block workload mode, qd worker threads each keep one read
+ *	or write of bs bytes in flight at sequential or random block
+ *	aligned offsets of the target. With a rate the I/Os are issued
+ *	in slots 1 / IOPS apart, a slot that a worker picks up late
+ *	means the queue depth is too low for the device
+ */
+static int block_run(
+	const char *const filename,
+	const block_spec_t *const spec,
+	const double rate,
+	const uint64_t max_trans,
+	const uint64_t timed_run,
+	const double freq)
+{
+	block_t *blk;
+	sigset_t set, old_set;
+	off_t size;
+	double secs_last, secs_now;
+	size_t i;
+	int ret = EXIT_SUCCESS;
+	int flags = spec->write ? (O_WRONLY | O_CREAT) : O_RDONLY;
+
+	blk = calloc(1, sizeof(*blk));
+	if (!blk) {
+		(void)fprintf(stderr, "Cannot allocate block workload state.\n");
+		return EXIT_ALLOC_ERROR;
+	}
+	blk->spec = *spec;
+	blk->fd = -1;
+	if (spec->direct)
+		flags |= O_DIRECT;
+	if (opt_flags & OPT_FSYNC)
+		flags |= O_DSYNC;
+	blk->fd = open(filename, flags, S_IRUSR | S_IWUSR);
+	if (blk->fd < 0) {
+		(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+			filename, errno, strerror(errno));
+		ret = EXIT_FILE_ERROR;
+		goto tidy;
+	}
+	/* lseek gives the size of block devices as well as files */
+	size = lseek(blk->fd, 0, SEEK_END);
+	if ((size < (off_t)spec->bs) && spec->write && max_trans) {
+		/* A new file, the -m size is the span to write to */
+		size = (off_t)max_trans;
+		if (ftruncate(blk->fd, size) < 0) {
+			(void)fprintf(stderr, "Cannot extend %s: errno = %d (%s).\n",
+				filename, errno, strerror(errno));
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+	}
+	blk->blocks = (size > 0) ? (uint64_t)size / spec->bs : 0;
+	if (!blk->blocks) {
+		(void)fprintf(stderr, "%s is smaller than the %s block size%s.\n",
+			filename, double_to_str((double)spec->bs),
+			spec->write ? ", use -m to give the size to write" : "");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	blk->limit = max_trans / spec->bs;
+	if (max_trans && !blk->limit)
+		blk->limit = 1;
+	blk->iops = rate / (double)spec->bs;
+
+	blk->workers = calloc(spec->qd, sizeof(*blk->workers));
+	if (!blk->workers) {
+		(void)fprintf(stderr, "Cannot allocate block workload state.\n");
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+	for (i = 0; i < spec->qd; i++) {
+		block_worker_t *const w = &blk->workers[i];
+		void *buf;
+
+		if (posix_memalign(&buf, BLOCK_ALIGN, (size_t)spec->bs) != 0) {
+			(void)fprintf(stderr, "Cannot allocate buffer of %" PRIu64 " bytes.\n",
+				spec->bs);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+		w->blk = blk;
+		w->buffer = buf;
+		w->rnd.id = (int)i;
+		gen_seed(&w->rnd);
+		/* Random data so writes are not compressed or deduplicated */
+		(void)memset(w->buffer, 0, (size_t)spec->bs);
+		gen_fill(&w->rnd, w->buffer, (size_t)spec->bs);
+	}
+
+	blk->time_start = mono_time();
+	secs_last = blk->time_start;
+
+	/* Signals are for the main thread, it has to see SIGINT */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	for (i = 0; i < spec->qd; i++) {
+		block_worker_t *const w = &blk->workers[i];
+
+		__atomic_add_fetch(&blk->running, 1, __ATOMIC_RELAXED);
+		if (pthread_create(&w->thread, NULL, block_worker, w) != 0) {
+			__atomic_sub_fetch(&blk->running, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		w->started = true;
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (i < spec->qd) {
+		(void)fprintf(stderr, "Cannot start %" PRIu64 " block workload workers.\n",
+			spec->qd);
+		ret = EXIT_ALLOC_ERROR;
+		goto tidy;
+	}
+
+	while (__atomic_load_n(&blk->running, __ATOMIC_ACQUIRE)) {
+		double nap = (freq < 0.1) ? freq : 0.1;
+
+		/* Wake up on time for the end of a -T run */
+		if (opt_flags & OPT_TIMED_RUN) {
+			const double left = blk->time_start + (double)timed_run - mono_time();
+
+			if (left < nap)
+				nap = (left > 0.0) ? left : 0.0;
+		}
+		(void)usleep((useconds_t)(nap * 1000000.0));
+		secs_now = mono_time();
+		if (sluice_finish ||
+		    ((opt_flags & OPT_TIMED_RUN) &&
+		     ((secs_now - blk->time_start) >= (double)timed_run)))
+			__atomic_store_n(&blk->stop, true, __ATOMIC_RELAXED);
+
+		if ((opt_flags & OPT_VERBOSE) && (secs_now > secs_last + freq)) {
+			const uint64_t ios = __atomic_load_n(&blk->ios, __ATOMIC_RELAXED);
+			const double secs = secs_now - blk->time_start;
+			char rate_str[32], total_str[32];
+
+			size_to_str((double)(ios * spec->bs) / secs, "%7.1f %s",
+				rate_str, sizeof(rate_str));
+			size_to_str((double)(ios * spec->bs), "%7.1f %s",
+				total_str, sizeof(total_str));
+			(void)fprintf(stderr, "Rate: %s/S, IOPS: %9.1f, Total: %s, "
+				"Dur: %.1f S  \r",
+				rate_str, (double)ios / secs, total_str, secs);
+			(void)fflush(stderr);
+			secs_last = secs_now;
+		}
+	}
+	secs_now = mono_time();
+	for (i = 0; i < spec->qd; i++) {
+		(void)pthread_join(blk->workers[i].thread, NULL);
+		blk->workers[i].started = false;
+	}
+
+	if (opt_flags & OPT_VERBOSE)
+		(void)fprintf(stderr, "%78s\r", "");
+	if (opt_flags & OPT_STATS)
+		block_stats_info(blk, secs_now - blk->time_start);
+	if (blk->errors)
+		ret = spec->write ? EXIT_WRITE_ERROR : EXIT_READ_ERROR;
+tidy:
+	__atomic_store_n(&blk->stop, true, __ATOMIC_RELAXED);
+	if (blk->workers) {
+		for (i = 0; i < spec->qd; i++) {
+			if (blk->workers[i].started)
+				(void)pthread_join(blk->workers[i].thread, NULL);
+			free(blk->workers[i].buffer);
+		}
+		free(blk->workers);
+	}
+	if (blk->fd >= 0)
+		(void)close(blk->fd);
+	free(blk);
+
+	return ret;
+}
+
+/*
+ *  traffic_parse()
+ *	parse a -l model[,on=secs][,off=secs][,alpha=a][,sigma=s][,seed=n]
+ */
+static int traffic_parse(char *const str, traffic_spec_t *const spec)
+{
+	char *saveptr = NULL, *tok;
+	const char *name = strtok_r(str, ",", &saveptr);
+
+	if (!name)
+		return -1;
+	if (!strcmp(name, "poisson"))
+		spec->model = TRAFFIC_POISSON;
+	else if (!strcmp(name, "onoff"))
+		spec->model = TRAFFIC_ONOFF;
+	else if (!strcmp(name, "pareto"))
+		spec->model = TRAFFIC_PARETO;
+	else
+		return -1;
+
+	while ((tok = strtok_r(NULL, ",", &saveptr)) != NULL) {
+		char *val = strchr(tok, '=');
+
+		if (!val || !val[1])
+			return -1;
+		*val++ = '\0';
+		if (!strcmp(tok, "on")) {
+			spec->on = get_double_scale(val, second_scales, "time");
+		} else if (!strcmp(tok, "off")) {
+			spec->off = get_double_scale(val, second_scales, "time");
+		} else if (!strcmp(tok, "alpha")) {
+			spec->alpha = atof(val);
+		} else if (!strcmp(tok, "sigma")) {
+			spec->sigma = atof(val);
+		} else if (!strcmp(tok, "seed")) {
+			size_t len;
+
+			spec->seed = get_uint64(val, &len);
+			spec->got_seed = true;
+		} else {
+			return -1;
+		}
+	}
+	if ((spec->on < TRAFFIC_PERIOD_MIN) || (spec->off < TRAFFIC_PERIOD_MIN) ||
+	    (spec->alpha <= 1.0) || (spec->sigma < 0.0) ||
+	    (spec->sigma > TRAFFIC_SIGMA_MAX))
+		return -1;
+	return 0;
+}
+
+/*
+ *  traffic_uniform()
+ *	uniform random number in [0, 1)
+ */
+static inline double traffic_uniform(traffic_t *const tm)
+{
+	return (double)(block_random(&tm->rnd) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ *  traffic_exp()
+ *	exponentially distributed random number with the given mean
+ */
+static inline double traffic_exp(traffic_t *const tm, const double mean)
+{
+	return -mean * log(1.0 - traffic_uniform(tm));
+}
+
+/*
+ *  traffic_period()
+ *	length of an on or off period, Pareto periods are scaled so
+ *	they have the given mean and are capped so one huge period
+ *	cannot stall the run
+ */
+static double traffic_period(traffic_t *const tm, const double mean)
+{
+	const double alpha = tm->spec.alpha;
+	double secs;
+
+	if (tm->spec.model != TRAFFIC_PARETO)
+		return traffic_exp(tm, mean);
+
+	secs = (mean * (alpha - 1.0) / alpha) /
+		pow(1.0 - traffic_uniform(tm), 1.0 / alpha);
+	return (secs > mean * TRAFFIC_PERIOD_CAP) ? mean * TRAFFIC_PERIOD_CAP : secs;
+}
+
+/*
+ *  traffic_size()
+ *	size of the next chunk, lognormal with the -i mean when a
+ *	sigma is given, otherwise always the mean
+ */
+static double traffic_size(traffic_t *const tm)
+{
+	const double sigma = tm->spec.sigma;
+	double u1, u2, size;
+
+	if (sigma <= 0.0)
+		return tm->size;
+
+	/* Box-Muller normal, then shift the mean back to tm->size */
+	u1 = 1.0 - traffic_uniform(tm);
+	u2 = traffic_uniform(tm);
+	size = tm->size * exp(sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2) -
+		(sigma * sigma / 2.0));
+	if (size < IO_SIZE_MIN)
+		size = IO_SIZE_MIN;
+	return (size > tm->size_max) ? tm->size_max : floor(size);
+}
+
+/*
+ *  traffic_init()
+ *	set up a traffic model with a mean of rate bytes per second
+ *	in chunks with a mean of size bytes, returns the largest
+ *	chunk size so the caller can size its buffer
+ */
+static double traffic_init(
+	traffic_t *const tm,
+	const traffic_spec_t *const spec,
+	const double rate,
+	const double size)
+{
+	(void)memset(tm, 0, sizeof(*tm));
+	tm->spec = *spec;
+	if (!spec->got_seed) {
+		gen_seed(&tm->rnd);
+		tm->spec.seed = tm->rnd.rnd[0];
+	}
+	/* splitmix64 the seed into the xorshift128+ state */
+	tm->rnd.rnd[0] = tm->spec.seed + 0x9e3779b97f4a7c15ULL;
+	tm->rnd.rnd[1] = (tm->rnd.rnd[0] ^ (tm->rnd.rnd[0] >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	tm->rnd.rnd[1] = (tm->rnd.rnd[1] ^ (tm->rnd.rnd[1] >> 27)) * 0x94d049bb133111ebULL;
+	tm->rnd.rnd[1] ^= tm->rnd.rnd[1] >> 31;
+	if (!(tm->rnd.rnd[0] | tm->rnd.rnd[1]))
+		tm->rnd.rnd[0] = 0x9e3779b97f4a7c15ULL;
+
+	tm->rate = rate;
+	tm->size = size;
+	tm->size_max = (spec->sigma > 0.0) ? size * TRAFFIC_SIZE_CAP : size;
+	if (tm->size_max > IO_SIZE_MAX)
+		tm->size_max = IO_SIZE_MAX;
+	/* On/off sends faster while on so the mean comes out at rate */
+	tm->peak = (spec->model == TRAFFIC_POISSON) ?
+		rate : rate * (spec->on + spec->off) / spec->on;
+	/* A gap longer than the mean gap ends a burst */
+	tm->threshold = size / rate;
+	tm->chunk_min = tm->size_max;
+	tm->chunk = traffic_size(tm);
+
+	return tm->size_max;
+}
+
+/*
+ *  traffic_begin()
+ *	start the schedule, the first chunk is due now
+ */
+static void traffic_begin(traffic_t *const tm)
+{
+	tm->next = mono_time();
+	if (tm->spec.model != TRAFFIC_POISSON)
+		tm->on_end = tm->next + traffic_period(tm, tm->spec.on);
+}
+
+/*
+ *  traffic_wait()
+ *	sleep until the next chunk is due, returns the time it was
+ *	sent at or a negative value if sluice was told to finish
+ */
+static double traffic_wait(traffic_t *const tm, stats_t *const stats)
+{
+	struct timespec ts;
+	double now = mono_time(), late;
+
+	if (tm->next > now) {
+		ts.tv_sec = (time_t)tm->next;
+		ts.tv_nsec = (long)((tm->next - (double)ts.tv_sec) * 1000000000.0);
+		stats->delays++;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+			if (sluice_finish)
+				return -1.0;
+		}
+		late = mono_time();
+		stats->phase_time[PHASE_DELAY] += late - now;
+		now = late;
+	}
+	late = now - tm->next;
+	if (late > TRAFFIC_LATE)
+		tm->late++;
+	if (late > tm->late_max)
+		tm->late_max = late;
+
+	return now;
+}
+
+/*
+ *  traffic_burst_end()
+ *	account for the burst that has just ended
+ */
+static void traffic_burst_end(traffic_t *const tm)
+{
+	const double secs = tm->burst_last - tm->burst_start;
+
+	if (!tm->burst_chunks)
+		return;
+	tm->bursts++;
+	tm->burst_time_total += secs;
+	/*
+	 *  Bytes sent before the last chunk over the time they took,
+	 *  bursts shorter than a mean gap say little about the rate
+	 */
+	if ((secs >= tm->threshold) &&
+	    ((double)(tm->burst_bytes - tm->burst_last_bytes) / secs > tm->burst_rate_max))
+		tm->burst_rate_max = (double)(tm->burst_bytes - tm->burst_last_bytes) / secs;
+	if (secs > tm->burst_time_max)
+		tm->burst_time_max = secs;
+	if (tm->burst_bytes > tm->burst_bytes_max)
+		tm->burst_bytes_max = tm->burst_bytes;
+	tm->burst_chunks = 0;
+	tm->burst_bytes = 0;
+}
+
+/*
+ *  traffic_next()
+ *	account for a chunk of n bytes sent at time now and
+ *	schedule the next one
+ */
+static void traffic_next(traffic_t *const tm, const uint64_t n, const double now)
+{
+	const double size = (double)n;
+
+	if (tm->chunks) {
+		const double gap = now - tm->last;
+
+		tm->gap_total += gap;
+		tm->gap_sq_total += gap * gap;
+		if (gap > tm->threshold) {
+			traffic_burst_end(tm);
+			tm->idle_total += gap;
+			if (gap > tm->idle_max)
+				tm->idle_max = gap;
+		}
+	}
+	if (!tm->burst_chunks)
+		tm->burst_start = now;
+	tm->burst_chunks++;
+	tm->burst_bytes += n;
+	tm->burst_last_bytes = n;
+	tm->burst_last = now;
+	tm->last = now;
+	tm->chunks++;
+	tm->bytes += n;
+	if (size < tm->chunk_min)
+		tm->chunk_min = size;
+	if (size > tm->chunk_max)
+		tm->chunk_max = size;
+
+	/*
+	 *  Each gap is paid for by the chunk just sent, so the mean
+	 *  rate comes out right whatever the chunk sizes are
+	 */
+	if (tm->spec.model == TRAFFIC_POISSON) {
+		tm->next += traffic_exp(tm, size / tm->rate);
+	} else {
+		tm->next += size / tm->peak;
+		if (tm->next >= tm->on_end) {
+			tm->next = tm->on_end + traffic_period(tm, tm->spec.off);
+			tm->on_end = tm->next + traffic_period(tm, tm->spec.on);
+		}
+	}
+	tm->chunk = traffic_size(tm);
+}
+
+/*
+ *  traffic_stats_info()
+ *	display the -l model and the bursts it achieved
+ */
+static void traffic_stats_info(traffic_t *const tm)
+{
+	static const char *const model_names[] = {
+		"Poisson", "exponential on/off", "Pareto on/off"
+	};
+	const double gap_mean = (tm->chunks > 1) ?
+		tm->gap_total / (double)(tm->chunks - 1) : 0.0;
+	const double gap_var = (tm->chunks > 1) ?
+		tm->gap_sq_total / (double)(tm->chunks - 1) - gap_mean * gap_mean : 0.0;
+
+	traffic_burst_end(tm);
+	(void)fprintf(stderr, "\nTraffic model:\n");
+	(void)fprintf(stderr, "  Model:          %s\n", model_names[tm->spec.model]);
+	if (tm->spec.model != TRAFFIC_POISSON) {
+		(void)fprintf(stderr, "  Mean on:        %s\n", secs_to_str(tm->spec.on));
+		(void)fprintf(stderr, "  Mean off:       %s\n", secs_to_str(tm->spec.off));
+		(void)fprintf(stderr, "  On rate:        %s/s\n", double_to_str(tm->peak));
+	}
+	if (tm->spec.model == TRAFFIC_PARETO)
+		(void)fprintf(stderr, "  Alpha:          %.2f\n", tm->spec.alpha);
+	if (tm->spec.sigma > 0.0)
+		(void)fprintf(stderr, "  Chunk sizes:    lognormal, sigma %.2f\n", tm->spec.sigma);
+	else
+		(void)fprintf(stderr, "  Chunk sizes:    fixed\n");
+	(void)fprintf(stderr, "  Seed:           %" PRIu64 "\n", tm->spec.seed);
+	(void)fprintf(stderr, "  Chunks:         %" PRIu64 "\n", tm->chunks);
+	if (!tm->chunks)
+		return;
+	(void)fprintf(stderr, "  Avg. chunk:     %s\n",
+		double_to_str((double)tm->bytes / (double)tm->chunks));
+	(void)fprintf(stderr, "  Min. chunk:     %s\n", double_to_str(tm->chunk_min));
+	(void)fprintf(stderr, "  Max. chunk:     %s\n", double_to_str(tm->chunk_max));
+	(void)fprintf(stderr, "  Gap CoV:        %.2f\n",
+		(gap_mean > 0.0) && (gap_var > 0.0) ? sqrt(gap_var) / gap_mean : 0.0);
+	(void)fprintf(stderr, "  Bursts:         %" PRIu64 "\n", tm->bursts);
+	if (tm->bursts) {
+		(void)fprintf(stderr, "  Avg. burst:     %s in %s\n",
+			double_to_str((double)tm->bytes / (double)tm->bursts),
+			secs_to_str(tm->burst_time_total / (double)tm->bursts));
+		(void)fprintf(stderr, "  Max. burst:     %s\n",
+			double_to_str((double)tm->burst_bytes_max));
+		(void)fprintf(stderr, "  Longest burst:  %s\n",
+			secs_to_str(tm->burst_time_max));
+		(void)fprintf(stderr, "  Burst rate:     %s/s\n",
+			double_to_str(tm->burst_rate_max));
+	}
+	if (tm->bursts > 1) {
+		(void)fprintf(stderr, "  Avg. idle:      %s\n",
+			secs_to_str(tm->idle_total / (double)(tm->bursts - 1)));
+		(void)fprintf(stderr, "  Max. idle:      %s\n",
+			secs_to_str(tm->idle_max));
+	}
+	(void)fprintf(stderr, "  Late chunks:    %" PRIu64 "\n", tm->late);
+	(void)fprintf(stderr, "  Max. lateness:  %s\n", secs_to_str(tm->late_max));
+}
+
+/*
+ *  occupancy_sample()
+ *	get the bytes queued in the pipe and the pipe size, the pipe
+ *	size can change under -x or -A so it is read every time
+ */
+static void occupancy_sample(occupancy_t *const oc)
+{
+	int queued;
+#if defined(F_GETPIPE_SZ)
+	const int sz = fcntl(oc->fd, F_GETPIPE_SZ);
+
+	if (sz > 0)
+		oc->capacity = (size_t)sz;
+#endif
+	if (oc->capacity < oc->capacity_min)
+		oc->capacity_min = oc->capacity;
+	if (oc->capacity > oc->capacity_max)
+		oc->capacity_max = oc->capacity;
+	if (ioctl(oc->fd, FIONREAD, &queued) == 0)
+		oc->queued = (queued < 0) ? 0 : (size_t)queued;
+}
+
+/*
+ *  occupancy_init()
+ *	set up -q sampling of an output pipe, returns -1 if the
+ *	output is not a pipe
+ */
+static int occupancy_init(occupancy_t *const oc, const int fd)
+{
+	struct stat buf;
+
+	(void)memset(oc, 0, sizeof(*oc));
+	if ((fstat(fd, &buf) < 0) || !S_ISFIFO(buf.st_mode))
+		return -1;
+	oc->fd = fd;
+	oc->capacity = OCC_PIPE_SIZE_DEFAULT;
+	oc->capacity_min = SIZE_MAX;
+	oc->after_time = mono_time();
+	occupancy_sample(oc);
+	oc->after = oc->queued;
+
+	return 0;
+}
+
+/*
+ *  occupancy_drain()
+ *	sample the pipe and update the estimate of the rate the
+ *	consumer is taking data out of it
+ */
+static void occupancy_drain(occupancy_t *const oc)
+{
+	const double now = mono_time();
+
+	occupancy_sample(oc);
+	if (oc->after >= oc->queued)
+		oc->drained += oc->after - oc->queued;
+	oc->after = oc->queued;
+
+	/* Consumers read in bursts, so average over a window */
+	if (now - oc->after_time >= OCC_DRAIN_WINDOW) {
+		const double rate = (double)oc->drained / (now - oc->after_time);
+
+		oc->drain = (oc->drain > 0.0) ?
+			oc->drain + (rate - oc->drain) * OCC_DRAIN_SMOOTH : rate;
+		oc->drained = 0;
+		oc->after_time = now;
+	}
+}
+
+/*
+ *  occupancy_write()
+ *	write n bytes to the pipe as it has room for them, polling
+ *	for room for at most the time the consumer needs to make it
+ *	rather than blocking in write. The drain rate is only as fast
+ *	as we write, so a faster consumer wakes us up early. If the
+ *	pipe is close to running dry while
+ *	behind the rate the delays are skipped until the next write.
+ *	Returns 0 when written, 1 if sluice was told to finish while
+ *	backing off or -1 on a write error.
+ */
+static int occupancy_write(
+	occupancy_t *const oc,
+	const char *buf,
+	size_t n,
+	const bool behind,
+	stats_t *const stats)
+{
+	size_t bucket;
+	bool full = false, ready = false;
+
+	occupancy_drain(oc);
+	oc->samples++;
+	oc->fill_total += (double)oc->queued / (double)oc->capacity;
+	bucket = (oc->queued * OCC_BUCKETS) / oc->capacity;
+	oc->hist[bucket >= OCC_BUCKETS ? OCC_BUCKETS - 1 : bucket]++;
+	oc->hurry = behind && ((double)oc->queued < (double)oc->capacity * OCC_LOW);
+	if (oc->hurry)
+		oc->hurries++;
+
+	while (n) {
+		/* Wait for room for all of it, or half a pipe of a large write */
+		const size_t want = (n < oc->capacity / 2) ? n : oc->capacity / 2;
+		const size_t room = (oc->queued < oc->capacity) ? oc->capacity - oc->queued : 0;
+		size_t len;
+		double t;
+
+		if ((room < want) && !ready) {
+			struct pollfd pfd;
+			struct timespec ts;
+			double secs = (oc->drain > 0.0) ?
+				(double)(want - room) / oc->drain : OCC_BACKOFF_MAX;
+
+			if (secs < OCC_BACKOFF_MIN)
+				secs = OCC_BACKOFF_MIN;
+			if (secs > OCC_BACKOFF_MAX)
+				secs = OCC_BACKOFF_MAX;
+			ts.tv_sec = (time_t)secs;
+			ts.tv_nsec = (long)((secs - (double)ts.tv_sec) * 1000000000.0);
+			if (!full) {
+				oc->full++;
+				full = true;
+			}
+			oc->backoffs++;
+			stats->delays++;
+			pfd.fd = oc->fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			t = mono_time();
+			/* Writable again, write what fits rather than wait for more */
+			ready = (ppoll(&pfd, 1, &ts, NULL) > 0) && (pfd.revents & POLLOUT);
+			t = mono_time() - t;
+			oc->backoff_time += t;
+			stats->phase_time[PHASE_DELAY] += t;
+			if (sluice_finish)
+				return 1;
+			occupancy_drain(oc);
+			continue;
+		}
+
+		ready = false;
+		len = (n < room) ? n : room;
+		/* A writable pipe has room for at least PIPE_BUF bytes */
+		if (!len)
+			len = (n < PIPE_BUF) ? n : PIPE_BUF;
+		t = mono_time();
+		{
+			const ssize_t ret = write(oc->fd, buf, len);
+
+			stats->phase_time[PHASE_WRITE] += mono_time() - t;
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			buf += ret;
+			n -= (size_t)ret;
+			oc->queued += (size_t)ret;
+			oc->after += (size_t)ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  occupancy_stats_info()
+ *	display the -q pipe fill levels seen before each write
+ */
+static void occupancy_stats_info(const occupancy_t *const oc)
+{
+	size_t i;
+
+	(void)fprintf(stderr, "\nPipe occupancy:\n");
+	(void)fprintf(stderr, "  Pipe size:      %s", double_to_str((double)oc->capacity_min));
+	if (oc->capacity_min != oc->capacity_max)
+		(void)fprintf(stderr, " .. %s", double_to_str((double)oc->capacity_max));
+	(void)fprintf(stderr, "\n");
+	(void)fprintf(stderr, "  Samples:        %" PRIu64 "\n", oc->samples);
+	if (!oc->samples)
+		return;
+	(void)fprintf(stderr, "  Avg. occupancy: %6.2f%%\n",
+		100.0 * oc->fill_total / (double)oc->samples);
+	(void)fprintf(stderr, "  Full:           %" PRIu64 "\n", oc->full);
+	(void)fprintf(stderr, "  Back-offs:      %" PRIu64 "\n", oc->backoffs);
+	(void)fprintf(stderr, "  Back-off time:  %s\n", secs_to_str(oc->backoff_time));
+	(void)fprintf(stderr, "  Delays skipped: %" PRIu64 "\n", oc->hurries);
+	(void)fprintf(stderr, "  Drain rate:     %s/s\n", double_to_str(oc->drain));
+	(void)fprintf(stderr, "  Occupancy histogram:\n");
+	for (i = 0; i < OCC_BUCKETS; i++)
+		(void)fprintf(stderr, "  %5.1f%% - %5.1f%%: %6.2f%%\n",
+			100.0 * (double)i / OCC_BUCKETS,
+			100.0 * (double)(i + 1) / OCC_BUCKETS - 0.1,
+			100.0 * (double)oc->hist[i] / (double)oc->samples);
+}
+
+/*
+ *  replay_u16(), replay_u32()
+ *	read capture file header fields in the capture's byte order
+ */
+static inline uint16_t replay_u16(const replay_t *const rp, const uint8_t *const ptr)
+{
+	uint16_t val;
+
+	(void)memcpy(&val, ptr, sizeof(val));
+	return rp->swap ? __builtin_bswap16(val) : val;
+}
+
+static inline uint32_t replay_u32(const replay_t *const rp, const uint8_t *const ptr)
+{
+	uint32_t val;
+
+	(void)memcpy(&val, ptr, sizeof(val));
+	return rp->swap ? __builtin_bswap32(val) : val;
+}
+
+/*
+ *  replay_be16()
+ *	read a network byte order packet header field
+ */
+static inline uint16_t replay_be16(const uint8_t *const ptr)
+{
+	return (uint16_t)((ptr[0] << 8) | ptr[1]);
+}
+
+/*
+ *  replay_ns()
+ *	convert timestamp ticks of an interface to ns
+ */
+static inline uint64_t replay_ns(const replay_if_t *const ifp, const uint64_t ticks)
+{
+	if (ifp->tps == 1000000000ULL)
+		return ticks;
+	return (ticks / ifp->tps) * 1000000000ULL +
+		(uint64_t)((double)(ticks % ifp->tps) * 1000000000.0 / (double)ifp->tps);
+}
+
+/*
+ *  replay_open()
+ *	map a pcap or pcapng capture and check its header
+ */
+static int replay_open(replay_t *const rp, const char *const filename, const bool frames)
+{
+	struct stat buf;
+	void *ptr;
+	uint32_t magic;
+	int fd;
+
+	(void)memset(rp, 0, sizeof(*rp));
+	rp->frames = frames;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+			filename, errno, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &buf) < 0) {
+		(void)fprintf(stderr, "fstat on %s failed: errno = %d (%s).\n",
+			filename, errno, strerror(errno));
+		(void)close(fd);
+		return -1;
+	}
+	if (buf.st_size < 24) {
+		(void)fprintf(stderr, "%s is too small to be a capture file.\n", filename);
+		(void)close(fd);
+		return -1;
+	}
+	ptr = mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (ptr == MAP_FAILED) {
+		(void)fprintf(stderr, "mmap of %s failed: errno = %d (%s).\n",
+			filename, errno, strerror(errno));
+		return -1;
+	}
+	(void)madvise(ptr, (size_t)buf.st_size, MADV_SEQUENTIAL);
+	rp->base = ptr;
+	rp->size = (size_t)buf.st_size;
+
+	(void)memcpy(&magic, rp->base, sizeof(magic));
+	switch (magic) {
+	case REPLAY_PCAPNG_SHB:
+		/* The section header sets the byte order, see replay_next() */
+		rp->pcapng = true;
+		rp->start = 0;
+		break;
+	case REPLAY_PCAP_MAGIC_US:
+	case REPLAY_PCAP_MAGIC_NS:
+		rp->swap = false;
+		break;
+	default:
+		magic = __builtin_bswap32(magic);
+		if ((magic != REPLAY_PCAP_MAGIC_US) && (magic != REPLAY_PCAP_MAGIC_NS)) {
+			(void)fprintf(stderr, "%s is not a pcap or pcapng capture.\n", filename);
+			(void)munmap(ptr, rp->size);
+			rp->base = NULL;
+			return -1;
+		}
+		rp->swap = true;
+		break;
+	}
+	if (!rp->pcapng) {
+		/* The top bits of the link type can carry FCS details */
+		rp->ifs[0].linktype = replay_u32(rp, rp->base + 20) & 0xffff;
+		rp->ifs[0].tps = (magic == REPLAY_PCAP_MAGIC_NS) ? 1000000000ULL : 1000000ULL;
+		rp->n_ifs = 1;
+		rp->start = 24;
+	}
+	rp->off = rp->start;
+
+	return 0;
+}
+
+/*
+ *  replay_idb()
+ *	add a pcapng interface, the timestamp resolution defaults to
+ *	microseconds unless there is an if_tsresol option
+ */
+static void replay_idb(replay_t *const rp, const uint8_t *const blk, const size_t len)
+{
+	replay_if_t *ifp;
+	size_t off = 16;
+
+	if (rp->n_ifs >= REPLAY_IF_MAX) {
+		rp->n_ifs++;
+		return;
+	}
+	ifp = &rp->ifs[rp->n_ifs++];
+	ifp->linktype = replay_u16(rp, blk + 8);
+	ifp->tps = 1000000ULL;
+
+	while (off + 4 <= len - 4) {
+		const uint16_t code = replay_u16(rp, blk + off);
+		const uint16_t opt_len = replay_u16(rp, blk + off + 2);
+
+		if ((code == 0) || (off + 4 + opt_len > len - 4))
+			break;
+		if ((code == 9) && (opt_len >= 1)) {
+			const uint8_t res = blk[off + 4];
+
+			if (res & 0x80) {
+				ifp->tps = 1ULL << ((res & 0x7f) > 63 ? 63 : (res & 0x7f));
+			} else {
+				uint8_t i;
+
+				ifp->tps = 1;
+				for (i = 0; (i < res) && (i < 19); i++)
+					ifp->tps *= 10;
+			}
+		}
+		off += 4 + ((opt_len + 3U) & ~3U);
+	}
+}
+
+/*
+ *  replay_next()
+ *	get the next packet of the capture, returns false at the end
+ */
+static bool replay_next(replay_t *const rp, replay_pkt_t *const pkt)
+{
+	if (!rp->pcapng) {
+		uint32_t caplen;
+
+		if (rp->off + 16 > rp->size)
+			goto end;
+		caplen = replay_u32(rp, rp->base + rp->off + 8);
+		if (rp->off + 16 + caplen > rp->size)
+			goto end;
+		pkt->ts = replay_ns(&rp->ifs[0],
+			(uint64_t)replay_u32(rp, rp->base + rp->off) * rp->ifs[0].tps +
+			replay_u32(rp, rp->base + rp->off + 4));
+		pkt->data = rp->base + rp->off + 16;
+		pkt->len = caplen;
+		pkt->linktype = rp->ifs[0].linktype;
+		rp->off += 16 + (size_t)caplen;
+		rp->packets++;
+		return true;
+	}
+
+	while (rp->off + 12 <= rp->size) {
+		uint8_t *blk = rp->base + rp->off;
+		uint32_t type, len, ifid = 0, caplen;
+		size_t data;
+
+		(void)memcpy(&type, blk, sizeof(type));
+		if (type == REPLAY_PCAPNG_SHB) {
+			/* New section, new byte order and interfaces */
+			uint32_t bom;
+
+			(void)memcpy(&bom, blk + 8, sizeof(bom));
+			if (bom == REPLAY_PCAPNG_BOM)
+				rp->swap = false;
+			else if (bom == __builtin_bswap32(REPLAY_PCAPNG_BOM))
+				rp->swap = true;
+			else
+				goto end;
+			rp->n_ifs = 0;
+		}
+		type = replay_u32(rp, blk);
+		len = replay_u32(rp, blk + 4);
+		if ((len < 12) || (len & 3) || (rp->off + len > rp->size))
+			goto end;
+		rp->off += len;
+
+		switch (type) {
+		case REPLAY_PCAPNG_IDB:
+			if (len >= 20)
+				replay_idb(rp, blk, len);
+			continue;
+		case REPLAY_PCAPNG_EPB:
+		case REPLAY_PCAPNG_PB:
+			if (len < 32)
+				continue;
+			ifid = (type == REPLAY_PCAPNG_EPB) ?
+				replay_u32(rp, blk + 8) : replay_u16(rp, blk + 8);
+			caplen = replay_u32(rp, blk + 20);
+			data = 28;
+			if ((caplen > len - 32) || (ifid >= rp->n_ifs) || (ifid >= REPLAY_IF_MAX)) {
+				rp->packets++;
+				rp->skipped++;
+				continue;
+			}
+			rp->ts_last = replay_ns(&rp->ifs[ifid],
+				((uint64_t)replay_u32(rp, blk + 12) << 32) |
+				replay_u32(rp, blk + 16));
+			break;
+		case REPLAY_PCAPNG_SPB:
+			/* No timestamp, it goes with the previous packet */
+			if ((len < 16) || !rp->n_ifs)
+				continue;
+			caplen = replay_u32(rp, blk + 8);
+			if (caplen > len - 16)
+				caplen = len - 16;
+			data = 12;
+			break;
+		default:
+			continue;
+		}
+		pkt->ts = rp->ts_last;
+		pkt->data = blk + data;
+		pkt->len = caplen;
+		pkt->linktype = rp->ifs[ifid].linktype;
+		rp->packets++;
+		return true;
+	}
+end:
+	if (rp->off < rp->size)
+		rp->truncated = true;
+	return false;
+}
+
+/*
+ *  replay_payload()
+ *	find the TCP, UDP or other IP payload of a frame, returns
+ *	false if the frame is not IP or the link type is unknown
+ */
+static bool replay_payload(
+	const replay_pkt_t *const pkt,
+	size_t *const off,
+	size_t *const len)
+{
+	const uint8_t *const d = pkt->data;
+	size_t l2, ip, end = pkt->len;
+	uint8_t proto;
+
+	switch (pkt->linktype) {
+	case REPLAY_LINK_NULL:
+	case REPLAY_LINK_LOOP:
+		l2 = 4;
+		break;
+	case REPLAY_LINK_ETHERNET: {
+		uint16_t type;
+
+		if (end < 14)
+			return false;
+		l2 = 14;
+		type = replay_be16(d + 12);
+		/* 802.1Q and 802.1ad tags */
+		while (((type == 0x8100) || (type == 0x88a8)) && (end >= l2 + 4)) {
+			type = replay_be16(d + l2 + 2);
+			l2 += 4;
+		}
+		if ((type != 0x0800) && (type != 0x86dd))
+			return false;
+		break;
+	}
+	case REPLAY_LINK_RAW:
+	case REPLAY_LINK_RAW_BSD:
+	case REPLAY_LINK_IPV4:
+	case REPLAY_LINK_IPV6:
+		l2 = 0;
+		break;
+	case REPLAY_LINK_SLL:
+		l2 = 16;
+		break;
+	case REPLAY_LINK_SLL2:
+		l2 = 20;
+		break;
+	default:
+		return false;
+	}
+	if (end < l2 + 1)
+		return false;
+
+	ip = l2;
+	switch (d[ip] >> 4) {
+	case 4: {
+		const size_t ihl = (size_t)(d[ip] & 0xf) * 4;
+		size_t tot;
+
+		if ((ihl < 20) || (end < ip + ihl))
+			return false;
+		/* Ethernet pads short frames, the IP length is the truth */
+		tot = replay_be16(d + ip + 2);
+		if ((tot >= ihl) && (ip + tot < end))
+			end = ip + tot;
+		proto = d[ip + 9];
+		*off = ip + ihl;
+		/* Later fragments have no transport header */
+		if (replay_be16(d + ip + 6) & 0x1fff)
+			goto done;
+		break;
+	}
+	case 6: {
+		size_t plen;
+
+		if (end < ip + 40)
+			return false;
+		plen = replay_be16(d + ip + 4);
+		if (plen && (ip + 40 + plen < end))
+			end = ip + 40 + plen;
+		proto = d[ip + 6];
+		*off = ip + 40;
+		/* Hop by hop, routing, fragment, destination options and AH */
+		while (*off + 8 <= end) {
+			if ((proto == 0) || (proto == 43) || (proto == 60)) {
+				const size_t ext = ((size_t)d[*off + 1] + 1) * 8;
+
+				proto = d[*off];
+				*off += ext;
+			} else if (proto == 51) {
+				const size_t ext = ((size_t)d[*off + 1] + 2) * 4;
+
+				proto = d[*off];
+				*off += ext;
+			} else if (proto == 44) {
+				const bool later = (replay_be16(d + *off + 2) & 0xfff8) != 0;
+
+				proto = d[*off];
+				*off += 8;
+				if (later)
+					goto done;
+			} else {
+				break;
+			}
+		}
+		break;
+	}
+	default:
+		return false;
+	}
+
+	if ((proto == 6) && (*off + 20 <= end))
+		*off += (size_t)(d[*off + 12] >> 4) * 4;
+	else if (((proto == 17) || (proto == 136)) && (*off + 8 <= end))
+		*off += 8;
+done:
+	if (*off > end)
+		*off = end;
+	*len = end - *off;
+	return true;
+}
+
+/*
+ *  replay_writev()
+ *	write all of the iovecs, carrying on after short writes
+ */
+static int replay_writev(const int fd, const struct iovec *const iov, const int n)
+{
+	struct iovec vec[REPLAY_IOV_MAX];
+	struct iovec *v = vec;
+	int left = n;
+
+	(void)memcpy(vec, iov, sizeof(*iov) * (size_t)n);
+	while (left) {
+		ssize_t ret = writev(fd, v, left);
+
+		if (ret < 0) {
+			if ((errno == EINTR) && !sluice_finish)
+				continue;
+			return -1;
+		}
+		while (left && ((size_t)ret >= v->iov_len)) {
+			ret -= (ssize_t)v->iov_len;
+			v++;
+			left--;
+		}
+		if (left) {
+			v->iov_base = (char *)v->iov_base + ret;
+			v->iov_len -= (size_t)ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ *  replay_flush()
+ *	write out the packets gathered so far
+ */
+static int replay_flush(
+	replay_t *const rp,
+	struct iovec *const iov,
+	int *const n_iov,
+	const int fdout,
+	const int fdtee)
+{
+	if (!*n_iov)
+		return 0;
+	if ((fdout >= 0) && (replay_writev(fdout, iov, *n_iov) < 0))
+		return -1;
+	if ((fdtee >= 0) && (replay_writev(fdtee, iov, *n_iov) < 0))
+		return -1;
+	rp->writes++;
+	*n_iov = 0;
+	return 0;
+}
+
+/*
+ *  replay_stats_info()
+ *	display the -Q replay and how close it came to the capture timing
+ */
+static void replay_stats_info(
+	const replay_t *const rp,
+	const double capture_secs,
+	const double speed,
+	const double secs)
+{
+	static const double percents[] = { 50.0, 90.0, 99.0, 99.9 };
+	size_t i;
+
+	(void)fprintf(stderr, "Capture format:   %s\n", rp->pcapng ? "pcapng" : "pcap");
+	(void)fprintf(stderr, "Packets:          %" PRIu64 "\n", rp->packets);
+	(void)fprintf(stderr, "Packets sent:     %" PRIu64 "\n", rp->sent);
+	if (!rp->frames) {
+		(void)fprintf(stderr, "No payload:       %" PRIu64 "\n", rp->empty);
+		(void)fprintf(stderr, "Not IP:           %" PRIu64 "\n", rp->skipped);
+	}
+	if (rp->truncated)
+		(void)fprintf(stderr, "Capture:          truncated or damaged\n");
+	(void)fprintf(stderr, "Data:             %s\n", double_to_str((double)rp->bytes));
+	(void)fprintf(stderr, "Writes:           %" PRIu64 "\n", rp->writes);
+	(void)fprintf(stderr, "Capture duration: %s\n", secs_to_str(capture_secs));
+	(void)fprintf(stderr, "Duration:         %s\n", secs_to_str(secs));
+	if (speed > 0.0)
+		(void)fprintf(stderr, "Speed:            %.3fx\n", speed);
+	if (secs > 0.0)
+		(void)fprintf(stderr, "Average rate:     %s/s\n",
+			double_to_str((double)rp->bytes / secs));
+	if ((speed <= 0.0) || !rp->sent)
+		return;
+
+	(void)fprintf(stderr, "\nTiming error:\n");
+	(void)fprintf(stderr, "  Average:        %.1f us\n",
+		rp->err_total / (double)rp->sent / 1000.0);
+	for (i = 0; i < SIZEOF_ARRAY(percents); i++) {
+		char label[16];
+		uint64_t ns = lat_percentile(rp->lat, rp->sent, percents[i]);
+
+		if (ns > rp->err_max)
+			ns = rp->err_max;
+		(void)snprintf(label, sizeof(label), "%g%%:", percents[i]);
+		(void)fprintf(stderr, "  %-16s%.1f us\n", label, (double)ns / 1000.0);
+	}
+	(void)fprintf(stderr, "  Max:            %.1f us\n", (double)rp->err_max / 1000.0);
+	(void)fprintf(stderr, "  Late packets:   %" PRIu64 " (%.2f%%)\n", rp->late,
+		100.0 * (double)rp->late / (double)rp->sent);
+}
+
+/*
+ *  replay_run()
+ *	-Q capture replay, send the payloads (or whole frames) of the
+ *	packets of a pcap or pcapng capture at their captured times
+ *	relative to the first packet, scaled by speed. With a rate the
+ *	speed is picked so the replay averages that rate. Packets that
+ *	are already due go out together with one writev.
+ */
+static int replay_run(
+	const char *const filename,
+	const bool frames,
+	double speed,
+	const double rate,
+	const int fdout,
+	const int fdtee,
+	const uint64_t max_trans,
+	const uint64_t timed_run)
+{
+	replay_t *rp;
+	replay_pkt_t pkt;
+	struct iovec iov[REPLAY_IOV_MAX];
+	uint64_t ts_first = 0, ts_end = 0, total = 0;
+	double capture_secs, time_start, time_begin, time_end;
+	bool first = true;
+	int n_iov = 0, ret = EXIT_SUCCESS;
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp) {
+		(void)fprintf(stderr, "Cannot allocate capture replay state.\n");
+		return EXIT_ALLOC_ERROR;
+	}
+	if (replay_open(rp, filename, frames) < 0) {
+		free(rp);
+		return EXIT_FILE_ERROR;
+	}
+
+	/* First pass, the capture time span and the bytes to send */
+	while (replay_next(rp, &pkt)) {
+		size_t off = 0, len = pkt.len;
+
+		if (!frames && !replay_payload(&pkt, &off, &len))
+			continue;
+		if (first || (pkt.ts < ts_first))
+			ts_first = pkt.ts;
+		if (pkt.ts > ts_end)
+			ts_end = pkt.ts;
+		first = false;
+		total += len;
+	}
+	capture_secs = (double)(ts_end - ts_first) / 1000000000.0;
+	if ((rate > 0.0) && (capture_secs > 0.0) && total)
+		speed = rate / ((double)total / capture_secs);
+	if (opt_flags & OPT_NO_RATE_CONTROL)
+		speed = 0.0;
+	rp->off = rp->start;
+	rp->packets = 0;
+	rp->skipped = 0;
+	rp->truncated = false;
+
+	time_begin = timeval_to_double();
+	time_start = mono_time();
+	while (!sluice_finish) {
+		size_t off = 0, len;
+		double due = 0.0, now;
+
+		if (!replay_next(rp, &pkt))
+			break;
+		len = pkt.len;
+		if (!frames) {
+			if (!replay_payload(&pkt, &off, &len)) {
+				rp->skipped++;
+				continue;
+			}
+			if (!len) {
+				rp->empty++;
+				continue;
+			}
+		}
+		if (max_trans && (rp->bytes + len > max_trans))
+			len = (size_t)(max_trans - rp->bytes);
+
+		now = mono_time();
+		if (speed > 0.0)
+			due = time_start + ((pkt.ts > ts_first) ?
+				(double)(pkt.ts - ts_first) / 1000000000.0 / speed : 0.0);
+		/* Send what has gathered before waiting for the next one */
+		if (n_iov && ((due > now) || (n_iov == REPLAY_IOV_MAX))) {
+			if (replay_flush(rp, iov, &n_iov, fdout, fdtee) < 0)
+				goto write_error;
+			now = mono_time();
+		}
+		if (due > now) {
+			struct timespec ts;
+
+			ts.tv_sec = (time_t)due;
+			ts.tv_nsec = (long)((due - (double)ts.tv_sec) * 1000000000.0);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+				if (sluice_finish)
+					goto finish;
+			}
+			now = mono_time();
+		}
+		if (speed > 0.0) {
+			const uint64_t err = (now > due) ? (uint64_t)((now - due) * 1000000000.0) : 0;
+
+			rp->lat[lat_bucket(err)]++;
+			rp->err_total += (double)err;
+			if (err > rp->err_max)
+				rp->err_max = err;
+			if (now - due > REPLAY_LATE)
+				rp->late++;
+		}
+		iov[n_iov].iov_base = pkt.data + off;
+		iov[n_iov].iov_len = len;
+		n_iov++;
+		rp->sent++;
+		rp->bytes += len;
+
+		if ((max_trans && (rp->bytes >= max_trans)) ||
+		    ((opt_flags & OPT_TIMED_RUN) && (now - time_start > (double)timed_run)))
+			break;
+	}
+finish:
+	if (replay_flush(rp, iov, &n_iov, fdout, fdtee) < 0)
+		goto write_error;
+	time_end = timeval_to_double();
+	if (opt_flags & OPT_STATS)
+		replay_stats_info(rp, capture_secs, speed, time_end - time_begin);
+	goto tidy;
+
+write_error:
+	(void)fprintf(stderr, "write error: errno=%d (%s).\n", errno, strerror(errno));
+	ret = EXIT_WRITE_ERROR;
+tidy:
+	(void)munmap(rp->base, rp->size);
+	free(rp);
+
+	return ret;
+}
+
+/*
+ *  tee_thread()
+ *	-E tee writer, write the queued chunks oldest first and then
+ *	anything spilled while the queue was full, so the tee output
+ *	stays in order
+ */
+static void *tee_thread(void *arg)
+{
+	tee_t *const tee = (tee_t *)arg;
+	char *buf = NULL;
+
+	(void)pthread_mutex_lock(&tee->lock);
+	while (!tee->err) {
+		double t, t_write, t_fsync = 0.0;
+		int ret, err;
+
+		if (tee->n_slots) {
+			const tee_slot_t slot = tee->slots[tee->slot_tail];
+			const size_t tail = tee->tail;
+			const size_t first = (slot.size < tee->capacity - tail) ?
+				slot.size : tee->capacity - tail;
+			uint64_t ns;
+
+			(void)pthread_mutex_unlock(&tee->lock);
+			t = mono_time();
+			ret = write_all(tee->fd, tee->ring + tail, first);
+			if ((ret == 0) && (first < slot.size))
+				ret = write_all(tee->fd, tee->ring, slot.size - first);
+			err = errno;
+			t_write = mono_time();
+			if ((ret == 0) && tee->sync) {
+				fsync_data(tee->fd, &tee->sync);
+				t_fsync = mono_time() - t_write;
+			}
+			ns = (uint64_t)((t_write + t_fsync - slot.time) * 1000000000.0);
+			(void)pthread_mutex_lock(&tee->lock);
+
+			tee->write_time += t_write - t;
+			tee->fsync_time += t_fsync;
+			if (ret < 0) {
+				tee->err = err;
+				break;
+			}
+			tee->writes++;
+			tee->written += slot.size;
+			tee->lat[lat_bucket(ns)]++;
+			tee->lag_total += (double)ns;
+			tee->lags++;
+			if (ns > tee->lag_max)
+				tee->lag_max = ns;
+			tee->tail = (tail + slot.size) % tee->capacity;
+			tee->queued -= slot.size;
+			tee->slot_tail = (tee->slot_tail + 1) % TEE_SLOTS;
+			tee->n_slots--;
+			(void)pthread_cond_signal(&tee->room);
+			continue;
+		}
+		if (tee->spilling && (tee->spill_rd < tee->spill_wr)) {
+			const uint64_t off = tee->spill_rd;
+			const size_t len = (tee->spill_wr - off < TEE_SPILL_CHUNK) ?
+				(size_t)(tee->spill_wr - off) : TEE_SPILL_CHUNK;
+
+			if (!buf && ((buf = malloc(TEE_SPILL_CHUNK)) == NULL)) {
+				tee->err = ENOMEM;
+				break;
+			}
+			(void)pthread_mutex_unlock(&tee->lock);
+			t = mono_time();
+			errno = EIO;
+			ret = (pread(tee->fd_spill, buf, len, (off_t)off) == (ssize_t)len) ?
+				write_all(tee->fd, buf, len) : -1;
+			err = errno;
+			t_write = mono_time();
+			if ((ret == 0) && tee->sync) {
+				fsync_data(tee->fd, &tee->sync);
+				t_fsync = mono_time() - t_write;
+			}
+			(void)pthread_mutex_lock(&tee->lock);
+
+			tee->write_time += t_write - t;
+			tee->fsync_time += t_fsync;
+			if (ret < 0) {
+				tee->err = err;
+				break;
+			}
+			tee->writes++;
+			tee->written += len;
+			tee->spill_rd += len;
+			continue;
+		}
+		if (tee->spilling) {
+			/* A spill write is landing at spill_wr, wait for it */
+			if (tee->spill_busy) {
+				(void)pthread_cond_wait(&tee->cond, &tee->lock);
+				continue;
+			}
+			/* Caught up with the spill file, back to the queue */
+			tee->spilling = false;
+			tee->spill_rd = 0;
+			tee->spill_wr = 0;
+			(void)ftruncate(tee->fd_spill, 0);
+			continue;
+		}
+		if (tee->stop)
+			break;
+		(void)pthread_cond_wait(&tee->cond, &tee->lock);
+	}
+	/* A blocked producer has to see a failed writer */
+	(void)pthread_cond_broadcast(&tee->room);
+	(void)pthread_mutex_unlock(&tee->lock);
+	free(buf);
+
+	return NULL;
+}
+
+/*
+ *  tee_write()
+ *	-E queue n bytes for the tee writer, when the queue is full
+ *	wait for it, drop the chunk or spill it depending on the
+ *	policy. Returns 0, 1 if sluice was told to finish while
+ *	waiting or -1 and errno if the writer failed.
+ */
+static int tee_write(
+	tee_t *const tee,
+	const char *buf,
+	size_t n)
+{
+	const double now = mono_time();
+	uint64_t behind;
+	bool full = false;
+
+	(void)pthread_mutex_lock(&tee->lock);
+	tee->chunks++;
+	behind = tee->queued + (tee->spill_wr - tee->spill_rd);
+	tee->behind_total += (double)behind;
+	if (behind > tee->behind_max)
+		tee->behind_max = behind;
+
+	while (n) {
+		const size_t room = tee->capacity - tee->queued;
+		double t;
+
+		if (tee->err) {
+			(void)pthread_mutex_unlock(&tee->lock);
+			errno = tee->err;
+			return -1;
+		}
+		/* Blocking takes what fits, otherwise the chunk goes whole */
+		if (!tee->spilling && (tee->n_slots < TEE_SLOTS) &&
+		    ((room >= n) || ((tee->policy == TEE_BLOCK) && room))) {
+			const size_t len = (room < n) ? room : n;
+			const size_t first = (len < tee->capacity - tee->head) ?
+				len : tee->capacity - tee->head;
+
+			(void)memcpy(tee->ring + tee->head, buf, first);
+			(void)memcpy(tee->ring, buf + first, len - first);
+			tee->slots[tee->slot_head].size = len;
+			tee->slots[tee->slot_head].time = now;
+			tee->slot_head = (tee->slot_head + 1) % TEE_SLOTS;
+			tee->n_slots++;
+			tee->head = (tee->head + len) % tee->capacity;
+			tee->queued += len;
+			buf += len;
+			n -= len;
+			(void)pthread_cond_signal(&tee->cond);
+			continue;
+		}
+		if (!full) {
+			tee->full++;
+			full = true;
+		}
+		if (tee->policy == TEE_DROP) {
+			tee->dropped += n;
+			tee->drops++;
+			break;
+		}
+		if (tee->policy == TEE_SPILL) {
+			const uint64_t off = tee->spill_wr;
+			size_t done = 0;
+
+			/*
+			 *  Write the spill file unlocked so a slow spill disk
+			 *  does not hold up the writer, the writer does not
+			 *  reset the spill file while spill_busy is set
+			 */
+			tee->spilling = true;
+			tee->spill_busy = true;
+			(void)pthread_mutex_unlock(&tee->lock);
+			while (done < n) {
+				const ssize_t ret = pwrite(tee->fd_spill, buf + done,
+					n - done, (off_t)(off + done));
+
+				if (ret < 0) {
+					const int err = errno;
+
+					if (err == EINTR)
+						continue;
+					(void)pthread_mutex_lock(&tee->lock);
+					tee->spill_busy = false;
+					(void)pthread_cond_signal(&tee->cond);
+					(void)pthread_mutex_unlock(&tee->lock);
+					errno = err;
+					return -1;
+				}
+				done += (size_t)ret;
+			}
+			(void)pthread_mutex_lock(&tee->lock);
+			tee->spill_busy = false;
+			tee->spill_wr += n;
+			tee->spilled += n;
+			if (tee->spill_wr - tee->spill_rd > tee->spill_max)
+				tee->spill_max = tee->spill_wr - tee->spill_rd;
+			(void)pthread_cond_signal(&tee->cond);
+			break;
+		}
+		t = mono_time();
+		cond_wait_timed(&tee->room, &tee->lock);
+		tee->block_time += mono_time() - t;
+		if (sluice_finish) {
+			(void)pthread_mutex_unlock(&tee->lock);
+			return 1;
+		}
+	}
+	(void)pthread_mutex_unlock(&tee->lock);
+
+	return 0;
+}
+
+/*
+ *  tee_finish()
+ *	-E stop the tee writer once it has written everything
+ *	queued, returns -1 and errno if it failed
+ */
+static int tee_finish(tee_t *const tee)
+{
+	if (tee->started) {
+		const double t = mono_time();
+
+		(void)pthread_mutex_lock(&tee->lock);
+		tee->stop = true;
+		(void)pthread_cond_signal(&tee->cond);
+		(void)pthread_mutex_unlock(&tee->lock);
+		(void)pthread_join(tee->thread, NULL);
+		tee->started = false;
+		tee->drain_time = mono_time() - t;
+	}
+	if (tee->err) {
+		errno = tee->err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  tee_free()
+ *	stop the -E tee writer and free it
+ */
+static void tee_free(tee_t *const tee)
+{
+	if (!tee)
+		return;
+
+	(void)tee_finish(tee);
+	if (tee->fd_spill >= 0)
+		(void)close(tee->fd_spill);
+	(void)pthread_cond_destroy(&tee->room);
+	(void)pthread_cond_destroy(&tee->cond);
+	(void)pthread_mutex_destroy(&tee->lock);
+	free(tee->ring);
+	free(tee);
+}
+
+/*
+ *  tee_init()
+ *	start a -E tee writer for fd with a capacity byte queue, the
+ *	spill policy spills to an unlinked file in $TMPDIR. Returns
+ *	NULL and errno on failure.
+ */
+static tee_t *tee_init(
+	const int fd,
+	const tee_policy_t policy,
+	const size_t capacity,
+	const bool sync)
+{
+	tee_t *tee;
+	sigset_t set, old_set;
+	int ret;
+
+	tee = calloc(1, sizeof(*tee));
+	if (!tee)
+		return NULL;
+	(void)pthread_mutex_init(&tee->lock, NULL);
+	(void)pthread_cond_init(&tee->cond, NULL);
+	(void)pthread_cond_init(&tee->room, NULL);
+	tee->fd = fd;
+	tee->fd_spill = -1;
+	tee->policy = policy;
+	tee->capacity = capacity;
+	tee->sync = sync;
+	tee->ring = malloc(capacity);
+	if (!tee->ring)
+		goto err;
+
+	if (policy == TEE_SPILL) {
+		const char *dir = getenv("TMPDIR");
+		char path[PATH_MAX];
+
+		if (!dir || !*dir)
+			dir = TEE_SPILL_DIR;
+		(void)snprintf(path, sizeof(path), "%s/sluice-spill-XXXXXX", dir);
+		tee->fd_spill = mkstemp(path);
+		if (tee->fd_spill < 0)
+			goto err;
+		(void)unlink(path);
+	}
+
+	/* Signals are for the pacing thread */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	ret = pthread_create(&tee->thread, NULL, tee_thread, tee);
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (ret) {
+		errno = ret;
+		goto err;
+	}
+	tee->started = true;
+
+	return tee;
+err:
+	ret = errno;
+	tee_free(tee);
+	errno = ret;
+	return NULL;
+}
+
+/*
+ *  tee_stats_info()
+ *	display the -E tee writer statistics and lag
+ */
+static void tee_stats_info(const tee_t *const tee)
+{
+	static const char *const policies[] = { "block", "drop", "spill" };
+	static const double percents[] = { 50.0, 90.0, 99.0, 99.9 };
+	size_t i;
+
+	(void)fprintf(stderr, "\nTee writer:\n");
+	(void)fprintf(stderr, "  Policy:         %s\n", policies[tee->policy]);
+	(void)fprintf(stderr, "  Queue size:     %s\n", double_to_str((double)tee->capacity));
+	(void)fprintf(stderr, "  Written:        %s in %" PRIu64 " writes, ",
+		double_to_str((double)tee->written), tee->writes);
+	(void)fprintf(stderr, "%s\n", secs_to_str(tee->write_time));
+	if (tee->fsync_time > 0.0)
+		(void)fprintf(stderr, "  Fsync:          %s\n", secs_to_str(tee->fsync_time));
+	(void)fprintf(stderr, "  Queue full:     %" PRIu64 " of %" PRIu64 " chunks\n",
+		tee->full, tee->chunks);
+	if (tee->policy == TEE_BLOCK)
+		(void)fprintf(stderr, "  Blocked:        %s\n", secs_to_str(tee->block_time));
+	if (tee->policy == TEE_DROP)
+		(void)fprintf(stderr, "  Dropped:        %s in %" PRIu64 " chunks\n",
+			double_to_str((double)tee->dropped), tee->drops);
+	if (tee->policy == TEE_SPILL) {
+		(void)fprintf(stderr, "  Spilled:        %s, ", double_to_str((double)tee->spilled));
+		(void)fprintf(stderr, "%s most at once\n", double_to_str((double)tee->spill_max));
+	}
+	(void)fprintf(stderr, "  Drain time:     %s\n", secs_to_str(tee->drain_time));
+	if (tee->chunks) {
+		(void)fprintf(stderr, "  Backlog:        %s average, ",
+			double_to_str(tee->behind_total / (double)tee->chunks));
+		(void)fprintf(stderr, "%s max\n", double_to_str((double)tee->behind_max));
+	}
+	if (tee->err)
+		(void)fprintf(stderr, "  Write error:    errno=%d (%s)\n",
+			tee->err, strerror(tee->err));
+	if (!tee->lags)
+		return;
+
+	/* Spilled data is not timed, it is in the backlog above */
+	(void)fprintf(stderr, "\nTee lag:\n");
+	(void)fprintf(stderr, "  Average:        %.3f ms\n",
+		tee->lag_total / (double)tee->lags / 1000000.0);
+	for (i = 0; i < SIZEOF_ARRAY(percents); i++) {
+		char label[16];
+		uint64_t ns = lat_percentile(tee->lat, tee->lags, percents[i]);
+
+		if (ns > tee->lag_max)
+			ns = tee->lag_max;
+		(void)snprintf(label, sizeof(label), "%g%%:", percents[i]);
+		(void)fprintf(stderr, "  %-16s%.3f ms\n", label, (double)ns / 1000000.0);
+	}
+	(void)fprintf(stderr, "  Max:            %.3f ms\n", (double)tee->lag_max / 1000000.0);
+}
+
+/*
+ *  commit_parse()
+ *	parse a -G time=secs,bytes=size[,thread] group commit spec
+ */
+static int commit_parse(char *const str, commit_spec_t *const spec)
+{
+	char *saveptr = NULL, *tok;
+
+	spec->interval = 0.0;
+	spec->bytes = 0;
+	spec->thread = false;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *val;
+
+		if (!strcmp(tok, "thread")) {
+			spec->thread = true;
+			continue;
+		}
+		val = strchr(tok, '=');
+		if (!val || !val[1])
+			return -1;
+		*val++ = '\0';
+		if (!strcmp(tok, "time")) {
+			spec->interval = get_double_scale(val, second_scales, "time");
+			if (spec->interval < COMMIT_INTERVAL_MIN)
+				return -1;
+		} else if (!strcmp(tok, "bytes")) {
+			spec->bytes = get_uint64_byte(val);
+			if (!spec->bytes)
+				return -1;
+		} else {
+			return -1;
+		}
+	}
+	if (!spec->bytes && (spec->interval <= 0.0))
+		spec->interval = COMMIT_INTERVAL_DEFAULT;
+	return 0;
+}
+
+/*
+ *  commit_run()
+ *	-G start writeback on the outputs with sync_file_range and, to
+ *	commit, wait for it with fdatasync. An output that cannot be
+ *	synced, e.g. a socket, is dropped.
+ */
+static void commit_run(commit_t *const cm, const bool commit)
+{
+	uint64_t written[COMMIT_FDS];
+	bool ok[COMMIT_FDS];
+	double t;
+	size_t i;
+
+	(void)pthread_mutex_lock(&cm->lock);
+	for (i = 0; i < cm->n_fds; i++) {
+		written[i] = cm->fds[i].written;
+		ok[i] = cm->fds[i].ok;
+	}
+	(void)pthread_mutex_unlock(&cm->lock);
+
+	t = mono_time();
+	for (i = 0; i < cm->n_fds; i++) {
+		if (ok[i] && (sync_file_range(cm->fds[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE) < 0))
+			ok[i] = false;
+	}
+	cm->kick_time += mono_time() - t;
+	cm->kicks++;
+
+	if (commit) {
+		uint64_t ns;
+
+		t = mono_time();
+		for (i = 0; i < cm->n_fds; i++) {
+			if (ok[i] && (fdatasync(cm->fds[i].fd) < 0))
+				ok[i] = false;
+		}
+		t = mono_time() - t;
+		ns = (uint64_t)(t * 1000000000.0);
+		cm->commit_time += t;
+		cm->commits++;
+		cm->lat[lat_bucket(ns)]++;
+		if (ns > cm->lat_max)
+			cm->lat_max = ns;
+	}
+
+	(void)pthread_mutex_lock(&cm->lock);
+	for (i = 0; i < cm->n_fds; i++) {
+		cm->fds[i].ok = ok[i];
+		if (commit)
+			cm->fds[i].synced = written[i];
+	}
+	(void)pthread_mutex_unlock(&cm->lock);
+}
+
+/*
+ *  commit_thread()
+ *	-G helper, start writeback and commit when asked to, and
+ *	commit anything left unsynced for longer than the interval
+ */
+static void *commit_thread(void *arg)
+{
+	commit_t *const cm = (commit_t *)arg;
+
+	(void)pthread_mutex_lock(&cm->lock);
+	while (!cm->stop) {
+		if (cm->want_kick || cm->want_commit) {
+			const bool commit = cm->want_commit;
+
+			cm->want_kick = false;
+			cm->want_commit = false;
+			(void)pthread_mutex_unlock(&cm->lock);
+			commit_run(cm, commit);
+			(void)pthread_mutex_lock(&cm->lock);
+			continue;
+		}
+		if ((cm->spec.interval > 0.0) && cm->pending) {
+			const double now = mono_time();
+			const double secs = cm->last + cm->spec.interval - now;
+			struct timespec ts;
+
+			if (secs <= 0.0) {
+				cm->want_commit = true;
+				cm->pending = 0;
+				cm->unkicked = 0;
+				cm->last = now;
+				continue;
+			}
+			(void)clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (time_t)secs;
+			ts.tv_nsec += (long)((secs - (double)(time_t)secs) * 1000000000.0);
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			(void)pthread_cond_timedwait(&cm->cond, &cm->lock, &ts);
+			continue;
+		}
+		(void)pthread_cond_wait(&cm->cond, &cm->lock);
+	}
+	(void)pthread_mutex_unlock(&cm->lock);
+
+	return NULL;
+}
+
+/*
+ *  commit_update()
+ *	-G account for n bytes written to each output, starting
+ *	writeback every COMMIT_KICK bytes and committing when the
+ *	time or byte interval is up, on the helper if there is one
+ */
+static void commit_update(commit_t *const cm, const uint64_t n, const double now)
+{
+	bool kick, due;
+	size_t i;
+
+	(void)pthread_mutex_lock(&cm->lock);
+	for (i = 0; i < cm->n_fds; i++) {
+		commit_fd_t *const cf = &cm->fds[i];
+
+		cf->written += n;
+		if (cf->ok && (cf->written - cf->synced > cm->unsynced_max))
+			cm->unsynced_max = cf->written - cf->synced;
+	}
+	cm->pending += n;
+	cm->unkicked += n;
+	due = (cm->spec.bytes && (cm->pending >= cm->spec.bytes)) ||
+	      ((cm->spec.interval > 0.0) && (now - cm->last >= cm->spec.interval));
+	kick = (cm->unkicked >= COMMIT_KICK);
+	if (due) {
+		cm->pending = 0;
+		cm->unkicked = 0;
+		cm->last = now;
+	} else if (kick) {
+		cm->unkicked = 0;
+	}
+	if (cm->started) {
+		if (due) {
+			if (cm->want_commit)
+				cm->coalesced++;
+			cm->want_commit = true;
+		}
+		if (kick)
+			cm->want_kick = true;
+		(void)pthread_cond_signal(&cm->cond);
+		(void)pthread_mutex_unlock(&cm->lock);
+		return;
+	}
+	(void)pthread_mutex_unlock(&cm->lock);
+
+	if (due || kick)
+		commit_run(cm, due);
+}
+
+/*
+ *  commit_stop()
+ *	stop the -G helper, if there is one
+ */
+static void commit_stop(commit_t *const cm)
+{
+	if (!cm->started)
+		return;
+	(void)pthread_mutex_lock(&cm->lock);
+	cm->stop = true;
+	(void)pthread_cond_signal(&cm->cond);
+	(void)pthread_mutex_unlock(&cm->lock);
+	(void)pthread_join(cm->thread, NULL);
+	cm->started = false;
+}
+
+/*
+ *  commit_finish()
+ *	-G stop the helper and commit whatever is left
+ */
+static void commit_finish(commit_t *const cm)
+{
+	bool unsynced = false;
+	size_t i;
+
+	commit_stop(cm);
+	for (i = 0; i < cm->n_fds; i++)
+		unsynced |= cm->fds[i].ok && (cm->fds[i].written != cm->fds[i].synced);
+	if (unsynced)
+		commit_run(cm, true);
+}
+
+/*
+ *  commit_free()
+ *	stop the -G helper and free the group commit state
+ */
+static void commit_free(commit_t *const cm)
+{
+	if (!cm)
+		return;
+
+	commit_stop(cm);
+	(void)pthread_cond_destroy(&cm->cond);
+	(void)pthread_mutex_destroy(&cm->lock);
+	free(cm);
+}
+
+/*
+ *  commit_init()
+ *	start -G group commits of the outputs that are regular files
+ *	or block devices, fd -1 for none. Returns NULL and errno on
+ *	failure, ENODEV if there is nothing to commit.
+ */
+static commit_t *commit_init(
+	const commit_spec_t *const spec,
+	const int fdout,
+	const int fdtee)
+{
+	const int fds[COMMIT_FDS] = { fdout, fdtee };
+	commit_t *cm;
+	sigset_t set, old_set;
+	size_t i;
+	int ret;
+
+	cm = calloc(1, sizeof(*cm));
+	if (!cm)
+		return NULL;
+	(void)pthread_mutex_init(&cm->lock, NULL);
+	(void)pthread_cond_init(&cm->cond, NULL);
+	cm->spec = *spec;
+	cm->last = mono_time();
+
+	for (i = 0; i < COMMIT_FDS; i++) {
+		struct stat buf;
+
+		if ((fds[i] < 0) || (fstat(fds[i], &buf) < 0) ||
+		    !(S_ISREG(buf.st_mode) || S_ISBLK(buf.st_mode)))
+			continue;
+		cm->fds[cm->n_fds].fd = fds[i];
+		cm->fds[cm->n_fds].ok = true;
+		cm->n_fds++;
+	}
+	if (!cm->n_fds) {
+		commit_free(cm);
+		errno = ENODEV;
+		return NULL;
+	}
+	if (!spec->thread)
+		return cm;
+
+	/* Signals are for the pacing thread */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	ret = pthread_create(&cm->thread, NULL, commit_thread, cm);
+	(void)pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (ret) {
+		commit_free(cm);
+		errno = ret;
+		return NULL;
+	}
+	cm->started = true;
+
+	return cm;
+}
+
+/*
+ *  commit_stats_info()
+ *	display the -G group commit statistics and commit latency
+ */
+static void commit_stats_info(const commit_t *const cm)
+{
+	static const double percents[] = { 50.0, 90.0, 99.0, 99.9 };
+	size_t i;
+
+	(void)fprintf(stderr, "\nGroup commit:\n");
+	if (cm->spec.interval > 0.0)
+		(void)fprintf(stderr, "  Every:          %s\n", secs_to_str(cm->spec.interval));
+	if (cm->spec.bytes)
+		(void)fprintf(stderr, "  Every:          %s\n", double_to_str((double)cm->spec.bytes));
+	(void)fprintf(stderr, "  Helper thread:  %s\n", cm->spec.thread ? "yes" : "no");
+	(void)fprintf(stderr, "  Commits:        %" PRIu64 ", %s\n",
+		cm->commits, secs_to_str(cm->commit_time));
+	if (cm->coalesced)
+		(void)fprintf(stderr, "  Coalesced:      %" PRIu64 "\n", cm->coalesced);
+	(void)fprintf(stderr, "  Writeback:      %" PRIu64 " starts, %s\n",
+		cm->kicks, secs_to_str(cm->kick_time));
+	(void)fprintf(stderr, "  Max unsynced:   %s\n", double_to_str((double)cm->unsynced_max));
+	for (i = 0; i < cm->n_fds; i++) {
+		if (!cm->fds[i].ok)
+			(void)fprintf(stderr, "  Sync failed:    fd %d, no longer synced\n",
+				cm->fds[i].fd);
+	}
+	if (!cm->commits)
+		return;
+
+	(void)fprintf(stderr, "\nCommit latency:\n");
+	(void)fprintf(stderr, "  Average:        %.3f ms\n",
+		cm->commit_time * 1000.0 / (double)cm->commits);
+	for (i = 0; i < SIZEOF_ARRAY(percents); i++) {
+		char label[16];
+		uint64_t ns = lat_percentile(cm->lat, cm->commits, percents[i]);
+
+		if (ns > cm->lat_max)
+			ns = cm->lat_max;
+		(void)snprintf(label, sizeof(label), "%g%%:", percents[i]);
+		(void)fprintf(stderr, "  %-16s%.3f ms\n", label, (double)ns / 1000000.0);
+	}
+	(void)fprintf(stderr, "  Max:            %.3f ms\n", (double)cm->lat_max / 1000000.0);
+}
+
+/*
+ *  cache_track()
+ *	start -N tracking of fd, only regular files and block
+ *	devices have page cache to drop
+ */
+static void cache_track(cache_t *const cn, cache_fd_t *const cf, const int fd)
+{
+	struct stat buf;
+	char path[64];
+	off_t cur;
+
+	cf->fd = -1;
+	cf->fd_map = -1;
+	if ((fd < 0) || (fstat(fd, &buf) < 0) ||
+	    !(S_ISREG(buf.st_mode) || S_ISBLK(buf.st_mode)))
+		return;
+	cur = lseek(fd, 0, SEEK_CUR);
+	if (cur < 0)
+		return;
+	cf->fd = fd;
+	cf->done = cur & ~(off_t)(cn->page_size - 1);
+	cf->kicked = cur;
+	cf->cursor = cur;
+	/* Outputs are write only, mincore needs a readable mapping */
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	cf->fd_map = open(path, O_RDONLY);
+}
+
+/*
+ *  cache_resident()
+ *	bytes of a -N file in the page cache from a window before
+ *	the dropped offset up to the cursor, using mincore
+ */
+static uint64_t cache_resident(cache_t *const cn, const cache_fd_t *const cf)
+{
+	off_t start = (cf->done > (off_t)cn->window) ?
+		cf->done - (off_t)cn->window : 0;
+	size_t len, pages, i;
+	uint64_t resident = 0;
+	void *ptr;
+
+	/* mmap needs a page aligned offset, the window need not be */
+	start &= ~(off_t)(cn->page_size - 1);
+	if ((cf->fd_map < 0) || (cf->cursor <= start))
+		return 0;
+	len = (size_t)(cf->cursor - start);
+	pages = (len + cn->page_size - 1) / cn->page_size;
+	if (pages > cn->vec_size) {
+		unsigned char *vec = realloc(cn->vec, pages);
+
+		if (!vec)
+			return 0;
+		cn->vec = vec;
+		cn->vec_size = pages;
+	}
+	ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, cf->fd_map, start);
+	if (ptr == MAP_FAILED)
+		return 0;
+	if (mincore(ptr, len, cn->vec) == 0) {
+		for (i = 0; i < pages; i++)
+			resident += cn->vec[i] & 1;
+	}
+	(void)munmap(ptr, len);
+
+	return resident * cn->page_size;
+}
+
+/*
+ *  cache_file()
+ *	-N start writeback of what has been written to an output and
+ *	drop what is more than the window behind the cursor, waiting
+ *	for its writeback first. At the end drop everything.
+ */
+static void cache_file(cache_t *const cn, cache_fd_t *const cf, const bool final)
+{
+	off_t cur, end, start;
+
+	cur = lseek(cf->fd, 0, SEEK_CUR);
+	if (cur < 0)
+		return;
+	cf->cursor = cur;
+	if (cf->output && (cur > cf->kicked)) {
+		(void)sync_file_range(cf->fd, cf->kicked, cur - cf->kicked, SYNC_FILE_RANGE_WRITE);
+		cf->kicked = cur;
+		cn->kicks++;
+	}
+	end = final ? cur : (cur - (off_t)cn->window) & ~(off_t)(cn->page_size - 1);
+	if (end <= cf->done)
+		return;
+	/*
+	 *  Only whole folios are dropped, so start back far enough to
+	 *  take in a large folio that straddled the last drop's end
+	 */
+	start = (cf->done > (off_t)CACHE_FOLIO_MAX) ?
+		(cf->done - (off_t)CACHE_FOLIO_MAX) & ~(off_t)(CACHE_FOLIO_MAX - 1) : 0;
+
+	if (cf->output) {
+		const double t = mono_time();
+
+		/* Dirty pages cannot be dropped until they are written back */
+		(void)sync_file_range(cf->fd, start, final ? 0 : end - start,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+		cn->wait_time += mono_time() - t;
+		cn->waits++;
+	}
+	/* A length of 0 takes in the partial last page too */
+	if (posix_fadvise(cf->fd, start, final ? 0 : end - start, POSIX_FADV_DONTNEED))
+		cn->errors++;
+	cn->dropped += (uint64_t)(end - cf->done);
+	cn->drops++;
+	cf->done = end;
+}
+
+/*
+ *  cache_sample()
+ *	sample the -N resident page cache of all the files
+ */
+static void cache_sample(cache_t *const cn)
+{
+	uint64_t resident = 0;
+	size_t i;
+
+	for (i = 0; i < CACHE_FDS; i++) {
+		if (cn->fds[i].fd >= 0)
+			resident += cache_resident(cn, &cn->fds[i]);
+	}
+	cn->resident = resident;
+	cn->resident_total += (double)resident;
+	cn->samples++;
+	if (resident > cn->resident_max)
+		cn->resident_max = resident;
+}
+
+/*
+ *  cache_update()
+ *	-N every window / CACHE_STEPS bytes of progress drop what is
+ *	behind the window and sample the resident cache
+ */
+static void cache_update(cache_t *const cn, const uint64_t total_bytes)
+{
+	double t;
+	size_t i;
+
+	if (total_bytes < cn->next)
+		return;
+	cn->next = total_bytes + cn->window / CACHE_STEPS;
+
+	t = mono_time();
+	for (i = 0; i < CACHE_FDS; i++) {
+		if (cn->fds[i].fd >= 0)
+			cache_file(cn, &cn->fds[i], false);
+	}
+	cache_sample(cn);
+	cn->time += mono_time() - t;
+}
+
+/*
+ *  cache_input()
+ *	-N the input is moving on to the next -I file, drop the rest
+ *	of the current one and track fd instead
+ */
+static void cache_input(cache_t *const cn, const int fd)
+{
+	cache_fd_t *const cf = &cn->fds[0];
+	const double t = mono_time();
+
+	if (cf->fd >= 0) {
+		cache_file(cn, cf, true);
+		if (cf->fd_map >= 0)
+			(void)close(cf->fd_map);
+	}
+	cache_track(cn, cf, fd);
+	cn->time += mono_time() - t;
+}
+
+/*
+ *  cache_finish()
+ *	-N drop all the cached pages of the files at the end
+ */
+static void cache_finish(cache_t *const cn)
+{
+	const double t = mono_time();
+	size_t i;
+
+	for (i = 0; i < CACHE_FDS; i++) {
+		if (cn->fds[i].fd >= 0)
+			cache_file(cn, &cn->fds[i], true);
+	}
+	cache_sample(cn);
+	cn->time += mono_time() - t;
+}
+
+/*
+ *  cache_free()
+ *	free the -N cache neutral state
+ */
+static void cache_free(cache_t *const cn)
+{
+	size_t i;
+
+	if (!cn)
+		return;
+
+	for (i = 0; i < CACHE_FDS; i++) {
+		if (cn->fds[i].fd_map >= 0)
+			(void)close(cn->fds[i].fd_map);
+	}
+	free(cn->vec);
+	free(cn);
+}
+
+/*
+ *  cache_init()
+ *	start -N cache neutral streaming of the input and outputs,
+ *	fd -1 for none. Returns NULL and errno on failure, ENODEV if
+ *	none of them are files.
+ */
+static cache_t *cache_init(
+	const uint64_t window,
+	const int fdin,
+	const int fdout,
+	const int fdtee)
+{
+	const int fds[CACHE_FDS] = { fdin, fdout, fdtee };
+	cache_t *cn;
+	long sz;
+	size_t i;
+	bool any = false;
+
+	cn = calloc(1, sizeof(*cn));
+	if (!cn)
+		return NULL;
+	sz = sysconf(_SC_PAGESIZE);
+	cn->page_size = (sz <= 0) ? PAGE_4K : (size_t)sz;
+	cn->window = window;
+	for (i = 0; i < CACHE_FDS; i++) {
+		cache_track(cn, &cn->fds[i], fds[i]);
+		cn->fds[i].output = (i > 0);
+		any |= (cn->fds[i].fd >= 0);
+	}
+	if (!any) {
+		cache_free(cn);
+		errno = ENODEV;
+		return NULL;
+	}
+	return cn;
+}
+
+/*
+ *  cache_stats_info()
+ *	display the -N page cache drops and resident cache sizes
+ */
+static void cache_stats_info(const cache_t *const cn)
+{
+	(void)fprintf(stderr, "\nCache neutral:\n");
+	(void)fprintf(stderr, "  Window:         %s\n", double_to_str((double)cn->window));
+	(void)fprintf(stderr, "  Dropped:        %s in %" PRIu64 " calls, ",
+		double_to_str((double)cn->dropped), cn->drops);
+	(void)fprintf(stderr, "%s\n", secs_to_str(cn->time));
+	(void)fprintf(stderr, "  Writeback:      %" PRIu64 " starts, %" PRIu64 " waits, %s\n",
+		cn->kicks, cn->waits, secs_to_str(cn->wait_time));
+	if (cn->samples) {
+		(void)fprintf(stderr, "  Resident:       %s average, ",
+			double_to_str(cn->resident_total / (double)cn->samples));
+		(void)fprintf(stderr, "%s max\n", double_to_str((double)cn->resident_max));
+		(void)fprintf(stderr, "  Left cached:    %s\n", double_to_str((double)cn->resident));
+	}
+	if (cn->errors)
+		(void)fprintf(stderr, "  Drop errors:    %" PRIu64 "\n", cn->errors);
+}
+
+/*
+ *  show_usage()
+ *	show options
+ */
+static void show_usage(void)
+{
+	(void)printf("%s, version %s\n\n", app_name, VERSION);
+	(void)printf("Usage: %s [options]\n", app_name);
+	(void)printf("  -a         append to file (-t, -O options only).\n");
+	(void)printf("  -A         auto-tune I/O size and pipe size.\n");
+	(void)printf("  -b         sparse -I file, skip or quickly write the holes.\n");
+	(void)printf("  -B rate    write -b holes at rate (in bytes per second).\n");
+	(void)printf("  -c delay   specify constant delay time (seconds).\n");
+	(void)printf("  -C cpus    pin to cpu list, allocate buffers on local node.\n");
+	(void)printf("  -d         discard output (no output).\n");
+	(void)printf("  -D         delay mode.\n");
+	(void)printf("  -e         skip read errors.\n");
+	(void)printf("  -E policy  write -t output from a queue, policy[,size] when\n"
+		     "             full: block, drop or spill.\n");
+	(void)printf("  -f freq    frequency of -v statistics.\n");
+	(void)printf("  -F         fsync file output on each write.\n");
+	(void)printf("  -G spec    group commit file output, time=secs,bytes=size[,thread].\n");
+	(void)printf("  -g group   join shared rate group, group is name,rate[,weight[,min]].\n");
+	(void)printf("  -h         print this help.\n");
+	(void)printf("  -H size    prefetch -I files size bytes ahead of reading.\n");
+	(void)printf("  -i size    set io read/write size in bytes.\n");
+	(void)printf("  -I file    read input from file or socket, files can be repeated,\n"
+		     "             a directory is copied to a -O directory.\n");
+	(void)printf("  -j workers -R generator, -Z compression or directory copy workers.\n");
+	(void)printf("  -J         resume a -I to -O copy from the -K checkpoint.\n");
+	(void)printf("  -k         lock memory to avoid paging.\n");
+	(void)printf("  -K file    checkpoint -I to -O copy progress, file[,interval].\n");
+	(void)printf("  -l model   traffic model, poisson, onoff or pareto[,key=value].\n");
+	(void)printf("  -L file    pace the streams listed in file.\n");
+	(void)printf("  -m size    set maximum amount to process.\n");
+	(void)printf("  -M name    publish live statistics to shared memory.\n");
+	(void)printf("  -n         no rate controls, just copy data untouched.\n");
+	(void)printf("  -o         shrink read/write buffer to avoid overrun.\n");
+	(void)printf("  -N size    keep at most size bytes of file I/O in the page cache.\n");
+	(void)printf("  -O file    short cut for -dt file; output to a file or socket.\n");
+	(void)printf("  -p         enable verbose mode with progress stats.\n");
+	(void)printf("  -P pidfile save process ID into file pidfile.\n");
+	(void)printf("  -q         pace on the stdout pipe fill level.\n");
+	(void)printf("  -Q file    replay a pcap or pcapng capture, file[,speed][,frame].\n");
+	(void)printf("  -r rate    set rate (in bytes per second).\n");
+	(void)printf("  -R	     ignore stdin, read from %s.\n", dev_urandom);
+	(void)printf("  -s shift   controls delay or buffer size adjustment.\n");
+	(void)printf("  -S         display statistics at end of stream to stderr.\n");
+	(void)printf("  -t file    tee output to file or socket.\n");
+	(void)printf("  -T time    stop after a specified amount of time.\n");
+	(void)printf("  -u         expand read/write buffer to avoid underrun.\n");
+	(void)printf("  -U size    udp: datagram size[,packets per second].\n");
+	(void)printf("  -v         set verbose mode (to stderr).\n");
+	(void)printf("  -V         print version information.\n");
+	(void)printf("  -w         warn on data rate underrun.\n");
+	(void)printf("  -W type    block workload, type[,bs[,qd[,iops]]][,direct].\n");
+#if defined(SET_XFER_SIZE)
+	(void)printf("  -x size    set pipe transfer size.\n");
+#endif
+	(void)printf("  -Y policy  scheduling policy[,priority], fifo, rr or other.\n");
+	(void)printf("  -z         ignore stdin, generate zeros.\n");
+	(void)printf("  -Z type    compress or decompress, type[:level][,in|out].\n");
+}
+
+#define DELAY(delay, stats)						\
+	if (delay > 0) {						\
+		const double t_delay = mono_time();			\
+		int delay_ret;						\
+									\
+		stats.delays++;						\
+		SLUICE_PROBE1(delay__start, (uint64_t)delay);		\
+		delay_ret = usleep((useconds_t)delay);			\
+		stats.phase_time[PHASE_DELAY] += mono_time() - t_delay;	\
+		SLUICE_PROBE1(delay__end, (uint64_t)delay);		\
+		if (delay_ret < 0) {					\
+			if (errno == EINTR) {				\
+				if (sluice_finish)			\
+					goto finish;			\
+				/*					\
+				 * usleep got interrupted, let		\
+				 * subsequent I/O cater with the	\
+				 * delay deltas rather than		\
+				 * trying to figure out how much	\
+				 * time was lost on early exit		\
+				 * from usleep				\
+				 */					\
+			} else {					\
+				(void)fprintf(stderr, "usleep error: "	\
+					"errno=%d (%s).\n",		\
+					errno, strerror(errno));	\
+				ret = EXIT_DELAY_ERROR;			\
+				goto tidy;				\
+			}						\
+		}							\
+	}
+
+#define DO_DELAY(delay, di, n, stats)					\
+	if (DELAY_GET_ACTION(n, di->action))				\
+		DELAY(delay / di->divisor, stats);
+
+/*
+ *  buffer_resize()
+ *	grow the main loop buffer when the rate controller
+ *	asks for a larger io_size
+ */
+static int buffer_resize(void *ctx, const double old_size, const double new_size)
+{
+	char **buffer = (char **)ctx;
+	char *tmp;
+
+	tmp = realloc(*buffer, BUF_SIZE(new_size));
+	if (!tmp)
+		return -1;
+	if (opt_flags & OPT_ZERO)
+		(void)memset(tmp, 0, (size_t)new_size);
+	SLUICE_PROBE2(buffer__resize, (uint64_t)old_size, (uint64_t)new_size);
+	*buffer = tmp;
+	return 0;
+}
+
+/*
+ *  stats_pacer()
+ *	copy the rate controller's statistics
+ */
+static void stats_pacer(stats_t *const stats, const sluice_pacer_t *pacer)
+{
+	sluice_pacer_stats_t ps;
+
+	sluice_pacer_stats(pacer, &ps);
+	stats->underruns = ps.underruns;
+	stats->overruns = ps.overruns;
+	stats->perfect = ps.perfect;
+	stats->reallocs = ps.reallocs;
+	stats->io_size_min = (uint64_t)ps.io_size_min;
+	stats->io_size_max = (uint64_t)ps.io_size_max;
+	(void)memcpy(stats->drift, ps.drift, sizeof(stats->drift));
+	stats->drift_total = ps.drift_total;
+	stats->target_rate = ps.target_rate;
+	stats->rate_min = ps.rate_min;
+	stats->rate_max = ps.rate_max;
+}
+
+static const delay_info_t *get_delay_info(uint64_t delay_mode)
+{
+	int i;
+
+	if (delay_mode > DELAY_MODE_MAX) {
+		(void)fprintf(stderr, "Delay mode -D %" PRIu64
+			" is too large, range 0..%u.\n",
+			delay_mode, DELAY_MODE_MAX);
+		return NULL;
+	}
+
+	for (i = 0; i <= DELAY_MODE_MAX; i++) {
+		if (delay_info[i].mode == delay_mode)
+			return &delay_info[i];
+	}
+	(void)fprintf(stderr, "Cannot find delay mode %" PRIu64 ".\n",
+			delay_mode);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	char run = ' ';			/* Overrun/underrun flag */
+	char *buffer = NULL;		/* Temp I/O buffer */
+	char *out_filename = NULL;	/* -t or -O option filename */
+	char *in_filename = NULL;	/* -I option filename */
+	char **in_filenames = NULL;	/* -I option filenames */
+	size_t n_in_files = 0;		/* Number of -I files */
+	size_t in_file = 0;		/* -I file being read */
+	char *pid_filename = NULL;	/* -P option filename */
+	char *stream_filename = NULL;	/* -L option filename */
+	char *outbuf;			/* Data to write */
+	char *group_name = NULL;	/* -g rate group name */
+	char *shm_name = NULL;		/* -M option segment name */
+	char *replay_filename = NULL;	/* -Q capture file */
+	char shm_path[PATH_MAX];	/* -M segment path */
+
+	double delay;
+	double io_size = 0.9;		/* -i IO buffer size */
+	double data_rate = 0.0;		/* -r data rate */
+	double secs_start, secs_last, freq = DEFAULT_FREQ;
+	double const_delay = -1.0;	/* -c delay time between I/O */
+	double group_rate = 0.0;	/* -g group aggregate rate */
+	double group_weight = 1.0;	/* -g member weight */
+	double group_min = 0.0;		/* -g member minimum rate */
+	double group_time = 0.0;	/* -g last share update */
+	double replay_speed = 1.0;	/* -Q speed multiplier */
 
-	uint64_t last_delay = 0;	/* Delays in 1/1000000 of a second */
 	uint64_t total_bytes = 0;	/* cumulative number of bytes read */
 	uint64_t max_trans = 0;		/* -m maximum data transferred */
 	uint64_t adjust_shift = 0;	/* -s adjustment scaling shift */
 	uint64_t timed_run = 0;		/* -T timed run duration */
 	uint64_t delay_mode = DELAY_R_W_D; /* read, write then delay */
+	uint64_t gen_workers = 0;	/* -j generator workers */
+	uint64_t dgram_size = DGRAM_SIZE_DEFAULT; /* -U datagram size */
+	uint64_t prefetch_distance = 0;	/* -H prefetch distance */
+	double hole_rate = 0.0;		/* -B sparse hole rate */
+	block_spec_t block_spec = {	/* -W block workload */
+		BLOCK_SIZE_DEFAULT, 1, 0.0, false, false, false
+	};
+	traffic_spec_t traffic_spec = {	/* -l traffic model */
+		TRAFFIC_POISSON, TRAFFIC_ON_DEFAULT, TRAFFIC_OFF_DEFAULT,
+		TRAFFIC_ALPHA_DEFAULT, 0.0, 0, false
+	};
+	int codec_level = 0;		/* -Z compression level */
+	bool codec_rate_in = false;	/* -Z rate applies to input */
+	bool replay_frames = false;	/* -Q send whole frames */
+	tee_policy_t tee_policy = TEE_BLOCK; /* -E queue full policy */
+	uint64_t tee_size = TEE_QUEUE_DEFAULT; /* -E queue size */
+	commit_spec_t commit_spec;	/* -G group commit */
+	uint64_t cache_window = 0;	/* -N cache window */
 #if defined(SET_XFER_SIZE)
 	uint64_t xfer_size = 0;		/* Pipe transfer size */
 #endif
 
 	off_t progress_size = 0;
 
-	int underrun_adjust = UNDERRUN_ADJUST_MAX;
-	int overrun_adjust = OVERRUN_ADJUST_MAX;
+	int warnings = 0;		/* Underruns in a row */
 	int fdin = -1, fdout, fdtee = -1;
-	int underruns = 0, overruns = 0, warnings = 0;
 	int ret = EXIT_SUCCESS;
+	int sched_policy = SCHED_OTHER, sched_priority = 0;
+	int fd_migrations = -1;
+	int fddgram = -1;		/* -O udp: socket */
 	bool fdout_sync = false, fdtee_sync = false;
 
 #if defined(SET_XFER_SIZE)
@@ -857,14 +8936,39 @@ int main(int argc, char **argv)
 	bool eof = false;		/* EOF on input */
 
 	stats_t stats;			/* Data rate statistics */
-	struct sigaction new_action;
 	const delay_info_t *di = NULL;
+	sluice_pacer_t *pacer = NULL;	/* Rate controller */
+	sluice_pacer_opts_t pacer_opts;	/* Rate controller settings */
+	sluice_shm_t *shm = NULL;	/* -M live statistics */
+	gen_t *gen = NULL;		/* -j generator */
+	codec_t *codec = NULL;		/* -Z compression stage */
+	const codec_type_t *codec_type = NULL; /* -Z compression type */
+	group_t *group = NULL;		/* -g rate group */
+	checkpoint_t checkpoint;	/* -K checkpoint state */
+	checkpoint_t *ckpt = NULL;	/* -K checkpointing enabled */
+	autotune_t autotune;		/* -A auto-tune state */
+	autotune_t *at = NULL;		/* -A auto-tune enabled */
+	traffic_t traffic;		/* -l traffic model state */
+	traffic_t *tm = NULL;		/* -l traffic model enabled */
+	occupancy_t occupancy;		/* -q pipe occupancy state */
+	occupancy_t *occ = NULL;	/* -q pipe occupancy enabled */
+	prefetch_t *prefetch = NULL;	/* -H prefetcher */
+	tee_t *tee = NULL;		/* -E asynchronous tee writer */
+	commit_t *commit = NULL;	/* -G group commit */
+	cache_t *cache = NULL;		/* -N cache neutral streaming */
+	sparse_t *sparse = NULL;	/* -b sparse input */
+	cpu_set_t cpu_set;		/* -C cpu affinity */
+	struct stat in_stat;		/* -I file or directory */
+	sock_server_t *sock_out = NULL;	/* -O/-t listening socket */
+	bool sock_stable = false;	/* -O/-t data is safe to send zero copy */
 
 	stats_init(&stats);
+	(void)memset(&checkpoint, 0, sizeof(checkpoint));
+	checkpoint.interval = CHECKPOINT_INTERVAL;
 
 	for (;;) {
 		const int c = getopt(argc, argv,
-			"ar:h?i:vm:wudot:f:FzRs:c:O:SnT:I:VpeD:P:x:");
+			"aAbB:E:g:G:r:h?H:i:j:JkK:l:vL:m:M:qQ:wW:udot:f:FzRs:c:C:O:SnN:T:I:U:VpeD:P:x:Y:Z:");
 		size_t len;
 
 		if (c == -1)
@@ -873,13 +8977,33 @@ int main(int argc, char **argv)
 		case 'a':
 			opt_flags |= OPT_APPEND;
 			break;
+		case 'A':
+			opt_flags |= OPT_AUTOTUNE;
+			break;
+		case 'b':
+			opt_flags |= OPT_SPARSE;
+			break;
+		case 'B':
+			opt_flags |= OPT_SPARSE;
+			hole_rate = get_double_byte(optarg);
+			if ((hole_rate < DATA_RATE_MIN) || (hole_rate > 1.0 * PB)) {
+				(void)fprintf(stderr, "-B hole rate must be %.2f bytes/sec .. 1PB/sec.\n",
+					DATA_RATE_MIN);
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
 		case 'c':
 			opt_flags |= (OPT_GOT_CONST_DELAY |
 				      OPT_UNDERRUN |
 				      OPT_OVERRUN);
 			const_delay = atof(optarg);
-			underrun_adjust = 1;
-			overrun_adjust = 1;
+			break;
+		case 'C':
+			opt_flags |= OPT_CPU_AFFINITY;
+			if (parse_cpu_list(optarg, &cpu_set) < 0) {
+				(void)fprintf(stderr, "Invalid -C cpu list.\n");
+				exit(EXIT_BAD_OPTION);
+			}
 			break;
 		case 'D':
 			delay_mode = get_uint64(optarg, &len);
@@ -890,12 +9014,68 @@ int main(int argc, char **argv)
 		case 'e':
 			opt_flags |= OPT_SKIP_READ_ERRORS;
 			break;
+		case 'E': {
+			char *saveptr = NULL, *tok;
+
+			opt_flags |= OPT_ASYNC_TEE;
+			tok = strtok_r(optarg, ",", &saveptr);
+			if (tok && !strcmp(tok, "block")) {
+				tee_policy = TEE_BLOCK;
+			} else if (tok && !strcmp(tok, "drop")) {
+				tee_policy = TEE_DROP;
+			} else if (tok && !strcmp(tok, "spill")) {
+				tee_policy = TEE_SPILL;
+			} else {
+				(void)fprintf(stderr, "-E expects block, drop or spill[,size].\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			tok = strtok_r(NULL, ",", &saveptr);
+			if (tok) {
+				tee_size = get_uint64_byte(tok);
+				if ((tee_size < TEE_QUEUE_MIN) || (tee_size > (uint64_t)SIZE_MAX / 2)) {
+					(void)fprintf(stderr, "-E queue size must be at least %s.\n",
+						double_to_str((double)TEE_QUEUE_MIN));
+					exit(EXIT_BAD_OPTION);
+				}
+			}
+			break;
+		}
 		case 'f':
 			freq = atof(optarg);
 			break;
 		case 'F':
 			opt_flags |= OPT_FSYNC;
 			break;
+		case 'G':
+			opt_flags |= OPT_GROUP_COMMIT;
+			if (commit_parse(optarg, &commit_spec) < 0) {
+				(void)fprintf(stderr, "-G expects time=secs (at least %gs), bytes=size "
+					"or thread, comma separated.\n", COMMIT_INTERVAL_MIN);
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		case 'g': {
+			char *saveptr = NULL, *tok;
+
+			opt_flags |= OPT_GROUP;
+			group_name = strtok_r(optarg, ",", &saveptr);
+			tok = strtok_r(NULL, ",", &saveptr);
+			if (!group_name || !tok || strchr(group_name, '/')) {
+				(void)fprintf(stderr, "-g option expects name,rate[,weight[,min]].\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			group_rate = get_double_byte(tok);
+			if ((tok = strtok_r(NULL, ",", &saveptr)) != NULL)
+				group_weight = atof(tok);
+			if ((tok = strtok_r(NULL, ",", &saveptr)) != NULL)
+				group_min = get_double_byte(tok);
+			if ((group_rate < DATA_RATE_MIN) || (group_rate > 1.0 * PB) ||
+			    (group_weight <= 0.0) || (group_min < 0.0)) {
+				(void)fprintf(stderr, "Invalid -g group rate, weight or minimum rate.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		}
 		case 'h':
 			show_usage();
 			exit(EXIT_SUCCESS);
@@ -903,20 +9083,95 @@ int main(int argc, char **argv)
 			opt_flags |= OPT_GOT_IOSIZE;
 			io_size = (double)get_uint64_byte(optarg);
 			break;
-		case 'I':
+		case 'I': {
+			char **tmp;
+
+			/* Multiple -I files are read one after another */
 			opt_flags |= OPT_INPUT_FILE;
-			in_filename = optarg;
+			tmp = realloc(in_filenames, (n_in_files + 1) * sizeof(*tmp));
+			if (!tmp) {
+				(void)fprintf(stderr, "Cannot allocate -I file list.\n");
+				exit(EXIT_ALLOC_ERROR);
+			}
+			in_filenames = tmp;
+			in_filenames[n_in_files++] = optarg;
+			in_filename = in_filenames[0];
+			break;
+		}
+		case 'j':
+			opt_flags |= OPT_GEN_WORKERS;
+			gen_workers = get_uint64(optarg, &len);
+			if ((gen_workers < GEN_WORKERS_MIN) ||
+			    (gen_workers > GEN_WORKERS_MAX)) {
+				(void)fprintf(stderr, "Generator workers must be %d .. %d.\n",
+					GEN_WORKERS_MIN, GEN_WORKERS_MAX);
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		case 'H':
+			opt_flags |= OPT_PREFETCH;
+			prefetch_distance = get_uint64_byte(optarg);
+			if (prefetch_distance < PREFETCH_CHUNK) {
+				(void)fprintf(stderr, "-H prefetch distance must be at least %s.\n",
+					double_to_str((double)PREFETCH_CHUNK));
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		case 'J':
+			opt_flags |= OPT_RESUME;
+			break;
+		case 'k':
+			opt_flags |= OPT_MLOCK;
+			break;
+		case 'K': {
+			char *saveptr = NULL, *tok;
+
+			opt_flags |= OPT_CHECKPOINT;
+			checkpoint.path = strtok_r(optarg, ",", &saveptr);
+			if ((tok = strtok_r(NULL, ",", &saveptr)) != NULL)
+				checkpoint.interval = (double)get_uint64_time(tok);
+			if (!checkpoint.path || (checkpoint.interval < 1.0)) {
+				(void)fprintf(stderr, "-K option expects file[,interval] with an interval of at least 1 second.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		}
+		case 'l':
+			opt_flags |= OPT_TRAFFIC;
+			if (traffic_parse(optarg, &traffic_spec) < 0) {
+				(void)fprintf(stderr, "-l expects poisson, onoff or pareto, then optional "
+					"on=secs, off=secs, alpha=a (> 1), sigma=s (0 .. %.0f) or seed=n.\n",
+					TRAFFIC_SIGMA_MAX);
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		case 'L':
+			opt_flags |= OPT_STREAM_LIST;
+			stream_filename = optarg;
 			break;
 		case 'm':
 			opt_flags |= OPT_MAX_TRANS_SIZE;
 			max_trans = get_uint64_byte(optarg);
 			break;
+		case 'M':
+			opt_flags |= OPT_SHM_STATS;
+			shm_name = optarg;
+			break;
 		case 'n':
 			opt_flags |= OPT_NO_RATE_CONTROL;
 			break;
 		case 'o':
 			opt_flags |= OPT_OVERRUN;
 			break;
+		case 'N':
+			opt_flags |= OPT_CACHE_NEUTRAL;
+			cache_window = get_uint64_byte(optarg);
+			if (cache_window < CACHE_WINDOW_MIN) {
+				(void)fprintf(stderr, "-N cache window must be at least %s.\n",
+					double_to_str((double)CACHE_WINDOW_MIN));
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
 		case 'O':
 			opt_flags |= OPT_DISCARD_STDOUT;
 			out_filename = optarg;
@@ -927,6 +9182,33 @@ int main(int argc, char **argv)
 		case 'P':
 			pid_filename = optarg;
 			break;
+		case 'q':
+			opt_flags |= OPT_OCCUPANCY;
+			break;
+		case 'Q': {
+			char *saveptr = NULL, *tok;
+
+			opt_flags |= OPT_REPLAY;
+			replay_filename = strtok_r(optarg, ",", &saveptr);
+			while ((tok = strtok_r(NULL, ",", &saveptr)) != NULL) {
+				if (!strcmp(tok, "frame")) {
+					replay_frames = true;
+					continue;
+				}
+				replay_speed = atof(tok);
+				if ((replay_speed < REPLAY_SPEED_MIN) ||
+				    (replay_speed > REPLAY_SPEED_MAX)) {
+					(void)fprintf(stderr, "-Q speed must be %g .. %g.\n",
+						REPLAY_SPEED_MIN, REPLAY_SPEED_MAX);
+					exit(EXIT_BAD_OPTION);
+				}
+			}
+			if (!replay_filename) {
+				(void)fprintf(stderr, "-Q expects file[,speed][,frame].\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		}
 		case 'r':
 			data_rate = get_double_byte(optarg);
 			if (data_rate > 1.0 * PB) {
@@ -958,9 +9240,92 @@ int main(int argc, char **argv)
 		case 'u':
 			opt_flags |= OPT_UNDERRUN;
 			break;
+		case 'U': {
+			char *saveptr = NULL, *tok;
+
+			opt_flags |= OPT_DGRAM;
+			tok = strtok_r(optarg, ",", &saveptr);
+			dgram_size = tok ? get_uint64_byte(tok) : 0;
+			if ((dgram_size <= sizeof(dgram_hdr_t)) ||
+			    (dgram_size > DGRAM_SIZE_MAX)) {
+				(void)fprintf(stderr, "-U size must be in the range %zu to %d.\n",
+					sizeof(dgram_hdr_t) + 1, DGRAM_SIZE_MAX);
+				exit(EXIT_BAD_OPTION);
+			}
+			/* A packet rate is just a data rate in datagrams */
+			if ((tok = strtok_r(NULL, ",", &saveptr)) != NULL) {
+				const double pps = atof(tok);
+
+				if (pps <= 0.0) {
+					(void)fprintf(stderr, "-U packet rate must be greater than zero.\n");
+					exit(EXIT_BAD_OPTION);
+				}
+				data_rate = pps * (double)dgram_size;
+				opt_flags |= OPT_GOT_RATE;
+			}
+			break;
+		}
 		case 'v':
 			opt_flags |= OPT_VERBOSE;
 			break;
+		case 'W': {
+			char *saveptr = NULL, *tok;
+			int field = 0;
+
+			opt_flags |= OPT_BLOCK;
+			tok = strtok_r(optarg, ",", &saveptr);
+			if (tok && !strcmp(tok, "read")) {
+				block_spec.write = false;
+			} else if (tok && !strcmp(tok, "write")) {
+				block_spec.write = true;
+			} else if (tok && !strcmp(tok, "randread")) {
+				block_spec.random = true;
+			} else if (tok && !strcmp(tok, "randwrite")) {
+				block_spec.write = true;
+				block_spec.random = true;
+			} else {
+				(void)fprintf(stderr, "-W type must be read, write, randread or randwrite.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			while ((tok = strtok_r(NULL, ",", &saveptr)) != NULL) {
+				if (!strcmp(tok, "direct")) {
+					block_spec.direct = true;
+					continue;
+				}
+				switch (field++) {
+				case 0:
+					block_spec.bs = get_uint64_byte(tok);
+					if ((block_spec.bs < IO_SIZE_MIN) || (block_spec.bs > 64 * MB)) {
+						(void)fprintf(stderr, "-W block size must be 1 byte to 64MB.\n");
+						exit(EXIT_BAD_OPTION);
+					}
+					break;
+				case 1:
+					block_spec.qd = get_uint64(tok, &len);
+					if ((block_spec.qd < 1) || (block_spec.qd > BLOCK_QD_MAX)) {
+						(void)fprintf(stderr, "-W queue depth must be 1 .. %d.\n",
+							BLOCK_QD_MAX);
+						exit(EXIT_BAD_OPTION);
+					}
+					break;
+				case 2:
+					block_spec.iops = atof(tok);
+					if (block_spec.iops <= 0.0) {
+						(void)fprintf(stderr, "-W IOPS must be greater than zero.\n");
+						exit(EXIT_BAD_OPTION);
+					}
+					break;
+				default:
+					(void)fprintf(stderr, "-W is type[,bs[,qd[,iops]]][,direct].\n");
+					exit(EXIT_BAD_OPTION);
+				}
+			}
+			if (block_spec.direct && (block_spec.bs % 512)) {
+				(void)fprintf(stderr, "-W direct block size must be a multiple of 512 bytes.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
+		}
 		case 'V':
 			opt_flags |= OPT_VERSION;
 			(void)printf("%s: %s\n", app_name, VERSION);
@@ -988,9 +9353,58 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 			break;
 #endif
+		case 'Y':
+			opt_flags |= OPT_SCHED;
+			if (parse_sched(optarg, &sched_policy, &sched_priority) < 0) {
+				(void)fprintf(stderr, "-Y option expects fifo, rr or other "
+					"and an optional valid priority.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			break;
 		case 'z':
 			opt_flags |= OPT_ZERO;
 			break;
+		case 'Z': {
+			char *saveptr = NULL, *name, *side, *level;
+			size_t i;
+
+			opt_flags |= OPT_CODEC;
+			name = strtok_r(optarg, ",", &saveptr);
+			side = strtok_r(NULL, ",", &saveptr);
+			level = name ? strchr(name, ':') : NULL;
+			if (level)
+				*level++ = '\0';
+			for (i = 0; name && (i < SIZEOF_ARRAY(codec_types)); i++) {
+				if (!strcmp(name, codec_types[i].name)) {
+					codec_type = &codec_types[i];
+					break;
+				}
+			}
+			if (!codec_type ||
+			    (side && strcmp(side, "in") && strcmp(side, "out"))) {
+				(void)fprintf(stderr, "-Z option expects lz4, unlz4, zstd or unzstd, "
+					"an optional :level and an optional ,in or ,out.\n");
+				exit(EXIT_BAD_OPTION);
+			}
+			if (!codec_type->available) {
+				(void)fprintf(stderr, "%s support was not built in, rebuild with make %s=1.\n",
+					codec_type->name,
+					codec_type->algo == CODEC_LZ4 ? "LZ4" : "ZSTD");
+				exit(EXIT_BAD_OPTION);
+			}
+			codec_level = codec_type->level_default;
+			if (level) {
+				codec_level = atoi(level);
+				if (codec_type->decompress || (codec_level < 0) ||
+				    (codec_level > codec_type->level_max)) {
+					(void)fprintf(stderr, "-Z %s level must be 0 to %d.\n",
+						codec_type->name, codec_type->level_max);
+					exit(EXIT_BAD_OPTION);
+				}
+			}
+			codec_rate_in = side && !strcmp(side, "in");
+			break;
+		}
 		case '?':
 			(void)printf("Try '%s -h' for more information.\n", app_name);
 			exit(EXIT_BAD_OPTION);
@@ -1017,6 +9431,22 @@ int main(int argc, char **argv)
 		ret = EXIT_FILE_ERROR;
 		goto tidy;
 	}
+	if (opt_flags & OPT_GROUP) {
+		if (opt_flags & (OPT_NO_RATE_CONTROL | OPT_GOT_CONST_DELAY)) {
+			(void)fprintf(stderr, "Cannot use -g with -c or -n options.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		group = group_join(group_name, group_rate, group_weight, group_min,
+			(opt_flags & OPT_GOT_RATE) ? data_rate : 0.0);
+		if (!group) {
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		/* Our rate is now our share of the group rate */
+		data_rate = group_update(group);
+		opt_flags |= OPT_GOT_RATE;
+	}
 	if ((opt_flags & OPT_NO_RATE_CONTROL) &&
             (opt_flags & (OPT_GOT_CONST_DELAY | OPT_GOT_RATE | OPT_UNDERRUN | OPT_OVERRUN))) {
 		(void)fprintf(stderr, "Cannot use -n option with -c, -r, -u or -o options.\n");
@@ -1028,7 +9458,114 @@ int main(int argc, char **argv)
 		ret = EXIT_BAD_OPTION;
 		goto tidy;
 	}
-	if (!(opt_flags & (OPT_GOT_RATE | OPT_NO_RATE_CONTROL))) {
+	if (opt_flags & OPT_STREAM_LIST) {
+		/* The streams are paced on their own, these are not per stream */
+		if (opt_flags & (OPT_GOT_CONST_DELAY | OPT_INPUT_FILE |
+				 OPT_DISCARD_STDOUT | OPT_URANDOM | OPT_ZERO |
+				 OPT_UNDERRUN | OPT_OVERRUN | OPT_MAX_TRANS_SIZE |
+				 OPT_SHM_STATS | OPT_GEN_WORKERS | OPT_GROUP |
+				 OPT_CODEC | OPT_FSYNC | OPT_CPU_AFFINITY |
+				 OPT_SCHED | OPT_MLOCK | OPT_DGRAM |
+				 OPT_CHECKPOINT | OPT_RESUME | OPT_PREFETCH |
+				 OPT_SPARSE | OPT_BLOCK | OPT_AUTOTUNE |
+				 OPT_TRAFFIC | OPT_OCCUPANCY | OPT_REPLAY |
+				 OPT_ASYNC_TEE | OPT_GROUP_COMMIT |
+				 OPT_CACHE_NEUTRAL) ||
+		    out_filename) {
+			(void)fprintf(stderr, "Cannot use -L with -A, -b, -c, -C, -d, -E, -F, -g, -G, "
+				"-H, -I, -j, -J, -k, -K, -l, -m, -M, -N, -o, -O, -q, -Q, -R, "
+				"-t, -u, -U, -W, -Y, -z or -Z options.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if ((opt_flags & OPT_GOT_RATE) && (data_rate < DATA_RATE_MIN)) {
+			(void)fprintf(stderr, "Rate value %.2f too low. Minimum allowed is %.2f bytes/sec.\n",
+				data_rate, DATA_RATE_MIN);
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if ((opt_flags & OPT_GOT_IOSIZE) &&
+		    ((io_size < IO_SIZE_MIN) || (io_size > IO_SIZE_MAX))) {
+			(void)fprintf(stderr, "I/O buffer size too large, maximum allowed: %s.\n",
+				double_to_str((double)IO_SIZE_MAX));
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if (sigaction_setup() < 0) {
+			ret = EXIT_SIGNAL_ERROR;
+			goto tidy;
+		}
+		ret = streams_run(stream_filename,
+			(opt_flags & OPT_GOT_RATE) ? data_rate : 0.0,
+			io_size, timed_run, freq);
+		goto tidy;
+	}
+	if (n_in_files > 1) {
+		size_t i;
+
+		for (i = 0; i < n_in_files; i++) {
+			if (sock_is_spec(in_filenames[i])) {
+				(void)fprintf(stderr, "Multiple -I options can only be used with files.\n");
+				ret = EXIT_BAD_OPTION;
+				goto tidy;
+			}
+		}
+	}
+	if ((opt_flags & OPT_PREFETCH) &&
+	    (!in_filename || sock_is_spec(in_filename))) {
+		(void)fprintf(stderr, "The -H option can only be used with -I files.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	if (((n_in_files > 1) || (opt_flags & OPT_PREFETCH)) &&
+	    ((opt_flags & OPT_CODEC) || (out_filename && sock_is_dgram(out_filename)))) {
+		(void)fprintf(stderr, "Multiple -I files and -H cannot be used with -Z or a udp: output.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	if ((opt_flags & OPT_INPUT_FILE) && (in_filename != NULL) &&
+	    sock_is_dgram(in_filename)) {
+		bool listening;
+		int fd;
+
+		if ((opt_flags & (OPT_GOT_RATE | OPT_GOT_CONST_DELAY | OPT_DGRAM)) ||
+		    out_filename) {
+			(void)fprintf(stderr, "Cannot use a udp-listen: input with -c, -r, -O, -t or -U options.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		fd = sock_open(in_filename, &listening);
+		if (fd < 0) {
+			ret = (errno == EEXIST) ? EXIT_BAD_OPTION : EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		if (!listening) {
+			(void)fprintf(stderr, "Datagram input must be a udp-listen: endpoint.\n");
+			(void)close(fd);
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if (sigaction_setup() < 0) {
+			(void)close(fd);
+			ret = EXIT_SIGNAL_ERROR;
+			goto tidy;
+		}
+		/* The sink just counts what arrives, pacing is up to the sender */
+		ret = dgram_sink_run(fd, fileno(stdout), timed_run);
+		(void)close(fd);
+		goto tidy;
+	}
+	/* -W, an I/O rate is just a data rate in blocks */
+	if (block_spec.iops > 0.0) {
+		if (opt_flags & (OPT_GOT_RATE | OPT_NO_RATE_CONTROL)) {
+			(void)fprintf(stderr, "-W IOPS and -r cannot be used together.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		data_rate = block_spec.iops * (double)block_spec.bs;
+		opt_flags |= OPT_GOT_RATE;
+	}
+	if (!(opt_flags & (OPT_GOT_RATE | OPT_NO_RATE_CONTROL | OPT_REPLAY))) {
 		(void)fprintf(stderr, "Must specify data rate with -r option (or use -n for no rate control).\n");
 		ret = EXIT_BAD_OPTION;
 		goto tidy;
@@ -1068,6 +9605,71 @@ int main(int argc, char **argv)
 		ret = EXIT_BAD_OPTION;
 		goto tidy;
 	}
+	if (opt_flags & OPT_BLOCK) {
+		const char *target = block_spec.write ? out_filename : in_filename;
+
+		if ((block_spec.write && (!(opt_flags & OPT_DISCARD_STDOUT) ||
+					  (opt_flags & OPT_INPUT_FILE))) ||
+		    (!block_spec.write && (out_filename || (n_in_files > 1))) ||
+		    !target || sock_is_spec(target) ||
+		    (opt_flags & (OPT_APPEND | OPT_GOT_CONST_DELAY | OPT_UNDERRUN |
+				  OPT_OVERRUN | OPT_SHM_STATS | OPT_GROUP | OPT_DGRAM |
+				  OPT_CODEC | OPT_CHECKPOINT | OPT_PREFETCH | OPT_SPARSE |
+				  OPT_ZERO | OPT_URANDOM | OPT_GEN_WORKERS))) {
+			(void)fprintf(stderr, "-W reads a -I file or writes a -O file, "
+				"without -a, -b, -c, -g, -H, -j, -K, -M, -o, -R, -u, -U, -z or -Z.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if (sigaction_setup() < 0) {
+			ret = EXIT_SIGNAL_ERROR;
+			goto tidy;
+		}
+		ret = block_run(target, &block_spec,
+			(opt_flags & OPT_NO_RATE_CONTROL) ? 0.0 : data_rate,
+			max_trans, timed_run, freq);
+		goto tidy;
+	}
+	if ((opt_flags & OPT_INPUT_FILE) && in_filename && !sock_is_spec(in_filename) &&
+	    (stat(in_filename, &in_stat) == 0) && S_ISDIR(in_stat.st_mode)) {
+		size_t tree_io_size = TREE_IO_SIZE;
+
+		if ((n_in_files > 1) || !(opt_flags & OPT_DISCARD_STDOUT) ||
+		    !out_filename || sock_is_spec(out_filename) ||
+		    (opt_flags & (OPT_APPEND | OPT_GOT_CONST_DELAY | OPT_UNDERRUN |
+				  OPT_OVERRUN | OPT_MAX_TRANS_SIZE | OPT_SHM_STATS |
+				  OPT_GROUP | OPT_DGRAM | OPT_CODEC | OPT_CHECKPOINT |
+				  OPT_PREFETCH | OPT_ZERO | OPT_URANDOM))) {
+			(void)fprintf(stderr, "A -I directory can only be copied to a -O directory, "
+				"without -a, -c, -g, -H, -K, -m, -M, -o, -R, -u, -U, -z or -Z.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if (opt_flags & OPT_GOT_IOSIZE) {
+			if ((io_size < IO_SIZE_MIN) || (io_size > IO_SIZE_MAX)) {
+				(void)fprintf(stderr, "I/O buffer size too large, maximum allowed: %s.\n",
+					double_to_str((double)IO_SIZE_MAX));
+				ret = EXIT_BAD_OPTION;
+				goto tidy;
+			}
+			tree_io_size = (size_t)io_size;
+		} else if (!(opt_flags & OPT_NO_RATE_CONTROL) &&
+			   (data_rate / 32.0 < (double)TREE_IO_SIZE)) {
+			/* ~32 writes per second, shared between the workers */
+			tree_io_size = (data_rate / 32.0 < IO_SIZE_MIN) ?
+				IO_SIZE_MIN : (size_t)(data_rate / 32.0);
+		}
+		if (sigaction_setup() < 0) {
+			ret = EXIT_SIGNAL_ERROR;
+			goto tidy;
+		}
+		ret = tree_run(in_filename, out_filename,
+			(opt_flags & OPT_NO_RATE_CONTROL) ? 0.0 : data_rate,
+			tree_io_size,
+			(opt_flags & OPT_GEN_WORKERS) ? (size_t)gen_workers : TREE_WORKERS_DEFAULT,
+			timed_run, freq);
+		goto tidy;
+	}
 
 	/*
 	 *  No size specified, then default rate
@@ -1122,13 +9724,26 @@ int main(int argc, char **argv)
 		ret = EXIT_BAD_OPTION;
 		goto tidy;
 	}
+	/*
+	 *  Pin before allocating so the buffer is allocated on and
+	 *  first touched from the node we are running on
+	 */
+	if (opt_flags & OPT_CPU_AFFINITY) {
+		if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) < 0) {
+			(void)fprintf(stderr, "sched_setaffinity failed: errno=%d (%s).\n",
+				errno, strerror(errno));
+			ret = EXIT_SCHED_ERROR;
+			goto tidy;
+		}
+		set_mempolicy_local();
+	}
 	if ((buffer = malloc(BUF_SIZE(io_size))) == NULL) {
 		(void)fprintf(stderr,"Cannot allocate buffer of %.0f bytes.\n",
 			io_size);
 		ret = EXIT_ALLOC_ERROR;
 		goto tidy;
 	}
-	if (opt_flags & OPT_ZERO)
+	if (opt_flags & (OPT_ZERO | OPT_CPU_AFFINITY))
 		(void)memset(buffer, 0, (size_t)io_size);
 
 	if (count_bits(opt_flags & (OPT_ZERO | OPT_URANDOM | OPT_INPUT_FILE)) > 1) {
@@ -1137,7 +9752,90 @@ int main(int argc, char **argv)
 		goto tidy;
 	}
 
-	if ((opt_flags & OPT_INPUT_FILE) && (in_filename != NULL)) {
+	if ((opt_flags & OPT_AUTOTUNE) &&
+	    (opt_flags & (OPT_GOT_IOSIZE | OPT_GOT_CONST_DELAY | OPT_UNDERRUN |
+			  OPT_OVERRUN | OPT_PIPE_XFER_SIZE | OPT_NO_RATE_CONTROL |
+			  OPT_CODEC | OPT_GEN_WORKERS))) {
+		(void)fprintf(stderr, "The -A option picks the I/O and pipe sizes, it cannot be used "
+			"with -i, -c, -u, -o, -x, -n, -Z or -j.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_TRAFFIC) &&
+	    (opt_flags & (OPT_GOT_CONST_DELAY | OPT_UNDERRUN | OPT_OVERRUN |
+			  OPT_NO_RATE_CONTROL | OPT_AUTOTUNE | OPT_DGRAM))) {
+		(void)fprintf(stderr, "The -l option times the I/O itself, it cannot be used "
+			"with -A, -c, -n, -o, -u or -U.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_REPLAY) &&
+	    (opt_flags & (OPT_INPUT_FILE | OPT_ZERO | OPT_URANDOM | OPT_CODEC |
+			  OPT_GEN_WORKERS | OPT_DGRAM | OPT_AUTOTUNE | OPT_TRAFFIC |
+			  OPT_OCCUPANCY | OPT_GOT_CONST_DELAY | OPT_UNDERRUN |
+			  OPT_OVERRUN | OPT_SPARSE | OPT_GROUP))) {
+		(void)fprintf(stderr, "The -Q option replays a capture, it cannot be used "
+			"with -A, -b, -c, -g, -I, -j, -l, -o, -q, -R, -u, -U, -z or -Z.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_ASYNC_TEE) &&
+	    (!out_filename || (opt_flags & (OPT_DISCARD_STDOUT | OPT_REPLAY | OPT_SPARSE)))) {
+		(void)fprintf(stderr, "The -E option needs a -t file, it cannot be used "
+			"with -b, -d, -O or -Q.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_GROUP_COMMIT) &&
+	    (opt_flags & (OPT_FSYNC | OPT_REPLAY | OPT_BLOCK))) {
+		(void)fprintf(stderr, "The -G option replaces -F, it cannot be used "
+			"with -F, -Q or -W.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_CACHE_NEUTRAL) && (opt_flags & (OPT_REPLAY | OPT_BLOCK))) {
+		(void)fprintf(stderr, "The -N option cannot be used with -Q or -W.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+
+	if ((opt_flags & OPT_RESUME) && !(opt_flags & OPT_CHECKPOINT)) {
+		(void)fprintf(stderr, "The -J option requires a -K checkpoint file.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	if (opt_flags & OPT_CHECKPOINT) {
+		/* Only a copy between seekable files can be resumed */
+		if (!(opt_flags & OPT_INPUT_FILE) || !in_filename || sock_is_spec(in_filename) ||
+		    (n_in_files > 1) ||
+		    !(opt_flags & OPT_DISCARD_STDOUT) || !out_filename || sock_is_spec(out_filename) ||
+		    (opt_flags & (OPT_APPEND | OPT_CODEC))) {
+			(void)fprintf(stderr, "The -K option can only be used to copy a single -I file to a -O file, "
+				"without -a or -Z.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		ckpt = &checkpoint;
+		if ((opt_flags & OPT_RESUME) &&
+		    (checkpoint_load(ckpt, in_filename, out_filename) < 0)) {
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+	}
+
+	if ((opt_flags & OPT_INPUT_FILE) && (in_filename != NULL) &&
+	    sock_is_spec(in_filename)) {
+		fdin = sock_input_open(in_filename);
+		if (fdin < 0) {
+			ret = (errno == EEXIST) ? EXIT_BAD_OPTION : EXIT_FILE_ERROR;
+			goto tidy;
+		}
+	} else if ((opt_flags & OPT_INPUT_FILE) && (in_filename != NULL)) {
 		struct stat buf;
 
 		fdin = open(in_filename, O_RDONLY);
@@ -1152,13 +9850,59 @@ int main(int argc, char **argv)
 				in_filename, errno, strerror(errno));
 			progress_size = 0;
 		} else {
+			size_t i;
+
+			/* Progress is through all the -I files */
 			progress_size = buf.st_size;
+			for (i = 1; i < n_in_files; i++) {
+				if (stat(in_filenames[i], &buf) == 0)
+					progress_size += buf.st_size;
+			}
+		}
+		if (ckpt && ckpt->offset &&
+		    (lseek(fdin, (off_t)ckpt->offset, SEEK_SET) < 0)) {
+			(void)fprintf(stderr, "lseek on %s failed: errno = %d (%s).\n",
+				in_filename, errno, strerror(errno));
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
 		}
 	}
 	if (opt_flags & OPT_MAX_TRANS_SIZE)
 		progress_size = (off_t)max_trans;
 
-	if (opt_flags & OPT_URANDOM) {
+	if (opt_flags & OPT_PREFETCH) {
+		prefetch = prefetch_init(in_filenames, n_in_files, prefetch_distance,
+			ckpt ? ckpt->offset : 0);
+		if (!prefetch) {
+			(void)fprintf(stderr, "Cannot start the prefetcher.\n");
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+	}
+
+	if ((opt_flags & OPT_GEN_WORKERS) && !(opt_flags & (OPT_URANDOM | OPT_CODEC))) {
+		(void)fprintf(stderr, "The -j option can only be used with the -R or -Z options.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	/* -j would be generator and compression workers, say which */
+	if ((opt_flags & OPT_GEN_WORKERS) &&
+	    ((opt_flags & (OPT_URANDOM | OPT_CODEC)) == (OPT_URANDOM | OPT_CODEC))) {
+		(void)fprintf(stderr, "The -j option cannot be used with both -R and -Z, "
+			"it sets the workers of either.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	/* With -Z, -j sets the number of compression workers instead */
+	if ((opt_flags & OPT_GEN_WORKERS) && !(opt_flags & OPT_CODEC)) {
+		gen = gen_init((size_t)gen_workers, (size_t)io_size);
+		if (!gen) {
+			(void)fprintf(stderr, "Cannot start %" PRIu64 " generator workers.\n",
+				gen_workers);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+	} else if (opt_flags & OPT_URANDOM) {
 		fdin = open(dev_urandom, O_RDONLY);
 		if (fdin < 0) {
 			(void)fprintf(stderr, "Cannot open %s: errno=%d (%s).\n",
@@ -1167,9 +9911,60 @@ int main(int argc, char **argv)
 			goto tidy;
 		}
 	}
-	if (out_filename) {
+	if ((opt_flags & OPT_DGRAM) &&
+	    (!out_filename || !sock_is_dgram(out_filename))) {
+		(void)fprintf(stderr, "The -U option can only be used with a -O udp: output.\n");
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
+	}
+	if (out_filename && sock_is_dgram(out_filename)) {
+		bool listening;
+
+		if (!(opt_flags & OPT_DISCARD_STDOUT) || gen || (opt_flags & OPT_CODEC)) {
+			(void)fprintf(stderr, "A udp: output can only be used with -O and without -j or -Z.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		fddgram = sock_open(out_filename, &listening);
+		if (fddgram < 0) {
+			ret = (errno == EEXIST) ? EXIT_BAD_OPTION : EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		if (listening) {
+			(void)fprintf(stderr, "Datagram output must be a udp: endpoint.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+	} else if (out_filename && sock_is_spec(out_filename)) {
+		bool listening;
+		const int fd = sock_open(out_filename, &listening);
+
+		if (fd < 0) {
+			ret = (errno == EEXIST) ? EXIT_BAD_OPTION : EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		if (listening) {
+			/*
+			 *  -z data never changes, so it can be sent zero copy,
+			 *  unless -u/-o can realloc the buffer while sends
+			 *  still reference it
+			 */
+			sock_stable = (opt_flags & OPT_ZERO) &&
+				!(opt_flags & (OPT_UNDERRUN | OPT_OVERRUN));
+			sock_out = sock_server_open(out_filename, fd, sock_stable);
+			if (!sock_out) {
+				ret = EXIT_FILE_ERROR;
+				goto tidy;
+			}
+		} else {
+			fdtee = fd;
+		}
+	} else if (out_filename) {
 		int open_flags = (opt_flags & OPT_APPEND) ? O_APPEND : O_TRUNC;
 
+		/* Resuming keeps the committed output */
+		if (ckpt && ckpt->offset)
+			open_flags = 0;
 		(void)umask(0077);
 		fdtee = open(out_filename, O_CREAT | open_flags | O_WRONLY, S_IRUSR | S_IWUSR);
 		if (fdtee < 0) {
@@ -1178,6 +9973,15 @@ int main(int argc, char **argv)
 			ret = EXIT_FILE_ERROR;
 			goto tidy;
 		}
+		/* Anything after the checkpoint was never committed */
+		if (ckpt && ckpt->offset &&
+		    ((ftruncate(fdtee, (off_t)ckpt->offset) < 0) ||
+		     (lseek(fdtee, (off_t)ckpt->offset, SEEK_SET) < 0))) {
+			(void)fprintf(stderr, "Cannot resume %s at offset %" PRIu64 ": errno = %d (%s).\n",
+				out_filename, ckpt->offset, errno, strerror(errno));
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
 	}
 
 	/* Default to stdin if not specified */
@@ -1185,18 +9989,115 @@ int main(int argc, char **argv)
 		fdin = fileno(stdin);
 	fdout = fileno(stdout);
 
+	if (opt_flags & OPT_REPLAY) {
+		if (sock_out || (fddgram >= 0)) {
+			(void)fprintf(stderr, "The -Q option cannot write to a listening or udp: socket.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		if (sigaction_setup() < 0) {
+			ret = EXIT_SIGNAL_ERROR;
+			goto tidy;
+		}
+		ret = replay_run(replay_filename, replay_frames, replay_speed,
+			(opt_flags & OPT_GOT_RATE) ? data_rate : 0.0,
+			(opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout, fdtee,
+			max_trans, timed_run);
+		goto tidy;
+	}
+
+	if (opt_flags & OPT_SPARSE) {
+		struct stat buf;
+
+		if (!in_filename || sock_is_spec(in_filename) || (n_in_files > 1) ||
+		    (fstat(fdin, &buf) < 0) || !S_ISREG(buf.st_mode) ||
+		    (opt_flags & OPT_CODEC) || (fddgram >= 0)) {
+			(void)fprintf(stderr, "The -b and -B options can only be used with a single -I file, "
+				"without -Z or a udp: output.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		sparse = sparse_init(fdin, (opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout,
+			fdtee, hole_rate);
+		if (!sparse) {
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+	}
+
+	if (opt_flags & OPT_CODEC) {
+		codec = codec_init(codec_type, codec_level,
+			(opt_flags & OPT_GEN_WORKERS) ? (size_t)gen_workers : CODEC_WORKERS_DEFAULT,
+			(opt_flags & OPT_ZERO) ? -1 : fdin, (size_t)io_size, max_trans);
+		if (!codec) {
+			(void)fprintf(stderr, "Cannot start the %s compression stage.\n",
+				codec_type->name);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+		codec->rate_in = codec_rate_in;
+	}
+
+	if (opt_flags & OPT_AUTOTUNE) {
+		/* Allocate for the largest io_size that will be tried */
+		const double io_max = autotune_init(&autotune, data_rate, max_trans,
+			fdin, (opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout);
+		char *tmp = realloc(buffer, BUF_SIZE(io_max));
+
+		if (!tmp) {
+			(void)fprintf(stderr,"Cannot allocate buffer of %.0f bytes.\n",
+				io_max);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+		buffer = tmp;
+		if (opt_flags & (OPT_ZERO | OPT_CPU_AFFINITY))
+			(void)memset(buffer, 0, (size_t)io_max);
+		at = &autotune;
+	}
+
+	if (opt_flags & OPT_TRAFFIC) {
+		/* Chunks are drawn around the io_size mean, allocate for the largest */
+		const double size_max = traffic_init(&traffic, &traffic_spec,
+			data_rate, io_size);
+		char *tmp = realloc(buffer, BUF_SIZE(size_max));
+
+		if (!tmp) {
+			(void)fprintf(stderr,"Cannot allocate buffer of %.0f bytes.\n",
+				size_max);
+			ret = EXIT_ALLOC_ERROR;
+			goto tidy;
+		}
+		buffer = tmp;
+		if (opt_flags & (OPT_ZERO | OPT_CPU_AFFINITY))
+			(void)memset(buffer, 0, (size_t)size_max);
+		tm = &traffic;
+	}
+
 	if ((secs_start = timeval_to_double()) < 0.0) {
 		ret = EXIT_TIME_ERROR;
 		goto tidy;
 	}
 
-	if (opt_flags & OPT_NO_RATE_CONTROL) {
-		delay = 0.0;
-	} else if (opt_flags & OPT_GOT_CONST_DELAY) {
-		delay = 1000000.0 * const_delay;
-	} else {
-		delay = io_size * 1000000.0 / (double)data_rate;
+	(void)memset(&pacer_opts, 0, sizeof(pacer_opts));
+	pacer_opts.rate = data_rate;
+	pacer_opts.io_size = io_size;
+	pacer_opts.const_delay = const_delay;
+	pacer_opts.shift = (uint32_t)adjust_shift;
+	pacer_opts.delay_mode = (uint32_t)delay_mode;
+	/* The -l model does its own timing, the pacer just counts */
+	pacer_opts.flags = ((opt_flags & OPT_NO_RATE_CONTROL) || tm ? SLUICE_PACER_NO_RATE : 0) |
+			   ((opt_flags & OPT_UNDERRUN) ? SLUICE_PACER_UNDERRUN : 0) |
+			   ((opt_flags & OPT_OVERRUN) ? SLUICE_PACER_OVERRUN : 0);
+	pacer_opts.resize = buffer_resize;
+	pacer_opts.ctx = &buffer;
+	if ((pacer = sluice_pacer_create(&pacer_opts)) == NULL) {
+		(void)fprintf(stderr, "Cannot create rate controller: errno=%d (%s).\n",
+			errno, strerror(errno));
+		ret = EXIT_BAD_OPTION;
+		goto tidy;
 	}
+	delay = sluice_pacer_delay(pacer);
 
 #if defined(SET_XFER_SIZE)
 	if (opt_flags & OPT_PIPE_XFER_SIZE) {
@@ -1216,54 +10117,142 @@ int main(int argc, char **argv)
 	(void)fprintf(stderr, "shift:           %" PRIu64 "\n", adjust_shift);
 #endif
 	secs_last = secs_start;
+	group_time = secs_start;
 	stats.time_begin = secs_start;
 	stats.target_rate = data_rate;
+	sluice_pacer_start(pacer, secs_start, 0);
+	if (ckpt) {
+		/* Carry on from the checkpoint at the same rate */
+		total_bytes = ckpt->offset;
+		sluice_pacer_start(pacer, secs_start, ckpt->offset);
+		stats.resumed = ckpt->offset;
+		stats.resumed_time = ckpt->elapsed;
+		ckpt->last = secs_start;
+	}
+	if (at) {
+		io_size = autotune_begin(at, secs_start, total_bytes, 0.0);
+		sluice_pacer_set_io_size(pacer, io_size);
+		delay = sluice_pacer_delay(pacer);
+	}
+	if (tm)
+		traffic_begin(tm);
 
-	(void)memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_handler = handle_sigint;
-	(void)sigemptyset(&new_action.sa_mask);
-	new_action.sa_flags = 0;
-	if (sigaction(SIGINT, &new_action, NULL) < 0) {
-		(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
-			errno, strerror(errno));
-		ret = EXIT_SIGNAL_ERROR;
-		goto tidy;
+	if (opt_flags & OPT_SHM_STATS) {
+		shm = shm_stats_open(shm_name, shm_path, sizeof(shm_path));
+		if (!shm) {
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		shm_stats_update(shm, &stats, secs_start, 0.0, io_size, delay, ' ');
 	}
 
-	(void)memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_handler = handle_siginfo;
-	(void)sigemptyset(&new_action.sa_mask);
-	new_action.sa_flags = 0;
-	if (sigaction(SIGUSR1, &new_action, NULL) < 0) {
-		(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
-			errno, strerror(errno));
+	if (sigaction_setup() < 0) {
 		ret = EXIT_SIGNAL_ERROR;
 		goto tidy;
 	}
-#ifdef SIGINFO
-	if (sigaction(SIGINFO, &new_action, NULL) < 0) {
-		(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
+
+	if ((opt_flags & OPT_MLOCK) &&
+	    (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)) {
+		(void)fprintf(stderr, "mlockall failed: errno=%d (%s).\n",
 			errno, strerror(errno));
-		ret = EXIT_SIGNAL_ERROR;
+		ret = EXIT_SCHED_ERROR;
 		goto tidy;
 	}
-#endif
-	(void)memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_handler = handle_sigusr2;
-	(void)sigemptyset(&new_action.sa_mask);
-	new_action.sa_flags = 0;
-	if (sigaction(SIGUSR2, &new_action, NULL) < 0) {
-		(void)fprintf(stderr, "Sigaction failed: errno=%d (%s).\n",
-			errno, strerror(errno));
-		ret = EXIT_SIGNAL_ERROR;
+	/*
+	 *  Only the pacing thread gets the -Y policy, any -j workers
+	 *  have already been created with the default policy
+	 */
+	if (opt_flags & OPT_SCHED) {
+		struct sched_param param;
+
+		(void)memset(&param, 0, sizeof(param));
+		param.sched_priority = sched_priority;
+		ret = pthread_setschedparam(pthread_self(), sched_policy, &param);
+		if (ret) {
+			(void)fprintf(stderr, "Cannot set scheduling policy: errno=%d (%s).\n",
+				ret, strerror(ret));
+			ret = EXIT_SCHED_ERROR;
+			goto tidy;
+		}
+	}
+	fd_migrations = open_migrations_counter();
+	stats.csw_valid = sched_counters(fd_migrations, &stats.nvcsw,
+		&stats.nivcsw, &stats.migrations);
+
+	if (fddgram != -1) {
+		ret = dgram_send_run(fddgram, fdin, (size_t)dgram_size,
+			(opt_flags & OPT_NO_RATE_CONTROL) ? 0.0 : data_rate,
+			max_trans, timed_run);
 		goto tidy;
 	}
 
+	if (opt_flags & OPT_OCCUPANCY) {
+		if ((opt_flags & OPT_DISCARD_STDOUT) ||
+		    (occupancy_init(&occupancy, fdout) < 0)) {
+			(void)fprintf(stderr, "The -q option needs stdout to be a pipe.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		occ = &occupancy;
+	}
+
 	if (opt_flags & OPT_FSYNC) {
 		fdout_sync = (fdout != -1) && !isatty(fdout);
 		fdtee_sync = (fdtee != -1) && !isatty(fdtee);
 	}
 
+	if (opt_flags & OPT_ASYNC_TEE) {
+		if (fdtee < 0) {
+			(void)fprintf(stderr, "The -E option cannot write to a listening socket.\n");
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+		/* The writer does any -F fsyncs */
+		tee = tee_init(fdtee, tee_policy, (size_t)tee_size, fdtee_sync);
+		if (!tee) {
+			(void)fprintf(stderr, "Cannot start the -E tee writer: errno=%d (%s).\n",
+				errno, strerror(errno));
+			ret = EXIT_FILE_ERROR;
+			goto tidy;
+		}
+		fdtee_sync = false;
+	}
+
+	if (opt_flags & OPT_GROUP_COMMIT) {
+		/*
+		 *  An -E tee is written later by its own thread, bytes queued
+		 *  for it are not yet written so it cannot be committed here
+		 */
+		commit = commit_init(&commit_spec,
+			(opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout,
+			tee ? -1 : fdtee);
+		if (!commit) {
+			if (errno == ENODEV)
+				(void)fprintf(stderr, "The -G option needs stdout or a -t/-O output "
+					"that is not written by -E to be a file or block device.\n");
+			else
+				(void)fprintf(stderr, "Cannot start -G group commits: errno=%d (%s).\n",
+					errno, strerror(errno));
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+	}
+
+	if (opt_flags & OPT_CACHE_NEUTRAL) {
+		cache = cache_init(cache_window, (opt_flags & OPT_ZERO) ? -1 : fdin,
+			(opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout, fdtee);
+		if (!cache) {
+			if (errno == ENODEV)
+				(void)fprintf(stderr, "The -N option needs the input or an output "
+					"to be a file or block device.\n");
+			else
+				(void)fprintf(stderr, "Cannot start -N cache neutral mode: errno=%d (%s).\n",
+					errno, strerror(errno));
+			ret = EXIT_BAD_OPTION;
+			goto tidy;
+		}
+	}
+
 	/*
 	 *  Main loop:
 	 *	read data until buffer is full
@@ -1275,14 +10264,51 @@ int main(int argc, char **argv)
 	while (!(eof | sluice_finish)) {
 		uint64_t inbufsize = 0;
 		bool complete = false;
-		double current_rate, secs_now;
-
-		DO_DELAY(delay, di, 0, stats);
+		double current_rate, secs_now, t, t_sent = 0.0, pace_delay;
+
+		/* -l, wait for the next chunk and take its size */
+		if (tm) {
+			if ((t_sent = traffic_wait(tm, &stats)) < 0.0)
+				goto finish;
+			io_size = tm->chunk;
+			sluice_pacer_set_io_size(pacer, io_size);
+		}
 
-		if (opt_flags & OPT_ZERO) {
+		/* -q, skip the delays while the pipe is running dry */
+		pace_delay = (occ && occ->hurry) ? 0.0 : delay;
+		DO_DELAY(pace_delay, di, 0, stats);
+
+		/* -g, reads and writes can block, keep our slot alive */
+		if (group)
+			group_heartbeat(group);
+		t = mono_time();
+		outbuf = buffer;
+		if (codec) {
+			uint64_t in_bytes;
+			const ssize_t n = codec_get(codec, &outbuf, (size_t)io_size, &in_bytes);
+
+			if (n < 0) {
+				ret = EXIT_READ_ERROR;
+				goto tidy;
+			}
+			if (n == 0)
+				eof = true;
+			inbufsize = (uint64_t)n;
+			/* -Z,in paces the data read, otherwise the data written */
+			total_bytes += codec->rate_in ? in_bytes : inbufsize;
+			stats.reads++;
+		} else if (opt_flags & OPT_ZERO) {
 			inbufsize = (uint64_t)io_size;
 			total_bytes += (uint64_t)io_size;
 			stats.reads++;
+		} else if (gen) {
+			uint64_t sz = (uint64_t)io_size;
+
+			if (max_trans && (total_bytes + sz) > max_trans)
+				sz = max_trans - total_bytes;
+			inbufsize = gen_get(gen, &outbuf, (size_t)sz);
+			total_bytes += inbufsize;
+			stats.reads++;
 		} else {
 			char *ptr = buffer;
 
@@ -1290,6 +10316,27 @@ int main(int argc, char **argv)
 				uint64_t sz = (uint64_t)io_size - inbufsize;
 				ssize_t n;
 
+				if (sparse && (sparse->data_end >= 0)) {
+					if (sparse->offset >= sparse->data_end) {
+						double hole_secs;
+
+						/* Write out the data before the hole first */
+						if (inbufsize)
+							break;
+						hole_secs = sparse_hole(sparse, fdin,
+							(opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout,
+							fdtee, sock_out);
+						if (hole_secs < 0.0) {
+							ret = EXIT_READ_ERROR;
+							goto tidy;
+						}
+						/* Holes are not paced by -r, so don't catch up on them */
+						sluice_pacer_pause(pacer, hole_secs);
+						continue;
+					}
+					if (sz > (uint64_t)(sparse->data_end - sparse->offset))
+						sz = (uint64_t)(sparse->data_end - sparse->offset);
+				}
 				/*
 				 * We hit the user specified max
 				 * limit to transfer
@@ -1320,6 +10367,22 @@ int main(int argc, char **argv)
 					}
 				}
 				if (n == 0) {
+					/* Carry on with the next -I file, if any */
+					if (in_file + 1 < n_in_files) {
+						if (cache)
+							cache_input(cache, -1);
+						(void)close(fdin);
+						fdin = open(in_filenames[++in_file], O_RDONLY);
+						if (fdin < 0) {
+							(void)fprintf(stderr, "open on %s failed: errno = %d (%s).\n",
+								in_filenames[in_file], errno, strerror(errno));
+							ret = EXIT_FILE_ERROR;
+							goto tidy;
+						}
+						if (cache)
+							cache_input(cache, fdin);
+						continue;
+					}
 					eof = true;
 					break;
 				}
@@ -1327,30 +10390,89 @@ int main(int argc, char **argv)
 				total_bytes += n;
 				ptr += n;
 				stats.reads++;
+				if (sparse) {
+					sparse->offset += n;
+					sparse->data_bytes += (uint64_t)n;
+				}
 			}
 		}
-		if (eof)
+		stats.phase_time[PHASE_READ] += mono_time() - t;
+		if (group)
+			group_heartbeat(group);
+		/* -b skips holes, so total_bytes is behind the input offset */
+		if (prefetch)
+			prefetch_update(prefetch, sparse ?
+				(uint64_t)sparse->offset : total_bytes);
+		/* A short final chunk still has to be written */
+		if (eof && !inbufsize)
 			break;
+		SLUICE_PROBE2(read__done, inbufsize, total_bytes);
 
-		DO_DELAY(delay, di, 1, stats);
+		DO_DELAY(pace_delay, di, 1, stats);
+
+		/* -g rate group, wait if the group is over its rate */
+		if (group) {
+			const double group_delay = group_take(group, inbufsize);
+
+			DELAY(group_delay, stats);
+		}
 
 		stats.writes++;
 		stats.total_bytes += inbufsize;
 		stats.buf_size_total += inbufsize;
-		if (!(opt_flags & OPT_DISCARD_STDOUT)) {
-			if (write(fdout, buffer, (size_t)inbufsize) < 0) {
+		if (occ) {
+			/* -q, write as the pipe has room rather than block */
+			const int occ_ret = occupancy_write(occ, outbuf,
+				(size_t)inbufsize, run == '-', &stats);
+
+			if (occ_ret > 0)
+				goto finish;
+			if (occ_ret < 0) {
+				(void)fprintf(stderr,"Write error: errno=%d (%s).\n",
+					errno, strerror(errno));
+				ret = EXIT_WRITE_ERROR;
+				goto tidy;
+			}
+			if (fdout_sync) {
+				t = mono_time();
+				fsync_data(fdout, &fdout_sync);
+				stats.phase_time[PHASE_FSYNC] += mono_time() - t;
+			}
+		} else if (!(opt_flags & OPT_DISCARD_STDOUT)) {
+			t = mono_time();
+			if (write(fdout, outbuf, (size_t)inbufsize) < 0) {
 				(void)fprintf(stderr,"Write error: errno=%d (%s).\n",
 					errno, strerror(errno));
 				ret = EXIT_WRITE_ERROR;
 				goto tidy;
 			}
-			fsync_data(fdout, &fdout_sync);
+			stats.phase_time[PHASE_WRITE] += mono_time() - t;
+			if (fdout_sync) {
+				t = mono_time();
+				fsync_data(fdout, &fdout_sync);
+				stats.phase_time[PHASE_FSYNC] += mono_time() - t;
+			}
 		}
 
 		/* -t Tee mode output */
-		if (fdtee >= 0) {
+		if (tee) {
+			int tee_ret;
+
+			t = mono_time();
+			tee_ret = tee_write(tee, outbuf, (size_t)inbufsize);
+			stats.phase_time[PHASE_TEE] += mono_time() - t;
+			if (tee_ret > 0)
+				goto finish;
+			if (tee_ret < 0) {
+				(void)fprintf(stderr, "write error: errno=%d (%s).\n",
+					errno, strerror(errno));
+				ret = EXIT_WRITE_ERROR;
+				goto tidy;
+			}
+		} else if (fdtee >= 0) {
+			t = mono_time();
 redo_write:
-			if (write(fdtee, buffer, (size_t)inbufsize) < 0) {
+			if (write(fdtee, outbuf, (size_t)inbufsize) < 0) {
 				if (errno == EINTR) {
 					if (sluice_finish)
 						goto finish;
@@ -1363,198 +10485,101 @@ redo_write:
 					goto tidy;
 				}
 			}
-			fsync_data(fdtee, &fdtee_sync);
+			stats.phase_time[PHASE_TEE] += mono_time() - t;
+			if (fdtee_sync) {
+				t = mono_time();
+				fsync_data(fdtee, &fdtee_sync);
+				stats.phase_time[PHASE_FSYNC] += mono_time() - t;
+			}
+		} else if (sock_out) {
+			t = mono_time();
+			sock_server_write(sock_out, outbuf, (size_t)inbufsize,
+				sock_stable);
+			stats.phase_time[PHASE_TEE] += mono_time() - t;
+		}
+		if (commit) {
+			t = mono_time();
+			commit_update(commit, (uint64_t)inbufsize, t);
+			stats.phase_time[PHASE_FSYNC] += mono_time() - t;
 		}
+		if (cache)
+			cache_update(cache, stats.total_bytes);
+		if (group)
+			group_heartbeat(group);
+		SLUICE_PROBE2(write__done, inbufsize, stats.total_bytes);
 		if (eof)
 			break;
 
-		DO_DELAY(delay, di, 2, stats);
+		pace_delay = (occ && occ->hurry) ? 0.0 : delay;
+		DO_DELAY(pace_delay, di, 2, stats);
+
+		t = mono_time();
 
 		if ((secs_now = timeval_to_double()) < 0.0) {
 			ret = EXIT_TIME_ERROR;
 			goto tidy;
 		}
-		current_rate = ((double)total_bytes) / (secs_now - secs_start);
-
-		/* Update min/max rate stats */
-		if (stats.rate_set) {
-			if (current_rate > stats.rate_max)
-				stats.rate_max = current_rate;
-			if (current_rate < stats.rate_min)
-				stats.rate_min = current_rate;
-			if (io_size > stats.io_size_max)
-				stats.io_size_max = io_size;
-			if (io_size < stats.io_size_min)
-				stats.io_size_min = io_size;
-		} else {
-			stats.rate_min = current_rate;
-			stats.rate_max = current_rate;
-			stats.io_size_min = io_size;
-			stats.io_size_max = io_size;
-			stats.rate_set = true;
-		}
-
-		/* Update drift stats only if we have rate controls enabled */
-		if (!(opt_flags & OPT_NO_RATE_CONTROL)) {
-			double drift_rate = 100.0 *
-				fabs(current_rate - data_rate) / data_rate;
-			int i;
-			double percent = DRIFT_PERCENT_START;
-
-			stats.drift_total++;
-			for (i = 0; i < DRIFT_MAX; i++, percent *= 2.0) {
-				if (drift_rate < percent) {
-					stats.drift[i]++;
-					break;
-				}
-			}
-		}
-#if DEBUG_RATE
-		(void)fprintf(stderr, "rate-pre : %.2f delay: %.2f io_size: %.3f\n",
-			current_rate, delay, io_size);
-#endif
-
-		if (opt_flags & OPT_NO_RATE_CONTROL) {
-			/* No rate to compare to */
-			run = '-';
-		} else {
-			if (current_rate > data_rate) {
-				/* Overrun */
-				run = '+' ;
-				if (!(opt_flags & OPT_GOT_CONST_DELAY)) {
-					if (adjust_shift)
-						delay += ((last_delay >> adjust_shift) + 100);
-					else {
-						double secs_desired = secs_start + ((total_bytes + inbufsize) / data_rate);
-						delay = 1000000.0 * (secs_desired - secs_now);
-						if (delay < 0)
-							delay = 0;
-					}
-				}
-				warnings = 0;
-				underruns = 0;
-				overruns++;
-				stats.overruns++;
-			} else if (current_rate < data_rate) {
-				/* Underrun */
-				run = '-' ;
-				if (!(opt_flags & OPT_GOT_CONST_DELAY)) {
-					if (adjust_shift)
-						delay -= ((last_delay >> adjust_shift) + 100);
-					else {
-						double secs_desired = secs_start + ((total_bytes + inbufsize) / data_rate);
-						delay = 1000000.0 * (secs_desired - secs_now);
-						if (delay < 0)
-							delay = 0;
-					}
-				}
-				warnings++;
-				underruns++;
-				stats.underruns++;
-				overruns = 0;
-			} else {
-				/* Perfect, rather unlikely.. */
-				warnings = 0;
-				underruns = 0;
-				overruns = 0;
-				stats.perfect++;
-				run = '0';
-			}
-
-			/* Avoid the impossible */
-			if (delay < 0)
-				delay = 0;
-
-			if ((opt_flags & OPT_UNDERRUN) &&
-			    (underruns >= underrun_adjust)) {
-				/* Adjust rate due to underruns */
-				char *tmp;
-				double tmp_io_size;
-
-				if (adjust_shift) {
-					/* Adjust by scaling io_size */
-					tmp_io_size = io_size + (io_size / (1 << adjust_shift));
-					/*
-					 * If size is too small, we get
-					 * stuck at 1
-					 */
-					if (tmp_io_size < 1)
-						tmp_io_size = 1;
-				} else {
-					/*
-					 * Adjust by comparing differences
-					 * in rates
-					*/
-					tmp_io_size = io_size +
-						(data_rate - current_rate) *
-						const_delay;
-				}
+		{
+			const uint64_t old_delay = (uint64_t)delay;
+			const uint64_t old_io_size = (uint64_t)io_size;
 
-				/* Need to grow buffer? */
-				if ((tmp_io_size > io_size) &&
-				    (tmp_io_size < IO_SIZE_MAX)) {
-					stats.reallocs++;
-					tmp = realloc(buffer, BUF_SIZE(tmp_io_size));
-					if (tmp) {
-						if (opt_flags & OPT_ZERO)
-							memset(tmp, 0, tmp_io_size);
-						buffer = tmp;
-						io_size = tmp_io_size;
-					}
-				}
-				underruns = 0;
-			}
-
-			if ((opt_flags & OPT_OVERRUN) &&
-			    (overruns >= overrun_adjust)) {
-				/* Adjust rate due to overruns */
-				char *tmp;
-				double tmp_io_size;
-
-				if (adjust_shift) {
-					/* Adjust by scaling io_size */
-					tmp_io_size = io_size -
-						(io_size / (1 << adjust_shift));
-					/*
-					 * If size is too small, we get
-					 * stuck at 1
-					 */
-					if (tmp_io_size < 1)
-						tmp_io_size = 1;
-				} else {
-					/*
-					 * Adjust by comparing differences
-					 * in rates
-					 */
-					tmp_io_size = io_size +
-						(data_rate - current_rate) *
-						const_delay;
-				}
-
-				/* Need to grow buffer? */
-				if ((tmp_io_size > io_size) &&
-				    (tmp_io_size < IO_SIZE_MAX)) {
-					stats.reallocs++;
-					tmp = realloc(buffer, BUF_SIZE(tmp_io_size));
-					if (tmp) {
-						if (opt_flags & OPT_ZERO)
-							memset(tmp, 0, tmp_io_size);
-						buffer = tmp;
-						io_size = tmp_io_size;
-					}
-				}
-				overruns = 0;
-			}
+			run = sluice_pacer_update(pacer, total_bytes,
+				inbufsize, secs_now);
+			current_rate = sluice_pacer_current_rate(pacer);
+			delay = sluice_pacer_delay(pacer);
+			io_size = sluice_pacer_io_size(pacer);
 
 			/* Too many continuous underruns? */
+			warnings = (run == '-') ? warnings + 1 : 0;
 			if ((opt_flags & OPT_WARNING) &&
+			    !(opt_flags & OPT_NO_RATE_CONTROL) &&
 			    (warnings > UNDERRUN_MAX)) {
 				(void)fprintf(stderr, "Warning: data underrun, "
 					"use larger I/O size (-i option)\n");
 				opt_flags &= ~OPT_WARNING;
 			}
+			if (!(opt_flags & OPT_NO_RATE_CONTROL))
+				SLUICE_PROBE4(rate__adjust, old_delay,
+					(uint64_t)delay, old_io_size,
+					(uint64_t)io_size);
+		}
+
+		/* -A, try the next io_size or settle on the best one */
+		if (at) {
+			const double tuned = autotune_sample(at, secs_now, total_bytes,
+				stats.phase_time[PHASE_WRITE] + stats.phase_time[PHASE_TEE]);
+
+			if (!DOUBLE_CMP(tuned, io_size)) {
+				sluice_pacer_set_io_size(pacer, tuned);
+				io_size = tuned;
+				delay = sluice_pacer_delay(pacer);
+			}
+		}
+
+		if (tm)
+			traffic_next(tm, inbufsize, t_sent);
+
+		/*
+		 *  -g rate group, if our share of the group rate has
+		 *  changed then re-target to the new rate from now on
+		 */
+		if (group && (secs_now > group_time + GROUP_UPDATE)) {
+			const double share = group_update(group);
+
+			group_time = secs_now;
+			if (fabs(share - data_rate) > data_rate * GROUP_RATE_CHANGE) {
+				data_rate = share;
+				sluice_pacer_set_rate(pacer, share,
+					total_bytes, secs_now);
+				delay = sluice_pacer_delay(pacer);
+			}
+		}
+
+		if (shm) {
+			stats_pacer(&stats, pacer);
+			shm_stats_update(shm, &stats, secs_now, current_rate,
+				io_size, delay, run);
 		}
-		last_delay = (uint64_t)delay;
 
 		/* Output feedback in verbose mode */
 		if ((opt_flags & OPT_VERBOSE) &&
@@ -1573,13 +10598,16 @@ redo_write:
 				/* Progress % and ETA estimates */
 				double secs = secs_now - secs_start;
 				if (progress_size) {
-					double percent = 100.0 *
-						(double)progress_size /
-						(double)stats.total_bytes;
-					double alpha = secs *
-						(double)progress_size /
-						(double)stats.total_bytes;
-					double secs_left = alpha - secs;
+					/* Include data copied before a -J resume and -b holes */
+					const double done = (double)(stats.resumed + stats.total_bytes +
+						(sparse ? sparse->hole_bytes : 0));
+					const double left = ((double)progress_size > done) ?
+						(double)progress_size - done : 0.0;
+					double percent = 100.0 * done /
+						(double)progress_size;
+					/* Time for the rest at the rate of this run */
+					double secs_left = stats.total_bytes ?
+						secs * left / (double)stats.total_bytes : 0.0;
 
 					(void)fprintf(stderr,"Rate: %s/S, "
 						"Total: %s, Dur: %.1f S, %5.1f%% ETA: %s  \r",
@@ -1610,11 +10638,25 @@ redo_write:
 		(void)fprintf(stderr, "rate-post: %.2f delay: %.2f io_size: %.3f\n",
 			current_rate, delay, io_size);
 #endif
+		stats.phase_time[PHASE_CONTROL] += mono_time() - t;
+
+		if (ckpt && (secs_now >= ckpt->last + ckpt->interval)) {
+			t = mono_time();
+			if (checkpoint_save(ckpt, fdtee, in_filename, out_filename,
+					    ckpt->elapsed + secs_now - secs_start) < 0) {
+				ret = EXIT_FILE_ERROR;
+				goto tidy;
+			}
+			stats.phase_time[PHASE_FSYNC] += mono_time() - t;
+			ckpt->last = secs_now;
+		}
+
 		/* Timed run, if we timed out then stop */
 		if ((opt_flags & OPT_TIMED_RUN) &&
 		    ((secs_now - secs_start) > timed_run))
 			break;
-		if (max_trans && total_bytes >= max_trans)
+		/* -Z applies -m to the input, the reader stops there */
+		if (max_trans && !codec && (total_bytes >= max_trans))
 			break;
 	}
 	ret = EXIT_SUCCESS;
@@ -1623,21 +10665,91 @@ finish:
 	if (opt_flags & OPT_VERBOSE)
 		(void)fprintf(stderr, "%78s\r", "");
 
+	if (tee && (tee_finish(tee) < 0)) {
+		(void)fprintf(stderr, "write error: errno=%d (%s).\n",
+			errno, strerror(errno));
+		ret = EXIT_WRITE_ERROR;
+	}
+	if (sparse && (sparse_finish(sparse,
+			(opt_flags & OPT_DISCARD_STDOUT) ? -1 : fdout, fdtee) < 0))
+		ret = EXIT_WRITE_ERROR;
+	if (commit)
+		commit_finish(commit);
+	if (cache)
+		cache_finish(cache);
+	if (ckpt && (checkpoint_save(ckpt, fdtee, in_filename, out_filename,
+				     ckpt->elapsed + timeval_to_double() - secs_start) < 0))
+		ret = EXIT_FILE_ERROR;
+	stats.checkpoints = ckpt ? ckpt->saves : 0;
+
 	if (opt_flags & OPT_STATS) {
+		uint64_t nvcsw = 0, nivcsw = 0;
+		int64_t migrations;
+
 		if ((stats.time_end = timeval_to_double()) < 0.0) {
 			ret = EXIT_TIME_ERROR;
 			goto tidy;
 		}
+		/* The primary output was done before the tee drained */
+		if (tee)
+			stats.time_end -= tee->drain_time;
+		stats.csw_valid &= sched_counters(fd_migrations, &nvcsw,
+			&nivcsw, &migrations);
+		stats.nvcsw = nvcsw - stats.nvcsw;
+		stats.nivcsw = nivcsw - stats.nivcsw;
+		stats.migrations = migrations;
+		stats_pacer(&stats, pacer);
 		stats_info(&stats);
+		if (gen)
+			gen_stats_info(gen);
+		if (codec)
+			codec_stats_info(codec);
+		if (prefetch)
+			prefetch_stats_info(prefetch);
+		if (sparse)
+			sparse_stats_info(sparse);
+		if (at)
+			autotune_stats_info(at);
+		if (tm)
+			traffic_stats_info(tm);
+		if (occ)
+			occupancy_stats_info(occ);
+		if (tee)
+			tee_stats_info(tee);
+		if (commit)
+			commit_stats_info(commit);
+		if (cache)
+			cache_stats_info(cache);
+		if (group)
+			group_stats_info(group);
+		if (sock_out)
+			sock_server_stats_info(sock_out);
 	}
 tidy:
+	if (shm)
+		shm_stats_close(shm, shm_path);
 	if (pid_filename) {
 		(void)unlink(pid_filename);
 	}
 
-	if ((fdin != -1) && (opt_flags & OPT_URANDOM)) {
+	if ((fdin != -1) && (fdin != fileno(stdin))) {
 		(void)close(fdin);
 	}
+	sock_server_close(sock_out);
+	gen_free(gen);
+	codec_free(codec);
+	prefetch_free(prefetch);
+	tee_free(tee);
+	commit_free(commit);
+	cache_free(cache);
+	sparse_free(sparse);
+	sluice_pacer_destroy(pacer);
+	free(in_filenames);
+	group_leave(group);
+	if (fd_migrations >= 0)
+		(void)close(fd_migrations);
+	if (fddgram >= 0)
+		(void)close(fddgram);
 	free(buffer);
 	if (fdtee >= 0)
 		(void)close(fdtee);